@@ -64,6 +64,8 @@ namespace fabomatic
     static constexpr uint8_t UID_BYTE_LEN{4};
     /* Number of cached UID, persisted in flash  */
     static constexpr uint8_t CACHE_LEN{10};
+    /* Maximum number of authorized users prefetched from the backend for this machine, kept in RAM only */
+    static constexpr uint16_t PREFETCH_MAX_USERS{200};
 
   } // namespace conf::rfid_tags
 
@@ -184,6 +186,11 @@ namespace fabomatic
      */
     static constexpr auto MQTT_REFRESH_PERIOD{30s};
 
+    /**
+     * Safety-net query of the machine state when the backend pushes it on the config topic (default: 10min)
+     */
+    static constexpr auto MACHINE_POLL_PERIOD{10min};
+
     /**
      * Timeout for hardware watchdog, set to 0s to disable (default: 60s)
      */
@@ -199,6 +206,21 @@ namespace fabomatic
      */
     static constexpr auto PORTAL_CONFIG_TIMEOUT{5min};
 
+    /**
+     * Period of the MQTT I/O task, which owns the connection to the broker (default: 10ms)
+     */
+    static constexpr auto MQTT_IO_PERIOD{10ms};
+
+    /**
+     * Stack size in bytes of the MQTT I/O task, which also runs WiFi and DNS calls
+     */
+    static constexpr auto MQTT_IO_STACK_SIZE{6 * 1024};
+
+    /**
+     * Period of the processing of messages received from the broker and of reply timeouts (default: 100ms)
+     */
+    static constexpr auto MQTT_EVENTS_PERIOD{100ms};
+
     /**
      * Board announcement on the MQTT server (default: 2min)
      */
@@ -221,22 +243,201 @@ namespace fabomatic
      */
     static constexpr std::string_view response_topic{"/reply"};
 
+    /**
+     * Machine configuration pushed by the backend as retained message (sub-topic of the full machine topic)
+     */
+    static constexpr std::string_view config_topic{"/config"};
+
+    /**
+     * MessagePack queries (sub-topic of the full machine topic), replies are expected on its response_topic.
+     * Used once the backend acknowledged the format in the checkmachine reply.
+     */
+    static constexpr std::string_view msgpack_topic{"/mp"};
+
+    /**
+     * Announce MessagePack support to the backend, and use it when acknowledged (default: true)
+     */
+    static constexpr auto MSGPACK_PAYLOAD{true};
+
     /**
      * Number of tries to get a reply from the backend
      */
     static constexpr auto MAX_TRIES{2};
 
     /**
-     * Timeout for a single backend reply request.
+     * Initial timeout for a backend reply, until the round-trip time has been measured.
      */
     static constexpr auto TIMEOUT_REPLY_SERVER{2s};
 
+    /**
+     * Bounds of the reply timeout derived from the measured round-trip time.
+     */
+    static constexpr auto TIMEOUT_REPLY_MIN{300ms};
+    static constexpr auto TIMEOUT_REPLY_MAX{5s};
+
+    /**
+     * Consecutive connection failures or unanswered queries opening the circuit breaker.
+     * While open, card taps are authorized locally without trying to reconnect.
+     * Only a reply of the backend closes it again, not the connection to the broker.
+     */
+    static constexpr auto BREAKER_FAILURE_THRESHOLD{3U};
+
+    /**
+     * Time the circuit breaker stays open before taskConnect probes the connection again
+     */
+    static constexpr auto BREAKER_OPEN_PERIOD{30s};
+
+    /**
+     * Bounds of the exponential backoff between connection attempts.
+     * Actual wait is randomized between half and the full backoff, so that boards do not reconnect all at once.
+     */
+    static constexpr auto RECONNECT_BACKOFF_MIN{2s};
+    static constexpr auto RECONNECT_BACKOFF_MAX{2min};
+
+    /**
+     * Maximum time for the WiFi association during a connection attempt
+     */
+    static constexpr auto WIFI_CONNECT_TIMEOUT{5s};
+
+    /**
+     * Maximum time for the WiFi association with the cached BSSID, channel and IP, before falling back to a full scan
+     */
+    static constexpr auto WIFI_FAST_CONNECT_TIMEOUT{2s};
+
+    /**
+     * Age after which the cached WiFi lease is no longer used and the next association renews it with DHCP.
+     * Must be shorter than the DHCP lease time of the network, since the static IP of the fast path is not renewed.
+     * Lease loaded at boot are counted from the boot.
+     */
+    static constexpr auto WIFI_LEASE_MAX_AGE{4h};
+
+    /**
+     * Consecutive connection failures after a fast association before discarding the cached lease
+     * (the IP may be assigned to another host although the access point accepts the association)
+     */
+    static constexpr auto WIFI_LEASE_MAX_FAILURES{3};
+
+    /**
+     * Validity of the resolved broker address. The cached address is used to connect even when expired,
+     * and resolved again in background once connected, the first time after a random delay between half and the full TTL.
+     */
+    static constexpr auto BROKER_ADDRESS_TTL{1h};
+
+    /**
+     * Delay before resolving the broker name again after a failure
+     */
+    static constexpr auto BROKER_RESOLVE_RETRY{5min};
+
+    /**
+     * Maximum time for the broker name lookup, polled by the connection state machine
+     */
+    static constexpr auto BROKER_RESOLVE_TIMEOUT{10s};
+
+    /**
+     * Maximum time for the TCP handshake with the broker, polled by the connection state machine
+     */
+    static constexpr auto TCP_CONNECT_TIMEOUT{3s};
+
+    /**
+     * Persistent MQTT session: stable client id (BOARD + machine id) and clean_session=false,
+     * so that the broker keeps the subscriptions and queues the QoS 1 replies during short disconnections.
+     * Replies queued for a previous session can only be told apart if the backend echoes the correlation id (cid)
+     * of the queries: until a reply carries one, replies without it are matched in order, as without persistent session.
+     */
+    static constexpr auto PERSISTENT_SESSION{true};
+
+    /**
+     * QoS of the reply subscription and of the buffered messages (start/stop use, maintenance)
+     */
+    static constexpr auto QOS_BACKEND{1};
+
+    /**
+     * With a persistent session, asynchronous queries do not time out during disconnections shorter than this
+     */
+    static constexpr auto SESSION_HOLD_MAX{30s};
+
+    /**
+     * Maximum size of an MQTT message (topic and payload). Queries are serialized in place into
+     * transmit buffers of this size, one per slot of the I/O queue.
+     */
+    static constexpr auto MAX_MSG_SIZE{300U};
+
+    /**
+     * Memory reserved for parsing a backend reply, in bytes. Replies needing more are rejected.
+     */
+    static constexpr auto REPLY_ARENA_SIZE{4096U};
+
+    /**
+     * Maximum length of the user and machine names kept from backend replies, longer names are truncated
+     */
+    static constexpr auto NAME_MAX_LENGTH{40U};
+
+    /**
+     * Maximum length of the maintenance description kept from backend replies, longer ones are truncated
+     */
+    static constexpr auto DESCRIPTION_MAX_LENGTH{80U};
+
+    /**
+     * Capacity of the queue of publications from the board logic to the MQTT I/O task, in messages (power of 2)
+     */
+    static constexpr auto IO_QUEUE_SIZE{8U};
+
+    /**
+     * Capacity of the queue of received messages and failed publications from the MQTT I/O task to the board logic,
+     * in messages (power of 2). When full, the I/O task waits for the board logic instead of dropping a reply.
+     */
+    static constexpr auto IO_EVENT_QUEUE_SIZE{16U};
+
+    /**
+     * Maximum number of asynchronous queries waiting for a backend reply
+     */
+    static constexpr auto MAX_PENDING_QUERIES{4U};
+
     /**
      * MQTT port for broker
      */
     static constexpr auto PORT_NUMBER{1883};
   } // namespace conf::mqtt
 
+  namespace conf::buffer
+  {
+    /**
+     * Label of the flash partition holding the buffered messages, see partitions.csv
+     */
+    static constexpr std::string_view PARTITION_LABEL{"msglog"};
+
+    /**
+     * Size in bytes of the log kept in RAM when the partition is missing (e.g. older partition table).
+     * Messages buffered there are lost on reboot.
+     */
+    static constexpr auto RAM_LOG_SIZE{8192U};
+
+    /**
+     * Number of buffered messages replayed without waiting for the previous replies.
+     * Kept below IO_QUEUE_SIZE so that live queries can be sent during the replay.
+     */
+    static constexpr auto REPLAY_WINDOW{4U};
+
+    /**
+     * Pause of the replay after the backend rejected a buffered message (request_ok false).
+     * The message stays in the log and is replayed again after this delay.
+     */
+    static constexpr auto REPLAY_REJECTED_DELAY{1min};
+  } // namespace conf::buffer
+
+  namespace conf::ntp
+  {
+    /**
+     * SNTP server giving the time of the usage events
+     */
+    static constexpr std::string_view SERVER{"pool.ntp.org"};
+
+    /**
+     * Period of the SNTP synchronization. In between, the time is kept by the monotonic clock.
+     */
+    static constexpr auto SYNC_PERIOD{1h};
+  } // namespace conf::ntp
+
   namespace conf::common
   {
     /**
@@ -252,14 +453,28 @@ namespace fabomatic
   // Checks on configured values
   static_assert(conf::mqtt::topic.size() < conf::common::STR_MAX_LENGTH, "MQTT topic too long");
   static_assert(conf::mqtt::response_topic.size() < conf::common::STR_MAX_LENGTH, "MQTT response too long");
+  static_assert(conf::mqtt::config_topic.size() < conf::common::STR_MAX_LENGTH, "MQTT config topic too long");
+  static_assert(conf::mqtt::msgpack_topic.size() < conf::common::STR_MAX_LENGTH, "MQTT msgpack topic too long");
+  static_assert(conf::tasks::MACHINE_POLL_PERIOD >= conf::tasks::MQTT_REFRESH_PERIOD, "MACHINE_POLL_PERIOD must be >= MQTT_REFRESH_PERIOD");
   static_assert(conf::buzzer::STANDARD_BEEP_DURATION <= 1s, "STANDARD_BEEP_DURATION must be <= 1s");
+  static_assert(conf::buffer::RAM_LOG_SIZE >= 2 * 4096, "RAM_LOG_SIZE must hold at least 2 flash sectors");
+  static_assert(conf::ntp::SYNC_PERIOD >= 15s, "SYNC_PERIOD must be >= 15s (SNTP minimum)");
+  static_assert(conf::buffer::REPLAY_WINDOW > 0 && conf::buffer::REPLAY_WINDOW < conf::mqtt::IO_QUEUE_SIZE, "REPLAY_WINDOW must be > 0 and < IO_QUEUE_SIZE");
+  static_assert(conf::mqtt::IO_EVENT_QUEUE_SIZE >= conf::buffer::REPLAY_WINDOW + conf::mqtt::MAX_PENDING_QUERIES + conf::mqtt::IO_QUEUE_SIZE,
+                "IO_EVENT_QUEUE_SIZE must hold the replies of the replay window and pending queries, and a failure for each request");
+  static_assert(conf::mqtt::REPLY_ARENA_SIZE >= 4 * conf::mqtt::MAX_MSG_SIZE, "REPLY_ARENA_SIZE too small for the largest reply");
+  static_assert(conf::mqtt::QOS_BACKEND >= 0 && conf::mqtt::QOS_BACKEND <= 2, "QOS_BACKEND must be 0, 1 or 2");
   static_assert(conf::mqtt::TIMEOUT_REPLY_SERVER > 500ms, "TIMEOUT_REPLY_SERVER must be > 500ms");
   static_assert(conf::mqtt::MAX_TRIES > 0, "MAX_TRIES must be > 0");
+  static_assert(conf::mqtt::BREAKER_FAILURE_THRESHOLD > 0, "BREAKER_FAILURE_THRESHOLD must be > 0");
+  static_assert(conf::mqtt::WIFI_FAST_CONNECT_TIMEOUT < conf::mqtt::WIFI_CONNECT_TIMEOUT, "WIFI_FAST_CONNECT_TIMEOUT must be < WIFI_CONNECT_TIMEOUT");
+  static_assert(conf::mqtt::RECONNECT_BACKOFF_MIN > 0s && conf::mqtt::RECONNECT_BACKOFF_MIN <= conf::mqtt::RECONNECT_BACKOFF_MAX, "RECONNECT_BACKOFF_MIN must be > 0 and <= RECONNECT_BACKOFF_MAX");
+  static_assert(conf::mqtt::TIMEOUT_REPLY_MIN <= conf::mqtt::TIMEOUT_REPLY_SERVER && conf::mqtt::TIMEOUT_REPLY_SERVER <= conf::mqtt::TIMEOUT_REPLY_MAX, "TIMEOUT_REPLY_SERVER must be within TIMEOUT_REPLY_MIN and TIMEOUT_REPLY_MAX");
 
   // Make sure the hardware watchdog period is not too short considering we're blocking tasks for some operations
   static_assert(conf::tasks::WATCHDOG_TIMEOUT == 0s ||
                     conf::tasks::WATCHDOG_TIMEOUT > (conf::machine::LONG_TAP_DURATION +
-                                                     conf::mqtt::TIMEOUT_REPLY_SERVER * conf::mqtt::MAX_TRIES * 3 +
+                                                     conf::mqtt::TIMEOUT_REPLY_MAX * conf::mqtt::MAX_TRIES * 3 +
                                                      conf::lcd::SHORT_MESSAGE_DELAY * 3 +
                                                      conf::buzzer::STANDARD_BEEP_DURATION * conf::buzzer::NB_BEEPS * 2 +
                                                      5s),
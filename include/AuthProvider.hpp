@@ -1,15 +1,20 @@
 #ifndef AUTHPROVIDER_HPP_
 #define AUTHPROVIDER_HPP_
 
+#include <chrono>
 #include <list>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <tuple>
+#include <vector>
 
 #include "FabUser.hpp"
+#include "MQTTtypes.hpp"
 #include "secrets.hpp"
 #include "WhiteList.hpp"
 #include "CachedCards.hpp"
+#include "CardCacheStore.hpp"
 
 namespace fabomatic
 {
@@ -21,7 +26,26 @@ namespace fabomatic
   private:
     WhiteList whitelist;
     mutable CachedCards cache;
-    mutable size_t cache_idx{0};
+    mutable CardCacheStore store;
+    mutable bool cache_dirty{false}; /* Cache changed since the last save */
+    mutable std::vector<FabUser> prefetched; /* Users authorized on this machine, sorted by card uid */
+    uint32_t prefetched_version{0};          /* Version of the prefetched list, 0 if none */
+
+    /// @brief Background download of the users list, one page per reply
+    struct PrefetchJob
+    {
+      uint32_t version{0};
+      uint16_t page{0};
+      std::vector<FabUser> received;
+    };
+    std::optional<PrefetchJob> prefetch_job{std::nullopt};
+    std::chrono::system_clock::time_point prefetch_retry{}; /* Earliest restart after a failed prefetch */
+
+    auto requestPrefetchPage(FabBackend &server) -> bool;
+    auto prefetchPageReceived(FabBackend &server, uint16_t page, const ServerMQTT::UserListResponse &response) -> void;
+    [[nodiscard]] auto appendPage(std::vector<FabUser> &received, const ServerMQTT::UserListResponse &response) const -> bool;
+    auto completePrefetch(std::vector<FabUser> &&received, uint32_t version) -> void;
+    [[nodiscard]] auto uidInPrefetched(card::uid_t uid) const -> std::optional<FabUser>;
     [[nodiscard]] auto uidInWhitelist(card::uid_t uid) const -> std::optional<WhiteListEntry>;
     [[nodiscard]] auto uidInCache(card::uid_t uid) const -> std::optional<CachedCard>;
     [[nodiscard]] auto searchCache(card::uid_t candidate_uid) const -> std::optional<CachedCard>;
@@ -31,9 +55,15 @@ namespace fabomatic
     AuthProvider() = delete;
     AuthProvider(WhiteList whitelist);
     [[nodiscard]] auto tryLogin(card::uid_t uid, FabBackend &server) const -> std::optional<FabUser>;
+    [[nodiscard]] auto fromBackend(card::uid_t uid, const ServerMQTT::UserResponse &response) const -> FabUser;
     auto setWhitelist(WhiteList list) -> void;
     auto saveCache() const -> bool;
     auto loadCache() -> void;
+    auto prefetchUsers(FabBackend &server, uint32_t version) -> bool;
+    auto startPrefetch(FabBackend &server, uint32_t version) -> bool;
+    [[nodiscard]] auto isPrefetching() const -> bool;
+    [[nodiscard]] auto getPrefetchVersion() const -> uint32_t;
+    [[nodiscard]] auto getPrefetchCount() const -> size_t;
   };
 } // namespace fabomatic
 #endif // AUTHPROVIDER_HPP_
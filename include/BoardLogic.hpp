@@ -57,6 +57,7 @@ namespace fabomatic
     BoardLogic() = default;
 
     auto refreshFromServer() -> void;
+    auto processMachineUpdate() -> void;
     auto onNewCard(card::uid_t uid) -> void;
     auto logout() -> void;
     auto changeStatus(Status newStatus) -> void;
@@ -74,6 +75,7 @@ namespace fabomatic
     auto configure(BaseRFIDWrapper &rfid, LCDWrapper &lcd) -> bool;
     auto reconfigure() -> bool;
     auto saveRfidCache() -> bool;
+    auto persist() -> bool;
 
     [[nodiscard]] auto getStatus() const -> Status;
     [[nodiscard]] auto getRebootRequest() const -> bool;
@@ -101,6 +103,8 @@ namespace fabomatic
     std::optional<std::reference_wrapper<LCDWrapper>> lcd{std::nullopt};       // Configured at runtime
     bool ready_for_a_new_card{true};
     bool led_status{false};
+    bool machine_state_fresh{false}; /* True if the last login reply already carried the machine state */
+    bool volatile_buffer_warned{false}; /* Missing msglog partition already reported by persist() */
 
     Machine machine;
     AuthProvider auth{secrets::cards::whitelist};
@@ -111,6 +115,8 @@ namespace fabomatic
     bool rebootRequest{false};
     Buzzer buzzer;
 
+    auto applyMachineState(const ServerMQTT::MachineResponse &result) -> void;
+    auto checkUsersVersion() -> void;
     [[nodiscard]] auto longTap(const card::uid_t card, const std::string &short_prompt) const -> bool;
   };
 } // namespace fabomatic
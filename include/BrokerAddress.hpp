@@ -0,0 +1,37 @@
+#ifndef BROKERADDRESS_HPP
+#define BROKERADDRESS_HPP
+
+#include <optional>
+#include <string>
+
+#include "ArduinoJson.h"
+#include "FieldCodec.hpp"
+#include "conf.hpp"
+
+namespace fabomatic
+{
+  /**
+   * Last resolved address of the MQTT broker, used to connect without waiting for (m)DNS.
+   */
+  struct BrokerAddress
+  {
+    std::string hostname{""}; /* Broker name as configured, the address is only valid for it */
+    std::string ip{""};       /* Dotted IPv4 address */
+
+    [[nodiscard]] auto isValidFor(const std::string &host) const -> bool { return !ip.empty() && hostname == host; };
+
+    [[nodiscard]] auto operator==(const BrokerAddress &other) const -> bool = default;
+
+    /// @brief Reads the address saved as JSON by older firmwares
+    [[nodiscard]] static auto fromJsonElement(const JsonObject &json_obj) -> std::optional<BrokerAddress>;
+  };
+
+  template <>
+  struct codec::Fields<BrokerAddress>
+  {
+    static constexpr size_t IP_MAX_LENGTH{15};
+    static constexpr auto fields = std::make_tuple(field("host", &BrokerAddress::hostname, conf::common::STR_MAX_LENGTH),
+                                                   field("ip", &BrokerAddress::ip, IP_MAX_LENGTH));
+  };
+} // namespace fabomatic
+#endif // BROKERADDRESS_HPP
@@ -0,0 +1,159 @@
+#ifndef BUFFERLOG_HPP_
+#define BUFFERLOG_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <esp_partition.h>
+
+namespace fabomatic
+{
+  /**
+   * Append-only ring log of records in a flash partition.
+   *
+   * Each sector starts with a header holding a sequence number, followed by CRC-framed records.
+   * Records are acknowledged in place by clearing their state word (a tombstone), as NOR flash
+   * bits can go from 1 to 0 without erasing. A sector is only erased when the writer wraps
+   * around to it, so each sector wears once per pass over the partition.
+   * If the oldest sector still holds unacknowledged records when it is needed, they are handed to
+   * the compactor, which chooses the records written back in the new sector. Without compactor,
+   * they are dropped.
+   *
+   * Without the partition (e.g. older partition table), the same layout is kept in RAM.
+   */
+  class BufferLog
+  {
+  public:
+    struct Stats
+    {
+      size_t capacity;    /* Bytes available for records */
+      size_t used;        /* Bytes between the oldest pending record and the write position */
+      uint32_t dropped;   /* Records overwritten before being acknowledged, without compactor or not written back */
+      uint32_t corrupted; /* Records discarded on load because of a bad CRC */
+      uint32_t erases;    /* Sectors erased since boot */
+    };
+
+    /// @brief Oldest record not yet acknowledged
+    struct Entry
+    {
+      uint32_t seq;
+      std::string data;
+    };
+
+    /// @brief Chooses the records written back when a sector holding pending records is reused
+    /// @param evicted pending records of the sector, oldest first
+    /// @param budget bytes available for the records written back, see recordSize()
+    /// @return the records to write back, oldest first. Records with seq 0 get a new sequence number.
+    using Compactor = std::function<std::vector<Entry>(std::vector<Entry> &&evicted, size_t budget)>;
+
+    static constexpr size_t SECTOR_SIZE{4096};
+    static constexpr size_t MAX_RECORD_SIZE{64}; /* Payload bytes */
+
+  private:
+    struct SectorHeader
+    {
+      uint32_t magic;
+      uint32_t sequence;
+      uint32_t crc;
+      uint32_t reserved;
+    };
+    static_assert(sizeof(SectorHeader) == 16, "SectorHeader layout shall not depend on the compiler padding");
+
+    struct RecordHeader
+    {
+      uint16_t magic;
+      uint16_t length; /* Payload bytes, the record is padded to 4 bytes */
+      uint32_t seq;
+      uint32_t crc;   /* Of seq, length and payload */
+      uint32_t state; /* STATE_PENDING when written, STATE_ACKED once acknowledged */
+    };
+    static_assert(sizeof(RecordHeader) == 16, "RecordHeader layout shall not depend on the compiler padding");
+
+    static constexpr uint32_t SECTOR_MAGIC{0x474C4246}; /* "FBLG" */
+    static constexpr uint16_t RECORD_MAGIC{0xB10C};
+    static constexpr uint16_t BLANK_MAGIC{0xFFFF};
+    static constexpr uint32_t STATE_PENDING{0xFFFFFFFF};
+    static constexpr uint32_t STATE_ACKED{0};
+    static constexpr size_t NONE{SIZE_MAX};
+
+    const esp_partition_t *partition{nullptr};
+    std::vector<uint8_t> ram; /* Emulated flash when the partition is missing */
+    size_t sectors{0};
+
+    size_t write_sector{0};
+    size_t write_offset{NONE}; /* Absolute offset of the next record, NONE if the write sector is full */
+    uint32_t sector_seq{0};    /* Sequence of the write sector */
+    size_t read_offset{NONE};  /* Absolute offset of the oldest pending record */
+    size_t pending{0};
+    uint32_t next_seq{1};
+    Stats stats{};
+    Compactor compactor;
+
+    [[nodiscard]] auto read(size_t offset, void *dst, size_t len) const -> bool;
+    [[nodiscard]] auto write(size_t offset, const void *src, size_t len) -> bool;
+    [[nodiscard]] auto erase(size_t sector) -> bool;
+
+    [[nodiscard]] static constexpr auto padded(size_t len) -> size_t { return (len + 3) & ~size_t{3}; };
+    [[nodiscard]] auto writeRecord(std::string_view data, uint32_t seq) -> bool;
+    [[nodiscard]] static auto crc(const RecordHeader &header, const uint8_t *payload) -> uint32_t;
+    [[nodiscard]] auto readSectorHeader(size_t sector) const -> std::optional<SectorHeader>;
+    [[nodiscard]] auto readRecord(size_t offset, RecordHeader &header, uint8_t *payload) const -> bool;
+    [[nodiscard]] auto sectorEnd(size_t offset) const -> size_t { return (offset / SECTOR_SIZE + 1) * SECTOR_SIZE; };
+
+    /// @brief Finds the first pending record at or after offset, up to the write position
+    [[nodiscard]] auto findPending(size_t offset) const -> size_t;
+    auto startSector(size_t sector) -> bool;
+    auto scan() -> void;
+
+  public:
+    BufferLog() = default;
+
+    /// @brief Opens the log on the given flash partition, or in RAM if not found
+    /// @param label partition label
+    /// @param ram_size size of the RAM log used as fallback, in bytes
+    /// @return true if the flash partition is used
+    auto open(std::string_view label, size_t ram_size) -> bool;
+
+    /// @brief Appends a record, written to flash before returning
+    /// @return the sequence number of the record, std::nullopt on failure
+    auto append(std::string_view data) -> std::optional<uint32_t>;
+
+    [[nodiscard]] auto front() const -> std::optional<Entry>;
+
+    /// @brief Returns up to max_count pending records, oldest first, without acknowledging them
+    [[nodiscard]] auto peek(size_t max_count) const -> std::vector<Entry>;
+
+    /// @brief Acknowledges the oldest pending record
+    auto pop_front() -> void;
+
+    /// @brief Acknowledges all the records
+    auto clear() -> void;
+
+    /// @brief Acknowledges the pending record with the given sequence number, wherever it is in the log
+    /// @return false if no such record is pending
+    auto discard(uint32_t seq) -> bool;
+
+    /// @brief Sets the function choosing the records kept when the log is full
+    auto setCompactor(Compactor function) -> void { compactor = std::move(function); };
+
+    /// @brief Space taken by a record in the log, header included
+    [[nodiscard]] static constexpr auto recordSize(size_t len) -> size_t { return sizeof(RecordHeader) + padded(len); };
+
+    [[nodiscard]] auto count() const -> size_t { return pending; };
+    [[nodiscard]] auto isPersistent() const -> bool { return partition != nullptr; };
+    [[nodiscard]] auto getStats() const -> Stats;
+
+    BufferLog(const BufferLog &) = delete;
+    BufferLog &operator=(const BufferLog &) = delete;
+    BufferLog(BufferLog &&) = default;
+    BufferLog &operator=(BufferLog &&) = default;
+    ~BufferLog() = default;
+  };
+} // namespace fabomatic
+
+#endif // BUFFERLOG_HPP_
@@ -1,98 +1,159 @@
 #ifndef BUFFEREDMSG_HPP
 #define BUFFEREDMSG_HPP
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <optional>
-#include <queue>
-#include <string>
-#include <memory>
+#include <string_view>
+#include <vector>
 
-#include "ArduinoJson.h"
-#include "MachineID.hpp"
+#include "BufferLog.hpp"
 #include "MQTTtypes.hpp"
+#include "card.hpp"
+#include "conf.hpp"
 
 namespace fabomatic
 {
+  /// @brief Usage events kept for replay when the backend cannot be reached
+  enum class BufferedAction : uint8_t
+  {
+    StartUse = 1,
+    StopUse = 2,
+    Maintenance = 3,
+    Session = 4, /* StartUse and StopUse of the same card, merged */
+    Summary = 5, /* Events compacted when the log was full, only their number and total duration are kept */
+  };
+
   /**
-   * Message that can be saved in Flash for future replay
+   * Usage event that can be saved in Flash for future replay.
+   * The payload is rendered by BufferedQuery when transmitted, on the machine topic.
+   * Usage events are logged before being published, so the sequence number identifies the event
+   * for the backend whether it is received live or replayed.
    */
   struct BufferedMsg
   {
-    std::string mqtt_message;
-    std::string mqtt_topic;
-    bool wait_for_answer;
-    BufferedMsg() = default;
-    BufferedMsg(const std::string &message, const std::string &topic, bool wait) : mqtt_message(message), mqtt_topic(topic), wait_for_answer{wait} {};
-    BufferedMsg(const BufferedMsg &source) = default;
-    BufferedMsg(BufferedMsg &source) = default;
+    BufferedAction action{BufferedAction::StartUse};
+    card::uid_t uid{card::INVALID};
+    std::chrono::seconds duration{0}; /* Duration of use, StopUse only */
+    uint32_t timestamp{0};            /* Unix time of the event, 0 if the clock was not set */
+    uint32_t seq{0};                  /* Sequence number given by the log when buffered */
+    uint16_t events{1};               /* Number of events in a Summary */
+
+    /// @brief Record for a query to be buffered
+    /// @return std::nullopt if the query is not buffered
+    [[nodiscard]] static auto fromQuery(const ServerMQTT::Query &query) -> std::optional<BufferedMsg>;
+
+    /// @brief Record for a JSON query as buffered by older firmwares
+    [[nodiscard]] static auto fromPayload(std::string_view payload) -> std::optional<BufferedMsg>;
+
+    [[nodiscard]] auto operator==(const BufferedMsg &other) const -> bool = default;
   };
 
   /**
-   * Class containing the buffered messages for future replay
+   * Messages buffered for future replay, oldest first.
+   * They are kept in a BufferLog, so they survive reboots when the flash partition is present.
+   *
+   * A StopUse following the StartUse of the same card replaces it with a Session. When the log is
+   * full, the evicted events are written back by importance (Maintenance, then StopUse and Session)
+   * within half a sector, and the others are folded into a Summary.
    */
   class Buffer
   {
+  public:
+    struct CompactionStats
+    {
+      uint32_t sessions;   /* StartUse and StopUse pairs merged into a Session */
+      uint32_t kept;       /* Records written back when the log was full */
+      uint32_t summarized; /* Events folded into a Summary when the log was full */
+    };
+
   private:
-    std::deque<BufferedMsg> msg_queue;
-    bool has_changed{true};
-    static constexpr auto MAGIC_NUMBER = 1;
+    /// @brief On-flash representation of a BufferedMsg, the sequence number is kept by the log.
+    /// Version 1 records end before events.
+    struct __attribute__((packed)) Record
+    {
+      uint8_t action;
+      uint8_t version;
+      uint64_t uid;
+      uint32_t duration;
+      uint32_t timestamp;
+      uint16_t events;
+    };
+    static_assert(sizeof(Record) == 20, "Record layout shall not depend on the compiler padding");
+    static constexpr uint8_t RECORD_VERSION = 2; // Increment when changing the record layout
+    static constexpr size_t RECORD_V1_SIZE = offsetof(Record, events);
+
+    BufferLog log;
+    bool opened{false};
+    std::optional<BufferedMsg> open_session; /* Last StartUse buffered, merged with the StopUse of the same card */
+    uint32_t published_seq{0};               /* Highest sequence number published, see markPublished() */
+    CompactionStats compaction{};
+
+    [[nodiscard]] static auto encode(const BufferedMsg &message) -> Record;
+    [[nodiscard]] static auto toEntry(const BufferedMsg &message) -> BufferLog::Entry;
+    [[nodiscard]] static auto decode(const BufferLog::Entry &entry) -> std::optional<BufferedMsg>;
+    [[nodiscard]] auto compact(std::vector<BufferLog::Entry> &&evicted, size_t budget) -> std::vector<BufferLog::Entry>;
 
   public:
-    auto push_back(const BufferedMsg &message) -> void;
-    auto push_front(const BufferedMsg &message) -> void;
+    /// @brief Opens the log, does nothing if already opened
+    /// @param label flash partition label, the log is kept in RAM if not found
+    auto begin(std::string_view label = conf::buffer::PARTITION_LABEL) -> void;
+
+    /// @brief Appends the message to the log
+    /// @param merge if true, a StopUse replaces the StartUse of the same card not published yet with a Session
+    /// @return the message as logged, with its sequence number. std::nullopt if not logged.
+    auto push_back(const BufferedMsg &message, bool merge = true) -> std::optional<BufferedMsg>;
+
+    /// @brief Returns the oldest message, which stays buffered until pop_front()
+    [[nodiscard]] auto front() const -> std::optional<BufferedMsg>;
+
+    /// @brief Returns up to max_count of the oldest messages, which stay buffered.
+    /// Unreadable records are skipped.
+    [[nodiscard]] auto peek(size_t max_count) const -> std::vector<BufferedMsg>;
+
+    /// @brief Acknowledges the oldest message
+    auto pop_front() -> void;
+
+    /// @brief Acknowledges the message with the given sequence number, wherever it is in the log
+    auto acknowledge(uint32_t seq) -> void;
+
+    /// @brief The message has been published, so it is not merged anymore
+    auto markPublished(uint32_t seq) -> void;
+
+    /// @brief Returns and acknowledges the oldest message
     auto getMessage() -> const BufferedMsg;
-    auto count() const -> size_t;
-    auto toJson(JsonDocument &doc, const std::string &element_name) const -> void;
-    auto hasChanged() const -> bool { return has_changed; };
-    auto setChanged(bool new_value) -> void { has_changed = new_value; };
 
-    static auto fromJsonElement(const JsonObject &json_obj) -> std::optional<Buffer>;
-    static constexpr auto MAX_MESSAGES = 40;
+    auto clear() -> void;
+    [[nodiscard]] auto count() const -> size_t;
+    [[nodiscard]] auto isPersistent() const -> bool { return log.isPersistent(); };
+    [[nodiscard]] auto getStats() const -> BufferLog::Stats { return log.getStats(); };
+    [[nodiscard]] auto getCompactionStats() const -> CompactionStats { return compaction; };
   };
 
   /**
-   * Query to be replayed
+   * Query to be replayed, rendered from the buffered record
    */
   class BufferedQuery final : public ServerMQTT::Query
   {
   private:
-    std::string_view mqtt_value;
-    std::string_view mqtt_topic;
-    bool wait_for_answer;
+    const BufferedMsg msg;
 
   public:
     BufferedQuery() = delete;
-    constexpr BufferedQuery(const std::string_view &value,
-                            const std::string_view &topic,
-                            bool wait) : mqtt_value(value),
-                                         mqtt_topic(topic),
-                                         wait_for_answer{wait} {};
-
-    [[nodiscard]] auto payload() const -> const std::string override
+    constexpr BufferedQuery(const BufferedMsg &message) : msg(message)
     {
-      auto value = std::string{mqtt_value};
-      if (value.find("}") == value.size() - 1 &&
-          value.find("replay") == value.npos)
-      {
-        value.erase(value.end() - 1);
-        value += ", \"replay\":true}";
-      }
-      return value;
+      setEvent(message.seq, message.timestamp);
     };
 
-    [[nodiscard]] auto waitForReply() const -> bool override
-    {
-      return wait_for_answer;
-    };
+    [[nodiscard]] auto type() const -> ServerMQTT::QueryType override { return ServerMQTT::QueryType::Replay; };
+    [[nodiscard]] auto waitForReply() const -> bool override { return true; };
+    [[nodiscard]] auto buffered() const -> bool override { return false; };
 
-    [[nodiscard]] auto buffered() const -> bool override
-    {
-      return false;
-    };
-
-    [[nodiscard]] auto topic() const -> std::string
-    {
-      return std::string(mqtt_topic);
-    };
+  protected:
+    /// @brief Same members as the original query, flagged as replayed. The event time and sequence
+    /// number are the original ones, so that the backend can ignore the messages received twice
+    auto writeFields(ServerMQTT::TxBuffer &out) const -> void override;
   };
 
 } // namespace fabomatic
@@ -16,8 +16,14 @@ namespace fabomatic
   {
     card::uid_t uid;
     FabUser::UserLevel level;
-    constexpr CachedCard() : uid(card::INVALID), level(FabUser::UserLevel::Unknown) {};
-    constexpr CachedCard(card::uid_t uid, FabUser::UserLevel level) : uid(uid), level(level) {};
+    uint32_t last_seen; /* Logical timestamp of the last backend confirmation, used for eviction */
+    constexpr CachedCard() : uid(card::INVALID), level(FabUser::UserLevel::Unknown), last_seen(0) {};
+    constexpr CachedCard(card::uid_t uid, FabUser::UserLevel level, uint32_t last_seen = 0) : uid(uid), level(level), last_seen(last_seen) {};
+
+    constexpr auto operator==(const CachedCard &other) const -> bool
+    {
+      return uid == other.uid && level == other.level && last_seen == other.last_seen;
+    }
   };
 
   /**
@@ -28,12 +34,13 @@ namespace fabomatic
   {
     std::array<card::uid_t, conf::rfid_tags::CACHE_LEN> cards;
     std::array<FabUser::UserLevel, conf::rfid_tags::CACHE_LEN> levels;
+    std::array<uint32_t, conf::rfid_tags::CACHE_LEN> last_seen;
 
-    constexpr CachedCards() : cards{card::INVALID}, levels{FabUser::UserLevel::Unknown} {};
+    constexpr CachedCards() : cards{card::INVALID}, levels{FabUser::UserLevel::Unknown}, last_seen{0} {};
 
     constexpr auto operator[](int i) const -> const CachedCard
     {
-      return {cards[i], levels[i]};
+      return {cards[i], levels[i], last_seen[i]};
     }
 
     auto find_uid(const card::uid_t &search_uid) const -> const std::optional<CachedCard>
@@ -46,15 +53,45 @@ namespace fabomatic
       if (pos != cards.cend())
       {
         auto idx = std::distance(cards.cbegin(), pos);
-        return CachedCard{*pos, levels[idx]};
+        return CachedCard{*pos, levels[idx], last_seen[idx]};
       }
       return std::nullopt;
     }
 
-    constexpr auto set_at(int idx, const card::uid_t &uid, const FabUser::UserLevel &level) -> void
+    constexpr auto set_at(int idx, const card::uid_t &uid, const FabUser::UserLevel &level, uint32_t stamp = 0) -> void
     {
       cards[idx] = uid;
       levels[idx] = level;
+      last_seen[idx] = stamp;
+    }
+
+    /// @brief Index of the slot to be overwritten by a new card (first empty slot, or least recently seen card)
+    constexpr auto eviction_idx() const -> size_t
+    {
+      size_t candidate = 0;
+      for (size_t idx = 0; idx < size(); idx++)
+      {
+        if (cards[idx] == card::INVALID)
+        {
+          return idx;
+        }
+        if (last_seen[idx] < last_seen[candidate])
+        {
+          candidate = idx;
+        }
+      }
+      return candidate;
+    }
+
+    /// @brief Next logical timestamp, greater than all the stored ones
+    constexpr auto next_stamp() const -> uint32_t
+    {
+      uint32_t max_stamp = 0;
+      for (const auto stamp : last_seen)
+      {
+        max_stamp = std::max(max_stamp, stamp);
+      }
+      return max_stamp + 1;
     }
 
     constexpr auto size() const -> size_t
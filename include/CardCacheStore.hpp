@@ -0,0 +1,56 @@
+#ifndef CARDCACHESTORE_HPP_
+#define CARDCACHESTORE_HPP_
+
+#include <cstdint>
+#include <string>
+
+#include "CachedCards.hpp"
+
+namespace fabomatic
+{
+  /**
+   * Persists the RFID cache in NVS, one small CRC-protected binary record per cache slot.
+   * Only the slots which changed since the last load/save are written, so that a cache
+   * update costs a few dozen bytes of wear-levelled flash instead of a full SavedConfig rewrite.
+   */
+  class CardCacheStore
+  {
+  private:
+    static constexpr auto NVS_NAMESPACE = "rfid_cache";
+    static constexpr uint8_t RECORD_VERSION = 1; // Increment when changing the record layout
+
+    /// @brief On-flash representation of a cache slot
+    struct __attribute__((packed)) Record
+    {
+      uint64_t uid;
+      uint32_t last_seen;
+      uint8_t level;
+      uint8_t version;
+      uint32_t crc;
+    };
+    static_assert(sizeof(Record) == 18, "Record layout shall not depend on the compiler padding");
+
+    /// @brief Mirror of the slots currently stored in NVS, to skip unchanged writes
+    CachedCards persisted;
+    bool loaded{false};
+
+    [[nodiscard]] static auto key(size_t idx) -> std::string;
+    [[nodiscard]] static auto crc(const Record &record) -> uint32_t;
+    [[nodiscard]] auto readAll() -> bool;
+
+  public:
+    CardCacheStore() = default;
+
+    /// @brief Loads the cached cards from NVS, invalid or missing records are returned as empty slots
+    [[nodiscard]] auto load() -> CachedCards;
+
+    /// @brief Writes the slots of the given cache which differ from the stored ones
+    /// @return true if all the changed slots have been written
+    auto save(const CachedCards &cache) -> bool;
+
+    /// @brief Removes all the cached cards from NVS
+    auto clear() -> bool;
+  };
+} // namespace fabomatic
+
+#endif // CARDCACHESTORE_HPP_
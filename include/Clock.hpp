@@ -0,0 +1,24 @@
+#ifndef CLOCK_HPP_
+#define CLOCK_HPP_
+
+#include <cstdint>
+
+/**
+ * Wall clock for the time of the usage events, synchronized by SNTP.
+ *
+ * The Unix time is derived from the monotonic clock and the offset measured at the last
+ * synchronization, so it keeps going while offline and is not affected by changes of the
+ * system time. Until the first synchronization since boot, the time is unknown.
+ */
+namespace fabomatic::Clock
+{
+  /// @brief Starts the SNTP synchronization, once the network is up. Does nothing if already started.
+  auto begin() -> void;
+
+  /// @brief Current Unix time in seconds, 0 if the clock has not been synchronized yet
+  [[nodiscard]] auto now() -> uint32_t;
+
+  [[nodiscard]] auto isSynchronized() -> bool;
+} // namespace fabomatic::Clock
+
+#endif // CLOCK_HPP_
@@ -2,9 +2,16 @@
 #define FABBACKEND_HPP_
 
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <vector>
+
+#include "pthread.h"
 
 #include "WiFi.h"
 #include <ArduinoJson.h>
@@ -12,19 +19,73 @@
 
 #include "FabUser.hpp"
 #include "MQTTtypes.hpp"
+#include "ReplyArena.hpp"
+#include "RttEstimator.hpp"
 #include "SavedConfig.hpp"
+#include "SpscQueue.hpp"
 #include "conf.hpp"
 #include "BufferedMsg.hpp"
 
 namespace fabomatic
 {
   /**
-   * This class is used to exchange messages with the MQTT broker and the backend
+   * This class is used to exchange messages with the MQTT broker and the backend.
+   *
+   * Once startIoTask() has been called, the MQTT client, the WiFi and the connection state machine
+   * belong to a dedicated I/O task. The board logic exchanges messages with it through two lock-free queues:
+   * publications to send, and received messages, processed in loop() and while waiting for a reply.
+   * Connection changes are reported apart, so that none is lost when the queue is full. Without I/O task (at boot, in tests), loop() runs the I/O step itself.
    */
   class FabBackend
   {
+  public:
+    /// @brief State of the connection circuit breaker
+    enum class BreakerState : uint8_t
+    {
+      Closed,   /* Normal operation */
+      Open,     /* Too many failures, no reconnection attempt until BREAKER_OPEN_PERIOD elapsed */
+      HalfOpen, /* Probing the connection, next failure opens the breaker again */
+    };
+
+    /// @brief WiFi association times for one connection path
+    struct WiFiPathStats
+    {
+      uint32_t count{0};
+      std::chrono::milliseconds last{0};
+      std::chrono::milliseconds total{0};
+    };
+
+    /// @brief WiFi association times with the cached lease (fast) and with a full scan and DHCP
+    struct WiFiStats
+    {
+      WiFiPathStats fast;
+      WiFiPathStats full;
+    };
+
+    /// @brief Broker name resolutions and their latency, and connections using the cached address instead
+    struct ResolveStats
+    {
+      uint32_t count{0};
+      uint32_t failures{0};
+      uint32_t cache_hits{0};
+      std::chrono::milliseconds last{0};
+      std::chrono::milliseconds total{0};
+    };
+
+    /// @brief Steps of the connection to the MQTT server, advanced by connectStep()
+    enum class LinkState : uint8_t
+    {
+      Disconnected,    /* Waiting for the next attempt */
+      AssociatingWiFi, /* WiFi.begin() called, waiting for association */
+      ResolvingBroker,
+      ConnectingTcp,
+      ConnectingMqtt,
+      Subscribing,
+      Connected,
+    };
+
   private:
-    constexpr static auto MAX_MSG_SIZE = 300;
+    constexpr static auto MAX_MSG_SIZE = conf::mqtt::MAX_MSG_SIZE;
     enum class PublishResult : uint8_t
     {
       ErrorNotPublished,
@@ -32,8 +93,25 @@ namespace fabomatic
       PublishedWithAnswer
     };
 
+    /// @brief Progress of a connection step running in the network stack, polled by connectStep()
+    enum class StepResult : uint8_t
+    {
+      Pending,
+      Done,
+      Failed
+    };
+
+    /// @brief State of the broker name lookup, set by the lwIP callback
+    enum class LookupState : uint8_t
+    {
+      Idle,
+      Running,
+      Found,
+      NotFound
+    };
+
     MQTTClient client{MAX_MSG_SIZE}; // Default is 128, and can be reached with some messages
-    JsonDocument doc;
+    ReplyArena reply_arena;          /* Memory of the reply being parsed, see parseReply() */
 
     std::string wifi_ssid{""};
     std::string wifi_password{""};
@@ -42,27 +120,174 @@ namespace fabomatic
     std::string mqtt_password{""};
     std::string mqtt_client_name{""};
 
-    MQTTClientCallbackSimpleFunction callback;
+    MQTTClientCallbackAdvancedFunction callback; /* Payloads may be binary */
     WiFiClient wifi_client;
 
     std::string topic{""};
     std::string response_topic{""};
-    std::string last_query{""};
+    std::string config_topic{""};
+    std::string msgpack_response_topic{""};
     std::string last_reply{""};
 
-    bool online{false};
-    bool answer_pending{false};
+    std::atomic<bool> online{false};
+    bool check_and_start_supported{false}; /* Announced by the backend in checkmachine replies */
+    std::optional<bool> summary_supported; /* Announced by the backend in checkmachine replies, unknown until the first one */
+    ServerMQTT::WireFormat wire_format{ServerMQTT::WireFormat::Json}; /* Acknowledged by the backend in checkmachine replies */
     int16_t channel{-1};
 
     Buffer buffer;
 
-    auto messageReceived(String &topic, String &payload) -> void;
+    uint32_t machine_version{0};      /* Version of the machine state last handed over to the board */
+    uint32_t last_seen_version{0};    /* Version of the machine state announced in the last reply */
+    std::chrono::system_clock::time_point last_seen_time{};
+    std::unique_ptr<ServerMQTT::MachineResponse> machine_update{nullptr};
+    uint32_t users_version{0};        /* Version of the authorized users list announced in the last reply carrying it */
+    bool config_pushed{false}; /* True once the backend pushed the machine configuration on config_topic */
+
+    /// @brief Query published and waiting for its reply, matched through the correlation id
+    struct PendingQuery
+    {
+      uint32_t cid;
+      ServerMQTT::QueryType type;
+      std::chrono::system_clock::time_point sent;
+      std::chrono::system_clock::time_point deadline;
+      std::optional<std::string> reply;
+      std::function<void(const std::string &)> on_reply; /* Empty for synchronous queries */
+      std::optional<BufferedMsg> record;                 /* Usage event in the log, not replayed while pending */
+      bool failed{false};                                /* Publication failed in the I/O task */
+    };
+    std::list<PendingQuery> pending;
+    uint32_t next_cid{1};
+    bool backend_echoes_cid{false}; /* A reply carried a correlation id since boot: replies without one are stale */
+    std::vector<uint32_t> replay_acked; /* Replayed messages answered before an older one, see replayStep() */
+    std::chrono::system_clock::time_point replay_resume; /* Replay paused until then after a rejected message */
+
+    std::array<RttEstimator, static_cast<size_t>(ServerMQTT::QueryType::Count)> rtt{};
+
+    /// @brief Publication requested by the board logic to the I/O task
+    struct IoRequest
+    {
+      enum class Kind : uint8_t
+      {
+        Publish,
+        Disconnect,
+      };
+      Kind kind{Kind::Publish};
+      std::string topic{""};      /* Short enough for the small string optimization */
+      ServerMQTT::TxBuffer payload; /* Serialized in place by the board logic, in format */
+      int qos{0};
+      uint32_t cid{0};
+      ServerMQTT::WireFormat format{ServerMQTT::WireFormat::Json}; /* MsgPack is sent on the msgpack sub-topic */
+    };
+
+    /// @brief Message or connection change reported by the I/O task to the board logic, in order
+    struct IoEvent
+    {
+      enum class Kind : uint8_t
+      {
+        Message,       /* Received from the broker */
+        PublishFailed, /* IoRequest not published, topic/payload/qos/cid copied from it */
+      };
+      Kind kind{Kind::Message};
+      std::string topic{""};
+      std::string payload{""};
+      int qos{0};
+      uint32_t cid{0};
+      std::chrono::system_clock::time_point time{};
+    };
+
+    SpscQueue<IoRequest, conf::mqtt::IO_QUEUE_SIZE> io_requests; /* Board logic -> I/O task */
+    SpscQueue<IoEvent, conf::mqtt::IO_EVENT_QUEUE_SIZE> io_events; /* I/O task -> board logic */
+    pthread_t io_thread;
+    std::atomic<bool> io_running{false};
+    std::atomic<bool> io_stop{false};
+    std::atomic<bool> io_exited{false}; /* Set by the I/O task when it returns */
+
+    /// @brief Connection changes reported by the I/O task, kept out of io_events so that none is lost
+    struct LinkChanges
+    {
+      uint32_t count{0}; /* Incremented on each change */
+      bool up{false};
+      std::chrono::system_clock::time_point last_up;
+      std::chrono::system_clock::time_point last_down;
+    };
+    mutable std::mutex link_mutex;
+    LinkChanges link_changes; /* Written by the I/O task */
+    uint32_t link_changes_seen{0};
+
+    // Board logic view of the connection, updated from link_changes
+    bool link_up{false};
+    std::chrono::system_clock::time_point link_lost; /* End of the last connection, for SESSION_HOLD_MAX */
+
+    mutable std::mutex breaker_mutex; /* Failures are recorded by both tasks */
+    std::atomic<BreakerState> breaker{BreakerState::Closed};
+    uint8_t consecutive_failures{0};
+    std::chrono::system_clock::time_point breaker_opened;
+
+    std::atomic<LinkState> link_state{LinkState::Disconnected};
+    IPAddress broker_ip;
+    std::chrono::system_clock::time_point step_started; /* Start of the current connection step */
+    std::chrono::system_clock::time_point next_attempt; /* Earliest time of the next connection attempt */
+    uint8_t reconnect_attempts{0}; /* Failed attempts since last connection, for backoff */
+
+    WiFiLease wifi_lease; /* Last successful association, for fast reconnection */
+    bool wifi_fast_path{false}; /* True if the ongoing association uses wifi_lease */
+    bool wifi_lease_used{false}; /* True if the current association was made with wifi_lease */
+    uint8_t wifi_lease_failures{0}; /* Consecutive connection failures after associating with wifi_lease */
+    std::chrono::steady_clock::time_point wifi_lease_time; /* When wifi_lease was obtained from DHCP, or loaded at boot */
+    std::chrono::system_clock::time_point wifi_begin; /* Start of the ongoing association */
+    mutable std::mutex stats_mutex; /* WiFi and DNS statistics, updated by the I/O task */
+    WiFiStats wifi_stats;
+
+    BrokerAddress broker_address; /* Last resolved address of broker_hostname, persisted */
+    bool broker_from_cache{false}; /* True if the ongoing connection uses broker_address */
+    bool verify_broker_address{false}; /* Resolve first, the last connection to broker_address failed */
+    std::chrono::system_clock::time_point broker_next_resolve; /* Next background resolution */
+    ResolveStats resolve_stats;
+    std::atomic<LookupState> lookup_state{LookupState::Idle};
+    std::atomic<uint32_t> lookup_result{0}; /* IPv4 address found by the lookup */
+    uint32_t lookup_generation{0}; /* Identifies the current lookup, changed under the lwIP core lock */
+    std::chrono::system_clock::time_point lookup_started;
+    int tcp_socket{-1}; /* Non-blocking socket of the ongoing TCP handshake, then owned by wifi_client */
+
+    auto messageReceived(char topic[], char bytes[], int length) -> void;
+    auto publishRequest(const IoRequest &request) -> bool;
+    auto replyReceived(IoEvent &event) -> void;
+    auto publishFailed(const IoEvent &event) -> void;
+    auto linkChanged(bool up, std::chrono::system_clock::time_point time) -> void;
+    auto processLinkChanges() -> void;
+    auto pushEvent(IoEvent &&event) -> void;
+    auto processEvents() -> void;
+    auto processQueuedEvents() -> void;
+    auto ioStep() -> void;
+    auto pollIo() -> void;
+    auto disconnectNow() -> void;
+    static auto ioTask(void *arg) -> void *;
 
     template <typename QueryT>
-    [[nodiscard]] auto publish(const QueryT &payload) -> PublishResult;
+    [[nodiscard]] auto publish(const QueryT &payload, uint32_t cid = 0) -> PublishResult;
+
+    [[nodiscard]] auto waitForAnswer(uint32_t cid, std::chrono::milliseconds timeout) -> bool;
+    [[nodiscard]] auto publishWithReply(const ServerMQTT::Query &payload, const std::optional<BufferedMsg> &record = std::nullopt) -> PublishResult;
+    auto dispatchReplies() -> void;
+    auto logEvent(ServerMQTT::Query &query) -> std::optional<BufferedMsg>;
+    auto replayStep() -> void;
+    [[nodiscard]] auto liveQueries() const -> size_t;
+    auto recordSuccess() -> void;
+    auto recordFailure() -> void;
+    auto setLinkState(LinkState state) -> void;
+    auto connectionFailed() -> void;
+    auto beginWiFi(bool fast) -> void;
+    auto saveWiFiLease() -> void;
+    auto isWiFiLeaseUsable() const -> bool;
+    auto discardWiFiLease() -> void;
+    auto cancelLookup() -> void;
+    [[nodiscard]] auto resolveStep(IPAddress &resolved) -> StepResult;
+    [[nodiscard]] auto tcpConnectStep() -> StepResult;
+    auto closeTcpSocket() -> void;
 
-    [[nodiscard]] auto waitForAnswer(std::chrono::milliseconds timeout) -> bool;
-    [[nodiscard]] auto publishWithReply(const ServerMQTT::Query &payload) -> PublishResult;
+    template <typename RespT>
+    [[nodiscard]] auto parseReply(const std::string &reply) -> std::unique_ptr<RespT>;
 
     template <typename RespT, typename QueryT, typename... QueryArgs>
     [[nodiscard]] auto processQuery(QueryArgs &&...) -> std::unique_ptr<RespT>;
@@ -70,20 +295,53 @@ namespace fabomatic
     template <typename QueryT, typename... QueryArgs>
     [[nodiscard]] auto processQuery(QueryArgs &&...args) -> bool;
 
-    auto loadBuffer(const Buffer &new_buffer) -> void;
+    template <typename RespT, typename QueryT, typename... QueryArgs>
+    auto processQueryAsync(std::function<void(std::unique_ptr<RespT>)> callback, QueryArgs &&...args) -> bool;
+
+    auto loadBuffer(const SavedConfig &config) -> void;
+    auto checkMachineVersion(const JsonDocument &reply) -> void;
+    auto configReceived(const std::string &payload) -> void;
 
   public:
+    /// @brief Completion callback of asynchronous queries, called from loop() with request_ok==false on timeout
+    using SimpleCallback = std::function<void(std::unique_ptr<ServerMQTT::SimpleResponse>)>;
+    using UserListCallback = std::function<void(std::unique_ptr<ServerMQTT::UserListResponse>)>;
+
     FabBackend() = default;
+    ~FabBackend();
 
     [[nodiscard]] auto checkCard(const card::uid_t uid) -> std::unique_ptr<ServerMQTT::UserResponse>;
     [[nodiscard]] auto checkMachine() -> std::unique_ptr<ServerMQTT::MachineResponse>;
+    [[nodiscard]] auto fetchUserList(uint16_t page) -> std::unique_ptr<ServerMQTT::UserListResponse>;
     [[nodiscard]] auto startUse(const card::uid_t uid) -> std::unique_ptr<ServerMQTT::SimpleResponse>;
+    [[nodiscard]] auto checkCardAndStartUse(const card::uid_t uid) -> std::unique_ptr<ServerMQTT::CheckAndStartResponse>;
     [[nodiscard]] auto inUse(const card::uid_t uid, std::chrono::seconds duration) -> std::unique_ptr<ServerMQTT::SimpleResponse>;
     [[nodiscard]] auto finishUse(const card::uid_t uid, std::chrono::seconds duration) -> std::unique_ptr<ServerMQTT::SimpleResponse>;
     [[nodiscard]] auto registerMaintenance(const card::uid_t maintainer) -> std::unique_ptr<ServerMQTT::SimpleResponse>;
+    auto startUseAsync(const card::uid_t uid, SimpleCallback callback) -> bool;
+    auto inUseAsync(const card::uid_t uid, std::chrono::seconds duration, SimpleCallback callback) -> bool;
+    auto finishUseAsync(const card::uid_t uid, std::chrono::seconds duration, SimpleCallback callback) -> bool;
+    auto fetchUserListAsync(uint16_t page, UserListCallback callback) -> bool;
+    [[nodiscard]] auto pendingQueries() const -> size_t;
+    [[nodiscard]] auto getRttEstimator(ServerMQTT::QueryType type) const -> const RttEstimator &;
+    [[nodiscard]] auto getRttStats() const -> std::string;
+    [[nodiscard]] auto getWiFiStats() const -> WiFiStats;
+    [[nodiscard]] auto getResolveStats() const -> ResolveStats;
+    [[nodiscard]] auto getTelemetry() const -> std::string;
     [[nodiscard]] auto alive() -> bool;
-    [[nodiscard]] auto publish(String topic, String payload, bool waitForAnswer) -> bool;
+    [[nodiscard]] auto publish(String topic, String payload) -> bool;
     [[nodiscard]] auto isOnline() const -> bool;
+    [[nodiscard]] auto getBreakerState() const -> BreakerState;
+    [[nodiscard]] auto isBreakerClosed() const -> bool;
+    [[nodiscard]] auto isReconnectDue() const -> bool;
+    [[nodiscard]] auto getLinkState() const -> LinkState;
+    [[nodiscard]] auto getClientId() const -> const std::string &;
+    auto connectStep() -> LinkState;
+    [[nodiscard]] auto isCheckAndStartSupported() const -> bool;
+    [[nodiscard]] auto getWireFormat() const -> ServerMQTT::WireFormat;
+    [[nodiscard]] auto isMachineStateCurrent() const -> bool;
+    [[nodiscard]] auto takeMachineUpdate() -> std::unique_ptr<ServerMQTT::MachineResponse>;
+    [[nodiscard]] auto getUsersVersion() const -> uint32_t;
     [[nodiscard]] auto hasBufferedMsg() const -> bool;
     [[nodiscard]] auto transmitBuffer() -> bool;
     [[nodiscard]] auto saveBuffer() -> bool;
@@ -91,6 +349,9 @@ namespace fabomatic
     auto connect() -> bool;
     auto connectWiFi() -> bool;
     auto loop() -> bool;
+    auto startIoTask() -> bool;
+    auto stopIoTask() -> void;
+    [[nodiscard]] auto isIoTaskRunning() const -> bool;
 
     auto configure(const SavedConfig &config) -> void; // Must be called before using the server
     auto disconnect() -> void;
@@ -0,0 +1,144 @@
+#ifndef FIELDCODEC_HPP_
+#define FIELDCODEC_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+
+#include "PayloadWriter.hpp"
+
+namespace fabomatic::codec
+{
+  /// @brief Rendering of a field in JSON, the binary encoding does not depend on it
+  enum class Format : uint8_t
+  {
+    Plain,
+    IPv4, /* uint32_t as dotted quad, first octet in the lowest byte as IPAddress */
+    Mac,  /* Byte array as colon-separated hex */
+  };
+
+  /// @brief Selects all the fields of a table, whatever their group
+  static constexpr uint8_t ALL_GROUPS{0xFF};
+
+  /// @brief Describes a member of Owner for the serializers
+  template <typename Owner, typename T>
+  struct Field
+  {
+    using type = T;
+    std::string_view name;
+    T Owner::*member;
+    size_t max_length; /* Strings only: longest value stored */
+    Format format;
+    uint8_t group; /* Fields of a group can be encoded separately */
+
+    /// @brief Same field, in the given group
+    template <typename G>
+    constexpr auto in(G field_group) const -> Field
+    {
+      return {name, member, max_length, format, static_cast<uint8_t>(field_group)};
+    }
+  };
+
+  template <typename Owner, typename T>
+  constexpr auto field(std::string_view name, T Owner::*member, size_t max_length = 0, Format format = Format::Plain) -> Field<Owner, T>
+  {
+    return {name, member, max_length, format, 0};
+  }
+
+  /**
+   * Field table of a type, specialized next to the type as
+   *   template <> struct Fields<T> { static constexpr auto fields = std::make_tuple(field(...), ...); };
+   * The binary encoding follows the table order: new fields shall be appended at the end,
+   * as records written before are decoded with the missing fields left to their default.
+   */
+  template <typename T>
+  struct Fields
+  {
+  };
+
+  template <typename T, typename = void>
+  struct is_described : std::false_type
+  {
+  };
+
+  template <typename T>
+  struct is_described<T, std::void_t<decltype(Fields<T>::fields)>> : std::true_type
+  {
+  };
+
+  /// @brief Sequential writer over a fixed byte range. Once the capacity is exceeded, the writer stays in error.
+  /// Without destination, only the size is computed.
+  class ByteWriter
+  {
+  private:
+    uint8_t *data;
+    size_t capacity;
+    size_t length{0};
+    bool overflow{false};
+
+  public:
+    constexpr ByteWriter(uint8_t *dst, size_t size) : data(dst), capacity(size){};
+
+    auto put(const void *src, size_t len) -> void;
+    auto fail() -> void { overflow = true; };
+
+    [[nodiscard]] auto size() const -> size_t { return length; };
+    [[nodiscard]] auto ok() const -> bool { return !overflow; };
+  };
+
+  /// @brief Sequential reader over a fixed byte range. Reading past the end puts the reader in error.
+  class ByteReader
+  {
+  private:
+    const uint8_t *data;
+    size_t length;
+    size_t position{0};
+    bool error{false};
+
+  public:
+    constexpr ByteReader(const uint8_t *src, size_t size) : data(src), length(size){};
+
+    auto get(void *dst, size_t len) -> void;
+    auto fail() -> void { error = true; };
+
+    [[nodiscard]] auto remaining() const -> size_t { return length - position; };
+    [[nodiscard]] auto ok() const -> bool { return !error; };
+  };
+
+  /// @brief Encoding of a member type, specialized for the types used in the field tables
+  template <typename T, typename = void>
+  struct Codec;
+
+  /// @brief Longest binary encoding of T, or of a group of its fields, known at compile time
+  template <typename T>
+  constexpr auto maxBinarySize(uint8_t group = ALL_GROUPS) -> size_t;
+
+  /// @brief Longest compact JSON rendering of T, known at compile time
+  template <typename T>
+  constexpr auto maxJsonSize() -> size_t;
+
+  /// @brief Writes the fields of value in table order, only those of the group if given
+  template <typename T>
+  auto encode(ByteWriter &out, const T &value, uint8_t group = ALL_GROUPS) -> void;
+
+  /// @brief Reads the fields of value in table order, only those of the group if given.
+  /// Fields after the end of the input keep their value.
+  /// @return false if the input is invalid, value may have been partially updated
+  template <typename T>
+  [[nodiscard]] auto decode(ByteReader &in, T &value, uint8_t group = ALL_GROUPS) -> bool;
+
+  /// @brief Writes the fields of value as members of the current JSON object
+  template <typename T, size_t N>
+  auto writeJson(PayloadWriter<N> &out, const T &value) -> void;
+
+  /// @brief Compact JSON rendering of value, for logs
+  template <typename T>
+  [[nodiscard]] auto toJson(const T &value) -> std::string;
+} // namespace fabomatic::codec
+
+#include "FieldCodec.tpp"
+
+#endif // FIELDCODEC_HPP_
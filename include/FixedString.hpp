@@ -0,0 +1,40 @@
+#ifndef FIXEDSTRING_HPP_
+#define FIXEDSTRING_HPP_
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+
+namespace fabomatic
+{
+  /**
+   * String of bounded length stored inline, without heap allocation.
+   * Longer values are truncated on assignment.
+   */
+  template <size_t N>
+  class FixedString
+  {
+  private:
+    std::array<char, N + 1> data{}; /* Always null-terminated */
+    size_t length{0};
+
+  public:
+    constexpr FixedString() = default;
+    FixedString(std::string_view value) { assign(value); };
+
+    auto assign(std::string_view value) -> void;
+    auto operator=(std::string_view value) -> FixedString &;
+
+    [[nodiscard]] auto view() const -> std::string_view { return {data.data(), length}; };
+    [[nodiscard]] auto c_str() const -> const char * { return data.data(); };
+    [[nodiscard]] auto size() const -> size_t { return length; };
+    [[nodiscard]] auto empty() const -> bool { return length == 0; };
+    [[nodiscard]] static constexpr auto capacity() -> size_t { return N; };
+
+    [[nodiscard]] auto operator==(std::string_view other) const -> bool { return view() == other; };
+  };
+} // namespace fabomatic
+
+#include "FixedString.tpp"
+
+#endif // FIXEDSTRING_HPP_
@@ -3,21 +3,87 @@
 
 #include "ArduinoJson.h"
 #include "FabUser.hpp"
+#include "FixedString.hpp"
 #include "Machine.hpp"
+#include "PayloadWriter.hpp"
 #include "card.hpp"
 #include "string"
 #include <memory>
 #include <string_view>
+#include <vector>
 
 namespace fabomatic::ServerMQTT
 {
+  /// @brief Kind of query, used to track the backend response time separately for each
+  enum class QueryType : uint8_t
+  {
+    CheckUser,
+    CheckMachine,
+    Alive,
+    ListUsers,
+    CheckAndStart,
+    StartUse,
+    StopUse,
+    InUse,
+    Maintenance,
+    Replay,
+    Count, /* Number of query types, not a valid type */
+  };
+
+  /// @brief Name of the query type, as used in telemetry
+  [[nodiscard]] auto queryTypeName(QueryType type) -> std::string_view;
+
+  /// @brief Encoding of the queries sent to the backend, MsgPack is negotiated with it (see conf::mqtt::MSGPACK_PAYLOAD)
+  using WireFormat = PayloadFormat;
+
+  /// @brief Converts a JSON message to MessagePack
+  /// @param json JSON object, as returned by Query::payload
+  /// @return the MessagePack encoding, empty if json is not valid
+  [[nodiscard]] auto toMsgPack(std::string_view json) -> std::string;
+
+  /// @brief Parses a backend message, either JSON or MessagePack
+  /// @param doc document to fill
+  /// @param payload message content, MessagePack if it does not start with '{'
+  [[nodiscard]] auto deserializePayload(JsonDocument &doc, const std::string &payload) -> DeserializationError;
+  [[nodiscard]] auto deserializePayload(JsonDocument &doc, const std::string &payload, const JsonDocument &filter) -> DeserializationError;
+
+  /// @brief Fixed transmit buffer for a query payload
+  using TxBuffer = PayloadWriter<conf::mqtt::MAX_MSG_SIZE>;
+
   class Query
   {
   public:
+    virtual auto type() const -> QueryType = 0;
     virtual auto waitForReply() const -> bool = 0;
-    virtual auto payload() const -> const std::string = 0;
     virtual auto buffered() const -> bool = 0;
     virtual ~Query() = default;
+
+    /// @brief Serializes the query as a JSON or MessagePack object, without heap allocation
+    /// @param out buffer to fill, cleared first
+    /// @param cid correlation id to be echoed by the backend, 0 for none
+    /// @param format encoding of the payload
+    /// @return false if the payload does not fit in the buffer, or cannot be encoded in this format
+    [[nodiscard]] auto serialize(TxBuffer &out, uint32_t cid = 0, WireFormat format = WireFormat::Json) const -> bool;
+
+    /// @brief JSON payload of the query, for buffering and logs
+    [[nodiscard]] auto payload() const -> const std::string;
+
+    /// @brief Sets the time and sequence number of a usage event, sent with the query
+    /// @param seq per-board sequence number of the event, 0 for none
+    /// @param timestamp Unix time of the event, 0 if unknown
+    constexpr auto setEvent(uint32_t seq, uint32_t timestamp) -> void
+    {
+      event_seq = seq;
+      event_time = timestamp;
+    };
+
+  protected:
+    /// @brief Writes the members of the query object
+    virtual auto writeFields(TxBuffer &out) const -> void = 0;
+
+  private:
+    uint32_t event_seq{0};
+    uint32_t event_time{0};
   };
 
   class UserQuery final : public Query
@@ -29,26 +95,77 @@ namespace fabomatic::ServerMQTT
     constexpr UserQuery(card::uid_t card_uid) : uid(card_uid){};
 
     [[nodiscard]] auto waitForReply() const -> bool override { return true; };
-    [[nodiscard]] auto payload() const -> const std::string override;
+    [[nodiscard]] auto type() const -> QueryType override { return QueryType::CheckUser; };
     [[nodiscard]] auto buffered() const -> bool override { return false; };
+
+  protected:
+    auto writeFields(TxBuffer &out) const -> void override;
   };
 
   class MachineQuery final : public Query
   {
   public:
     constexpr MachineQuery() = default;
-    [[nodiscard]] auto payload() const -> const std::string override;
+    [[nodiscard]] auto type() const -> QueryType override { return QueryType::CheckMachine; };
     [[nodiscard]] auto waitForReply() const -> bool override { return true; };
     [[nodiscard]] auto buffered() const -> bool override { return false; };
+
+  protected:
+    auto writeFields(TxBuffer &out) const -> void override;
   };
 
   class AliveQuery final : public Query
   {
   public:
-    constexpr AliveQuery() = default;
-    [[nodiscard]] auto payload() const -> const std::string override;
+    const std::string telemetry; /* Additional JSON members, empty if none */
+
+    /// @brief Board announcement and telemetry
+    /// @param stats JSON members with the connection statistics, see FabBackend::getTelemetry
+    AliveQuery(const std::string &stats = "") : telemetry(stats){};
+    [[nodiscard]] auto type() const -> QueryType override { return QueryType::Alive; };
     [[nodiscard]] auto waitForReply() const -> bool override { return false; };
     [[nodiscard]] auto buffered() const -> bool override { return false; };
+
+  protected:
+    auto writeFields(TxBuffer &out) const -> void override;
+  };
+
+  class UserListQuery final : public Query
+  {
+  public:
+    const uint16_t page;
+
+    UserListQuery() = delete;
+
+    /// @brief Request for the list of users authorized on this machine
+    /// @param page_nb page number, starting from 0
+    constexpr UserListQuery(uint16_t page_nb) : page(page_nb){};
+
+    [[nodiscard]] auto type() const -> QueryType override { return QueryType::ListUsers; };
+    [[nodiscard]] auto waitForReply() const -> bool override { return true; };
+    [[nodiscard]] auto buffered() const -> bool override { return false; };
+
+  protected:
+    auto writeFields(TxBuffer &out) const -> void override;
+  };
+
+  class CheckAndStartQuery final : public Query
+  {
+  public:
+    const card::uid_t uid;
+
+    CheckAndStartQuery() = delete;
+
+    /// @brief Request to check the user, register the start of use if allowed, and get the machine state in one exchange
+    /// @param card_uid machine user card id
+    constexpr CheckAndStartQuery(card::uid_t card_uid) : uid(card_uid){};
+
+    [[nodiscard]] auto type() const -> QueryType override { return QueryType::CheckAndStart; };
+    [[nodiscard]] auto waitForReply() const -> bool override { return true; };
+    [[nodiscard]] auto buffered() const -> bool override { return false; };
+
+  protected:
+    auto writeFields(TxBuffer &out) const -> void override;
   };
 
   class StartUseQuery final : public Query
@@ -59,9 +176,12 @@ namespace fabomatic::ServerMQTT
     StartUseQuery() = delete;
     constexpr StartUseQuery(card::uid_t card_uid) : uid(card_uid){};
 
-    [[nodiscard]] auto payload() const -> const std::string override;
+    [[nodiscard]] auto type() const -> QueryType override { return QueryType::StartUse; };
     [[nodiscard]] auto waitForReply() const -> bool override { return true; };
     [[nodiscard]] auto buffered() const -> bool override { return true; };
+
+  protected:
+    auto writeFields(TxBuffer &out) const -> void override;
   };
 
   class StopUseQuery final : public Query
@@ -77,9 +197,12 @@ namespace fabomatic::ServerMQTT
     /// @param mid machine id
     /// @param duration duration of usage, in seconds
     constexpr StopUseQuery(card::uid_t card_uid, std::chrono::seconds duration) : uid(card_uid), duration_s(duration){};
-    [[nodiscard]] auto payload() const -> const std::string override;
+    [[nodiscard]] auto type() const -> QueryType override { return QueryType::StopUse; };
     [[nodiscard]] auto waitForReply() const -> bool override { return true; };
     [[nodiscard]] auto buffered() const -> bool override { return true; };
+
+  protected:
+    auto writeFields(TxBuffer &out) const -> void override;
   };
 
   class InUseQuery final : public Query
@@ -95,9 +218,12 @@ namespace fabomatic::ServerMQTT
     /// @param mid machine id
     /// @param duration duration of usage, in seconds
     constexpr InUseQuery(card::uid_t card_uid, std::chrono::seconds duration) : uid(card_uid), duration_s(duration){};
-    [[nodiscard]] auto payload() const -> const std::string override;
+    [[nodiscard]] auto type() const -> QueryType override { return QueryType::InUse; };
     [[nodiscard]] auto waitForReply() const -> bool override { return true; };
     [[nodiscard]] auto buffered() const -> bool override { return false; };
+
+  protected:
+    auto writeFields(TxBuffer &out) const -> void override;
   };
 
   class RegisterMaintenanceQuery final : public Query
@@ -108,9 +234,12 @@ namespace fabomatic::ServerMQTT
     RegisterMaintenanceQuery() = delete;
     constexpr RegisterMaintenanceQuery(card::uid_t card_uid) : uid(card_uid){};
 
-    [[nodiscard]] auto payload() const -> const std::string override;
+    [[nodiscard]] auto type() const -> QueryType override { return QueryType::Maintenance; };
     [[nodiscard]] auto waitForReply() const -> bool override { return true; };
     [[nodiscard]] auto buffered() const -> bool override { return true; };
+
+  protected:
+    auto writeFields(TxBuffer &out) const -> void override;
   };
 
   class Response
@@ -134,7 +263,7 @@ namespace fabomatic::ServerMQTT
   {
   public:
     uint8_t result{static_cast<uint8_t>(UserResult::Invalid)};  /* Result of the user check */
-    std::string holder_name{""};                                /* Name of the user from server DB */
+    FixedString<conf::mqtt::NAME_MAX_LENGTH> holder_name{};     /* Name of the user from server DB */
     FabUser::UserLevel user_level{FabUser::UserLevel::Unknown}; /* User priviledges */
 
     UserResponse() = delete;
@@ -144,6 +273,7 @@ namespace fabomatic::ServerMQTT
                                              result(static_cast<uint8_t>(res)){};
 
     [[nodiscard]] static auto fromJson(JsonDocument &doc) -> std::unique_ptr<UserResponse>;
+    [[nodiscard]] static auto jsonFilter() -> const JsonDocument &;
 
     [[nodiscard]] auto getResult() const -> UserResult;
     [[nodiscard]] auto toString() const -> const std::string;
@@ -156,14 +286,51 @@ namespace fabomatic::ServerMQTT
     bool maintenance = true;     /* True if the machine needs maintenance */
     bool allowed = false;        /* True if the machine can be used by anybody */
     uint16_t logoff{0};          /* Timeout in minutes */
-    std::string name{""};        /* Name of the machine from server DB */
+    FixedString<conf::mqtt::NAME_MAX_LENGTH> name{};               /* Name of the machine from server DB */
     uint8_t type{0};             /* Type of the machine */
     uint16_t grace{0};           /* Grace period in minutes */
-    std::string description{""}; /* Description of the expired maintenance */
+    FixedString<conf::mqtt::DESCRIPTION_MAX_LENGTH> description{}; /* Description of the expired maintenance */
+    uint32_t users_version{0};   /* Version of the authorized users list, 0 if the backend does not support prefetch */
+    bool check_and_start{false}; /* True if the backend supports the combined checkandstart query */
+    bool msgpack{false};         /* True if the backend accepts MessagePack queries on conf::mqtt::msgpack_topic */
+    bool summary{false};         /* True if the backend records the summaries of compacted usage events */
+    uint32_t version{0};         /* Version of the machine state, 0 if not provided by the backend */
     MachineResponse() = delete;
     MachineResponse(bool rok) : Response(rok){};
 
     [[nodiscard]] static auto fromJson(JsonDocument &doc) -> std::unique_ptr<MachineResponse>;
+    [[nodiscard]] static auto fromJsonElement(const JsonVariantConst &elem) -> std::unique_ptr<MachineResponse>;
+    [[nodiscard]] static auto jsonFilter() -> const JsonDocument &;
+  };
+
+  class CheckAndStartResponse final : public Response
+  {
+  public:
+    bool supported{false};                    /* False if the backend did not understand the combined query */
+    bool started{false};                      /* True if the backend registered the start of use */
+    std::unique_ptr<UserResponse> user;       /* Result of the user check */
+    std::unique_ptr<MachineResponse> machine; /* Current machine state, request_ok is false if not provided */
+    CheckAndStartResponse() = delete;
+    CheckAndStartResponse(bool rok) : Response(rok),
+                                      user(std::make_unique<UserResponse>(false)),
+                                      machine(std::make_unique<MachineResponse>(false)){};
+
+    [[nodiscard]] static auto fromJson(JsonDocument &doc) -> std::unique_ptr<CheckAndStartResponse>;
+    [[nodiscard]] static auto jsonFilter() -> const JsonDocument &;
+  };
+
+  class UserListResponse final : public Response
+  {
+  public:
+    uint16_t page{0};           /* Page number of this reply */
+    uint16_t pages{0};          /* Total number of pages */
+    uint32_t version{0};        /* Version of the authorized users list */
+    std::vector<FabUser> users; /* Users authorized on the machine in this page */
+    UserListResponse() = delete;
+    UserListResponse(bool rok) : Response(rok){};
+
+    [[nodiscard]] static auto fromJson(JsonDocument &doc) -> std::unique_ptr<UserListResponse>;
+    [[nodiscard]] static auto jsonFilter() -> const JsonDocument &;
   };
 
   class SimpleResponse final : public Response
@@ -173,6 +340,7 @@ namespace fabomatic::ServerMQTT
     constexpr SimpleResponse(bool rok) : Response(rok){};
 
     [[nodiscard]] static auto fromJson(JsonDocument &doc) -> std::unique_ptr<SimpleResponse>;
+    [[nodiscard]] static auto jsonFilter() -> const JsonDocument &;
   };
 
 } // namespace fabomatic::ServerMQTT
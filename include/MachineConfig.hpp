@@ -6,6 +6,7 @@
 #include <string>
 
 #include "pins.hpp"
+#include "FieldCodec.hpp"
 #include "MachineID.hpp"
 #include "conf.hpp"
 
@@ -53,6 +54,35 @@ namespace fabomatic
     MachineConfig(MachineConfig &&) = delete;                   // move constructor
     MachineConfig &operator=(MachineConfig &&) = delete;        // move assignment
   };
+
+  /// @brief Machine IDs are encoded as their number
+  template <>
+  struct codec::Codec<MachineID>
+  {
+    static constexpr auto binarySize(size_t length) -> size_t { return Codec<uint16_t>::binarySize(length); };
+    static constexpr auto jsonSize(size_t length, Format format) -> size_t { return Codec<uint16_t>::jsonSize(length, format); };
+
+    static auto write(ByteWriter &out, const MachineID &value, size_t length) -> void { Codec<uint16_t>::write(out, value.id, length); };
+    static auto read(ByteReader &in, MachineID &value, size_t length) -> void { Codec<uint16_t>::read(in, value.id, length); };
+
+    template <size_t N>
+    static auto json(PayloadWriter<N> &out, std::string_view key, const MachineID &value, Format format) -> void
+    {
+      Codec<uint16_t>::json(out, key, value.id, format);
+    };
+  };
+
+  /// @brief The relay configuration comes from the pins, it is not part of the table
+  template <>
+  struct codec::Fields<MachineConfig>
+  {
+    static constexpr auto fields = std::make_tuple(field("machine_id", &MachineConfig::machine_id),
+                                                   field("machine_type", &MachineConfig::machine_type),
+                                                   field("machine_name", &MachineConfig::machine_name, conf::common::STR_MAX_LENGTH),
+                                                   field("mqtt_switch_topic", &MachineConfig::mqtt_switch_topic, conf::common::STR_MAX_LENGTH),
+                                                   field("autologoff", &MachineConfig::autologoff),
+                                                   field("grace_period", &MachineConfig::grace_period));
+  };
 } // namespace fabomatic
 
 #endif // MACHINECONFIG_HPP_
\ No newline at end of file
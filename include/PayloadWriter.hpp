@@ -0,0 +1,82 @@
+#ifndef PAYLOADWRITER_HPP_
+#define PAYLOADWRITER_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace fabomatic
+{
+  /// @brief Encoding of a PayloadWriter content
+  enum class PayloadFormat : uint8_t
+  {
+    Json,
+    MsgPack,
+  };
+
+  /**
+   * Writes a flat JSON or MessagePack object into a fixed buffer, without heap allocation.
+   * Fields are appended in order; once the capacity is exceeded the writer stays in error.
+   */
+  template <size_t N>
+  class PayloadWriter
+  {
+  private:
+    static constexpr size_t MAX_DEPTH = 4; /* Nested MessagePack maps */
+
+    std::array<char, N + 1> data{}; /* Always null-terminated */
+    size_t length{0};
+    bool failed{false}; /* Capacity exceeded, or content not representable in the format */
+    bool first_field{true};
+    PayloadFormat encoding{PayloadFormat::Json};
+    std::array<size_t, MAX_DEPTH> map_offsets{}; /* MessagePack map headers, patched with the count by endObject() */
+    std::array<uint16_t, MAX_DEPTH> map_sizes{};
+    size_t depth{0};
+
+    auto append(std::string_view text) -> void;
+    auto append(char c) -> void;
+    auto appendString(std::string_view value) -> void;
+    auto appendKey(std::string_view key) -> void;
+    auto appendPacked(uint8_t type, uint64_t value, size_t bytes) -> void;
+    auto appendPackedString(std::string_view value) -> void;
+    template <typename T>
+    auto appendPackedInteger(T value) -> void;
+
+  public:
+    constexpr PayloadWriter() = default;
+
+    /// @brief Empties the buffer and clears the error
+    /// @param format encoding of the fields written next
+    auto clear(PayloadFormat format = PayloadFormat::Json) -> void;
+
+    /// @brief Replaces the content with a preformatted payload
+    auto assign(std::string_view content) -> void;
+
+    auto beginObject() -> void;
+    auto endObject() -> void;
+
+    /// @brief Adds a member holding a nested object, closed by endObject()
+    auto beginObject(std::string_view key) -> void;
+
+    /// @brief Adds a member to the current object
+    /// @tparam T bool, integral type, std::chrono::duration (written as count) or string-like
+    template <typename T>
+    auto field(std::string_view key, const T &value) -> void;
+
+    /// @brief Adds preformatted JSON members ("a":1,"b":2) to the current object
+    /// @note Not supported in MessagePack: the writer goes in error
+    auto members(std::string_view json_members) -> void;
+
+    [[nodiscard]] auto view() const -> std::string_view { return {data.data(), length}; };
+    [[nodiscard]] auto c_str() const -> const char * { return data.data(); };
+    [[nodiscard]] auto size() const -> size_t { return length; };
+    [[nodiscard]] auto ok() const -> bool { return !failed; };
+    [[nodiscard]] auto format() const -> PayloadFormat { return encoding; };
+    [[nodiscard]] static constexpr auto capacity() -> size_t { return N; };
+  };
+} // namespace fabomatic
+
+#include "PayloadWriter.tpp"
+
+#endif // PAYLOADWRITER_HPP_
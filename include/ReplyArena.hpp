@@ -0,0 +1,56 @@
+#ifndef REPLYARENA_HPP_
+#define REPLYARENA_HPP_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "ArduinoJson.h"
+#include "conf.hpp"
+
+namespace fabomatic
+{
+  /**
+   * Fixed memory for the JsonDocument parsing a backend reply, reset before each parse.
+   * Blocks are bump-allocated, only the last one can be freed or grown in place.
+   * Replies needing more than conf::mqtt::REPLY_ARENA_SIZE fail with DeserializationError::NoMemory.
+   */
+  class ReplyArena final : public ArduinoJson::Allocator
+  {
+  private:
+    static constexpr size_t ALIGN = alignof(std::max_align_t);
+    static constexpr size_t NO_BLOCK = SIZE_MAX;
+
+    alignas(ALIGN) std::array<uint8_t, conf::mqtt::REPLY_ARENA_SIZE> memory{};
+    size_t used{0};          /* Bytes allocated, including block headers */
+    size_t last{NO_BLOCK};   /* Offset of the last block header, NO_BLOCK if it was freed */
+    size_t peak{0};          /* Highest usage since construction */
+    uint32_t failures{0};    /* Allocations refused for lack of space */
+
+    [[nodiscard]] static constexpr auto aligned(size_t size) -> size_t { return (size + ALIGN - 1) & ~(ALIGN - 1); };
+    [[nodiscard]] auto blockSize(const void *ptr) const -> size_t;
+    [[nodiscard]] auto isLast(const void *ptr) const -> bool;
+
+  public:
+    ReplyArena() = default;
+
+    auto allocate(size_t size) -> void * override;
+    auto deallocate(void *ptr) -> void override;
+    auto reallocate(void *ptr, size_t new_size) -> void * override;
+
+    /// @brief Releases all blocks. No JsonDocument may still use the arena.
+    auto reset() -> void;
+
+    [[nodiscard]] auto getUsed() const -> size_t { return used; };
+    [[nodiscard]] auto getPeak() const -> size_t { return peak; };
+    [[nodiscard]] auto getFailures() const -> uint32_t { return failures; };
+
+    ReplyArena(const ReplyArena &) = delete;
+    ReplyArena &operator=(const ReplyArena &) = delete;
+    ReplyArena(ReplyArena &&) = delete;
+    ReplyArena &operator=(ReplyArena &&) = delete;
+    ~ReplyArena() = default;
+  };
+} // namespace fabomatic
+
+#endif // REPLYARENA_HPP_
@@ -0,0 +1,45 @@
+#ifndef RTTESTIMATOR_HPP
+#define RTTESTIMATOR_HPP
+
+#include <chrono>
+#include <cstdint>
+
+#include "conf.hpp"
+
+namespace fabomatic
+{
+  /**
+   * Tracks the backend round-trip time and derives the reply timeout from it
+   * (smoothed RTT and variance, as for TCP retransmission timers).
+   */
+  class RttEstimator
+  {
+  public:
+    using milliseconds = std::chrono::milliseconds;
+
+  private:
+    milliseconds srtt{0};
+    milliseconds rttvar{0};
+    milliseconds rto{conf::mqtt::TIMEOUT_REPLY_SERVER};
+    uint32_t samples{0};
+
+    [[nodiscard]] static auto clamp(milliseconds timeout) -> milliseconds;
+
+  public:
+    /// @brief Updates the estimates with a measured round-trip time
+    /// @param rtt time between the query publication and its reply
+    auto addSample(milliseconds rtt) -> void;
+
+    /// @brief Doubles the timeout after a reply did not arrive, until the next sample
+    auto backoff() -> void;
+
+    /// @brief Gets the time to wait for a reply
+    /// @param attempt number of previous unanswered waits for the same query, doubling the timeout each
+    [[nodiscard]] auto getTimeout(uint8_t attempt = 0) const -> milliseconds;
+
+    [[nodiscard]] auto getSmoothedRtt() const -> milliseconds;
+    [[nodiscard]] auto getRttVariance() const -> milliseconds;
+    [[nodiscard]] auto getSamples() const -> uint32_t;
+  };
+} // namespace fabomatic
+#endif // RTTESTIMATOR_HPP
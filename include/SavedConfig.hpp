@@ -1,50 +1,142 @@
 #ifndef SAVEDCONFIG_HPP_
 #define SAVEDCONFIG_HPP_
 
+#include <array>
+#include <bitset>
 #include <cstdint>
+#include <functional>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <mutex>
+#include <vector>
 
 #include <EEPROM.h>
 #include <ArduinoJson.h>
+#include <Preferences.h>
 
 #include "MachineConfig.hpp"
 #include "conf.hpp"
-#include "CachedCards.hpp"
+#include "BrokerAddress.hpp"
 #include "BufferedMsg.hpp"
+#include "FieldCodec.hpp"
+#include "WiFiLease.hpp"
 
 namespace fabomatic
 {
   /**
    * Persisted settings and facilities to load/save settings from Flash
+   *
+   * Each section is stored in NVS as a versioned binary record generated from the field table
+   * (see codec::Fields<SavedConfig>), in two alternating slots. A slot holds a sequence number
+   * and a CRC: the newer valid slot is loaded, so a write torn by a power cut falls back to the
+   * previous contents of the section instead of the defaults.
+   * Settings saved in the EEPROM image by older firmwares (JSON or binary) are read once, when
+   * NVS holds no section yet.
+   *
+   * The settings are read from flash and parsed once, then served from a resident copy.
+   * Saving compares the settings with the resident copy section by section, and writes
+   * only the sections which changed.
+   * Changes made at runtime (boot count, network state) are recorded with Update() and
+   * written together by Flush().
    */
   class SavedConfig
   {
+  public:
+    /// @brief Groups of settings changing together
+    enum class Section : uint8_t
+    {
+      Settings, /* Credentials, machine and portal settings, from the portal or defaults */
+      Counters, /* Boot count */
+      Network,  /* WiFi lease and broker address, refreshed at runtime */
+      Count,
+    };
+    using Sections = std::bitset<static_cast<size_t>(Section::Count)>;
+
+    /// @brief Longest WiFi password, a WPA2 passphrase or the PSK in hex
+    static constexpr size_t PASSWORD_MAX_LENGTH{64};
+
+    /// @brief Size of the EEPROM image, as used by the settings of older firmwares
+    static constexpr size_t EEPROM_SIZE{4096};
+
+    static constexpr auto NVS_NAMESPACE = "settings";
+
+    /// @brief NVS key of one of the two slots of a section
+    [[nodiscard]] static auto slotKey(Section section, uint8_t slot) -> std::string;
+
   private:
-    static constexpr auto JSON_DOC_SIZE = 4096;
-    static_assert(JSON_DOC_SIZE > (conf::common::STR_MAX_LENGTH * 7 + sizeof(bool) + sizeof(size_t) + sizeof(CachedCards) + (sizeof(Buffer) + 40) * 40), "JSON_DOC_SIZE must be larger than SavedConfig size in JSON");
-    static std::string json_buffer;
+    struct BinaryHeader
+    {
+      uint8_t marker;  /* BINARY_MARKER, older JSON settings start with '{' */
+      uint8_t version; /* MAGIC_NUMBER of the firmware which saved the settings */
+      uint16_t length; /* Bytes of fields following the header */
+    };
+    static_assert(sizeof(BinaryHeader) == 4, "BinaryHeader layout shall not depend on the compiler padding");
+    static constexpr uint8_t BINARY_MARKER{0xFB};
+
+    struct SlotHeader
+    {
+      uint32_t seq;    /* Incremented on each write of the section, the highest valid slot is loaded */
+      uint32_t crc;    /* Of the header with crc set to 0, and of the fields */
+      uint16_t length; /* Bytes of fields following the header */
+      uint8_t version; /* MAGIC_NUMBER of the firmware which saved the section */
+      uint8_t reserved;
+    };
+    static_assert(sizeof(SlotHeader) == 12, "SlotHeader layout shall not depend on the compiler padding");
+
+    /// @brief Slot holding the current contents of a section
+    struct SlotState
+    {
+      uint32_t seq{0}; /* 0 if the section is not in NVS yet */
+      uint8_t slot{1}; /* The next write goes to the other slot */
+    };
+
+    /// @brief Longest slot record, header included
+    static constexpr auto maxSlotSize() -> size_t;
+
     static std::mutex buffer_mutex;
 
-    /// @brief Serialize the current configuration into a JsonDocument
-    /// @return JsonDocument
-    [[nodiscard]] auto toJsonDocument() const -> JsonDocument;
+    /// @brief Contents of the flash, loaded on first use and updated on each save
+    static std::optional<SavedConfig> resident;
+    static bool resident_loaded;
+    static std::array<SlotState, static_cast<size_t>(Section::Count)> slots;
+
+    /// @brief Changes recorded by Update(), not written yet
+    static std::optional<SavedConfig> pending;
+
+    /// @brief Reads the sections from NVS, falling back to the EEPROM of older firmwares. buffer_mutex shall be held
+    [[nodiscard]] static auto readFlash() -> std::optional<SavedConfig>;
+
+    /// @brief Reads and parses the EEPROM contents written by older firmwares, buffer_mutex shall be held
+    [[nodiscard]] static auto readEEPROM() -> std::optional<SavedConfig>;
+
+    /// @brief Decodes the newest valid slot of a section into config
+    /// @return false if no slot of the section is valid, config is left unchanged
+    [[nodiscard]] static auto readSection(Preferences &prefs, Section section, SavedConfig &config) -> bool;
+
+    /// @brief Writes the section to its older slot, buffer_mutex shall be held
+    [[nodiscard]] auto writeSection(Preferences &prefs, Section section) const -> bool;
+
+    /// @brief Writes the sections which changed, buffer_mutex shall be held
+    [[nodiscard]] auto commit() const -> bool;
 
-    /// @brief Deserialize a JsonDocument into a SavedConfig
+    /// @brief Decodes the binary settings
+    /// @param data EEPROM image, starting with the header
+    /// @param size bytes available
+    /// @return std::nullopt if the settings are invalid, or a valid SavedConfig
+    [[nodiscard]] static auto fromBinary(const uint8_t *data, size_t size) -> std::optional<SavedConfig>;
+
+    /// @brief Deserialize the JSON settings saved by older firmwares
     /// @param json_text json document as string to be deserialized
     /// @return std::nullopt if the document is invalid, or a valid SavedConfig
-    [[nodiscard]] static auto fromJsonDocument(const std::string &json_text) -> std::optional<SavedConfig>;
+    [[nodiscard]] static auto fromJsonDocument(std::string_view json_text) -> std::optional<SavedConfig>;
 
   public:
-    static constexpr auto MAGIC_NUMBER = 0x51; // Increment when changing the struct
+    static constexpr auto MAGIC_NUMBER = 0x53; // Increment when changing the struct, unless only appending fields to the table
 
     // Magic number to check if the EEPROM is initialized
     mutable uint8_t magic_number{0};
 
-    /// @brief list of cached RFID cards
-    CachedCards cachedRfid;
-
     /// @brief WiFi SSID
     std::string ssid{""};
 
@@ -73,34 +165,81 @@ namespace fabomatic
     /// @brief if true, the FORCE_OPEN_PORTAL flag will be ignored
     bool disablePortal{false};
 
-    Buffer message_buffer;
+    /// @brief Messages buffered by firmwares keeping them in the settings (version 0x51), moved to the log on startup
+    std::vector<BufferedMsg> legacy_buffer;
+
+    /// @brief Last successful WiFi association, for fast reconnection
+    WiFiLease wifi_lease;
+
+    /// @brief Last resolved address of mqtt_server
+    BrokerAddress broker_address;
 
     /// @brief Allow compiler-time construction
     SavedConfig() = default;
 
-    /// @brief Saves the configuration to EEPROM
+    /// @brief Saves the sections of the configuration which differ from the saved ones.
+    /// Pending changes are discarded, this configuration supersedes them.
     /// @return true if successful
     auto SaveToEEPROM() const -> bool;
 
+    /// @brief Sections which differ from the other configuration
+    [[nodiscard]] auto changedSections(const SavedConfig &other) const -> Sections;
+
     /// @brief Sets the machine ID (converting to string)
     auto setMachineID(MachineID id) -> void;
 
     /// @brief Gets the machine ID (converting from string)
     [[nodiscard]] auto getMachineID() const -> MachineID;
 
-    /// @brief Returns a json-prettified fragment for logging
+    /// @brief Returns a compact JSON rendering for logging
     [[nodiscard]] auto toString() const -> const std::string;
 
-    /// @brief Loads the configuration from EEPROM if available and matching revision number
+    /// @brief Loads the configuration from flash if available and matching revision number.
+    /// Flash is only read on the first call, the resident copy is returned afterwards,
+    /// with the pending changes applied.
     /// @return std::nullopt if not valid, SavedConfig otherwise
     [[nodiscard]] static auto LoadFromEEPROM() -> std::optional<SavedConfig>;
 
+    /// @brief Reads the configuration from flash again, e.g. after writing it directly.
+    /// Pending changes are discarded.
+    /// @return std::nullopt if not valid, SavedConfig otherwise
+    [[nodiscard]] static auto ReloadFromEEPROM() -> std::optional<SavedConfig>;
+
     /// @brief Returns the default configuration built from conf.hpp and secrets.hpp
     [[nodiscard]] static auto DefaultConfig() -> SavedConfig;
 
-    /// @brief Increments the boot count and saves it to EEPROM
+    /// @brief Applies change to the configuration, without writing flash until Flush()
+    static auto Update(const std::function<void(SavedConfig &)> &change) -> void;
+
+    /// @brief Writes the pending changes, if any, in one pass
+    /// @return true if successful, on failure the changes are kept for the next call
+    static auto Flush() -> bool;
+
+    /// @brief True if changes are waiting for Flush()
+    [[nodiscard]] static auto HasPendingChanges() -> bool;
+
+    /// @brief Increments the boot count, written on next Flush()
     static auto IncrementBootCount() -> size_t;
   };
 
+  template <>
+  struct codec::Fields<SavedConfig>
+  {
+    using Section = SavedConfig::Section;
+
+    // Settings fields are in group 0, the default
+    static constexpr auto fields = std::make_tuple(field("disablePortal", &SavedConfig::disablePortal),
+                                                   field("bootCount", &SavedConfig::bootCount).in(Section::Counters),
+                                                   field("ssid", &SavedConfig::ssid, conf::common::STR_MAX_LENGTH),
+                                                   field("password", &SavedConfig::password, SavedConfig::PASSWORD_MAX_LENGTH),
+                                                   field("mqtt_server", &SavedConfig::mqtt_server, conf::common::STR_MAX_LENGTH),
+                                                   field("mqtt_user", &SavedConfig::mqtt_user, conf::common::STR_MAX_LENGTH),
+                                                   field("mqtt_password", &SavedConfig::mqtt_password, conf::common::STR_MAX_LENGTH),
+                                                   field("mqtt_switch_topic", &SavedConfig::mqtt_switch_topic, conf::common::STR_MAX_LENGTH),
+                                                   field("machine_id", &SavedConfig::machine_id, conf::common::STR_MAX_LENGTH),
+                                                   field("wifi_lease", &SavedConfig::wifi_lease).in(Section::Network),
+                                                   field("broker_address", &SavedConfig::broker_address).in(Section::Network));
+  };
+
 } // namespace fabomatic
 #endif // SAVEDCONFIG_HPP_
\ No newline at end of file
@@ -0,0 +1,68 @@
+#ifndef SPSCQUEUE_HPP_
+#define SPSCQUEUE_HPP_
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+
+namespace fabomatic
+{
+  /**
+   * Bounded lock-free queue between exactly one producer thread and one consumer thread.
+   * push(), acquire() and commit() must only be called by the producer, pop(), front() and release() only by the consumer.
+   */
+  template <typename T, size_t N>
+  class SpscQueue
+  {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscQueue capacity must be a power of 2");
+
+  private:
+    std::array<T, N> slots{};
+    std::atomic<size_t> head{0}; /* Next slot to read, written by the consumer only */
+    std::atomic<size_t> tail{0}; /* Next slot to write, written by the producer only */
+
+  public:
+    SpscQueue() = default;
+
+    /// @brief Adds an item at the end of the queue (producer side)
+    /// @return false if the queue is full, the item is left untouched
+    [[nodiscard]] auto push(T &&item) -> bool;
+
+    /// @brief Removes the item at the front of the queue (consumer side)
+    /// @return std::nullopt if the queue is empty
+    [[nodiscard]] auto pop() -> std::optional<T>;
+
+    /// @brief Gives access to the next free slot, to build an item in place (producer side).
+    /// The slot keeps its previous content, and is only visible to the consumer after commit().
+    /// @return nullptr if the queue is full
+    [[nodiscard]] auto acquire() -> T *;
+
+    /// @brief Publishes the slot returned by acquire() to the consumer (producer side)
+    auto commit() -> void;
+
+    /// @brief Gives access to the item at the front of the queue, without moving it (consumer side)
+    /// @return nullptr if the queue is empty
+    [[nodiscard]] auto front() -> T *;
+
+    /// @brief Gives the slot returned by front() back to the producer (consumer side)
+    auto release() -> void;
+
+    [[nodiscard]] auto empty() const -> bool;
+    [[nodiscard]] auto size() const -> size_t;
+    [[nodiscard]] constexpr auto capacity() const -> size_t { return N; };
+
+    /// @brief Removes all items. Neither producer nor consumer must be running.
+    auto clear() -> void;
+
+    SpscQueue(const SpscQueue &) = delete;
+    SpscQueue &operator=(const SpscQueue &) = delete;
+    SpscQueue(SpscQueue &&) = delete;
+    SpscQueue &operator=(SpscQueue &&) = delete;
+    ~SpscQueue() = default;
+  };
+} // namespace fabomatic
+
+#include "SpscQueue.tpp"
+
+#endif // SPSCQUEUE_HPP_
@@ -0,0 +1,45 @@
+#ifndef WIFILEASE_HPP
+#define WIFILEASE_HPP
+
+#include <array>
+#include <cstdint>
+#include <optional>
+
+#include "ArduinoJson.h"
+#include "FieldCodec.hpp"
+
+namespace fabomatic
+{
+  /**
+   * Access point and IP settings of the last successful WiFi association,
+   * used to reconnect without scanning all channels nor waiting for DHCP.
+   */
+  struct WiFiLease
+  {
+    std::array<uint8_t, 6> bssid{};
+    int32_t channel{0}; /* 0 if no lease is known */
+    uint32_t ip{0};     /* IPv4 addresses, as IPAddress::operator uint32_t */
+    uint32_t gateway{0};
+    uint32_t subnet{0};
+    uint32_t dns{0};
+
+    [[nodiscard]] auto isValid() const -> bool { return channel > 0 && ip != 0; };
+
+    [[nodiscard]] auto operator==(const WiFiLease &other) const -> bool = default;
+
+    /// @brief Reads the lease saved as JSON by older firmwares
+    [[nodiscard]] static auto fromJsonElement(const JsonObject &json_obj) -> std::optional<WiFiLease>;
+  };
+
+  template <>
+  struct codec::Fields<WiFiLease>
+  {
+    static constexpr auto fields = std::make_tuple(field("bssid", &WiFiLease::bssid, 0, Format::Mac),
+                                                   field("channel", &WiFiLease::channel),
+                                                   field("ip", &WiFiLease::ip, 0, Format::IPv4),
+                                                   field("gateway", &WiFiLease::gateway, 0, Format::IPv4),
+                                                   field("subnet", &WiFiLease::subnet, 0, Format::IPv4),
+                                                   field("dns", &WiFiLease::dns, 0, Format::IPv4));
+  };
+} // namespace fabomatic
+#endif // WIFILEASE_HPP
@@ -1,8 +1,10 @@
 #ifndef CARD_HPP_
 #define CARD_HPP_
 
-#include <sstream>
+#include <array>
 #include <iomanip>
+#include <sstream>
+#include <string_view>
 
 #include "Arduino.h"
 #include "conf.hpp"
@@ -14,19 +16,32 @@ namespace fabomatic::card
   using uid_t = u_int64_t;
   static constexpr uid_t INVALID = 0ULL;
 
+  /// @brief Length of the hex representation of a UID
+  static constexpr size_t UID_STR_LEN{8};
+
+  /// @brief Returns the hex representation of the UID, without allocation
+  /// @param uid number to convert
+  /// @return UID_STR_LEN lowercase hex digits of the lower 32 bits, not null-terminated
+  [[nodiscard]] constexpr inline auto uid_chars(const card::uid_t uid) -> std::array<char, UID_STR_LEN>
+  {
+    constexpr std::string_view digits{"0123456789abcdef"};
+    std::array<char, UID_STR_LEN> result{};
+    auto number = static_cast<uint32_t>(uid);
+    for (auto i = UID_STR_LEN; i > 0; i--)
+    {
+      result[i - 1] = digits[number & 0xF];
+      number >>= 4;
+    }
+    return result;
+  }
+
   /// @brief Returns a string representation of the UID
   /// @param uid number to convert
   /// @return an hex string representation of the UID (e.g. "123456ADCD")
   [[nodiscard]] inline auto uid_str(const card::uid_t uid) -> const std::string
   {
-    uint64_t number = static_cast<uint64_t>(uid);
-    uint32_t long1 = static_cast<uint32_t>(number & 0xFFFF0000) >> 16;
-    uint32_t long2 = static_cast<uint32_t>(number & 0x0000FFFF);
-
-    std::stringstream ss{};
-    ss << std::setfill('0') << std::setw(4) << std::hex << long1;
-    ss << std::setfill('0') << std::setw(4) << std::hex << long2;
-    return ss.str();
+    const auto chars = uid_chars(uid);
+    return std::string{chars.data(), chars.size()};
   }
 
   /// @brief Converts a UID from an array of bytes to a number
@@ -30,6 +30,11 @@ namespace fabomatic
 
     auto processQueries() -> size_t;
 
+    /// @brief publish a retained message from the broker thread. May be called from a different thread
+    /// @param topic topic of the message
+    /// @param payload message content
+    auto pushRetained(const std::string &topic, const std::string &payload) -> void;
+
     auto mainLoop() -> void;
 
   private:
@@ -41,8 +46,12 @@ namespace fabomatic
       std::string source_topic{""};
       std::string source_query{""};
       std::string reply_topic{""};
+      bool msgpack{false}; /* Query received on the msgpack sub-topic, source_query converted to JSON */
     };
     std::queue<query> queries{};
+    std::queue<std::pair<std::string, std::string>> retained{};
+
+    auto userFields(const std::string &uid_str) const -> const std::string;
 
     std::function<const std::string(const std::string &, const std::string &)> callback = [this](const std::string &topic, const std::string &query)
     { return defaultReplies(query); };
@@ -27,9 +27,11 @@ namespace fabomatic
     const auto pos = std::find(cache.cards.cbegin(), cache.cards.cend(), uid);
     if (pos != cache.cards.cend())
     {
-      // Update the level at same index
+      // Update the level at same index, refreshing the timestamp only for valid cards
       const auto idx = std::distance(cache.cards.cbegin(), pos);
-      cache.levels[idx] = level;
+      const auto stamp = (level == FabUser::UserLevel::Unknown) ? cache.last_seen[idx] : cache.next_stamp();
+      cache.set_at(idx, uid, level, stamp);
+      cache_dirty = true;
       return;
     }
 
@@ -37,14 +39,9 @@ namespace fabomatic
     if (level == FabUser::UserLevel::Unknown)
       return;
 
-    // Sanity check
-    if (cache_idx >= cache.size())
-      cache_idx = 0;
-
-    // Add into list
-    cache.set_at(cache_idx, uid, level);
-
-    cache_idx = (cache_idx + 1) % conf::rfid_tags::CACHE_LEN;
+    // Add into list, replacing an empty slot or the least recently seen card
+    cache.set_at(cache.eviction_idx(), uid, level, cache.next_stamp());
+    cache_dirty = true;
   }
 
   /// @brief Verifies the card ID against the server (if available) or the whitelist
@@ -54,47 +51,29 @@ namespace fabomatic
   auto AuthProvider::tryLogin(card::uid_t uid, FabBackend &server) const -> std::optional<FabUser>
   {
     FabUser user;
-    using UserResult = ServerMQTT::UserResult;
     const auto uid_str = card::uid_str(uid);
 
     ESP_LOGD(TAG, "tryLogin called for %s", uid_str.c_str());
 
-    if (!server.isOnline())
-      server.connect();
+    // Users prefetched for this machine do not need a backend round-trip
+    if (const auto &result = uidInPrefetched(uid); result.has_value())
+    {
+      user = result.value();
+      updateCache(uid, user.user_level);
+      ESP_LOGD(TAG, " -> prefetch check OK (%s)", user.toString().c_str());
+      return user;
+    }
 
-    if (server.isOnline())
+    // Reconnection happens in background, the user shall not wait for it
+    if (server.isOnline() && server.isBreakerClosed())
     {
       const auto response = server.checkCard(uid);
-      if (response->request_ok)
+      if (response->request_ok) // Server replied, its answer prevails
       {
-        user.card_uid = uid;
-
-        if (response->getResult() == UserResult::Authorized)
-        {
-          user.authenticated = true;
-          user.holder_name = response->holder_name;
-          user.user_level = response->user_level;
-          // Cache the positive result
-          updateCache(uid, response->user_level);
-
-          ESP_LOGD(TAG, " -> online check OK (%s)", user.toString().c_str());
-
-          return user;
-        }
-
-        // Invalidate the cache entries
-        updateCache(uid, FabUser::UserLevel::Unknown);
-
-      } // if (response->request_ok)
-
+        return fromBackend(uid, *response);
+      }
       ESP_LOGD(TAG, " -> online check NOT OK");
-
       user.authenticated = false;
-
-      if (response->request_ok) // Server replied but user is not valid
-      {
-        return user;
-      }
     }
     // Check whitelist if offline
     if (const auto &result = uidInWhitelist(uid); result.has_value())
@@ -125,6 +104,36 @@ namespace fabomatic
     return std::nullopt;
   }
 
+  /// @brief Builds the user from a backend reply to a card check, and updates the cache accordingly
+  /// @param uid card ID
+  /// @param response backend reply, with request_ok==true
+  /// @return a FabUser with an authenticated flag==true if valid
+  auto AuthProvider::fromBackend(card::uid_t uid, const ServerMQTT::UserResponse &response) const -> FabUser
+  {
+    FabUser user;
+    user.card_uid = uid;
+
+    if (response.getResult() == ServerMQTT::UserResult::Authorized)
+    {
+      user.authenticated = true;
+      user.holder_name = response.holder_name.c_str();
+      user.user_level = response.user_level;
+      // Cache the positive result
+      updateCache(uid, response.user_level);
+
+      ESP_LOGD(TAG, " -> online check OK (%s)", user.toString().c_str());
+      return user;
+    }
+
+    // Invalidate the cache entries
+    updateCache(uid, FabUser::UserLevel::Unknown);
+    prefetched.erase(std::remove(prefetched.begin(), prefetched.end(), FabUser{uid, "", false, FabUser::UserLevel::Unknown}), prefetched.end());
+
+    ESP_LOGD(TAG, " -> online check NOT OK");
+    user.authenticated = false;
+    return user;
+  }
+
   /// @brief Checks if the card ID is whitelisted
   /// @param uid card ID
   /// @return a whitelistentry object if the card is found in whitelist
@@ -159,17 +168,154 @@ namespace fabomatic
     return cache.find_uid(candidate_uid);
   }
 
-  /// @brief Loads the cache from EEPROM
-  auto AuthProvider::loadCache() -> void
+  /// @brief Checks if the card ID is in the list prefetched from the backend
+  /// @param uid card ID
+  /// @return an authenticated FabUser if the card is found
+  auto AuthProvider::uidInPrefetched(card::uid_t candidate_uid) const -> std::optional<FabUser>
+  {
+    const FabUser key{candidate_uid, "", false, FabUser::UserLevel::Unknown};
+    const auto pos = std::lower_bound(prefetched.cbegin(), prefetched.cend(), key);
+    if (pos != prefetched.cend() && *pos == key)
+    {
+      return *pos;
+    }
+    return std::nullopt;
+  }
+
+  /// @brief Downloads the list of users authorized on this machine, page by page
+  /// @param server the server to query
+  /// @param version version of the list announced by the backend
+  /// @return true if the whole list has been received, previous list is kept otherwise
+  auto AuthProvider::prefetchUsers(FabBackend &server, uint32_t version) -> bool
+  {
+    std::vector<FabUser> received;
+    uint16_t page = 0;
+    uint16_t pages = 1;
+    auto truncated = false;
+
+    while (page < pages && !truncated)
+    {
+      const auto response = server.fetchUserList(page);
+      if (!response->request_ok || response->page != page)
+      {
+        ESP_LOGW(TAG, "Prefetch of authorized users failed at page %u", page);
+        return false;
+      }
+      pages = response->pages;
+      truncated = appendPage(received, *response);
+      page++;
+    }
+
+    completePrefetch(std::move(received), version);
+    return true;
+  }
+
+  /// @brief Starts downloading the list of users authorized on this machine in background.
+  /// Each page is requested from the reply callback of the previous one, called by FabBackend::loop().
+  /// @param server the server to query
+  /// @param version version of the list announced by the backend
+  /// @return true if the download is running, previous list is kept until it completes
+  auto AuthProvider::startPrefetch(FabBackend &server, uint32_t version) -> bool
+  {
+    if (prefetch_job.has_value())
+    {
+      // A newer version is fetched once this one completed
+      return true;
+    }
+    if (std::chrono::system_clock::now() < prefetch_retry)
+    {
+      return false;
+    }
+
+    prefetch_job.emplace(PrefetchJob{version, 0, {}});
+    return requestPrefetchPage(server);
+  }
+
+  auto AuthProvider::isPrefetching() const -> bool
+  {
+    return prefetch_job.has_value();
+  }
+
+  /// @brief Requests the next page of the background prefetch
+  /// @return false if the query could not be published, the prefetch is then abandoned
+  auto AuthProvider::requestPrefetchPage(FabBackend &server) -> bool
+  {
+    const auto page = prefetch_job->page;
+    // Called immediately with request_ok==false if not published
+    server.fetchUserListAsync(page, [this, &server, page](std::unique_ptr<ServerMQTT::UserListResponse> response)
+                              { prefetchPageReceived(server, page, *response); });
+    return prefetch_job.has_value();
+  }
+
+  /// @brief Adds a page to the background prefetch, and requests the next one or completes the list
+  auto AuthProvider::prefetchPageReceived(FabBackend &server, uint16_t page, const ServerMQTT::UserListResponse &response) -> void
   {
-    const auto &config = SavedConfig::LoadFromEEPROM();
-    if (!config.has_value())
+    if (!prefetch_job.has_value())
+    {
+      return;
+    }
+
+    if (!response.request_ok || response.page != page)
+    {
+      ESP_LOGW(TAG, "Prefetch of authorized users failed at page %u", page);
+      prefetch_job.reset();
+      prefetch_retry = std::chrono::system_clock::now() + conf::tasks::MQTT_REFRESH_PERIOD;
       return;
+    }
+
+    const auto truncated = appendPage(prefetch_job->received, response);
+    prefetch_job->page++;
+    if (!truncated && prefetch_job->page < response.pages)
+    {
+      requestPrefetchPage(server);
+      return;
+    }
+
+    completePrefetch(std::move(prefetch_job->received), prefetch_job->version);
+    prefetch_job.reset();
+  }
+
+  /// @brief Adds the users of a page to the list being downloaded
+  /// @return true if the list is full, the remaining pages are not needed
+  auto AuthProvider::appendPage(std::vector<FabUser> &received, const ServerMQTT::UserListResponse &response) const -> bool
+  {
+    for (const auto &user : response.users)
+    {
+      if (received.size() >= conf::rfid_tags::PREFETCH_MAX_USERS)
+      {
+        ESP_LOGW(TAG, "Prefetch truncated to %u users", conf::rfid_tags::PREFETCH_MAX_USERS);
+        return true;
+      }
+      received.push_back(user);
+    }
+    return false;
+  }
+
+  /// @brief Replaces the prefetched list with the downloaded one
+  auto AuthProvider::completePrefetch(std::vector<FabUser> &&received, uint32_t version) -> void
+  {
+    std::sort(received.begin(), received.end());
+    prefetched = std::move(received);
+    prefetched_version = version;
+
+    ESP_LOGI(TAG, "Prefetched %zu authorized users (version %lu)", prefetched.size(), version);
+  }
 
-    const auto &loaded = config.value().cachedRfid;
+  auto AuthProvider::getPrefetchVersion() const -> uint32_t
+  {
+    return prefetched_version;
+  }
+
+  auto AuthProvider::getPrefetchCount() const -> size_t
+  {
+    return prefetched.size();
+  }
 
-    std::copy(loaded.cards.cbegin(), loaded.cards.cend(), cache.cards.begin());
-    std::copy(loaded.levels.cbegin(), loaded.levels.cend(), cache.levels.begin());
+  /// @brief Loads the cache from NVS
+  auto AuthProvider::loadCache() -> void
+  {
+    cache = store.load();
+    cache_dirty = false;
   }
 
   /// @brief Sets the whitelist
@@ -179,21 +325,18 @@ namespace fabomatic
     whitelist = list;
   }
 
-  /// @brief Saves the cache of RFID to EEPROM
+  /// @brief Saves the changed entries of the RFID cache to NVS, if the cache changed since the last save
   auto AuthProvider::saveCache() const -> bool
   {
-    SavedConfig config = SavedConfig::LoadFromEEPROM().value_or(SavedConfig::DefaultConfig());
-
-    if (std::equal(config.cachedRfid.cards.cbegin(), config.cachedRfid.cards.cend(), cache.cards.cbegin()) &&
-        std::equal(config.cachedRfid.levels.cbegin(), config.cachedRfid.levels.cend(), cache.levels.cbegin()))
+    if (!cache_dirty)
     {
-      ESP_LOGD(TAG, "Cache is the same, not saving");
       return true;
     }
-
-    std::copy(cache.cards.cbegin(), cache.cards.cend(), config.cachedRfid.cards.begin());
-    std::copy(cache.levels.cbegin(), cache.levels.cend(), config.cachedRfid.levels.begin());
-
-    return config.SaveToEEPROM();
+    if (!store.save(cache))
+    {
+      return false;
+    }
+    cache_dirty = false;
+    return true;
   }
 } // namespace fabomatic
\ No newline at end of file
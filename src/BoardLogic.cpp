@@ -37,36 +37,71 @@ namespace fabomatic
     };
   }
 
-  /// @brief connects and polls the server for up-to-date machine information
+  /// @brief polls the server for up-to-date machine information, if online
   void BoardLogic::refreshFromServer()
   {
     ESP_LOGD(TAG, "BoardLogic::refreshFromServer() called");
 
-    if (server.connect())
+    if (server.isOnline())
     {
+      // Machine state may have been received with the reply to another query
+      processMachineUpdate();
+
+      if (server.isMachineStateCurrent())
+      {
+        ESP_LOGD(TAG, "Machine state is current, skipping checkMachine");
+        return;
+      }
+
       // Check the configured machine data from the server
       const auto result = server.checkMachine();
       if (result->request_ok)
       {
-        if (result->is_valid)
-        {
-          machine.setMaintenanceNeeded(result->maintenance);
-          machine.setAllowed(result->allowed);
-          machine.setAutologoffDelay(std::chrono::minutes(result->logoff));
-          machine.setGracePeriod(std::chrono::minutes(result->grace));
-          machine.setMachineName(result->name);
-          machine.setMaintenanceInfo(result->description);
-          MachineType mt = static_cast<MachineType>(result->type);
-          machine.setMachineType(mt);
-
-          ESP_LOGD(TAG, "Machine data updated:%s", machine.toString().c_str());
-        }
-        else
-        {
-          ESP_LOGW(TAG, "The configured machine ID %u is unknown to the server\r\n", machine.getMachineId().id);
-        }
+        applyMachineState(*result);
       }
+      checkUsersVersion();
+    }
+  }
+
+  /// @brief Applies the machine state received from the backend outside of checkMachine, if any
+  void BoardLogic::processMachineUpdate()
+  {
+    if (const auto update = server.takeMachineUpdate(); update)
+    {
+      applyMachineState(*update);
     }
+    checkUsersVersion();
+  }
+
+  /// @brief Prefetches the authorized users in background if the backend announced a new version with any reply
+  void BoardLogic::checkUsersVersion()
+  {
+    if (const auto version = server.getUsersVersion(); version != 0 && version != auth.getPrefetchVersion())
+    {
+      auth.startPrefetch(server, version);
+    }
+  }
+
+  /// @brief Updates the machine with the state received from the backend
+  /// @param result backend reply, with request_ok==true
+  void BoardLogic::applyMachineState(const ServerMQTT::MachineResponse &result)
+  {
+    if (!result.is_valid)
+    {
+      ESP_LOGW(TAG, "The configured machine ID %u is unknown to the server\r\n", machine.getMachineId().id);
+      return;
+    }
+
+    machine.setMaintenanceNeeded(result.maintenance);
+    machine.setAllowed(result.allowed);
+    machine.setAutologoffDelay(std::chrono::minutes(result.logoff));
+    machine.setGracePeriod(std::chrono::minutes(result.grace));
+    machine.setMachineName(result.name.c_str());
+    machine.setMaintenanceInfo(result.description.c_str());
+    MachineType mt = static_cast<MachineType>(result.type);
+    machine.setMachineType(mt);
+
+    ESP_LOGD(TAG, "Machine data updated:%s", machine.toString().c_str());
   }
 
   /// @brief Called when a RFID tag has been detected
@@ -83,12 +118,17 @@ namespace fabomatic
     if (machine.isFree())
     {
       // machine is free
+      machine_state_fresh = false;
       if (!authorize(uid))
       {
         ESP_LOGI(TAG, "Login failed for %s", card::uid_str(uid).c_str());
       }
       Tasks::delay(conf::lcd::SHORT_MESSAGE_DELAY);
-      refreshFromServer();
+      // Machine state may already have been received with the login reply
+      if (!machine_state_fresh && server.isBreakerClosed())
+      {
+        refreshFromServer();
+      }
       return;
     }
 
@@ -110,10 +150,11 @@ namespace fabomatic
   /// @brief Removes the current machine user and changes the status to LoggedOut
   void BoardLogic::logout()
   {
-    const auto result = server.finishUse(machine.getActiveUser().card_uid,
-                                         machine.getUsageDuration());
-
-    ESP_LOGI(TAG, "Logout, result finishUse: %d", result->request_ok);
+    // The reply is not needed to log out, do not keep the user waiting for it
+    server.finishUseAsync(machine.getActiveUser().card_uid,
+                          machine.getUsageDuration(),
+                          [](std::unique_ptr<ServerMQTT::SimpleResponse> result)
+                          { ESP_LOGI(TAG, "Logout, result finishUse: %d", result->request_ok); });
 
     machine.logout();
     changeStatus(Status::LoggedOut);
@@ -170,9 +211,46 @@ namespace fabomatic
     user.card_uid = uid;
     user.user_level = FabUser::UserLevel::Unknown;
 
-    const auto response = auth.tryLogin(uid, server);
+    // Single round-trip when the backend supports it, otherwise check then start use.
+    // A login which may be refused on the board side (maintenance, machine blocked) checks first.
+    auto use_started = false;
+    std::optional<FabUser> response{std::nullopt};
+    if (server.isOnline() && server.isBreakerClosed() && server.isCheckAndStartSupported() &&
+        machine.isAllowed() && !machine.isMaintenanceNeeded())
+    {
+      const auto combined = server.checkCardAndStartUse(uid);
+      if (combined->request_ok && combined->supported && combined->user->request_ok)
+      {
+        if (combined->machine->request_ok)
+        {
+          applyMachineState(*combined->machine);
+          machine_state_fresh = true;
+        }
+        response = auth.fromBackend(uid, *combined->user);
+        use_started = combined->started;
+      }
+    }
+
+    if (!response.has_value())
+    {
+      response = auth.tryLogin(uid, server);
+    }
+
+    // The machine state in the combined reply may still refuse the login: the backend registered a usage which did not happen
+    const auto cancel_started_use = [this, uid, &use_started]()
+    {
+      if (use_started)
+      {
+        server.finishUseAsync(uid, 0s,
+                              [](std::unique_ptr<ServerMQTT::SimpleResponse> result)
+                              { ESP_LOGW(TAG, "Login refused after backend start, result finishUse: %d", result->request_ok); });
+        use_started = false;
+      }
+    };
+
     if (!response.has_value() || response.value().user_level == FabUser::UserLevel::Unknown)
     {
+      cancel_started_use();
       ESP_LOGI(TAG, "Failed login for %s", card::uid_str(uid).c_str());
       changeStatus(Status::LoginDenied);
       beepFail();
@@ -183,6 +261,7 @@ namespace fabomatic
 
     if (!machine.isAllowed())
     {
+      cancel_started_use();
       ESP_LOGI(TAG, "Login refused due to machine not allowed");
       changeStatus(Status::NotAllowed);
       beepFail();
@@ -194,6 +273,7 @@ namespace fabomatic
       if (conf::machine::MAINTENANCE_BLOCK &&
           user.user_level < FabUser::UserLevel::FabStaff)
       {
+        cancel_started_use();
         changeStatus(Status::MaintenanceNeeded);
         beepFail();
         Tasks::delay(conf::lcd::SHORT_MESSAGE_DELAY);
@@ -232,13 +312,18 @@ namespace fabomatic
 
     if (machine.login(user))
     {
-      const auto result = server.startUse(machine.getActiveUser().card_uid);
-      ESP_LOGI(TAG, "Login, result startUse: %d", result->request_ok);
+      if (!use_started)
+      {
+        server.startUseAsync(machine.getActiveUser().card_uid,
+                             [](std::unique_ptr<ServerMQTT::SimpleResponse> result)
+                             { ESP_LOGI(TAG, "Login, result startUse: %d", result->request_ok); });
+      }
       changeStatus(Status::LoggedIn);
       beepOk();
     }
     else
     {
+      cancel_started_use();
       changeStatus(Status::NotAllowed);
       beepFail();
       Tasks::delay(conf::lcd::SHORT_MESSAGE_DELAY);
@@ -650,6 +735,33 @@ namespace fabomatic
     return this->auth.saveCache();
   }
 
+  /// @brief Writes to flash the state changed since the last call, in one pass:
+  /// RFID cache, settings and counters. Called periodically, and before a reboot or an OTA update.
+  /// @return false if some state could not be persisted
+  auto BoardLogic::persist() -> bool
+  {
+    auto success = true;
+    if (!saveRfidCache())
+    {
+      ESP_LOGE(TAG, "persist - saveRfidCache failed");
+      success = false;
+    }
+
+    // Without msglog partition (older partition table), nothing can be retried: not a failure
+    if (!server.saveBuffer() && !volatile_buffer_warned)
+    {
+      ESP_LOGW(TAG, "persist - no msglog partition, buffered messages are kept in RAM only");
+      volatile_buffer_warned = true;
+    }
+
+    if (!SavedConfig::Flush())
+    {
+      ESP_LOGE(TAG, "persist - settings not saved, will retry");
+      success = false;
+    }
+    return success;
+  }
+
   auto BoardLogic::getHostname() const -> const std::string
   {
     // Hostname is BOARD + machine_id (which shall be unique) e.g. BOARD1
@@ -0,0 +1,17 @@
+#include "BrokerAddress.hpp"
+
+namespace fabomatic
+{
+  auto BrokerAddress::fromJsonElement(const JsonObject &json_obj) -> std::optional<BrokerAddress>
+  {
+    if (json_obj.isNull() || json_obj["ip"].isNull())
+    {
+      return std::nullopt;
+    }
+
+    BrokerAddress address;
+    address.hostname = json_obj["host"].as<std::string>();
+    address.ip = json_obj["ip"].as<std::string>();
+    return address;
+  }
+} // namespace fabomatic
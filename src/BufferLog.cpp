@@ -0,0 +1,462 @@
+#include "BufferLog.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+
+#include <esp_rom_crc.h>
+
+#include "Logging.hpp"
+
+namespace fabomatic
+{
+  auto BufferLog::read(size_t offset, void *dst, size_t len) const -> bool
+  {
+    if (partition != nullptr)
+    {
+      return esp_partition_read(partition, offset, dst, len) == 0;
+    }
+    if (offset + len > ram.size())
+    {
+      return false;
+    }
+    std::memcpy(dst, ram.data() + offset, len);
+    return true;
+  }
+
+  auto BufferLog::write(size_t offset, const void *src, size_t len) -> bool
+  {
+    if (partition != nullptr)
+    {
+      return esp_partition_write(partition, offset, src, len) == 0;
+    }
+    if (offset + len > ram.size())
+    {
+      return false;
+    }
+    // Same behaviour as NOR flash, bits can only be cleared
+    const auto *bytes = static_cast<const uint8_t *>(src);
+    for (size_t i = 0; i < len; i++)
+    {
+      ram[offset + i] &= bytes[i];
+    }
+    return true;
+  }
+
+  auto BufferLog::erase(size_t sector) -> bool
+  {
+    stats.erases++;
+    if (partition != nullptr)
+    {
+      return esp_partition_erase_range(partition, sector * SECTOR_SIZE, SECTOR_SIZE) == 0;
+    }
+    std::fill_n(ram.begin() + sector * SECTOR_SIZE, SECTOR_SIZE, 0xFF);
+    return true;
+  }
+
+  auto BufferLog::crc(const RecordHeader &header, const uint8_t *payload) -> uint32_t
+  {
+    auto value = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&header), offsetof(RecordHeader, crc));
+    return esp_rom_crc32_le(value, payload, header.length);
+  }
+
+  auto BufferLog::readSectorHeader(size_t sector) const -> std::optional<SectorHeader>
+  {
+    SectorHeader header{};
+    if (!read(sector * SECTOR_SIZE, &header, sizeof(header)) || header.magic != SECTOR_MAGIC ||
+        header.crc != esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&header), offsetof(SectorHeader, crc)))
+    {
+      return std::nullopt;
+    }
+    return header;
+  }
+
+  /**
+   * @brief Reads and checks the record at the given offset.
+   * @return false if there is no valid record, e.g. end of the written area or torn write
+   */
+  auto BufferLog::readRecord(size_t offset, RecordHeader &header, uint8_t *payload) const -> bool
+  {
+    // A record never starts at a sector boundary, the sector header is there
+    if (offset % SECTOR_SIZE == 0 ||
+        offset + sizeof(RecordHeader) > sectorEnd(offset) ||
+        !read(offset, &header, sizeof(header)) ||
+        header.magic != RECORD_MAGIC ||
+        header.length > MAX_RECORD_SIZE ||
+        offset + sizeof(RecordHeader) + header.length > sectorEnd(offset))
+    {
+      return false;
+    }
+    return read(offset + sizeof(RecordHeader), payload, header.length) && header.crc == crc(header, payload);
+  }
+
+  auto BufferLog::findPending(size_t offset) const -> size_t
+  {
+    std::array<uint8_t, MAX_RECORD_SIZE> payload;
+    while (true)
+    {
+      RecordHeader header{};
+      if (readRecord(offset, header, payload.data()))
+      {
+        if (header.state == STATE_PENDING)
+        {
+          return offset;
+        }
+        offset += sizeof(RecordHeader) + padded(header.length);
+        continue;
+      }
+
+      // End of the records of this sector, offset may be the end of a full sector
+      const auto sector = (offset - 1) / SECTOR_SIZE;
+      if (sector == write_sector)
+      {
+        return NONE;
+      }
+      offset = ((sector + 1) % sectors) * SECTOR_SIZE + sizeof(SectorHeader);
+    }
+  }
+
+  /**
+   * @brief Erases the given sector to continue writing there. Records still pending in it are handed
+   * to the compactor and the ones it keeps are written back, the others are dropped.
+   */
+  auto BufferLog::startSector(size_t sector) -> bool
+  {
+    std::vector<Entry> evicted;
+    std::array<uint8_t, MAX_RECORD_SIZE> payload;
+    while (read_offset != NONE && read_offset / SECTOR_SIZE == sector)
+    {
+      RecordHeader header{};
+      if (!readRecord(read_offset, header, payload.data()))
+      {
+        break;
+      }
+      evicted.push_back({header.seq, std::string{reinterpret_cast<const char *>(payload.data()), header.length}});
+      read_offset = findPending(read_offset + sizeof(RecordHeader) + padded(header.length));
+    }
+    pending -= std::min(pending, evicted.size());
+
+    write_sector = sector;
+    write_offset = NONE;
+    if (!erase(sector))
+    {
+      ESP_LOGE(TAG, "BufferLog: failed to erase sector %u", sector);
+      stats.dropped += evicted.size();
+      return false;
+    }
+
+    SectorHeader header{SECTOR_MAGIC, ++sector_seq, 0, UINT32_MAX};
+    header.crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&header), offsetof(SectorHeader, crc));
+    if (!write(sector * SECTOR_SIZE, &header, sizeof(header)))
+    {
+      ESP_LOGE(TAG, "BufferLog: failed to write sector %u header", sector);
+      stats.dropped += evicted.size();
+      return false;
+    }
+    write_offset = sector * SECTOR_SIZE + sizeof(SectorHeader);
+
+    if (evicted.empty())
+    {
+      return true;
+    }
+
+    if (!compactor)
+    {
+      stats.dropped += evicted.size();
+      ESP_LOGW(TAG, "BufferLog: log full, dropped %u oldest messages", evicted.size());
+      return true;
+    }
+
+    // Half of the sector at most, so that appending goes on
+    size_t budget = (SECTOR_SIZE - sizeof(SectorHeader)) / 2;
+    const auto kept = compactor(std::move(evicted), budget);
+    size_t written = 0;
+    for (const auto &entry : kept)
+    {
+      if (entry.data.size() > MAX_RECORD_SIZE || recordSize(entry.data.size()) > budget ||
+          !writeRecord(entry.data, entry.seq != 0 ? entry.seq : next_seq++))
+      {
+        break;
+      }
+      budget -= recordSize(entry.data.size());
+      written++;
+    }
+    if (written < kept.size())
+    {
+      stats.dropped += kept.size() - written;
+      ESP_LOGE(TAG, "BufferLog: %u compacted messages not written back", kept.size() - written);
+    }
+    return true;
+  }
+
+  /**
+   * @brief Rebuilds the read and write positions from the log content, oldest sector first.
+   */
+  auto BufferLog::scan() -> void
+  {
+    std::optional<size_t> oldest;
+    std::optional<size_t> newest;
+    uint32_t oldest_seq = UINT32_MAX;
+    uint32_t newest_seq = 0;
+    for (size_t sector = 0; sector < sectors; sector++)
+    {
+      if (const auto header = readSectorHeader(sector); header)
+      {
+        if (header->sequence < oldest_seq)
+        {
+          oldest_seq = header->sequence;
+          oldest = sector;
+        }
+        if (header->sequence >= newest_seq)
+        {
+          newest_seq = header->sequence;
+          newest = sector;
+        }
+      }
+    }
+
+    if (!oldest || !newest)
+    {
+      ESP_LOGI(TAG, "BufferLog: formatting the log (%u sectors)", sectors);
+      startSector(0);
+      return;
+    }
+
+    write_sector = *newest;
+    sector_seq = newest_seq;
+    std::array<uint8_t, MAX_RECORD_SIZE> payload;
+    for (auto sector = *oldest;; sector = (sector + 1) % sectors)
+    {
+      // Sectors erased but never started are skipped
+      if (readSectorHeader(sector))
+      {
+        auto offset = sector * SECTOR_SIZE + sizeof(SectorHeader);
+        RecordHeader header{};
+        while (readRecord(offset, header, payload.data()))
+        {
+          next_seq = std::max(next_seq, header.seq + 1);
+          if (header.state == STATE_PENDING)
+          {
+            pending++;
+            if (read_offset == NONE)
+            {
+              read_offset = offset;
+            }
+          }
+          offset += sizeof(RecordHeader) + padded(header.length);
+        }
+
+        // Anything else than erased flash after the last record is a torn write
+        const auto torn = offset % SECTOR_SIZE != 0 && offset + sizeof(RecordHeader) <= sectorEnd(offset) &&
+                          read(offset, &header, sizeof(header)) && header.magic != BLANK_MAGIC;
+        if (torn)
+        {
+          stats.corrupted++;
+          ESP_LOGW(TAG, "BufferLog: discarding damaged records in sector %u", sector);
+        }
+        if (sector == write_sector)
+        {
+          // Never write after a damaged record, continue in the next sector
+          write_offset = torn ? NONE : offset;
+        }
+      }
+      if (sector == write_sector)
+      {
+        break;
+      }
+    }
+  }
+
+  auto BufferLog::open(std::string_view label, size_t ram_size) -> bool
+  {
+    const std::string name{label};
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name.c_str());
+    if (partition != nullptr && partition->size / SECTOR_SIZE >= 2)
+    {
+      sectors = partition->size / SECTOR_SIZE;
+      ram.clear();
+    }
+    else
+    {
+      ESP_LOGW(TAG, "BufferLog: partition %s not found, buffered messages are kept in RAM", name.c_str());
+      partition = nullptr;
+      sectors = std::max<size_t>(ram_size / SECTOR_SIZE, 2);
+      ram.assign(sectors * SECTOR_SIZE, 0xFF);
+    }
+
+    write_sector = 0;
+    write_offset = NONE;
+    sector_seq = 0;
+    read_offset = NONE;
+    pending = 0;
+    next_seq = 1;
+    stats = {};
+    scan();
+
+    ESP_LOGI(TAG, "BufferLog: %u messages pending, %u/%u bytes used", pending, getStats().used, getStats().capacity);
+    return partition != nullptr;
+  }
+
+  /**
+   * @brief Writes a record at the write position, which shall have room for it.
+   */
+  auto BufferLog::writeRecord(std::string_view data, uint32_t seq) -> bool
+  {
+    std::array<uint8_t, sizeof(RecordHeader) + MAX_RECORD_SIZE> record;
+    record.fill(0xFF);
+    RecordHeader header{RECORD_MAGIC, static_cast<uint16_t>(data.size()), seq, 0, STATE_PENDING};
+    header.crc = crc(header, reinterpret_cast<const uint8_t *>(data.data()));
+    std::memcpy(record.data(), &header, sizeof(header));
+    std::memcpy(record.data() + sizeof(header), data.data(), data.size());
+
+    const auto size = recordSize(data.size());
+    if (!write(write_offset, record.data(), size))
+    {
+      ESP_LOGE(TAG, "BufferLog: write failed at %u", write_offset);
+      write_offset = NONE;
+      return false;
+    }
+
+    if (read_offset == NONE)
+    {
+      read_offset = write_offset;
+    }
+    write_offset += size;
+    pending++;
+    return true;
+  }
+
+  auto BufferLog::append(std::string_view data) -> std::optional<uint32_t>
+  {
+    if (sectors == 0 || data.size() > MAX_RECORD_SIZE)
+    {
+      ESP_LOGE(TAG, "BufferLog: cannot append %u bytes", data.size());
+      return std::nullopt;
+    }
+
+    if (write_offset == NONE || write_offset + recordSize(data.size()) > (write_sector + 1) * SECTOR_SIZE)
+    {
+      if (!startSector((write_sector + 1) % sectors))
+      {
+        return std::nullopt;
+      }
+    }
+
+    if (!writeRecord(data, next_seq))
+    {
+      return std::nullopt;
+    }
+    return next_seq++;
+  }
+
+  auto BufferLog::front() const -> std::optional<Entry>
+  {
+    if (read_offset == NONE)
+    {
+      return std::nullopt;
+    }
+    std::array<uint8_t, MAX_RECORD_SIZE> payload;
+    RecordHeader header{};
+    if (!readRecord(read_offset, header, payload.data()))
+    {
+      ESP_LOGE(TAG, "BufferLog: cannot read record at %u", read_offset);
+      return std::nullopt;
+    }
+    return Entry{header.seq, std::string{reinterpret_cast<const char *>(payload.data()), header.length}};
+  }
+
+  auto BufferLog::peek(size_t max_count) const -> std::vector<Entry>
+  {
+    std::vector<Entry> entries;
+    std::array<uint8_t, MAX_RECORD_SIZE> payload;
+    auto offset = read_offset;
+    while (offset != NONE && entries.size() < max_count)
+    {
+      RecordHeader header{};
+      if (!readRecord(offset, header, payload.data()))
+      {
+        break;
+      }
+      entries.push_back({header.seq, std::string{reinterpret_cast<const char *>(payload.data()), header.length}});
+      offset = findPending(offset + sizeof(RecordHeader) + padded(header.length));
+    }
+    return entries;
+  }
+
+  auto BufferLog::pop_front() -> void
+  {
+    if (read_offset == NONE)
+    {
+      return;
+    }
+    RecordHeader header{};
+    if (!read(read_offset, &header, sizeof(header)))
+    {
+      return;
+    }
+    const auto acked = STATE_ACKED;
+    if (!write(read_offset + offsetof(RecordHeader, state), &acked, sizeof(acked)))
+    {
+      // Replayed again after a reboot
+      ESP_LOGE(TAG, "BufferLog: failed to acknowledge record %lu", header.seq);
+    }
+    pending--;
+    read_offset = findPending(read_offset + sizeof(RecordHeader) + padded(header.length));
+  }
+
+  auto BufferLog::discard(uint32_t seq) -> bool
+  {
+    std::array<uint8_t, MAX_RECORD_SIZE> payload;
+    auto offset = read_offset;
+    while (offset != NONE)
+    {
+      RecordHeader header{};
+      if (!readRecord(offset, header, payload.data()))
+      {
+        return false;
+      }
+      const auto next = findPending(offset + sizeof(RecordHeader) + padded(header.length));
+      if (header.seq == seq)
+      {
+        const auto acked = STATE_ACKED;
+        if (!write(offset + offsetof(RecordHeader, state), &acked, sizeof(acked)))
+        {
+          ESP_LOGE(TAG, "BufferLog: failed to discard record %lu", seq);
+          return false;
+        }
+        pending--;
+        if (offset == read_offset)
+        {
+          read_offset = next;
+        }
+        return true;
+      }
+      offset = next;
+    }
+    return false;
+  }
+
+  auto BufferLog::clear() -> void
+  {
+    while (read_offset != NONE)
+    {
+      pop_front();
+    }
+    pending = 0;
+  }
+
+  auto BufferLog::getStats() const -> Stats
+  {
+    auto result = stats;
+    result.capacity = sectors * (SECTOR_SIZE - sizeof(SectorHeader));
+    result.used = 0;
+    if (read_offset != NONE)
+    {
+      const auto write_pos = write_offset != NONE ? write_offset : (write_sector + 1) * SECTOR_SIZE;
+      const auto distance = (write_sector + sectors - read_offset / SECTOR_SIZE) % sectors;
+      result.used = distance * (SECTOR_SIZE - sizeof(SectorHeader)) + (write_pos - write_sector * SECTOR_SIZE) - read_offset % SECTOR_SIZE;
+    }
+    return result;
+  }
+} // namespace fabomatic
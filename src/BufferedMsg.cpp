@@ -1,107 +1,362 @@
 #include "BufferedMsg.hpp"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+
 #include <ArduinoJson.h>
+
+#include "Clock.hpp"
 #include "Logging.hpp"
 
 namespace fabomatic
 {
-
-  auto Buffer::push_back(const BufferedMsg &message) -> void
+  namespace
   {
-    if constexpr (conf::debug::ENABLE_BUFFERING)
+    auto actionName(BufferedAction action) -> std::string_view
     {
-      msg_queue.push_back(message);
-      if (msg_queue.size() > MAX_MESSAGES)
+      switch (action)
       {
-        msg_queue.pop_front();
-        ESP_LOGW(TAG, "Removing first message from the buffer");
+      case BufferedAction::StartUse:
+        return "startuse";
+      case BufferedAction::StopUse:
+        return "stopuse";
+      case BufferedAction::Maintenance:
+        return "maintenance";
+      case BufferedAction::Session:
+        return "session";
+      case BufferedAction::Summary:
+        return "summary";
       }
-      has_changed = true;
+      return "";
+    }
+
+    /// @brief Importance of the events when the log is full, the least important are summarized first
+    auto priority(BufferedAction action) -> uint8_t
+    {
+      switch (action)
+      {
+      case BufferedAction::Maintenance:
+        return 3;
+      case BufferedAction::StopUse:
+      case BufferedAction::Session:
+        return 2;
+      case BufferedAction::StartUse:
+        return 1;
+      case BufferedAction::Summary:
+        break;
+      }
+      return 0;
+    }
+  } // namespace
+
+  auto BufferedMsg::fromQuery(const ServerMQTT::Query &query) -> std::optional<BufferedMsg>
+  {
+    using namespace ServerMQTT;
+    // The query type identifies the final class
+    switch (query.type())
+    {
+    case QueryType::StartUse:
+      return BufferedMsg{BufferedAction::StartUse, static_cast<const StartUseQuery &>(query).uid, std::chrono::seconds{0}, Clock::now()};
+    case QueryType::StopUse:
+    {
+      const auto &stop = static_cast<const StopUseQuery &>(query);
+      return BufferedMsg{BufferedAction::StopUse, stop.uid, stop.duration_s, Clock::now()};
+    }
+    case QueryType::Maintenance:
+      return BufferedMsg{BufferedAction::Maintenance, static_cast<const RegisterMaintenanceQuery &>(query).uid, std::chrono::seconds{0}, Clock::now()};
+    default:
+      return std::nullopt;
+    }
+  }
+
+  auto BufferedMsg::fromPayload(std::string_view payload) -> std::optional<BufferedMsg>
+  {
+    JsonDocument doc;
+    if (deserializeJson(doc, payload.data(), payload.size()))
+    {
+      return std::nullopt;
+    }
+
+    BufferedMsg msg;
+    const std::string_view action = doc["action"].as<const char *>() != nullptr ? doc["action"].as<const char *>() : "";
+    if (action == actionName(BufferedAction::StartUse))
+      msg.action = BufferedAction::StartUse;
+    else if (action == actionName(BufferedAction::StopUse))
+      msg.action = BufferedAction::StopUse;
+    else if (action == actionName(BufferedAction::Maintenance))
+      msg.action = BufferedAction::Maintenance;
+    else
+      return std::nullopt;
+
+    const auto uid = doc["uid"].as<const char *>();
+    msg.uid = uid != nullptr ? std::strtoull(uid, nullptr, 16) : card::INVALID;
+    msg.duration = std::chrono::seconds{doc["duration"].as<uint32_t>()};
+    return msg;
+  }
+
+  auto Buffer::encode(const BufferedMsg &message) -> Record
+  {
+    return Record{static_cast<uint8_t>(message.action),
+                  RECORD_VERSION,
+                  message.uid,
+                  static_cast<uint32_t>(message.duration.count()),
+                  message.timestamp,
+                  message.events};
+  }
+
+  auto Buffer::toEntry(const BufferedMsg &message) -> BufferLog::Entry
+  {
+    const auto record = encode(message);
+    return {message.seq, std::string{reinterpret_cast<const char *>(&record), sizeof(record)}};
+  }
+
+  auto Buffer::decode(const BufferLog::Entry &entry) -> std::optional<BufferedMsg>
+  {
+    Record record{};
+    record.events = 1;
+    if (entry.data.empty() || entry.data.size() > sizeof(record))
+    {
+      return std::nullopt;
+    }
+    std::memcpy(&record, entry.data.data(), entry.data.size());
+    const auto expected_size = record.version == 1 ? RECORD_V1_SIZE : sizeof(record);
+    if ((record.version != 1 && record.version != RECORD_VERSION) || entry.data.size() != expected_size ||
+        actionName(static_cast<BufferedAction>(record.action)).empty())
+    {
+      return std::nullopt;
+    }
+    return BufferedMsg{static_cast<BufferedAction>(record.action),
+                       record.uid,
+                       std::chrono::seconds{record.duration},
+                       record.timestamp,
+                       entry.seq,
+                       record.events};
+  }
 
-      ESP_LOGI(TAG, "Buffered %s on %s, %lu messages queued",
-               message.mqtt_message.c_str(),
-               message.mqtt_topic.c_str(),
-               msg_queue.size());
+  auto Buffer::begin(std::string_view label) -> void
+  {
+    if (opened)
+    {
+      return;
     }
+    log.setCompactor([this](std::vector<BufferLog::Entry> &&evicted, size_t budget)
+                     { return compact(std::move(evicted), budget); });
+    log.open(label, conf::buffer::RAM_LOG_SIZE);
+    opened = true;
   }
 
-  auto Buffer::push_front(const BufferedMsg &message) -> void
+  auto Buffer::push_back(const BufferedMsg &message, bool merge) -> std::optional<BufferedMsg>
   {
     if constexpr (conf::debug::ENABLE_BUFFERING)
     {
-      msg_queue.push_front(message);
-      if (msg_queue.size() > MAX_MESSAGES)
+      auto buffered = message;
+
+      // The StartUse is not sent if not published yet. It is discarded first, as a use
+      // counted twice is worse than a use lost on a power cut in between.
+      if (merge && message.action == BufferedAction::StopUse && open_session && open_session->uid == message.uid &&
+          open_session->seq > published_seq && log.discard(open_session->seq))
       {
-        msg_queue.pop_back();
-        ESP_LOGW(TAG, "Removing last message from the buffer");
+        buffered.action = BufferedAction::Session;
+        if (open_session->timestamp != 0)
+        {
+          buffered.timestamp = open_session->timestamp;
+        }
+        else if (message.timestamp != 0)
+        {
+          buffered.timestamp = message.timestamp - static_cast<uint32_t>(message.duration.count());
+        }
+        compaction.sessions++;
       }
-      has_changed = true;
+      if (message.action == BufferedAction::StartUse || message.action == BufferedAction::StopUse)
+      {
+        open_session.reset();
+      }
+
+      const auto record = encode(buffered);
+      const auto seq = log.append({reinterpret_cast<const char *>(&record), sizeof(record)});
+      const auto uid_hex = card::uid_chars(buffered.uid);
+      if (!seq)
+      {
+        ESP_LOGE(TAG, "Failed to buffer %s for %.8s", actionName(buffered.action).data(), uid_hex.data());
+        return std::nullopt;
+      }
+      buffered.seq = seq.value();
 
-      ESP_LOGI(TAG, "Buffered %s on %s, %lu messages queued",
-               message.mqtt_message.c_str(),
-               message.mqtt_topic.c_str(),
-               msg_queue.size());
+      if (buffered.action == BufferedAction::StartUse)
+      {
+        open_session = buffered;
+      }
+
+      ESP_LOGI(TAG, "Buffered %s for %.8s (seq %lu), %u messages queued",
+               actionName(buffered.action).data(),
+               uid_hex.data(),
+               seq.value(),
+               log.count());
+      return buffered;
     }
+    return std::nullopt;
   }
 
-  auto Buffer::getMessage() -> const BufferedMsg
+  auto Buffer::front() const -> std::optional<BufferedMsg>
   {
-    if (msg_queue.size() == 0)
+    if (const auto entry = log.front(); entry)
     {
-      ESP_LOGE(TAG, "Calling getMessage() on empty queue!");
-      return {"", "", false};
+      return decode(entry.value());
     }
-
-    auto elem = msg_queue.front();
-    msg_queue.pop_front();
-    has_changed = true;
-
-    return elem;
+    return std::nullopt;
   }
 
-  auto Buffer::count() const -> size_t
+  auto Buffer::peek(size_t max_count) const -> std::vector<BufferedMsg>
   {
-    return msg_queue.size();
+    std::vector<BufferedMsg> messages;
+    for (const auto &entry : log.peek(max_count))
+    {
+      if (const auto message = decode(entry); message)
+      {
+        messages.push_back(message.value());
+      }
+    }
+    return messages;
   }
 
-  auto Buffer::toJson(JsonDocument &doc, const std::string &element_name) const -> void
+  auto Buffer::pop_front() -> void
   {
-    auto obj = doc.createNestedObject(element_name);
-    obj["VERSION"] = MAGIC_NUMBER;
-    auto json_elem = obj.createNestedArray("messages");
+    log.pop_front();
+  }
 
-    for (auto elem = msg_queue.begin(); elem != msg_queue.end(); elem++)
+  auto Buffer::acknowledge(uint32_t seq) -> void
+  {
+    if (!log.discard(seq))
     {
-      auto obj_msg = json_elem.createNestedObject();
-      obj_msg["tp"] = elem->mqtt_topic;
-      obj_msg["msg"] = elem->mqtt_message;
-      obj_msg["wait"] = elem->wait_for_answer;
+      ESP_LOGW(TAG, "Buffered message %lu already acknowledged", seq);
     }
   }
 
-  auto Buffer::fromJsonElement(const JsonObject &json_obj) -> std::optional<Buffer>
+  auto Buffer::markPublished(uint32_t seq) -> void
+  {
+    published_seq = std::max(published_seq, seq);
+  }
+
+  /**
+   * @brief Chooses the records written back when the log is full: the most important events first,
+   * oldest first among equals, while the budget allows. The others are folded into one Summary,
+   * along with the previous summaries.
+   */
+  auto Buffer::compact(std::vector<BufferLog::Entry> &&evicted, size_t budget) -> std::vector<BufferLog::Entry>
   {
-    Buffer buff;
+    constexpr auto RECORD_SIZE = BufferLog::recordSize(sizeof(Record));
 
-    // Check that the version is the same
-    auto version = json_obj["VERSION"].as<unsigned int>();
-    if (version != MAGIC_NUMBER)
+    std::vector<BufferedMsg> messages;
+    messages.reserve(evicted.size());
+    for (const auto &entry : evicted)
     {
-      ESP_LOGD(TAG, "Buffer::fromJson() : wrong version number (%d, expected %d)", version, MAGIC_NUMBER);
-      return std::nullopt;
+      if (const auto message = decode(entry); message)
+      {
+        messages.push_back(message.value());
+      }
     }
 
-    for (const auto &elem : json_obj["messages"].as<JsonArray>())
+    std::vector<size_t> order(messages.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&messages](size_t a, size_t b)
+                     { return priority(messages[a].action) > priority(messages[b].action); });
+
+    // Room for the summary
+    budget = budget > RECORD_SIZE ? budget - RECORD_SIZE : 0;
+    std::vector<bool> keep(messages.size(), false);
+    for (const auto idx : order)
     {
-      const auto &msg = BufferedMsg{elem["msg"].as<std::string>(),
-                                    elem["tp"].as<std::string>(),
-                                    elem["wait"].as<bool>()};
-      buff.push_back(msg);
+      if (budget < RECORD_SIZE || messages[idx].action == BufferedAction::Summary)
+      {
+        break;
+      }
+      keep[idx] = true;
+      budget -= RECORD_SIZE;
     }
 
-    ESP_LOGD(TAG, "Buffer::fromJsonElement() : data loaded successfully");
+    BufferedMsg summary{BufferedAction::Summary, card::INVALID, std::chrono::seconds{0}, 0, 0, 0};
+    std::vector<BufferLog::Entry> kept;
+    for (size_t idx = 0; idx < messages.size(); idx++)
+    {
+      const auto &message = messages[idx];
+      if (keep[idx])
+      {
+        kept.push_back(toEntry(message));
+        compaction.kept++;
+        continue;
+      }
+      if (message.action != BufferedAction::Summary)
+      {
+        compaction.summarized++;
+      }
+      summary.events = static_cast<uint16_t>(std::min<uint32_t>(summary.events + message.events, UINT16_MAX));
+      summary.duration += message.duration;
+      if (message.timestamp != 0 && (summary.timestamp == 0 || message.timestamp < summary.timestamp))
+      {
+        summary.timestamp = message.timestamp;
+      }
+    }
 
-    return buff;
+    // The summary covers the oldest events, with a new sequence number
+    if (summary.events > 0)
+    {
+      kept.insert(kept.begin(), toEntry(summary));
+    }
+    ESP_LOGW(TAG, "Buffer full: %u events kept, %u summarized", kept.size() - (summary.events > 0 ? 1 : 0), summary.events);
+    return kept;
   }
 
-} // namespace fabomatic
\ No newline at end of file
+  auto Buffer::getMessage() -> const BufferedMsg
+  {
+    const auto message = front();
+    if (!message)
+    {
+      ESP_LOGE(TAG, "Calling getMessage() on empty queue!");
+      return {};
+    }
+    pop_front();
+    return message.value();
+  }
+
+  auto Buffer::clear() -> void
+  {
+    log.clear();
+  }
+
+  auto Buffer::count() const -> size_t
+  {
+    return log.count();
+  }
+
+  auto BufferedQuery::writeFields(ServerMQTT::TxBuffer &out) const -> void
+  {
+    const auto uid_hex = card::uid_chars(msg.uid);
+    switch (msg.action)
+    {
+    case BufferedAction::StartUse:
+    case BufferedAction::Maintenance:
+      out.field("action", actionName(msg.action));
+      out.field("uid", std::string_view{uid_hex.data(), uid_hex.size()});
+      break;
+    case BufferedAction::StopUse:
+    case BufferedAction::Session:
+      // A session is a stop of use for backends ignoring the flag, they derive the start from the duration
+      out.field("action", actionName(BufferedAction::StopUse));
+      out.field("uid", std::string_view{uid_hex.data(), uid_hex.size()});
+      out.field("duration", msg.duration);
+      if (msg.action == BufferedAction::Session)
+      {
+        out.field("session", true);
+      }
+      break;
+    case BufferedAction::Summary:
+      out.field("action", actionName(msg.action));
+      out.field("events", msg.events);
+      out.field("duration", msg.duration);
+      break;
+    }
+    out.field("replay", true);
+  }
+} // namespace fabomatic
@@ -0,0 +1,136 @@
+#include "CardCacheStore.hpp"
+
+#include <cstddef>
+
+#include <Preferences.h>
+#include <esp_rom_crc.h>
+
+#include "Logging.hpp"
+
+namespace fabomatic
+{
+  auto CardCacheStore::key(size_t idx) -> std::string
+  {
+    return "card" + std::to_string(idx);
+  }
+
+  auto CardCacheStore::crc(const Record &record) -> uint32_t
+  {
+    return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&record), offsetof(Record, crc));
+  }
+
+  auto CardCacheStore::readAll() -> bool
+  {
+    Preferences prefs;
+    persisted = CachedCards{};
+
+    // Namespace is created on first write, open read-write to avoid NOT_FOUND errors on a blank NVS
+    if (!prefs.begin(NVS_NAMESPACE, false))
+    {
+      ESP_LOGE(TAG, "CardCacheStore::readAll() : NVS begin failed");
+      return false;
+    }
+
+    for (size_t idx = 0; idx < persisted.size(); idx++)
+    {
+      const auto &slot_key = key(idx);
+      if (!prefs.isKey(slot_key.c_str()))
+        continue;
+
+      Record record{};
+      if (prefs.getBytes(slot_key.c_str(), &record, sizeof(record)) != sizeof(record) ||
+          record.version != RECORD_VERSION || record.crc != crc(record))
+      {
+        ESP_LOGW(TAG, "CardCacheStore: discarding invalid record %s", slot_key.c_str());
+        prefs.remove(slot_key.c_str());
+        continue;
+      }
+
+      persisted.set_at(idx, record.uid, static_cast<FabUser::UserLevel>(record.level), record.last_seen);
+    }
+
+    prefs.end();
+    loaded = true;
+    return true;
+  }
+
+  auto CardCacheStore::load() -> CachedCards
+  {
+    if (!readAll())
+    {
+      ESP_LOGW(TAG, "CardCacheStore::load() : returning empty cache");
+    }
+    return persisted;
+  }
+
+  auto CardCacheStore::save(const CachedCards &cache) -> bool
+  {
+    if (!loaded && !readAll())
+      return false;
+
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, false))
+    {
+      ESP_LOGE(TAG, "CardCacheStore::save() : NVS begin failed");
+      return false;
+    }
+
+    auto success = true;
+    size_t written = 0;
+    for (size_t idx = 0; idx < cache.size(); idx++)
+    {
+      const auto &entry = cache[idx];
+      if (entry == persisted[idx])
+        continue;
+
+      const auto &slot_key = key(idx);
+      if (entry.uid == card::INVALID)
+      {
+        // Empty slot, no need to keep the record
+        if (prefs.isKey(slot_key.c_str()) && !prefs.remove(slot_key.c_str()))
+        {
+          success = false;
+          continue;
+        }
+      }
+      else
+      {
+        Record record{entry.uid, entry.last_seen, static_cast<uint8_t>(entry.level), RECORD_VERSION, 0};
+        record.crc = crc(record);
+        if (prefs.putBytes(slot_key.c_str(), &record, sizeof(record)) != sizeof(record))
+        {
+          ESP_LOGE(TAG, "CardCacheStore::save() : failed to write %s", slot_key.c_str());
+          success = false;
+          continue;
+        }
+      }
+      persisted.set_at(idx, entry.uid, entry.level, entry.last_seen);
+      written++;
+    }
+
+    prefs.end();
+
+    if (written > 0)
+    {
+      ESP_LOGD(TAG, "CardCacheStore: %zu slot(s) written (%zu bytes)", written, written * sizeof(Record));
+    }
+
+    return success;
+  }
+
+  auto CardCacheStore::clear() -> bool
+  {
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, false))
+    {
+      ESP_LOGE(TAG, "CardCacheStore::clear() : NVS begin failed");
+      return false;
+    }
+    const auto result = prefs.clear();
+    prefs.end();
+
+    persisted = CachedCards{};
+    loaded = result;
+    return result;
+  }
+} // namespace fabomatic
@@ -0,0 +1,56 @@
+#include "Clock.hpp"
+
+#include <atomic>
+#include <chrono>
+
+#include "Arduino.h"
+#include <esp_sntp.h>
+
+#include "Logging.hpp"
+#include "conf.hpp"
+
+namespace fabomatic::Clock
+{
+  namespace
+  {
+    std::atomic<bool> started{false};
+    std::atomic<int64_t> offset{0}; /* Unix time minus monotonic time, in seconds. 0 until synchronized */
+
+    auto monotonicSeconds() -> int64_t
+    {
+      return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// @brief Called by the SNTP client from the network task
+    auto synchronized(struct timeval *tv) -> void
+    {
+      const auto previous = offset.exchange(tv->tv_sec - monotonicSeconds());
+      ESP_LOGI(TAG, "Clock synchronized, Unix time %lld (drift %lld s)",
+               static_cast<long long>(tv->tv_sec),
+               previous == 0 ? 0LL : static_cast<long long>(offset.load() - previous));
+    }
+  } // namespace
+
+  auto begin() -> void
+  {
+    if (started.exchange(true))
+    {
+      return;
+    }
+    sntp_set_time_sync_notification_cb(synchronized);
+    sntp_set_sync_interval(std::chrono::duration_cast<std::chrono::milliseconds>(conf::ntp::SYNC_PERIOD).count());
+    configTime(0, 0, conf::ntp::SERVER.data());
+    ESP_LOGI(TAG, "Clock: SNTP started with %s", conf::ntp::SERVER.data());
+  }
+
+  auto now() -> uint32_t
+  {
+    const auto current = offset.load();
+    return current == 0 ? 0 : static_cast<uint32_t>(monotonicSeconds() + current);
+  }
+
+  auto isSynchronized() -> bool
+  {
+    return offset.load() != 0;
+  }
+} // namespace fabomatic::Clock
@@ -1,9 +1,14 @@
 #include "FabBackend.hpp"
+#include "Clock.hpp"
 #include "secrets.hpp"
 #include "Logging.hpp"
 #include "SavedConfig.hpp"
 #include "Tasks.hpp"
 #include <ArduinoJson.h>
+#include <lwip/dns.h>
+#include <lwip/sockets.h>
+#include <lwip/tcpip.h>
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <sstream>
@@ -20,11 +25,20 @@ namespace fabomatic
    */
   void FabBackend::configure(const SavedConfig &config)
   {
+    // The connection settings belong to the I/O task
+    const auto restart_io = isIoTaskRunning();
+    stopIoTask();
+    cancelLookup();
+
     wifi_ssid = config.ssid;
     wifi_password = config.password;
     broker_hostname = config.mqtt_server;
     mqtt_user = config.mqtt_user;
     mqtt_password = config.mqtt_password;
+    wifi_lease = config.wifi_lease;
+    wifi_lease_time = std::chrono::steady_clock::now(); // Unknown age, counted from the boot
+    wifi_lease_failures = 0;
+    broker_address = config.broker_address;
 
 #if (PINS_WOKWI)
     channel = 6;
@@ -32,23 +46,59 @@ namespace fabomatic
 #else
     channel = -1;
 #endif
+    if (client.connected()) // Topic or IP may also have changed
+    {
+      disconnectNow();
+    }
+    setLinkState(LinkState::Disconnected);
     online = false;
+    next_attempt = std::chrono::system_clock::now();
+    reconnect_attempts = 0;
+    broker_from_cache = false;
+    verify_broker_address = false;
+    // The persisted address is refreshed in background, between half and the full TTL after connecting
+    const auto half_ttl = std::chrono::duration_cast<std::chrono::milliseconds>(conf::mqtt::BROKER_ADDRESS_TTL) / 2;
+    broker_next_resolve = std::chrono::system_clock::now() + half_ttl + std::chrono::milliseconds(random(0, half_ttl.count() + 1));
+    check_and_start_supported = false;
+    summary_supported.reset();
+    replay_resume = {};
+    wire_format = ServerMQTT::WireFormat::Json;
+    machine_version = 0;
+    users_version = 0;
+    last_seen_version = 0;
+    machine_update.reset();
+    config_pushed = false;
+    breaker = BreakerState::Closed; // New settings deserve a new chance
+    consecutive_failures = 0;
 
     std::stringstream ss_topic_name, ss_client_name;
     ss_topic_name << conf::mqtt::topic << "/" << config.machine_id;
     topic = ss_topic_name.str();
+    response_topic.assign(topic).append(conf::mqtt::response_topic);
+    config_topic.assign(topic).append(conf::mqtt::config_topic);
+    msgpack_response_topic.assign(topic).append(conf::mqtt::msgpack_topic).append(conf::mqtt::response_topic);
 
-    ss_client_name << "BOARD" << random(0, 1000);
+    // The broker finds the session of a persistent client by its id.
+    // Replies queued for a previous boot shall not match new queries: correlation ids start at random.
+    if constexpr (conf::mqtt::PERSISTENT_SESSION)
+    {
+      ss_client_name << "BOARD" << config.machine_id;
+      next_cid = static_cast<uint32_t>(random(1, INT32_MAX));
+    }
+    else
+    {
+      ss_client_name << "BOARD" << random(0, 1000);
+    }
     mqtt_client_name = ss_client_name.str();
 
-    if (client.connected()) // Topic or IP may also have changed
+    loadBuffer(config);
+    processEvents();
+
+    if (restart_io)
     {
-      client.disconnect();
-      wifi_client.stop();
+      startIoTask();
     }
 
-    loadBuffer(config.message_buffer);
-
     ESP_LOGD(TAG, "FabServer configured");
   }
 
@@ -56,66 +106,64 @@ namespace fabomatic
    * @brief Posts a query to the MQTT server and waits for a reply.
    *
    * @param query The query to be posted.
+   * @param record The logged usage event carried by the query, not replayed while waiting.
    * @return true if the server answered, false otherwise.
    */
-  auto FabBackend::publishWithReply(const ServerMQTT::Query &query) -> PublishResult
+  auto FabBackend::publishWithReply(const ServerMQTT::Query &query, const std::optional<BufferedMsg> &record) -> PublishResult
   {
-    auto try_cpt = 0;
-    auto published = false;
+    auto &estimator = rtt[static_cast<size_t>(query.type())];
+
+    // Synchronous queries are waited for explicitly, hence no deadline nor callback
+    const auto cid = next_cid++;
+    pending.push_back({cid, query.type(), std::chrono::system_clock::now(), std::chrono::system_clock::time_point::max(), std::nullopt, nullptr, record});
+    const auto entry = std::prev(pending.end());
 
-    while (try_cpt < conf::mqtt::MAX_TRIES)
+    // Not retried here: the link state machine reconnects, and usage events are replayed from the log
+    if (publish(query, cid) != PublishResult::PublishedWithoutAnswer)
     {
-      try_cpt++;
+      ESP_LOGE(TAG, "MQTT Client: failure to send query %s", query.payload().data());
+      pending.erase(entry);
+      return PublishResult::ErrorNotPublished;
+    }
+    entry->sent = std::chrono::system_clock::now();
 
-      if (!published)
+    // The query is not sent again, so a reply is still expected: keep waiting with a longer timeout
+    for (auto wait_cpt = 0; wait_cpt < conf::mqtt::MAX_TRIES; wait_cpt++)
+    {
+      if (waitForAnswer(cid, estimator.getTimeout(wait_cpt)))
       {
-        if (publish(query) == PublishResult::PublishedWithoutAnswer)
-        {
-          published = true;
-        }
-        else
-        {
-          ESP_LOGE(TAG, "MQTT Client: failure to send query %s", query.payload().data());
-          Tasks::delay(conf::mqtt::TIMEOUT_REPLY_SERVER);
-        }
+        ESP_LOGD(TAG, "MQTT Client: received answer (%u bytes)", last_reply.size());
+        return PublishResult::PublishedWithAnswer;
       }
 
-      if (waitForAnswer(conf::mqtt::TIMEOUT_REPLY_SERVER))
+      // Not sent by the I/O task after all
+      if (entry->failed)
       {
-        ESP_LOGD(TAG, "MQTT Client: received answer: %s", last_reply.data());
-        return PublishResult::PublishedWithAnswer;
+        ESP_LOGE(TAG, "MQTT Client: failure to send query %s", query.payload().data());
+        pending.erase(entry);
+        return PublishResult::ErrorNotPublished;
       }
 
-      ESP_LOGW(TAG, "MQTT Client: no answer received, retrying %d/%d", try_cpt, conf::mqtt::MAX_TRIES);
-      Tasks::delay(conf::mqtt::TIMEOUT_REPLY_SERVER);
+      ESP_LOGW(TAG, "MQTT Client: no answer received, waiting %d/%d", wait_cpt + 1, conf::mqtt::MAX_TRIES);
     }
 
-    ESP_LOGE(TAG, "MQTT Client: failure to send query %s", query.payload().data());
+    ESP_LOGE(TAG, "MQTT Client: no answer to query %s", query.payload().data());
 
-    // Do not send twice if response did not arrive
-    if (query.buffered() && !published)
-    {
-      const auto &msg = BufferedMsg{query.payload(), topic, query.waitForReply()};
-      buffer.push_back(msg);
-    }
-
-    if (published)
-    {
-      return PublishResult::PublishedWithoutAnswer;
-    }
-
-    return PublishResult::ErrorNotPublished;
+    // A late reply will be discarded
+    pending.erase(entry);
+    estimator.backoff();
+    recordFailure();
+    return PublishResult::PublishedWithoutAnswer;
   }
 
   /**
-   * @brief Publishes a message on the MQTT server.
+   * @brief Publishes a message on the MQTT server, without waiting for a reply.
    *
    * @param mqtt_topic The topic to publish to.
    * @param mqtt_payload The payload to publish.
-   * @param waitForAnswer Whether to wait for an answer.
-   * @return true if the message was published successfully, false otherwise.
+   * @return true if the message was queued for the I/O task, false otherwise.
    */
-  bool FabBackend::publish(String mqtt_topic, String mqtt_payload, bool waitForAnswer)
+  bool FabBackend::publish(String mqtt_topic, String mqtt_payload)
   {
     if (mqtt_payload.length() + mqtt_topic.length() > FabBackend::MAX_MSG_SIZE - 8)
     {
@@ -123,271 +171,1759 @@ namespace fabomatic
       return false;
     }
 
-    answer_pending = waitForAnswer;
-    last_query.assign(mqtt_payload.c_str());
-
     ESP_LOGI(TAG, "MQTT Client: sending message %s on topic %s", mqtt_payload.c_str(), mqtt_topic.c_str());
 
-    return client.publish(mqtt_topic.c_str(), mqtt_payload.c_str());
+    auto *request = isOnline() ? io_requests.acquire() : nullptr;
+    if (request == nullptr)
+    {
+      return false;
+    }
+    request->kind = IoRequest::Kind::Publish;
+    request->topic.assign(mqtt_topic.c_str());
+    request->payload.assign(mqtt_payload.c_str());
+    request->qos = 0;
+    request->cid = 0;
+    request->format = ServerMQTT::WireFormat::Json;
+    io_requests.commit();
+
+    if (!isIoTaskRunning())
+    {
+      ioStep();
+    }
+    return true;
   }
 
   /**
    * @brief Publishes a query on the MQTT server.
+   * The query is serialized in place into a free slot of the I/O queue, without heap allocation.
    *
    * @param query The query to be published.
-   * @return true if the query was published successfully, false otherwise.
+   * @param cid The correlation id of the pending reply, 0 if no reply is expected.
+   * @return PublishedWithoutAnswer if the query was queued for the I/O task, ErrorNotPublished otherwise.
+   * A failure in the I/O task is reported afterwards with a PublishFailed event.
    */
   template <typename QueryT>
-  auto FabBackend::publish(const QueryT &query) -> PublishResult
+  auto FabBackend::publish(const QueryT &query, uint32_t cid) -> PublishResult
   {
-    String s_payload(query.payload().c_str());
-    std::string temp_topic;
+    auto *request = isOnline() ? io_requests.acquire() : nullptr;
+    if (request == nullptr)
+    {
+      return PublishResult::ErrorNotPublished;
+    }
+
+    // Buffered messages are replayed on the machine topic as well
+    request->topic.assign(this->topic);
+
+    // Queries with preformatted JSON members (telemetry) cannot be packed, they are sent as JSON
+    auto format = wire_format;
+    auto serialized = query.serialize(request->payload, cid, format);
+    if (!serialized && format == ServerMQTT::WireFormat::MsgPack)
+    {
+      format = ServerMQTT::WireFormat::Json;
+      serialized = query.serialize(request->payload, cid, format);
+    }
+    if (!serialized || request->payload.size() + request->topic.size() > FabBackend::MAX_MSG_SIZE - 8)
+    {
+      ESP_LOGE(TAG, "MQTT Client: Message is too long: %s", query.payload().c_str());
+      return PublishResult::ErrorNotPublished;
+    }
+
+    last_reply.clear();
+
+    // Messages kept in the buffer when offline must not be lost by the broker either
+    request->kind = IoRequest::Kind::Publish;
+    request->qos = (std::is_base_of<BufferedQuery, QueryT>::value || query.buffered()) ? conf::mqtt::QOS_BACKEND : 0;
+    request->cid = cid;
+    request->format = format;
 
-    // Check at compile-time if topic is specified
-    if constexpr (std::is_base_of<BufferedQuery, QueryT>::value)
+    if (format == ServerMQTT::WireFormat::MsgPack)
     {
-      temp_topic = static_cast<BufferedQuery>(query).topic();
+      ESP_LOGD(TAG, "MQTT Client: sending %s message (%zu bytes MessagePack) on topic %s (QoS %d)", ServerMQTT::queryTypeName(query.type()).data(), request->payload.size(), request->topic.c_str(), request->qos);
     }
     else
     {
-      // Just use the default topic for the machine
-      temp_topic = this->topic;
+      ESP_LOGD(TAG, "MQTT Client: sending message %s on topic %s (QoS %d)", request->payload.c_str(), request->topic.c_str(), request->qos);
     }
 
-    String s_topic{temp_topic.c_str()};
+    io_requests.commit();
 
-    if (s_payload.length() + s_topic.length() > FabBackend::MAX_MSG_SIZE - 8)
+    if (!isIoTaskRunning())
     {
-      ESP_LOGE(TAG, "MQTT Client: Message is too long: %s", s_payload.c_str());
-      return PublishResult::ErrorNotPublished;
+      ioStep();
     }
+    return PublishResult::PublishedWithoutAnswer;
+  }
 
-    answer_pending = query.waitForReply(); // Don't wait if not needed
-    last_query.assign(s_payload.c_str());
-    last_reply.clear();
+  /**
+   * @brief Processes the messages received from the broker and the reply timeouts.
+   * Without I/O task, also runs the MQTT client and maintains the connection.
+   *
+   * @return true if the client is online, false otherwise.
+   */
+  bool FabBackend::loop()
+  {
+    pollIo();
+
+    // Timeouts must fire even when the connection is down
+    dispatchReplies();
+
+    // The backlog drains in background, in between the queries of the board logic
+    replayStep();
+
+    return online;
+  }
 
-    ESP_LOGD(TAG, "MQTT Client: sending message %s on topic %s", s_payload.c_str(), s_topic.c_str());
+  /**
+   * @brief One iteration of the I/O task: sends the requested publications, runs the MQTT client
+   * and advances the connection state machine by one step.
+   */
+  void FabBackend::ioStep()
+  {
+    while (auto *request = io_requests.front())
+    {
+      if (request->kind == IoRequest::Kind::Disconnect)
+      {
+        io_requests.release();
+        disconnectNow();
+        continue;
+      }
+
+      if (link_state != LinkState::Connected || !publishRequest(*request))
+      {
+        ESP_LOGW(TAG, "MQTT Client: failure to publish on %s, last error %d", request->topic.c_str(), client.lastError());
+        pushEvent({IoEvent::Kind::PublishFailed, request->topic, std::string{request->payload.view()}, request->qos, request->cid});
+        if (link_state == LinkState::Connected)
+        {
+          connectionFailed();
+        }
+      }
+      io_requests.release();
+    }
 
-    if (client.publish(s_topic, s_payload))
+    if (link_state == LinkState::Connected)
     {
-      return PublishResult::PublishedWithoutAnswer;
+      client.loop();
     }
 
-    return PublishResult::ErrorNotPublished;
+    // Detects a lost connection, or advances the reconnection by one step
+    connectStep();
   }
 
   /**
-   * @brief Main loop for the MQTT client.
+   * @brief Publishes a request of the board logic with the MQTT client, in the I/O task.
+   * MessagePack payloads, serialized as such by the board logic, are sent on the msgpack sub-topic.
    *
-   * @return true if the client is running successfully, false otherwise.
+   * @param request The publication, with its serialized payload.
+   * @return true if the client published the message.
    */
-  bool FabBackend::loop()
+  bool FabBackend::publishRequest(const IoRequest &request)
+  {
+    if (request.format == ServerMQTT::WireFormat::MsgPack)
+    {
+      const auto packed_topic = request.topic + std::string{conf::mqtt::msgpack_topic};
+      return client.publish(packed_topic.c_str(), request.payload.c_str(), static_cast<int>(request.payload.size()), false, request.qos);
+    }
+
+    return client.publish(request.topic.c_str(), request.payload.c_str(), static_cast<int>(request.payload.size()), false, request.qos);
+  }
+
+  /**
+   * @brief Runs the I/O step if there is no I/O task, then processes the events it reported.
+   */
+  void FabBackend::pollIo()
+  {
+    if (!isIoTaskRunning())
+    {
+      ioStep();
+    }
+    processEvents();
+  }
+
+  /**
+   * @brief Reports a received message or a failed publication to the board logic.
+   * When the queue is full, the I/O task waits for the board logic to process it, in loop()
+   * or in stopIoTask(). Without I/O task, the caller is the board logic: the queue is processed inline.
+   *
+   * @param event The event, moved into the queue.
+   */
+  void FabBackend::pushEvent(IoEvent &&event)
   {
-    if (!client.loop())
+    while (!io_events.push(std::move(event)))
     {
-      if (online)
+      if (!isIoTaskRunning())
       {
-        ESP_LOGI(TAG, "MQTT Client: connection lost");
+        ESP_LOGW(TAG, "MQTT Client: event queue full, processing it inline");
+        processQueuedEvents();
+        continue;
+      }
+      delay(std::chrono::milliseconds(conf::tasks::MQTT_IO_PERIOD).count());
+    }
+  }
+
+  /**
+   * @brief Processes the connection changes and the events reported by the I/O task, in order.
+   */
+  void FabBackend::processEvents()
+  {
+    processLinkChanges();
+    processQueuedEvents();
+  }
+
+  /**
+   * @brief Processes the messages and failed publications reported by the I/O task, in order.
+   * Unlike processEvents(), publishes nothing, so that it can run within an I/O step.
+   */
+  void FabBackend::processQueuedEvents()
+  {
+    while (auto event = io_events.pop())
+    {
+      switch (event->kind)
+      {
+      case IoEvent::Kind::Message:
+        replyReceived(*event);
+        break;
+      case IoEvent::Kind::PublishFailed:
+        publishFailed(event.value());
+        break;
+      }
+    }
+  }
+
+  /**
+   * @brief Handles a publication which failed in the I/O task: the query fails without waiting for
+   * its timeout. Usage events stay in the log until replayed.
+   *
+   * @param event The PublishFailed event.
+   */
+  void FabBackend::publishFailed(const IoEvent &event)
+  {
+    if (event.cid != 0)
+    {
+      const auto it = std::find_if(pending.begin(), pending.end(), [&event](const PendingQuery &p)
+                                   { return p.cid == event.cid; });
+      if (it != pending.end())
+      {
+        it->failed = true;
+      }
+    }
+  }
+
+  /**
+   * @brief Applies the connection changes reported by the I/O task since the last call.
+   * Changes alternate between up and down: if the board logic missed a short disconnection
+   * or connection, it is applied before the current state.
+   */
+  void FabBackend::processLinkChanges()
+  {
+    LinkChanges changes;
+    {
+      std::lock_guard<std::mutex> lock(link_mutex);
+      changes = link_changes;
+    }
+    if (changes.count == link_changes_seen)
+    {
+      return;
+    }
+    link_changes_seen = changes.count;
+
+    if (changes.up == link_up)
+    {
+      linkChanged(!changes.up, changes.up ? changes.last_down : changes.last_up);
+    }
+    linkChanged(changes.up, changes.up ? changes.last_up : changes.last_down);
+  }
+
+  /**
+   * @brief Tracks the connection changes reported by the I/O task.
+   * Asynchronous queries wait for the replies held by the broker during the disconnection,
+   * and the board announces itself on each new connection.
+   *
+   * @param up true if the connection was established, false if lost.
+   * @param time Time of the change.
+   */
+  void FabBackend::linkChanged(bool up, std::chrono::system_clock::time_point time)
+  {
+    if (!up)
+    {
+      link_up = false;
+      link_lost = time;
+      return;
+    }
+
+    link_up = true;
+    Clock::begin();
+
+    // Replies held by the broker during the disconnection are still expected
+    if (conf::mqtt::PERSISTENT_SESSION && link_lost != std::chrono::system_clock::time_point{})
+    {
+      const auto outage = std::min<std::chrono::system_clock::duration>(time - link_lost, conf::mqtt::SESSION_HOLD_MAX);
+      for (auto &query : pending)
+      {
+        if (query.on_reply)
+        {
+          query.deadline += outage;
+        }
       }
-      online = false;
+      link_lost = {};
+    }
+
+    // The format is acknowledged again by the backend after each reconnection
+    wire_format = ServerMQTT::WireFormat::Json;
+
+    // Announce the board to the server
+    if (auto query = ServerMQTT::AliveQuery{getTelemetry()}; publish(query) == PublishResult::PublishedWithoutAnswer)
+    {
+      ESP_LOGI(TAG, "MQTT Client: board announced to server");
+    }
+    else
+    {
+      ESP_LOGW(TAG, "MQTT Client: failure to announce board to server");
+    }
+  }
+
+  /**
+   * @brief Starts the I/O task, which then owns the MQTT client and maintains the connection.
+   *
+   * @return true if the task is running.
+   */
+  bool FabBackend::startIoTask()
+  {
+    if (isIoTaskRunning())
+    {
+      return true;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    attr.stacksize = conf::tasks::MQTT_IO_STACK_SIZE;
+    io_stop = false;
+    io_exited = false;
+    if (pthread_create(&io_thread, &attr, &FabBackend::ioTask, this))
+    {
+      ESP_LOGE(TAG, "Error creating MQTT I/O task");
       return false;
     }
+    io_running = true;
+    ESP_LOGI(TAG, "MQTT I/O task started");
     return true;
   }
 
   /**
-   * @brief Waits for an answer from the MQTT server.
+   * @brief Stops the I/O task, waiting for its current step to complete.
+   * The events it reports meanwhile are processed, so that it does not wait for room in the queue.
+   * The board logic then runs the I/O steps from loop().
+   */
+  void FabBackend::stopIoTask()
+  {
+    if (!isIoTaskRunning())
+    {
+      return;
+    }
+
+    io_stop = true;
+    while (!io_exited)
+    {
+      processQueuedEvents();
+      delay(std::chrono::milliseconds(conf::tasks::MQTT_IO_PERIOD).count());
+    }
+    pthread_join(io_thread, nullptr);
+    io_running = false;
+    ESP_LOGI(TAG, "MQTT I/O task stopped");
+  }
+
+  /**
+   * @brief Checks if the I/O task is running.
+   *
+   * @return true if the MQTT client is run by the I/O task, false if by loop().
+   */
+  bool FabBackend::isIoTaskRunning() const
+  {
+    return io_running;
+  }
+
+  /**
+   * @brief Body of the I/O task.
+   *
+   * @param arg The FabBackend instance.
+   */
+  void *FabBackend::ioTask(void *arg)
+  {
+    auto *backend = static_cast<FabBackend *>(arg);
+    while (!backend->io_stop)
+    {
+      backend->ioStep();
+      delay(std::chrono::milliseconds(conf::tasks::MQTT_IO_PERIOD).count());
+    }
+    backend->io_exited = true;
+    return nullptr;
+  }
+
+  FabBackend::~FabBackend()
+  {
+    stopIoTask();
+  }
+
+  /**
+   * @brief Invokes the callbacks of the asynchronous queries which got their reply or timed out.
+   * Callbacks are called after removal from the pending list, so they may issue new queries.
+   */
+  void FabBackend::dispatchReplies()
+  {
+    const auto now = std::chrono::system_clock::now();
+    std::list<PendingQuery> completed;
+
+    // The broker keeps the replies of a persistent session during short disconnections
+    const auto holding = conf::mqtt::PERSISTENT_SESSION && !link_up && now - link_lost < conf::mqtt::SESSION_HOLD_MAX;
+
+    for (auto it = pending.begin(); it != pending.end();)
+    {
+      const auto next = std::next(it);
+      if (it->on_reply && (it->reply.has_value() || it->failed || (!holding && now > it->deadline)))
+      {
+        completed.splice(completed.end(), pending, it);
+      }
+      it = next;
+    }
+
+    for (auto &query : completed)
+    {
+      if (query.failed)
+      {
+        ESP_LOGE(TAG, "Failure, query %lu not sent", query.cid);
+      }
+      else if (!query.reply.has_value())
+      {
+        ESP_LOGE(TAG, "Failure, no answer from MQTT server for query %lu", query.cid);
+        rtt[static_cast<size_t>(query.type)].backoff();
+        recordFailure();
+      }
+      query.on_reply(query.reply.value_or(""));
+    }
+  }
+
+  /**
+   * @brief Waits for the answer to a synchronous query from the MQTT server.
    *
+   * @param cid The correlation id of the query.
    * @param max_duration The maximum duration to wait.
    * @return true if the server answered, false otherwise.
    */
-  bool FabBackend::waitForAnswer(std::chrono::milliseconds max_duration)
+  bool FabBackend::waitForAnswer(uint32_t cid, std::chrono::milliseconds max_duration)
   {
     const auto start_time = std::chrono::system_clock::now();
     const auto DELAY_MS = 25ms;
     do
     {
-      if (answer_pending)
+      pollIo();
+
+      const auto it = std::find_if(pending.begin(), pending.end(), [cid](const PendingQuery &p)
+                                   { return p.cid == cid; });
+      if (it == pending.end() || it->failed)
       {
-        client.loop();
-        if (!client.connected())
-        {
-          ESP_LOGW(TAG, "MQTT Client: connection lost while waiting for answer");
-          connect();
-        }
-        Tasks::delay(DELAY_MS);
+        return false;
       }
-      else
+
+      if (it->reply.has_value())
       {
+        last_reply = std::move(*it->reply);
+        pending.erase(it);
         return true;
       }
+
+      if (!isOnline())
+      {
+        // Reply is lost with the connection, reconnection happens in the I/O task
+        ESP_LOGW(TAG, "MQTT Client: connection lost while waiting for answer");
+        return false;
+      }
+      Tasks::delay(DELAY_MS);
     } while (std::chrono::system_clock::now() < (start_time + max_duration));
 
-    ESP_LOGE(TAG, "Failure, no answer from MQTT server (timeout:%lld ms)", max_duration.count());
-    return false;
+    ESP_LOGE(TAG, "Failure, no answer from MQTT server (timeout:%lld ms)", max_duration.count());
+    return false;
+  }
+
+  /**
+   * @brief Checks if the client is online.
+   *
+   * @return true if the client is online, false otherwise.
+   */
+  bool FabBackend::isOnline() const
+  {
+    return online;
+  }
+
+  /**
+   * @brief Gets the number of queries waiting for a reply.
+   *
+   * @return The number of pending queries, synchronous and asynchronous.
+   */
+  size_t FabBackend::pendingQueries() const
+  {
+    return pending.size();
+  }
+
+  /**
+   * @brief Gets the round-trip time estimator for a type of query.
+   *
+   * @param type The query type.
+   * @return The estimator, with the current reply timeout.
+   */
+  const RttEstimator &FabBackend::getRttEstimator(ServerMQTT::QueryType type) const
+  {
+    return rtt[static_cast<size_t>(type)];
+  }
+
+  /**
+   * @brief Gets the round-trip time estimates for telemetry.
+   *
+   * @return JSON object with srtt, rttvar and rto in ms for each query type measured, empty string if none.
+   */
+  std::string FabBackend::getRttStats() const
+  {
+    std::stringstream ss{};
+    auto first = true;
+    for (auto idx = 0U; idx < rtt.size(); idx++)
+    {
+      const auto &estimator = rtt[idx];
+      if (estimator.getSamples() == 0)
+      {
+        continue;
+      }
+
+      ss << (first ? "{" : ",")
+         << "\"" << ServerMQTT::queryTypeName(static_cast<ServerMQTT::QueryType>(idx)) << "\":{"
+         << "\"srtt\":" << estimator.getSmoothedRtt().count() << ","
+         << "\"rttvar\":" << estimator.getRttVariance().count() << ","
+         << "\"rto\":" << estimator.getTimeout().count() << ","
+         << "\"samples\":" << estimator.getSamples() << "}";
+      first = false;
+    }
+
+    if (!first)
+    {
+      ss << "}";
+    }
+    return ss.str();
+  }
+
+  /**
+   * @brief Gets the state of the connection circuit breaker.
+   *
+   * @return The breaker state.
+   */
+  FabBackend::BreakerState FabBackend::getBreakerState() const
+  {
+    return breaker;
+  }
+
+  /**
+   * @brief Checks if the backend may be used for interactive requests such as card taps.
+   *
+   * @return false if recent failures opened the circuit breaker: local authorization shall be used.
+   */
+  bool FabBackend::isBreakerClosed() const
+  {
+    return breaker == BreakerState::Closed;
+  }
+
+  /**
+   * @brief Checks if connect() will actually try to connect.
+   *
+   * @return false while the circuit breaker is open and BREAKER_OPEN_PERIOD has not elapsed.
+   */
+  bool FabBackend::isReconnectDue() const
+  {
+    std::lock_guard<std::mutex> lock(breaker_mutex);
+    return breaker != BreakerState::Open ||
+           std::chrono::system_clock::now() - breaker_opened >= conf::mqtt::BREAKER_OPEN_PERIOD;
+  }
+
+  /**
+   * @brief Resets the failure count after a reply of the backend, closing the breaker.
+   * A successful connection is not enough, as the broker may be up while the backend is not.
+   */
+  void FabBackend::recordSuccess()
+  {
+    std::lock_guard<std::mutex> lock(breaker_mutex);
+    consecutive_failures = 0;
+    if (breaker != BreakerState::Closed)
+    {
+      ESP_LOGI(TAG, "Circuit breaker closed");
+      breaker = BreakerState::Closed;
+    }
+  }
+
+  /**
+   * @brief Counts a failed connection or unanswered query, opening the breaker if needed.
+   */
+  void FabBackend::recordFailure()
+  {
+    std::lock_guard<std::mutex> lock(breaker_mutex);
+    if (consecutive_failures < UINT8_MAX)
+    {
+      consecutive_failures++;
+    }
+
+    if (breaker == BreakerState::HalfOpen || consecutive_failures >= conf::mqtt::BREAKER_FAILURE_THRESHOLD)
+    {
+      if (breaker != BreakerState::Open)
+      {
+        ESP_LOGW(TAG, "Circuit breaker open after %u failures", consecutive_failures);
+      }
+      breaker = BreakerState::Open;
+      breaker_opened = std::chrono::system_clock::now();
+    }
+  }
+
+  /**
+   * @brief Checks if the combined checkandstart query may be used.
+   *
+   * @return true if the backend announced support for it.
+   */
+  bool FabBackend::isCheckAndStartSupported() const
+  {
+    return check_and_start_supported;
+  }
+
+  /**
+   * @brief Gets the encoding of the queries, negotiated with the backend.
+   *
+   * @return MsgPack if the backend acknowledged it in the last checkmachine reply, Json otherwise.
+   */
+  ServerMQTT::WireFormat FabBackend::getWireFormat() const
+  {
+    return wire_format;
+  }
+
+  /**
+   * @brief Tracks the machine state and users list versions piggybacked on backend replies.
+   * If the machine version changed and the reply carries the full state under "machine",
+   * the state is kept for takeMachineUpdate().
+   *
+   * @param reply The deserialized backend reply.
+   */
+  void FabBackend::checkMachineVersion(const JsonDocument &reply)
+  {
+    // The users list may change while the machine state does not
+    if (!reply["users_version"].isNull())
+    {
+      users_version = reply["users_version"];
+    }
+    else if (!reply["machine"]["users_version"].isNull())
+    {
+      users_version = reply["machine"]["users_version"];
+    }
+
+    if (reply["machine_version"].isNull())
+    {
+      return;
+    }
+
+    last_seen_version = reply["machine_version"];
+    last_seen_time = std::chrono::system_clock::now();
+
+    if (last_seen_version != machine_version && !reply["machine"].isNull())
+    {
+      machine_update = ServerMQTT::MachineResponse::fromJsonElement(reply["machine"]);
+      machine_update->version = last_seen_version;
+      machine_version = last_seen_version;
+      ESP_LOGD(TAG, "Machine state version %lu received with reply", machine_version);
+    }
+  }
+
+  /**
+   * @brief Handles the machine configuration pushed (retained) by the backend.
+   * Duplicates, e.g. the retained message delivered again after a reconnection, are ignored by version.
+   *
+   * @param payload The machine configuration, same format as the checkmachine reply.
+   */
+  void FabBackend::configReceived(const std::string &payload)
+  {
+    // Empty payload clears the retained message
+    if (payload.empty())
+    {
+      return;
+    }
+
+    auto response = parseReply<ServerMQTT::MachineResponse>(payload);
+    if (!response->request_ok)
+    {
+      return;
+    }
+
+    config_pushed = true;
+    last_seen_version = response->version;
+    last_seen_time = std::chrono::system_clock::now();
+
+    if (response->version != 0 && response->version == machine_version)
+    {
+      ESP_LOGD(TAG, "Pushed config version %lu already applied", response->version);
+      return;
+    }
+
+    machine_version = response->version;
+    machine_update = std::move(response);
+    ESP_LOGI(TAG, "Pushed config version %lu received", machine_version);
+  }
+
+  /**
+   * @brief Checks if the machine state known by the board is the latest one announced by the backend.
+   *
+   * @return true if a recent reply or push confirmed the current version, so that checkMachine can be skipped.
+   */
+  bool FabBackend::isMachineStateCurrent() const
+  {
+    // Pushed configuration only needs a slow safety-net poll
+    const auto validity = config_pushed ? conf::tasks::MACHINE_POLL_PERIOD : conf::tasks::MQTT_REFRESH_PERIOD;
+    return machine_version != 0 &&
+           last_seen_version == machine_version &&
+           std::chrono::system_clock::now() - last_seen_time < validity;
+  }
+
+  /**
+   * @brief Returns the machine state received with a reply since the last call, if any.
+   *
+   * @return nullptr if no new machine state has been received.
+   */
+  std::unique_ptr<ServerMQTT::MachineResponse> FabBackend::takeMachineUpdate()
+  {
+    return std::move(machine_update);
+  }
+
+  /**
+   * @brief Gets the version of the authorized users list announced by the backend.
+   *
+   * @return The last version received with any reply, 0 if the backend does not support prefetch.
+   */
+  uint32_t FabBackend::getUsersVersion() const
+  {
+    return users_version;
+  }
+
+  /**
+   * @brief Callback function for received MQTT messages, called by the MQTT client in the I/O task.
+   * The message is handed over to the board logic.
+   *
+   * @param topic The topic the message was received on.
+   * @param bytes The payload of the message, JSON or MessagePack.
+   * @param length The payload length in bytes.
+   */
+  void FabBackend::messageReceived(char topic[], char bytes[], int length)
+  {
+    ESP_LOGI(TAG, "MQTT Client: Received %d bytes on %s", length, topic);
+
+    if (length <= 0) // Retained message cleared
+    {
+      return;
+    }
+
+    pushEvent({IoEvent::Kind::Message, topic, std::string(bytes, length), 0, 0, std::chrono::system_clock::now()});
+  }
+
+  /**
+   * @brief Handles a message received from the broker: pushed configuration, or reply to a pending query.
+   *
+   * @param event The Message event, with topic, payload and reception time.
+   */
+  void FabBackend::replyReceived(IoEvent &event)
+  {
+    if (config_topic == event.topic)
+    {
+      configReceived(event.payload);
+      return;
+    }
+
+    // Only the correlation id is needed here, the full reply is parsed by the query owner
+    static const auto cid_filter = []()
+    {
+      JsonDocument f;
+      f["cid"] = true;
+      return f;
+    }();
+    uint32_t cid = 0;
+    {
+      reply_arena.reset();
+      JsonDocument cid_doc{&reply_arena};
+      if (!ServerMQTT::deserializePayload(cid_doc, event.payload, cid_filter))
+      {
+        cid = cid_doc["cid"].as<uint32_t>();
+      }
+    }
+
+    // Backends not echoing the correlation id answer in order. With a persistent session,
+    // the broker may deliver replies to queries of a previous session: once the backend
+    // has echoed an id, the id must match and replies without one are dropped.
+    if (cid != 0 && !backend_echoes_cid)
+    {
+      ESP_LOGI(TAG, "MQTT Client: backend echoes correlation ids");
+      backend_echoes_cid = true;
+    }
+    const auto in_order = !conf::mqtt::PERSISTENT_SESSION || !backend_echoes_cid;
+    const auto it = std::find_if(pending.begin(), pending.end(), [cid, in_order](const PendingQuery &p)
+                                 { return !p.reply.has_value() && (p.cid == cid || (cid == 0 && in_order)); });
+    if (it == pending.end())
+    {
+      ESP_LOGW(TAG, "MQTT Client: ignoring reply without pending query (cid:%lu)", cid);
+      return;
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(event.time - it->sent);
+    it->reply.emplace(std::move(event.payload));
+    rtt[static_cast<size_t>(it->type)].addSample(elapsed);
+    recordSuccess();
+  }
+
+  /**
+   * @brief Connects to the WiFi network.
+   *
+   * @return true if the connection succeeded, false otherwise.
+   */
+  bool FabBackend::connectWiFi()
+  {
+    static constexpr auto NB_TRIES = 15;
+    static constexpr auto DELAY_MS = 250ms;
+
+    // Connect WiFi if needed
+    if (WiFi.status() != WL_CONNECTED)
+    {
+      WiFi.setAutoReconnect(true);
+      WiFi.persistent(true);
+      WiFi.mode(WIFI_STA);
+      ESP_LOGD(TAG, "FabServer::connectWiFi() : WiFi connection state=%d, connecting to SSID:%s (channel:%d)", WiFi.status(), wifi_ssid.c_str(), channel);
+      WiFi.begin(wifi_ssid.data(), wifi_password.data(), channel);
+      Tasks::delay(DELAY_MS);
+      for (auto i = 0; i < NB_TRIES; i++)
+      {
+        if (WiFi.status() == WL_CONNECTED)
+        {
+          ESP_LOGD(TAG, "FabServer::connectWiFi() : WiFi connection successful");
+          break;
+        }
+        Tasks::delay(DELAY_MS);
+      }
+    }
+    return WiFi.status() == WL_CONNECTED;
+  }
+
+  /**
+   * @brief Runs a complete connection attempt to the WiFi network and the MQTT server,
+   * without waiting for the reconnection backoff. Blocking: use only at boot.
+   * Afterwards the connection is maintained in the background by the I/O task or loop().
+   *
+   * @return true if the client is online, false otherwise.
+   */
+  bool FabBackend::connect()
+  {
+    // The I/O task owns the connection
+    if (isIoTaskRunning())
+    {
+      return online;
+    }
+
+    if (link_state == LinkState::Connected)
+    {
+      connectStep(); // Checks the connection is still alive
+      processEvents();
+      return online;
+    }
+
+    if (!isReconnectDue())
+    {
+      ESP_LOGD(TAG, "FabServer::connect() skipped, circuit breaker open");
+      return false;
+    }
+
+    next_attempt = std::chrono::system_clock::now(); // Explicit request
+    connectStep();
+    while (link_state != LinkState::Connected && link_state != LinkState::Disconnected)
+    {
+      // Association, name lookup and TCP handshake complete in the background
+      Tasks::delay(link_state == LinkState::AssociatingWiFi ? 250ms : 10ms);
+      connectStep();
+    }
+    processEvents();
+
+    return online;
+  }
+
+  /**
+   * @brief Advances the connection state machine by one step.
+   * Steps are: WiFi association, broker name resolution, TCP connection, MQTT connection, subscriptions.
+   * Association, name lookup and TCP handshake run in the network stack and are polled at each step;
+   * only the MQTT handshake waits for the broker, bounded by the MQTT client command timeout.
+   * Failed attempts are retried after an exponential backoff with random jitter.
+   *
+   * @return The new connection state.
+   */
+  FabBackend::LinkState FabBackend::connectStep()
+  {
+    switch (link_state)
+    {
+    case LinkState::Disconnected:
+      if (std::chrono::system_clock::now() < next_attempt || !isReconnectDue())
+      {
+        break;
+      }
+
+      if (auto expected = BreakerState::Open; breaker.compare_exchange_strong(expected, BreakerState::HalfOpen))
+      {
+        ESP_LOGI(TAG, "Circuit breaker half-open, probing connection");
+      }
+
+      if (wifi_lease.isValid() && !isWiFiLeaseUsable())
+      {
+        // Also drops an association made with its static IP
+        ESP_LOGI(TAG, "Cached WiFi lease expired, renewing it with DHCP");
+        discardWiFiLease();
+      }
+      else if (WiFi.status() == WL_CONNECTED)
+      {
+        if (!wifi_lease.isValid())
+        {
+          saveWiFiLease();
+        }
+        setLinkState(LinkState::ResolvingBroker);
+        break;
+      }
+
+      WiFi.setAutoReconnect(true);
+      WiFi.persistent(true);
+      WiFi.mode(WIFI_STA);
+      beginWiFi(wifi_lease.isValid());
+      setLinkState(LinkState::AssociatingWiFi);
+      break;
+
+    case LinkState::AssociatingWiFi:
+      if (WiFi.status() == WL_CONNECTED)
+      {
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - wifi_begin);
+        {
+          std::lock_guard<std::mutex> lock(stats_mutex);
+          auto &stats = wifi_fast_path ? wifi_stats.fast : wifi_stats.full;
+          stats.count++;
+          stats.last = elapsed;
+          stats.total += elapsed;
+        }
+        ESP_LOGI(TAG, "FabServer : WiFi connected in %lld ms (%s)", elapsed.count(), wifi_fast_path ? "cached BSSID and IP" : "full scan");
+
+        // DHCP lease and access point may have changed
+        if (!wifi_fast_path)
+        {
+          saveWiFiLease();
+        }
+        setLinkState(LinkState::ResolvingBroker);
+      }
+      else if (wifi_fast_path && std::chrono::system_clock::now() - step_started > conf::mqtt::WIFI_FAST_CONNECT_TIMEOUT)
+      {
+        // The cached BSSID, channel or static IP may be stale: full scan and DHCP
+        ESP_LOGW(TAG, "Fast WiFi reconnection failed, discarding cached lease");
+        discardWiFiLease();
+        beginWiFi(false);
+        setLinkState(LinkState::AssociatingWiFi); // Restart the timeout
+      }
+      else if (std::chrono::system_clock::now() - step_started > conf::mqtt::WIFI_CONNECT_TIMEOUT)
+      {
+        ESP_LOGW(TAG, "Failure to connect to WiFi SSID %s", wifi_ssid.c_str());
+        connectionFailed();
+      }
+      break;
+
+    case LinkState::ResolvingBroker:
+    {
+      // mDNS is slow and unreliable, the cached address is used first and refreshed once connected
+      const auto cached = broker_address.isValidFor(broker_hostname);
+      broker_from_cache = false;
+      if (cached && !verify_broker_address)
+      {
+        broker_from_cache = broker_ip.fromString(broker_address.ip.c_str());
+      }
+
+      if (!broker_from_cache)
+      {
+        IPAddress resolved;
+        const auto result = resolveStep(resolved);
+        if (result == StepResult::Pending)
+        {
+          break;
+        }
+        if (result == StepResult::Done)
+        {
+          broker_ip = resolved;
+        }
+        else if (cached && broker_ip.fromString(broker_address.ip.c_str()))
+        {
+          ESP_LOGW(TAG, "Falling back to cached address of MQTT server [%s]", broker_address.ip.c_str());
+          broker_from_cache = true;
+        }
+        else
+        {
+          connectionFailed();
+          break;
+        }
+      }
+
+      if (broker_from_cache)
+      {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        resolve_stats.cache_hits++;
+        ESP_LOGD(TAG, "Using cached address [%s] of MQTT server [%s]", broker_address.ip.c_str(), broker_hostname.c_str());
+      }
+      setLinkState(LinkState::ConnectingTcp);
+      break;
+    }
+
+    case LinkState::ConnectingTcp:
+    {
+      const auto result = tcpConnectStep();
+      if (result == StepResult::Pending)
+      {
+        break;
+      }
+      if (result == StepResult::Failed)
+      {
+        ESP_LOGW(TAG, "Failure to open TCP connection to MQTT server %s", broker_hostname.c_str());
+        connectionFailed();
+        break;
+      }
+      setLinkState(LinkState::ConnectingMqtt);
+      break;
+    }
+
+    case LinkState::ConnectingMqtt:
+      client.begin(broker_ip, conf::mqtt::PORT_NUMBER, wifi_client);
+
+      callback = [&](MQTTClient *, char topic[], char bytes[], int length)
+      { return messageReceived(topic, bytes, length); };
+
+      client.onMessageAdvanced(callback);
+
+      client.setCleanSession(!conf::mqtt::PERSISTENT_SESSION);
+
+      // TCP connection already open
+      if (!client.connect(mqtt_client_name.c_str(),
+                          mqtt_user.c_str(),
+                          mqtt_password.c_str(), true))
+      {
+        ESP_LOGW(TAG, "Failure to connect as client: %s with username %s, last error %d", mqtt_client_name.c_str(), mqtt_user.c_str(), client.lastError());
+        connectionFailed();
+        break;
+      }
+      setLinkState(LinkState::Subscribing);
+      break;
+
+    case LinkState::Subscribing:
+    {
+      // Subscriptions are kept by the broker with the session
+      const auto resumed = conf::mqtt::PERSISTENT_SESSION && client.sessionPresent();
+      if (resumed)
+      {
+        ESP_LOGD(TAG, "MQTT Client: session resumed, subscriptions kept");
+      }
+      else
+      {
+        if (!client.subscribe(response_topic.c_str(), conf::mqtt::QOS_BACKEND))
+        {
+          ESP_LOGE(TAG, "MQTT Client: failure to subscribe to reply topic %s", response_topic.c_str());
+          connectionFailed();
+          break;
+        }
+        ESP_LOGD(TAG, "MQTT Client: subscribed to reply topic %s", response_topic.c_str());
+
+        if constexpr (conf::mqtt::MSGPACK_PAYLOAD)
+        {
+          if (!client.subscribe(msgpack_response_topic.c_str(), conf::mqtt::QOS_BACKEND))
+          {
+            ESP_LOGE(TAG, "MQTT Client: failure to subscribe to reply topic %s", msgpack_response_topic.c_str());
+            connectionFailed();
+            break;
+          }
+        }
+
+        // Machine configuration pushed by the backend, optional
+        if (!client.subscribe(config_topic.c_str()))
+        {
+          ESP_LOGW(TAG, "MQTT Client: failure to subscribe to config topic %s", config_topic.c_str());
+        }
+      }
+
+      // The breaker closes on the first reply: the broker may accept connections while the backend is down
+      online = true;
+      reconnect_attempts = 0;
+      wifi_fast_path = false;
+      wifi_lease_failures = 0;
+      verify_broker_address = false;
+      setLinkState(LinkState::Connected); // The board logic announces the board on this change
+      break;
+    }
+
+    case LinkState::Connected:
+      if (WiFi.status() != WL_CONNECTED || !client.connected())
+      {
+        ESP_LOGI(TAG, "MQTT Client: connection lost");
+        // Not a failed attempt, but all boards lost it at the same time if the broker restarted
+        reconnect_attempts = 0;
+        connectionFailed();
+        break;
+      }
+
+      // Background refresh of the cached broker address, used at next connection
+      if (lookup_state != LookupState::Idle || std::chrono::system_clock::now() >= broker_next_resolve)
+      {
+        if (IPAddress resolved; resolveStep(resolved) == StepResult::Done && resolved != broker_ip)
+        {
+          ESP_LOGI(TAG, "MQTT server [%s] moved to [%s]", broker_hostname.c_str(), resolved.toString().c_str());
+        }
+      }
+      break;
+    }
+
+    return link_state;
+  }
+
+  /**
+   * @brief Gets the connection statistics sent with the alive message.
+   *
+   * @return JSON members "rtt" (if measured), "wifi" with the average association time in ms of each path
+   * and "dns" with the broker name resolutions.
+   */
+  std::string FabBackend::getTelemetry() const
+  {
+    const auto average = [](const WiFiPathStats &stats)
+    { return stats.count == 0 ? 0 : stats.total.count() / stats.count; };
+
+    std::stringstream ss{};
+    if (const auto rtt_stats = getRttStats(); !rtt_stats.empty())
+    {
+      ss << "\"rtt\":" << rtt_stats << ",";
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    ss << "\"wifi\":{"
+       << "\"fast\":" << wifi_stats.fast.count << ","
+       << "\"fast_ms\":" << average(wifi_stats.fast) << ","
+       << "\"full\":" << wifi_stats.full.count << ","
+       << "\"full_ms\":" << average(wifi_stats.full) << "},";
+
+    const auto resolve_ms = resolve_stats.count == 0 ? 0 : resolve_stats.total.count() / resolve_stats.count;
+    ss << "\"dns\":{"
+       << "\"n\":" << resolve_stats.count << ","
+       << "\"fail\":" << resolve_stats.failures << ","
+       << "\"cached\":" << resolve_stats.cache_hits << ","
+       << "\"ms\":" << resolve_ms << "},";
+
+    const auto log_stats = buffer.getStats();
+    const auto compaction = buffer.getCompactionStats();
+    ss << "\"buffer\":{"
+       << "\"n\":" << buffer.count() << ","
+       << "\"sessions\":" << compaction.sessions << ","
+       << "\"summarized\":" << compaction.summarized << ","
+       << "\"dropped\":" << log_stats.dropped << "}";
+    return ss.str();
+  }
+
+  /**
+   * @brief Starts the WiFi association.
+   *
+   * @param fast If true, uses the access point, channel and static IP of the last association,
+   * otherwise scans the channels and uses DHCP.
+   */
+  void FabBackend::beginWiFi(bool fast)
+  {
+    wifi_fast_path = fast;
+    wifi_lease_used = fast;
+    wifi_begin = std::chrono::system_clock::now();
+
+    if (fast)
+    {
+      ESP_LOGD(TAG, "FabServer : connecting to SSID:%s with cached BSSID (channel:%d)", wifi_ssid.c_str(), wifi_lease.channel);
+      WiFi.config(IPAddress(wifi_lease.ip), IPAddress(wifi_lease.gateway), IPAddress(wifi_lease.subnet), IPAddress(wifi_lease.dns));
+      WiFi.begin(wifi_ssid.data(), wifi_password.data(), wifi_lease.channel, wifi_lease.bssid.data());
+      return;
+    }
+
+    ESP_LOGD(TAG, "FabServer : WiFi connection state=%d, connecting to SSID:%s (channel:%d)", WiFi.status(), wifi_ssid.c_str(), channel);
+    WiFi.config(IPAddress(), IPAddress(), IPAddress()); // Back to DHCP
+    WiFi.begin(wifi_ssid.data(), wifi_password.data(), channel);
+  }
+
+  /**
+   * @brief Keeps the access point and IP settings of the current association for the next reconnection.
+   */
+  void FabBackend::saveWiFiLease()
+  {
+    WiFiLease lease;
+    if (const auto *bssid = WiFi.BSSID(); bssid != nullptr)
+    {
+      std::copy(bssid, bssid + lease.bssid.size(), lease.bssid.begin());
+    }
+    lease.channel = WiFi.channel();
+    lease.ip = WiFi.localIP();
+    lease.gateway = WiFi.gatewayIP();
+    lease.subnet = WiFi.subnetMask();
+    lease.dns = WiFi.dnsIP();
+
+    if (!lease.isValid())
+    {
+      return;
+    }
+
+    // Renewed by DHCP even if unchanged
+    wifi_lease_time = std::chrono::steady_clock::now();
+    wifi_lease_failures = 0;
+    if (lease == wifi_lease)
+    {
+      return;
+    }
+
+    wifi_lease = lease;
+    SavedConfig::Update([&lease](SavedConfig &sc)
+                        { sc.wifi_lease = lease; });
+    ESP_LOGI(TAG, "Updated WiFi lease (channel %d, IP %s)", lease.channel, WiFi.localIP().toString().c_str());
+  }
+
+  /**
+   * @brief Tells if the cached lease can still be used for a fast association:
+   * its static IP is not renewed, so it is used only within WIFI_LEASE_MAX_AGE of the last DHCP.
+   */
+  bool FabBackend::isWiFiLeaseUsable() const
+  {
+    return wifi_lease.isValid() && std::chrono::steady_clock::now() - wifi_lease_time < conf::mqtt::WIFI_LEASE_MAX_AGE;
+  }
+
+  /**
+   * @brief Forgets the cached lease and drops the current association, so that the next one scans and uses DHCP.
+   * The persisted lease is replaced after the next association.
+   */
+  void FabBackend::discardWiFiLease()
+  {
+    wifi_lease = WiFiLease{};
+    wifi_lease_used = false;
+    wifi_lease_failures = 0;
+    WiFi.disconnect();
+  }
+
+  /**
+   * @brief Advances the resolution of broker_hostname: starts a lookup in the network stack, then polls it.
+   * The address is persisted if it changed.
+   * Next background resolution is scheduled after BROKER_ADDRESS_TTL, or BROKER_RESOLVE_RETRY on failure.
+   *
+   * @param resolved Set to the broker address once resolved.
+   * @return StepResult::Pending while the lookup runs, then Done or Failed.
+   */
+  FabBackend::StepResult FabBackend::resolveStep(IPAddress &resolved)
+  {
+    struct LookupRequest
+    {
+      FabBackend *self;
+      uint32_t generation;
+    };
+
+    if (lookup_state == LookupState::Idle)
+    {
+      // Called by lwIP with the DNS or mDNS answer, or nullptr on timeout.
+      // The answer of a lookup which timed out or was cancelled is ignored: it must not complete the next one.
+      const auto found = [](const char *, const ip_addr_t *address, void *arg)
+      {
+        const std::unique_ptr<LookupRequest> request{static_cast<LookupRequest *>(arg)};
+        auto *self = request->self;
+        if (request->generation != self->lookup_generation)
+        {
+          return;
+        }
+        if (address != nullptr)
+        {
+          self->lookup_result = address->u_addr.ip4.addr;
+        }
+        auto expected = LookupState::Running;
+        self->lookup_state.compare_exchange_strong(expected, address != nullptr ? LookupState::Found : LookupState::NotFound);
+      };
+
+      ip_addr_t address;
+      auto *request = new LookupRequest{this, 0};
+      lookup_started = std::chrono::system_clock::now();
+
+      LOCK_TCPIP_CORE();
+      request->generation = ++lookup_generation;
+      lookup_state = LookupState::Running;
+      const auto err = dns_gethostbyname(broker_hostname.c_str(), &address, found, request);
+      UNLOCK_TCPIP_CORE();
+
+      if (err != ERR_INPROGRESS) // The callback will not be called
+      {
+        delete request;
+      }
+
+      if (err == ERR_OK) // Numeric address, or answer cached by lwIP
+      {
+        lookup_result = address.u_addr.ip4.addr;
+        lookup_state = LookupState::Found;
+      }
+      else if (err != ERR_INPROGRESS)
+      {
+        lookup_state = LookupState::NotFound;
+      }
+    }
+
+    const auto now = std::chrono::system_clock::now();
+    auto state = lookup_state.load();
+    if (state == LookupState::Running)
+    {
+      if (now - lookup_started < conf::mqtt::BROKER_RESOLVE_TIMEOUT)
+      {
+        return StepResult::Pending;
+      }
+      cancelLookup();
+      state = LookupState::NotFound;
+    }
+    lookup_state = LookupState::Idle;
+
+    const auto success = state == LookupState::Found;
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - lookup_started);
+    {
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      resolve_stats.count++;
+      resolve_stats.last = elapsed;
+      resolve_stats.total += elapsed;
+      if (!success)
+      {
+        resolve_stats.failures++;
+      }
+    }
+
+    if (!success)
+    {
+      broker_next_resolve = now + conf::mqtt::BROKER_RESOLVE_RETRY;
+      ESP_LOGE(TAG, "Failed to resolve MQTT server [%s] in %lld ms", broker_hostname.c_str(), elapsed.count());
+      return StepResult::Failed;
+    }
+
+    resolved = IPAddress(lookup_result.load());
+    broker_next_resolve = now + conf::mqtt::BROKER_ADDRESS_TTL;
+    ESP_LOGD(TAG, "Resolved MQTT server [%s] as [%s] in %lld ms", broker_hostname.c_str(), resolved.toString().c_str(), elapsed.count());
+
+    const BrokerAddress address{broker_hostname, resolved.toString().c_str()};
+    if (address != broker_address)
+    {
+      broker_address = address;
+      SavedConfig::Update([&address](SavedConfig &sc)
+                          { sc.broker_address = address; });
+    }
+    return StepResult::Done;
+  }
+
+  /**
+   * @brief Abandons the ongoing broker lookup, if any. lwIP cannot cancel it, so its answer will be ignored.
+   */
+  void FabBackend::cancelLookup()
+  {
+    if (lookup_state == LookupState::Running)
+    {
+      LOCK_TCPIP_CORE(); // The lookup callback runs with this lock held
+      ++lookup_generation;
+      UNLOCK_TCPIP_CORE();
+    }
+    lookup_state = LookupState::Idle;
+  }
+
+  /**
+   * @brief Advances the TCP connection to the broker: opens a non-blocking socket, then polls the handshake.
+   * Once established, the socket is handed over to wifi_client.
+   *
+   * @return StepResult::Pending during the handshake, then Done or Failed.
+   */
+  FabBackend::StepResult FabBackend::tcpConnectStep()
+  {
+    if (tcp_socket < 0)
+    {
+      ESP_LOGD(TAG, "Connecting to MQTT server [%s:%d]...", broker_ip.toString().c_str(), conf::mqtt::PORT_NUMBER);
+      tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
+      if (tcp_socket < 0)
+      {
+        ESP_LOGE(TAG, "Failure to create socket, errno %d", errno);
+        return StepResult::Failed;
+      }
+      fcntl(tcp_socket, F_SETFL, fcntl(tcp_socket, F_GETFL, 0) | O_NONBLOCK);
+
+      sockaddr_in address{};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = static_cast<uint32_t>(broker_ip);
+      address.sin_port = htons(conf::mqtt::PORT_NUMBER);
+      if (::connect(tcp_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 && errno != EINPROGRESS)
+      {
+        ESP_LOGE(TAG, "Failure to connect socket, errno %d", errno);
+        closeTcpSocket();
+        return StepResult::Failed;
+      }
+    }
+
+    fd_set writable;
+    FD_ZERO(&writable);
+    FD_SET(tcp_socket, &writable);
+    timeval no_wait{0, 0};
+    const auto ready = select(tcp_socket + 1, nullptr, &writable, nullptr, &no_wait);
+    if (ready == 0)
+    {
+      if (std::chrono::system_clock::now() - step_started < conf::mqtt::TCP_CONNECT_TIMEOUT)
+      {
+        return StepResult::Pending;
+      }
+      ESP_LOGW(TAG, "TCP handshake timed out");
+      closeTcpSocket();
+      return StepResult::Failed;
+    }
+
+    auto error = 0;
+    socklen_t len = sizeof(error);
+    if (ready < 0 || getsockopt(tcp_socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+    {
+      ESP_LOGW(TAG, "TCP handshake failed, error %d", error);
+      closeTcpSocket();
+      return StepResult::Failed;
+    }
+
+    // Back to blocking mode, as WiFiClient::connect() leaves its sockets
+    fcntl(tcp_socket, F_SETFL, fcntl(tcp_socket, F_GETFL, 0) & ~O_NONBLOCK);
+    wifi_client = WiFiClient(tcp_socket);
+    tcp_socket = -1;
+    return StepResult::Done;
+  }
+
+  /**
+   * @brief Closes the socket of an unfinished TCP handshake, if any.
+   */
+  void FabBackend::closeTcpSocket()
+  {
+    if (tcp_socket >= 0)
+    {
+      close(tcp_socket);
+      tcp_socket = -1;
+    }
+  }
+
+  /**
+   * @brief Gets the broker name resolution statistics.
+   *
+   * @return The statistics since boot.
+   */
+  FabBackend::ResolveStats FabBackend::getResolveStats() const
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return resolve_stats;
+  }
+
+  /**
+   * @brief Gets the WiFi association times, for the cached lease and full scan paths.
+   *
+   * @return The statistics since boot.
+   */
+  FabBackend::WiFiStats FabBackend::getWiFiStats() const
+  {
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    return wifi_stats;
+  }
+
+  /**
+   * @brief Changes the connection state, recording when the step started.
+   *
+   * @param state The new state.
+   */
+  void FabBackend::setLinkState(LinkState state)
+  {
+    const auto now = std::chrono::system_clock::now();
+    const auto was_connected = link_state == LinkState::Connected;
+    link_state = state;
+    step_started = now;
+
+    if (was_connected != (state == LinkState::Connected))
+    {
+      std::lock_guard<std::mutex> lock(link_mutex);
+      link_changes.count++;
+      link_changes.up = !was_connected;
+      (was_connected ? link_changes.last_down : link_changes.last_up) = now;
+    }
+  }
+
+  /**
+   * @brief Closes the connection and schedules the next attempt with exponential backoff and random jitter.
+   */
+  void FabBackend::connectionFailed()
+  {
+    online = false;
+    if (client.connected())
+    {
+      client.disconnect();
+    }
+    wifi_client.stop();
+    closeTcpSocket();
+    recordFailure();
+
+    // Broker, TCP or MQTT failures after a fast association may come from a stale static IP
+    // which the access point still accepts: the lease is discarded if they repeat.
+    // Failures of the association itself are handled in AssociatingWiFi.
+    if (wifi_lease_used && link_state != LinkState::AssociatingWiFi && link_state != LinkState::Connected &&
+        ++wifi_lease_failures >= conf::mqtt::WIFI_LEASE_MAX_FAILURES)
+    {
+      ESP_LOGW(TAG, "%d connection failures with cached WiFi lease, discarding it", wifi_lease_failures);
+      discardWiFiLease();
+    }
+    wifi_fast_path = false;
+
+    // The broker may have moved: next attempt resolves its name first
+    if (broker_from_cache && (link_state == LinkState::ConnectingTcp || link_state == LinkState::ConnectingMqtt))
+    {
+      ESP_LOGW(TAG, "Connection failed with cached MQTT server address, resolving it again");
+      verify_broker_address = true;
+    }
+    broker_from_cache = false;
+
+    auto backoff = std::chrono::duration_cast<std::chrono::milliseconds>(conf::mqtt::RECONNECT_BACKOFF_MIN);
+    for (auto i = 0; i < reconnect_attempts && backoff < conf::mqtt::RECONNECT_BACKOFF_MAX; i++)
+    {
+      backoff *= 2;
+    }
+    backoff = std::min<std::chrono::milliseconds>(backoff, conf::mqtt::RECONNECT_BACKOFF_MAX);
+
+    // Wait between half and the full backoff
+    const auto half = backoff / 2;
+    const auto wait = half + std::chrono::milliseconds(random(0, half.count() + 1));
+    next_attempt = std::chrono::system_clock::now() + wait;
+
+    if (reconnect_attempts < UINT8_MAX)
+    {
+      reconnect_attempts++;
+    }
+    setLinkState(LinkState::Disconnected);
+    ESP_LOGD(TAG, "Next connection attempt in %lld ms", wait.count());
   }
 
   /**
-   * @brief Checks if the client is online.
+   * @brief Gets the state of the connection to the MQTT server.
    *
-   * @return true if the client is online, false otherwise.
+   * @return The connection state.
    */
-  bool FabBackend::isOnline() const
+  FabBackend::LinkState FabBackend::getLinkState() const
   {
-    return online;
+    return link_state;
   }
 
   /**
-   * @brief Callback function for received MQTT messages.
+   * @brief Gets the MQTT client id, stable across reboots with a persistent session.
    *
-   * @param s_topic The topic the message was received on.
-   * @param s_payload The payload of the message.
+   * @return The client id used to connect to the broker.
    */
-  void FabBackend::messageReceived(String &s_topic, String &s_payload)
+  const std::string &FabBackend::getClientId() const
   {
-    ESP_LOGI(TAG, "MQTT Client: Received on %s -> %s", s_topic.c_str(), s_payload.c_str());
-
-    last_reply.assign(s_payload.c_str());
-    answer_pending = false;
+    return mqtt_client_name;
   }
 
   /**
-   * @brief Connects to the WiFi network.
-   *
-   * @return true if the connection succeeded, false otherwise.
+   * @brief Disconnects from the MQTT server.
    */
-  bool FabBackend::connectWiFi()
+  void FabBackend::disconnect()
   {
-    static constexpr auto NB_TRIES = 15;
-    static constexpr auto DELAY_MS = 250ms;
+    if (!isIoTaskRunning())
+    {
+      disconnectNow();
+      processEvents();
+      return;
+    }
 
-    // Connect WiFi if needed
-    if (WiFi.status() != WL_CONNECTED)
+    online = false; // No more publications until reconnected
+    auto *request = io_requests.acquire();
+    if (request == nullptr)
     {
-      WiFi.setAutoReconnect(true);
-      WiFi.persistent(true);
-      WiFi.mode(WIFI_STA);
-      ESP_LOGD(TAG, "FabServer::connectWiFi() : WiFi connection state=%d, connecting to SSID:%s (channel:%d)", WiFi.status(), wifi_ssid.c_str(), channel);
-      WiFi.begin(wifi_ssid.data(), wifi_password.data(), channel);
-      Tasks::delay(DELAY_MS);
-      for (auto i = 0; i < NB_TRIES; i++)
-      {
-        if (WiFi.status() == WL_CONNECTED)
-        {
-          ESP_LOGD(TAG, "FabServer::connectWiFi() : WiFi connection successful");
-          break;
-        }
-        Tasks::delay(DELAY_MS);
-      }
+      ESP_LOGE(TAG, "MQTT Client: request queue full, disconnection not requested");
+      return;
     }
-    return WiFi.status() == WL_CONNECTED;
+    request->kind = IoRequest::Kind::Disconnect;
+    io_requests.commit();
   }
 
   /**
-   * @brief Establishes a connection to the WiFi network and the MQTT server.
-   *
-   * @return true if both operations succeeded, false otherwise.
+   * @brief Closes the connection to the broker, in the I/O task.
    */
-  bool FabBackend::connect()
+  void FabBackend::disconnectNow()
   {
-    const auto status = WiFi.status();
+    client.disconnect();
+    wifi_client.stop();
+    closeTcpSocket();
+    online = false;
+    setLinkState(LinkState::Disconnected);
+    delay(100);
+  }
 
-    ESP_LOGD(TAG, "FabServer::connect() called, Wifi status=%d", status);
+  /**
+   * @brief Advances the replay of the buffered messages, without waiting.
+   *
+   * The REPLAY_WINDOW oldest messages are published at once, each with its correlation id.
+   * Answered messages leave the log oldest first, so a message answered before an older one
+   * waits in replay_acked (cumulative acknowledgement). Unanswered messages are published again
+   * with the same sequence number, the backend ignoring the ones it already recorded.
+   * Usage events published live are skipped until their query is over.
+   */
+  void FabBackend::replayStep()
+  {
+    const auto now = std::chrono::system_clock::now();
+    auto &estimator = rtt[static_cast<size_t>(ServerMQTT::QueryType::Replay)];
+    const auto holding = conf::mqtt::PERSISTENT_SESSION && !link_up && now - link_lost < conf::mqtt::SESSION_HOLD_MAX;
 
-    // Check if WiFi network is available, and if not, try to connect
-    if (status != WL_CONNECTED)
+    for (auto it = pending.begin(); it != pending.end();)
     {
-      online = false;
-
-      if (client.connected())
+      const auto next = std::next(it);
+      if (it->type == ServerMQTT::QueryType::Replay && it->record)
       {
-        ESP_LOGD(TAG, "Closing MQTT client due to WiFi down");
-        client.disconnect();
+        if (it->reply.has_value())
+        {
+          if (parseReply<ServerMQTT::SimpleResponse>(it->reply.value())->request_ok)
+          {
+            replay_acked.push_back(it->record->seq);
+          }
+          else
+          {
+            // Not recorded by the backend: the message stays in the log
+            ESP_LOGW(TAG, "Replayed message %lu rejected by the backend, retrying later", it->record->seq);
+            replay_resume = now + conf::buffer::REPLAY_REJECTED_DELAY;
+          }
+          pending.erase(it);
+        }
+        else if (it->failed || (!holding && now > it->deadline))
+        {
+          if (!it->failed)
+          {
+            ESP_LOGW(TAG, "No answer for replayed message %lu", it->record->seq);
+            estimator.backoff();
+            recordFailure();
+          }
+          pending.erase(it);
+        }
       }
-      Tasks::delay(100ms);
-      connectWiFi();
+      it = next;
     }
 
-    // Check if WiFi is available but MQTT client is not
-    if (WiFi.status() == WL_CONNECTED &&
-        !client.connected())
+    while (hasBufferedMsg())
     {
-      IPAddress ip;
-      if (WiFi.hostByName(broker_hostname.c_str(), ip))
+      if (const auto front = buffer.front(); front)
       {
-        ESP_LOGD(TAG, "Resolved MQTT server [%s] as [%s]", broker_hostname.c_str(), ip.toString().c_str());
+        const auto acked = std::find(replay_acked.begin(), replay_acked.end(), front->seq);
+        if (acked == replay_acked.end())
+        {
+          break;
+        }
+        replay_acked.erase(acked);
       }
       else
       {
-        ESP_LOGE(TAG, "Failed to resolve MQTT server [%s]", broker_hostname.c_str());
-        return false;
+        ESP_LOGE(TAG, "Discarding unreadable buffered message");
       }
+      buffer.pop_front();
+    }
 
-      ESP_LOGD(TAG, "Connecting to MQTT server [%s:%d]...", ip.toString().c_str(), conf::mqtt::PORT_NUMBER);
-
-      client.begin(ip, conf::mqtt::PORT_NUMBER, wifi_client);
-
-      callback = [&](String &a, String &b)
-      { return messageReceived(a, b); };
+    // Messages acknowledged by a live reply as well are no longer in the log. Records written back
+    // by a compaction are out of sequence order: an acknowledged message is looked up in the window,
+    // where it stays until it reaches the front.
+    const auto window = buffer.peek(conf::buffer::REPLAY_WINDOW);
+    if (!replay_acked.empty())
+    {
+      replay_acked.erase(std::remove_if(replay_acked.begin(), replay_acked.end(), [&window](uint32_t seq)
+                                        { return std::none_of(window.begin(), window.end(), [seq](const BufferedMsg &msg)
+                                                              { return msg.seq == seq; }); }),
+                         replay_acked.end());
+    }
 
-      client.onMessage(callback);
+    if (!isOnline() || now < replay_resume)
+    {
+      return;
+    }
 
-      if (!client.connect(mqtt_client_name.c_str(),
-                          mqtt_user.c_str(),
-                          mqtt_password.c_str(), false))
+    for (const auto &msg : window)
+    {
+      const auto in_flight = std::any_of(pending.begin(), pending.end(), [&msg](const PendingQuery &p)
+                                         { return p.record && p.record->seq == msg.seq; });
+      if (in_flight || std::find(replay_acked.begin(), replay_acked.end(), msg.seq) != replay_acked.end())
       {
-        ESP_LOGW(TAG, "Failure to connect as client: %s with username %s, last error %d", mqtt_client_name.c_str(), mqtt_user.c_str(), client.lastError());
-        client.disconnect();
+        continue;
       }
 
-      // Setup subscriptions
-      if (client.connected())
+      // Summaries are only understood by backends announcing it, they wait for the checkmachine reply
+      if (msg.action == BufferedAction::Summary && summary_supported != true)
       {
-        std::stringstream tmp_topic;
-        tmp_topic << topic << conf::mqtt::response_topic;
-        response_topic.assign(tmp_topic.str());
-
-        if (!client.subscribe(response_topic.c_str()))
-        {
-          ESP_LOGE(TAG, "MQTT Client: failure to subscribe to reply topic %s", response_topic.c_str());
-        }
-        else
-        {
-          ESP_LOGD(TAG, "MQTT Client: subscribed to reply topic %s", response_topic.c_str());
-          online = true;
-        }
-        // Announce the board to the server
-        if (auto query = ServerMQTT::AliveQuery{}; publish(query) == PublishResult::PublishedWithoutAnswer)
+        if (!summary_supported.has_value())
         {
-          ESP_LOGI(TAG, "MQTT Client: board announced to server");
-        }
-        else
-        {
-          ESP_LOGW(TAG, "MQTT Client: failure to announce board to server");
+          break;
         }
+        ESP_LOGW(TAG, "Backend does not record summaries, discarding summary of %u events (seq %lu)", msg.events, msg.seq);
+        buffer.acknowledge(msg.seq);
+        continue;
       }
-      else
+
+      const auto cid = next_cid++;
+      if (publish(BufferedQuery{msg}, cid) != PublishResult::PublishedWithoutAnswer)
       {
-        ESP_LOGW(TAG, "Failure to connect to MQTT server %s", broker_hostname.c_str());
+        // I/O queue full, next step will continue
+        break;
       }
+      pending.push_back({cid, ServerMQTT::QueryType::Replay, now, now + estimator.getTimeout(), std::nullopt, nullptr, msg});
+      buffer.markPublished(msg.seq);
     }
+  }
 
-    if (!client.connected())
+  /**
+   * @brief Writes a usage event to the log before it is published, so that it is replayed if no
+   * answer arrives. The query carries the event time and the sequence number of the record, which
+   * identify the event for the backend whether it is received live or replayed.
+   *
+   * @param query The query, stamped with the event time and sequence number if it is a usage event.
+   * @return The logged record, std::nullopt for other queries or if the event could not be logged.
+   */
+  auto FabBackend::logEvent(ServerMQTT::Query &query) -> std::optional<BufferedMsg>
+  {
+    const auto record = BufferedMsg::fromQuery(query);
+    if (!record)
     {
-      online = false;
+      return std::nullopt;
     }
 
-    return online;
+    // A StopUse sent live shall not replace its StartUse by a session
+    const auto logged = buffer.push_back(*record, !isOnline());
+    query.setEvent(logged ? logged->seq : 0, record->timestamp);
+    if (logged && isOnline())
+    {
+      buffer.markPublished(logged->seq);
+    }
+    return logged;
   }
 
   /**
-   * @brief Disconnects from the MQTT server.
+   * @brief Gets the number of queries of the board logic waiting for a reply, replayed messages excluded.
    */
-  void FabBackend::disconnect()
+  size_t FabBackend::liveQueries() const
   {
-    client.disconnect();
-    wifi_client.stop();
-    Tasks::delay(100ms);
+    return std::count_if(pending.begin(), pending.end(), [](const PendingQuery &p)
+                         { return p.type != ServerMQTT::QueryType::Replay; });
+  }
+
+  /**
+   * @brief Parses a backend reply, JSON or MessagePack, into the response type.
+   * Only the members read by the response are kept, in reply_arena: the document never
+   * outlives this call, so the arena is reset before each parse.
+   *
+   * @tparam RespT The type of the response.
+   * @param reply The raw reply payload.
+   * @return The response, with request_ok==false if the reply cannot be parsed.
+   */
+  template <typename RespT>
+  std::unique_ptr<RespT> FabBackend::parseReply(const std::string &reply)
+  {
+    reply_arena.reset();
+    JsonDocument reply_doc{&reply_arena};
+    if (DeserializationError error = ServerMQTT::deserializePayload(reply_doc, reply, RespT::jsonFilter()))
+    {
+      ESP_LOGE(TAG, "Failed to parse reply (%u bytes): %s", reply.size(), error.c_str());
+      return std::make_unique<RespT>(false);
+    }
+    checkMachineVersion(reply_doc);
+    return RespT::fromJson(reply_doc);
   }
 
   /**
@@ -405,47 +1941,32 @@ namespace fabomatic
     static_assert(std::is_base_of<ServerMQTT::Response, RespT>::value, "RespT must inherit from Response");
     QueryT query{args...};
 
-    auto nb_tries = 0;
-    while (isOnline() && hasBufferedMsg() && !transmitBuffer() && nb_tries < 3)
-    {
-      // To preserve chronological order, we cannot send new messages until the old ones have been sent.
-      ESP_LOGW(TAG, "Online with pending messages that could not be transmitted, retrying...");
-
-      Tasks::delay(250ms);
-
-      if (!isOnline())
-      {
-        connect();
-      }
-      nb_tries++;
-    }
+    // Before logging the event, which is sent live
+    replayStep();
 
-    if (isOnline() && !hasBufferedMsg())
+    const auto logged = logEvent(query);
+    if (isOnline())
     {
-      if (publishWithReply(query) == PublishResult::PublishedWithAnswer)
+      const auto result = publishWithReply(query, logged);
+      if (result == PublishResult::PublishedWithAnswer)
       {
-        // Deserialize the JSON document
-        const auto payload = last_reply.c_str();
-        if (DeserializationError error = deserializeJson(doc, payload))
+        auto response = parseReply<RespT>(last_reply);
+        // A usage event rejected by the backend stays in the log, to be replayed
+        if (logged && response->request_ok)
         {
-          ESP_LOGE(TAG, "Failed to parse json: %s (%s)", payload, error.c_str());
-          return std::make_unique<RespT>(false);
+          buffer.acknowledge(logged->seq);
         }
-        return RespT::fromJson(doc);
+        return response;
       }
-      else
+      if (result == PublishResult::PublishedWithoutAnswer)
       {
-        ESP_LOGE(TAG, "Failed to publish query %s", query.payload().data());
+        // Unanswered: the connection is reset. Failed publications are left to the link state machine
+        ESP_LOGE(TAG, "No answer to query %s", query.payload().data());
         this->disconnect();
       }
     }
 
-    if (query.buffered())
-    {
-      const auto &msg = BufferedMsg{query.payload(), topic, query.waitForReply()};
-      buffer.push_back(msg);
-    }
-
+    // Usage events are left in the log, to be replayed
     return std::make_unique<RespT>(false);
   }
 
@@ -461,23 +1982,11 @@ namespace fabomatic
   {
     static_assert(std::is_base_of<ServerMQTT::Query, QueryT>::value, "QueryT must inherit from Query");
     QueryT query{args...};
+    const auto record = BufferedMsg::fromQuery(query);
 
-    auto nb_tries = 0;
-    while (isOnline() && hasBufferedMsg() && !transmitBuffer() && nb_tries < 3)
-    {
-      // To preserve chronological order, we cannot send new messages until the old ones have been sent.
-      ESP_LOGW(TAG, "Online with pending messages that could not be transmitted, retrying...");
-
-      Tasks::delay(250ms);
-
-      if (!isOnline())
-      {
-        connect();
-      }
-      nb_tries++;
-    }
+    replayStep();
 
-    if (isOnline() && !hasBufferedMsg())
+    if (isOnline())
     {
       if (publish(query) == PublishResult::PublishedWithoutAnswer)
       {
@@ -490,11 +1999,79 @@ namespace fabomatic
       }
     }
 
-    if (query.buffered())
+    if (record)
+    {
+      buffer.push_back(*record);
+    }
+    return false;
+  }
+
+  /**
+   * @brief Publishes a query and returns immediately, the reply being handled by the callback.
+   *
+   * @tparam RespT The type of the response.
+   * @tparam QueryT The type of the query.
+   * @tparam ...Args The arguments to be passed to the query constructor.
+   * @param callback Called from loop() with the response, or with request_ok==false on timeout.
+   * Called immediately if the query could not be published.
+   * @return true if the query has been published, false otherwise.
+   */
+  template <typename RespT, typename QueryT, typename... QueryArgs>
+  bool FabBackend::processQueryAsync(std::function<void(std::unique_ptr<RespT>)> callback, QueryArgs &&...args)
+  {
+    static_assert(std::is_base_of<ServerMQTT::Query, QueryT>::value, "QueryT must inherit from Query");
+    static_assert(std::is_base_of<ServerMQTT::Response, RespT>::value, "RespT must inherit from Response");
+    QueryT query{args...};
+
+    // Before logging the event, which is sent live
+    replayStep();
+
+    const auto logged = logEvent(query);
+    if (isOnline() && liveQueries() < conf::mqtt::MAX_PENDING_QUERIES)
+    {
+      const auto cid = next_cid++;
+      const auto now = std::chrono::system_clock::now();
+
+      // Same total wait as the synchronous queries
+      const auto &estimator = rtt[static_cast<size_t>(query.type())];
+      auto deadline = now;
+      for (auto attempt = 0; attempt < conf::mqtt::MAX_TRIES; attempt++)
+      {
+        deadline += estimator.getTimeout(attempt);
+      }
+
+      const auto on_reply = [this, callback, logged](const std::string &reply)
+      {
+        if (reply.empty())
+        {
+          callback(std::make_unique<RespT>(false));
+          return;
+        }
+
+        if (logged)
+        {
+          buffer.acknowledge(logged->seq);
+        }
+        callback(parseReply<RespT>(reply));
+      };
+
+      pending.push_back({cid, query.type(), now, deadline, std::nullopt, on_reply, logged});
+
+      if (publish(query, cid) == PublishResult::PublishedWithoutAnswer)
+      {
+        return true;
+      }
+
+      pending.pop_back();
+      ESP_LOGE(TAG, "Failed to publish query %s", query.payload().data());
+      this->disconnect();
+    }
+    else if (liveQueries() >= conf::mqtt::MAX_PENDING_QUERIES)
     {
-      const auto &msg = BufferedMsg{query.payload(), topic, query.waitForReply()};
-      buffer.push_back(msg);
+      ESP_LOGW(TAG, "Too many pending queries, query %s not sent", query.payload().data());
     }
+
+    callback(std::make_unique<RespT>(false));
     return false;
   }
 
@@ -516,7 +2093,57 @@ namespace fabomatic
    */
   std::unique_ptr<ServerMQTT::MachineResponse> FabBackend::checkMachine()
   {
-    return processQuery<ServerMQTT::MachineResponse, ServerMQTT::MachineQuery>();
+    auto response = processQuery<ServerMQTT::MachineResponse, ServerMQTT::MachineQuery>();
+    if (response->request_ok)
+    {
+      check_and_start_supported = response->check_and_start;
+      if (summary_supported != response->summary)
+      {
+        ESP_LOGI(TAG, "Backend %s summaries of compacted events", response->summary ? "records" : "does not record");
+        summary_supported = response->summary;
+      }
+      if constexpr (conf::mqtt::MSGPACK_PAYLOAD)
+      {
+        const auto format = response->msgpack ? ServerMQTT::WireFormat::MsgPack : ServerMQTT::WireFormat::Json;
+        if (format != wire_format)
+        {
+          ESP_LOGI(TAG, "Backend %s MessagePack queries", response->msgpack ? "accepts" : "does not accept");
+          wire_format = format;
+        }
+      }
+      machine_version = response->version;
+      machine_update.reset(); // Superseded by this reply
+    }
+    else if (wire_format != ServerMQTT::WireFormat::Json)
+    {
+      // The backend may not understand MessagePack anymore, negotiate again with JSON
+      ESP_LOGW(TAG, "No checkmachine reply, falling back to JSON queries");
+      wire_format = ServerMQTT::WireFormat::Json;
+    }
+    return response;
+  }
+
+  /**
+   * @brief Gets one page of the users authorized on the machine.
+   *
+   * @param page The page number, starting from 0.
+   * @return A unique_ptr to the server response.
+   */
+  std::unique_ptr<ServerMQTT::UserListResponse> FabBackend::fetchUserList(uint16_t page)
+  {
+    return processQuery<ServerMQTT::UserListResponse, ServerMQTT::UserListQuery>(page);
+  }
+
+  /**
+   * @brief Gets one page of the users authorized on the machine without waiting for the reply.
+   *
+   * @param page The page number, starting from 0.
+   * @param callback Called with the server response.
+   * @return true if the query has been published.
+   */
+  bool FabBackend::fetchUserListAsync(uint16_t page, UserListCallback callback)
+  {
+    return processQueryAsync<ServerMQTT::UserListResponse, ServerMQTT::UserListQuery>(callback, page);
   }
 
   /**
@@ -530,6 +2157,30 @@ namespace fabomatic
     return processQuery<ServerMQTT::SimpleResponse, ServerMQTT::StartUseQuery>(uid);
   }
 
+  /**
+   * @brief Checks the card, registers the start of usage if the user is allowed and
+   * gets the machine state in a single exchange. The query is only sent if the backend
+   * announced support for it in the last checkMachine reply.
+   *
+   * @param uid The card UID of the user.
+   * @return A unique_ptr to the server response, with supported==false if the caller shall use checkCard/startUse.
+   */
+  std::unique_ptr<ServerMQTT::CheckAndStartResponse> FabBackend::checkCardAndStartUse(card::uid_t uid)
+  {
+    if (!check_and_start_supported)
+    {
+      return std::make_unique<ServerMQTT::CheckAndStartResponse>(false);
+    }
+
+    auto response = processQuery<ServerMQTT::CheckAndStartResponse, ServerMQTT::CheckAndStartQuery>(uid);
+    if (response->request_ok && !response->supported)
+    {
+      ESP_LOGW(TAG, "Backend did not process checkandstart query, falling back to checkuser/startuse");
+      check_and_start_supported = false;
+    }
+    return response;
+  }
+
   /**
    * @brief Registers the end of machine usage.
    *
@@ -554,6 +2205,44 @@ namespace fabomatic
     return processQuery<ServerMQTT::SimpleResponse, ServerMQTT::InUseQuery>(uid, duration_s);
   }
 
+  /**
+   * @brief Registers the start of machine usage without waiting for the reply.
+   *
+   * @param uid The card UID of the user.
+   * @param callback Called with the server response.
+   * @return true if the query has been published.
+   */
+  bool FabBackend::startUseAsync(card::uid_t uid, SimpleCallback callback)
+  {
+    return processQueryAsync<ServerMQTT::SimpleResponse, ServerMQTT::StartUseQuery>(callback, uid);
+  }
+
+  /**
+   * @brief Informs the backend that the machine is in use without waiting for the reply.
+   *
+   * @param uid The card UID of the user.
+   * @param duration_s The duration of usage in seconds.
+   * @param callback Called with the server response.
+   * @return true if the query has been published.
+   */
+  bool FabBackend::inUseAsync(card::uid_t uid, std::chrono::seconds duration_s, SimpleCallback callback)
+  {
+    return processQueryAsync<ServerMQTT::SimpleResponse, ServerMQTT::InUseQuery>(callback, uid, duration_s);
+  }
+
+  /**
+   * @brief Registers the end of machine usage without waiting for the reply.
+   *
+   * @param uid The card UID of the user.
+   * @param duration_s The duration of usage in seconds.
+   * @param callback Called with the server response.
+   * @return true if the query has been published.
+   */
+  bool FabBackend::finishUseAsync(card::uid_t uid, std::chrono::seconds duration_s, SimpleCallback callback)
+  {
+    return processQueryAsync<ServerMQTT::SimpleResponse, ServerMQTT::StopUseQuery>(callback, uid, duration_s);
+  }
+
   /**
    * @brief Registers a maintenance action.
    *
@@ -572,7 +2261,7 @@ namespace fabomatic
    */
   bool FabBackend::alive()
   {
-    return processQuery<ServerMQTT::AliveQuery>();
+    return processQuery<ServerMQTT::AliveQuery>(getTelemetry());
   }
 
   /**
@@ -590,71 +2279,80 @@ namespace fabomatic
     return this->buffer.count() > 0;
   }
 
+  /**
+   * @brief Replays the buffered messages, and waits until they are all answered or until
+   * no message got answered for the usual reply timeout.
+   * @return true if no message is left in the buffer
+   */
   [[nodiscard]] auto FabBackend::transmitBuffer() -> bool
   {
-    while (hasBufferedMsg() && isOnline())
+    const auto &estimator = rtt[static_cast<size_t>(ServerMQTT::QueryType::Replay)];
+    auto stall_timeout = std::chrono::milliseconds{0};
+    for (auto attempt = 0; attempt < conf::mqtt::MAX_TRIES; attempt++)
+    {
+      stall_timeout += estimator.getTimeout(attempt);
+    }
+
+    ESP_LOGD(TAG, "Retransmitting %u buffered messages...", buffer.count());
+    auto remaining = buffer.count();
+    auto last_progress = std::chrono::system_clock::now();
+    while (isOnline())
     {
-      ESP_LOGD(TAG, "Retransmitting buffered messages...");
-      const auto &msg = buffer.getMessage();
-      const BufferedQuery bq{msg.mqtt_message, msg.mqtt_topic, msg.wait_for_answer};
-      if (bq.waitForReply())
+      pollIo();
+      replayStep();
+      if (!hasBufferedMsg())
       {
-        if (auto result = publishWithReply(bq); result != PublishResult::PublishedWithAnswer)
-        {
-          ESP_LOGW(TAG, "Retransmitting buffered message failed!");
+        break;
+      }
 
-          // If it has been published but not answered, do not try again
-          if (result == PublishResult::PublishedWithoutAnswer)
-          {
-            const auto &bmsg = BufferedMsg{msg.mqtt_message, msg.mqtt_topic, msg.wait_for_answer};
-            buffer.push_front(bmsg);
-          }
-          break;
-        }
+      const auto now = std::chrono::system_clock::now();
+      if (buffer.count() < remaining)
+      {
+        remaining = buffer.count();
+        last_progress = now;
       }
-      else
+      else if (now - last_progress > stall_timeout)
       {
-        if (publish(bq) == PublishResult::ErrorNotPublished)
-        {
-          // Will try again
-          ESP_LOGW(TAG, "Retransmitting buffered message failed!");
-          const auto &bmsg = BufferedMsg{msg.mqtt_message, msg.mqtt_topic, msg.wait_for_answer};
-          buffer.push_front(bmsg);
-          break;
-        }
+        ESP_LOGW(TAG, "Retransmitting buffered messages failed!");
+        break;
       }
+      Tasks::delay(25ms);
     }
-    last_reply = "";
 
-    ESP_LOGW(TAG, "Retransmittion completed, remaining messages=%d", buffer.count());
+    ESP_LOGI(TAG, "Retransmission completed, remaining messages=%u", buffer.count());
     return !hasBufferedMsg();
   }
 
+  /**
+   * @brief Messages are written to the log as they are buffered, nothing is left to save.
+   * @return false if buffered messages are only kept in RAM, as the log partition is missing.
+   */
   auto FabBackend::saveBuffer() -> bool
   {
-    if (!buffer.hasChanged())
-    {
-      return true;
-    }
+    return buffer.isPersistent() || !hasBufferedMsg();
+  }
 
-    auto sc = SavedConfig::LoadFromEEPROM().value_or(SavedConfig::DefaultConfig());
-    sc.message_buffer = buffer;
+  /**
+   * @brief Opens the log of buffered messages, and moves there the messages kept in the
+   * settings by previous firmwares.
+   */
+  auto FabBackend::loadBuffer(const SavedConfig &config) -> void
+  {
+    buffer.begin();
 
-    if (sc.SaveToEEPROM())
+    if (!config.legacy_buffer.empty())
     {
-      buffer.setChanged(false);
-      ESP_LOGI(TAG, "Saved %d buffered messages", buffer.count());
-      return true;
+      for (const auto &msg : config.legacy_buffer)
+      {
+        buffer.push_back(msg);
+      }
+      // Saving in the new format drops them from the settings
+      SavedConfig::Update([](SavedConfig &sc)
+                          { sc.legacy_buffer.clear(); });
+      ESP_LOGI(TAG, "Moved %u buffered messages from the settings", config.legacy_buffer.size());
     }
 
-    ESP_LOGE(TAG, "Failed to save buffered messages!");
-    return false;
-  }
-
-  auto FabBackend::loadBuffer(const Buffer &new_buffer) -> void
-  {
-    buffer = new_buffer;
-    buffer.setChanged(false);
-    ESP_LOGI(TAG, "Loaded buffer with %d messages", buffer.count());
+    const auto stats = buffer.getStats();
+    ESP_LOGI(TAG, "Loaded buffer with %d messages (%u/%u bytes)", buffer.count(), stats.used, stats.capacity);
   }
 } // namespace fabomatic
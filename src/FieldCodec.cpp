@@ -0,0 +1,31 @@
+#include "FieldCodec.hpp"
+
+#include <cstring>
+
+namespace fabomatic::codec
+{
+  auto ByteWriter::put(const void *src, size_t len) -> void
+  {
+    if (overflow || len > capacity - length)
+    {
+      overflow = true;
+      return;
+    }
+    if (data != nullptr)
+    {
+      std::memcpy(data + length, src, len);
+    }
+    length += len;
+  }
+
+  auto ByteReader::get(void *dst, size_t len) -> void
+  {
+    if (error || len > length - position)
+    {
+      error = true;
+      return;
+    }
+    std::memcpy(dst, data + position, len);
+    position += len;
+  }
+} // namespace fabomatic::codec
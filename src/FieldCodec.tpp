@@ -0,0 +1,290 @@
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <string>
+
+#include "FieldCodec.hpp"
+
+namespace fabomatic::codec
+{
+  namespace detail
+  {
+    /// @brief Decimal digits of the longest value of an integer type, sign included
+    template <typename T>
+    constexpr auto maxDigits() -> size_t
+    {
+      return std::numeric_limits<T>::digits10 + 1 + (std::is_signed_v<T> ? 1 : 0);
+    }
+
+    /// @brief Quoted JSON string of up to len characters, all of them escaped
+    constexpr auto maxQuoted(size_t len) -> size_t
+    {
+      return 2 + 2 * len;
+    }
+
+    template <typename T>
+    using member_t = std::remove_cv_t<typename std::decay_t<T>::type>;
+
+    template <typename F>
+    constexpr auto selected(const F &field, uint8_t group) -> bool
+    {
+      return group == ALL_GROUPS || field.group == group;
+    }
+  } // namespace detail
+
+  template <>
+  struct Codec<bool>
+  {
+    static constexpr auto binarySize(size_t) -> size_t { return 1; };
+    static constexpr auto jsonSize(size_t, Format) -> size_t { return 5; };
+
+    static auto write(ByteWriter &out, const bool &value, size_t) -> void
+    {
+      const uint8_t byte = value ? 1 : 0;
+      out.put(&byte, 1);
+    }
+
+    static auto read(ByteReader &in, bool &value, size_t) -> void
+    {
+      uint8_t byte{0};
+      in.get(&byte, 1);
+      value = byte != 0;
+    }
+
+    template <size_t N>
+    static auto json(PayloadWriter<N> &out, std::string_view key, const bool &value, Format) -> void
+    {
+      out.field(key, value);
+    }
+  };
+
+  /// @brief Integers and enumerations, in the byte order of the board
+  template <typename T>
+  struct Codec<T, std::enable_if_t<(std::is_integral_v<T> && !std::is_same_v<T, bool>) || std::is_enum_v<T>>>
+  {
+    using value_t = std::conditional_t<std::is_enum_v<T>, std::underlying_type<T>, std::common_type<T>>;
+    using number_t = typename value_t::type;
+
+    static constexpr auto binarySize(size_t) -> size_t { return sizeof(T); };
+    static constexpr auto jsonSize(size_t, Format format) -> size_t
+    {
+      return format == Format::IPv4 ? sizeof("\"255.255.255.255\"") - 1 : detail::maxDigits<number_t>();
+    };
+
+    static auto write(ByteWriter &out, const T &value, size_t) -> void
+    {
+      out.put(&value, sizeof(T));
+    }
+
+    static auto read(ByteReader &in, T &value, size_t) -> void
+    {
+      in.get(&value, sizeof(T));
+    }
+
+    template <size_t N>
+    static auto json(PayloadWriter<N> &out, std::string_view key, const T &value, Format format) -> void
+    {
+      const auto number = static_cast<number_t>(value);
+      if constexpr (sizeof(number_t) == sizeof(uint32_t))
+      {
+        if (format == Format::IPv4)
+        {
+          const auto ip = static_cast<uint32_t>(number);
+          std::array<char, 16> text{};
+          const auto len = snprintf(text.data(), text.size(), "%u.%u.%u.%u",
+                                    static_cast<unsigned>(ip & 0xFF), static_cast<unsigned>((ip >> 8) & 0xFF),
+                                    static_cast<unsigned>((ip >> 16) & 0xFF), static_cast<unsigned>((ip >> 24) & 0xFF));
+          out.field(key, std::string_view{text.data(), static_cast<size_t>(len)});
+          return;
+        }
+      }
+      out.field(key, number);
+    }
+  };
+
+  /// @brief Durations, as their count
+  template <typename Rep, typename Period>
+  struct Codec<std::chrono::duration<Rep, Period>>
+  {
+    using duration_t = std::chrono::duration<Rep, Period>;
+
+    static constexpr auto binarySize(size_t) -> size_t { return sizeof(Rep); };
+    static constexpr auto jsonSize(size_t, Format) -> size_t { return detail::maxDigits<Rep>(); };
+
+    static auto write(ByteWriter &out, const duration_t &value, size_t) -> void
+    {
+      const auto count = value.count();
+      out.put(&count, sizeof(Rep));
+    }
+
+    static auto read(ByteReader &in, duration_t &value, size_t) -> void
+    {
+      Rep count{0};
+      in.get(&count, sizeof(Rep));
+      value = duration_t{count};
+    }
+
+    template <size_t N>
+    static auto json(PayloadWriter<N> &out, std::string_view key, const duration_t &value, Format) -> void
+    {
+      out.field(key, value);
+    }
+  };
+
+  /// @brief Strings of up to max_length (at most 255) characters, prefixed with their length
+  template <>
+  struct Codec<std::string>
+  {
+    static constexpr auto binarySize(size_t max_length) -> size_t { return 1 + max_length; };
+    static constexpr auto jsonSize(size_t max_length, Format) -> size_t { return detail::maxQuoted(max_length); };
+
+    static auto write(ByteWriter &out, const std::string &value, size_t max_length) -> void
+    {
+      if (value.size() > max_length)
+      {
+        out.fail();
+        return;
+      }
+      const auto len = static_cast<uint8_t>(value.size());
+      out.put(&len, 1);
+      out.put(value.data(), len);
+    }
+
+    static auto read(ByteReader &in, std::string &value, size_t max_length) -> void
+    {
+      uint8_t len{0};
+      in.get(&len, 1);
+      if (!in.ok() || len > max_length || len > in.remaining())
+      {
+        in.fail();
+        return;
+      }
+      value.resize(len);
+      in.get(value.data(), len);
+    }
+
+    template <size_t N>
+    static auto json(PayloadWriter<N> &out, std::string_view key, const std::string &value, Format) -> void
+    {
+      out.field(key, std::string_view{value});
+    }
+  };
+
+  /// @brief Fixed byte arrays, rendered as hex in JSON
+  template <size_t L>
+  struct Codec<std::array<uint8_t, L>>
+  {
+    static constexpr auto binarySize(size_t) -> size_t { return L; };
+    static constexpr auto jsonSize(size_t, Format format) -> size_t { return format == Format::Mac ? 1 + 3 * L : 2 + 2 * L; };
+
+    static auto write(ByteWriter &out, const std::array<uint8_t, L> &value, size_t) -> void
+    {
+      out.put(value.data(), L);
+    }
+
+    static auto read(ByteReader &in, std::array<uint8_t, L> &value, size_t) -> void
+    {
+      in.get(value.data(), L);
+    }
+
+    template <size_t N>
+    static auto json(PayloadWriter<N> &out, std::string_view key, const std::array<uint8_t, L> &value, Format format) -> void
+    {
+      std::array<char, 3 * L + 1> text{};
+      size_t len = 0;
+      for (const auto byte : value)
+      {
+        if (format == Format::Mac && len > 0)
+        {
+          text[len++] = ':';
+        }
+        len += snprintf(text.data() + len, text.size() - len, "%02x", byte);
+      }
+      out.field(key, std::string_view{text.data(), len});
+    }
+  };
+
+  /// @brief Types with a field table, nested as JSON objects. Fields can only be appended to the
+  /// table of the outermost type, the layout of nested types shall not change.
+  template <typename T>
+  struct Codec<T, std::enable_if_t<is_described<T>::value>>
+  {
+    static constexpr auto binarySize(size_t) -> size_t { return maxBinarySize<T>(); };
+    static constexpr auto jsonSize(size_t, Format) -> size_t { return maxJsonSize<T>(); };
+
+    static auto write(ByteWriter &out, const T &value, size_t) -> void
+    {
+      encode(out, value);
+    }
+
+    static auto read(ByteReader &in, T &value, size_t) -> void
+    {
+      if (!decode(in, value))
+      {
+        in.fail();
+      }
+    }
+
+    template <size_t N>
+    static auto json(PayloadWriter<N> &out, std::string_view key, const T &value, Format) -> void
+    {
+      out.beginObject(key);
+      writeJson(out, value);
+      out.endObject();
+    }
+  };
+
+  template <typename T>
+  constexpr auto maxBinarySize(uint8_t group) -> size_t
+  {
+    return std::apply([group](const auto &...fields)
+                      { return (size_t{0} + ... + (detail::selected(fields, group) ? Codec<detail::member_t<decltype(fields)>>::binarySize(fields.max_length) : 0)); },
+                      Fields<T>::fields);
+  }
+
+  template <typename T>
+  constexpr auto maxJsonSize() -> size_t
+  {
+    // Braces, and one separator less than fields. Names are never escaped.
+    return std::apply([](const auto &...fields)
+                      { return (size_t{1} + ... + (fields.name.size() + 4 +
+                                                   Codec<detail::member_t<decltype(fields)>>::jsonSize(fields.max_length, fields.format))); },
+                      Fields<T>::fields);
+  }
+
+  template <typename T>
+  auto encode(ByteWriter &out, const T &value, uint8_t group) -> void
+  {
+    std::apply([&out, &value, group](const auto &...fields)
+               { ((detail::selected(fields, group) ? Codec<detail::member_t<decltype(fields)>>::write(out, value.*(fields.member), fields.max_length) : void()), ...); },
+               Fields<T>::fields);
+  }
+
+  template <typename T>
+  auto decode(ByteReader &in, T &value, uint8_t group) -> bool
+  {
+    std::apply([&in, &value, group](const auto &...fields)
+               { ((detail::selected(fields, group) && in.ok() && in.remaining() > 0 ? Codec<detail::member_t<decltype(fields)>>::read(in, value.*(fields.member), fields.max_length) : void()), ...); },
+               Fields<T>::fields);
+    return in.ok();
+  }
+
+  template <typename T, size_t N>
+  auto writeJson(PayloadWriter<N> &out, const T &value) -> void
+  {
+    std::apply([&out, &value](const auto &...fields)
+               { (Codec<detail::member_t<decltype(fields)>>::json(out, fields.name, value.*(fields.member), fields.format), ...); },
+               Fields<T>::fields);
+  }
+
+  template <typename T>
+  auto toJson(const T &value) -> std::string
+  {
+    PayloadWriter<maxJsonSize<T>()> out;
+    out.beginObject();
+    writeJson(out, value);
+    out.endObject();
+    return std::string{out.view()};
+  }
+} // namespace fabomatic::codec
@@ -0,0 +1,27 @@
+#include <algorithm>
+#include <cstdint>
+
+#include "FixedString.hpp"
+
+namespace fabomatic
+{
+  template <size_t N>
+  auto FixedString<N>::assign(std::string_view value) -> void
+  {
+    length = std::min(value.size(), N);
+    // Do not cut a UTF-8 sequence in the middle
+    while (length < value.size() && length > 0 && (static_cast<uint8_t>(value[length]) & 0xC0) == 0x80)
+    {
+      length--;
+    }
+    value.copy(data.data(), length);
+    data[length] = '\0';
+  }
+
+  template <size_t N>
+  auto FixedString<N>::operator=(std::string_view value) -> FixedString &
+  {
+    assign(value);
+    return *this;
+  }
+} // namespace fabomatic
@@ -1,3 +1,6 @@
+#include <array>
+#include <cstdio>
+#include <cstdlib>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -17,75 +20,191 @@
 
 namespace fabomatic::ServerMQTT
 {
-  auto UserQuery::payload() const -> const std::string
+  auto queryTypeName(QueryType type) -> std::string_view
   {
-    std::stringstream ss{};
-    ss << "{\"action\":\"checkuser\","
-       << "\"uid\":\"" << card::uid_str(uid) << "\""
-       << "}";
-    return ss.str();
+    switch (type)
+    {
+    case QueryType::CheckUser:
+      return "checkuser";
+    case QueryType::CheckMachine:
+      return "checkmachine";
+    case QueryType::Alive:
+      return "alive";
+    case QueryType::ListUsers:
+      return "listusers";
+    case QueryType::CheckAndStart:
+      return "checkandstart";
+    case QueryType::StartUse:
+      return "startuse";
+    case QueryType::StopUse:
+      return "stopuse";
+    case QueryType::InUse:
+      return "inuse";
+    case QueryType::Maintenance:
+      return "maintenance";
+    case QueryType::Replay:
+      return "replay";
+    default:
+      return "unknown";
+    }
   }
 
-  auto MachineQuery::payload() const -> const std::string
+  auto toMsgPack(std::string_view json) -> std::string
   {
-    std::stringstream ss{};
-    ss << "{\"action\":\"checkmachine\""
-       << "}";
-    return ss.str();
+    JsonDocument json_doc;
+    if (deserializeJson(json_doc, json.data(), json.size()) != DeserializationError::Ok)
+    {
+      return "";
+    }
+    std::string result;
+    serializeMsgPack(json_doc, result);
+    return result;
   }
 
-  auto AliveQuery::payload() const -> const std::string
+  auto deserializePayload(JsonDocument &doc, const std::string &payload) -> DeserializationError
   {
-    std::stringstream ss{};
+    // A JSON object always starts with '{', a MessagePack map never does
+    if (!payload.empty() && payload.front() != '{')
+    {
+      return deserializeMsgPack(doc, payload);
+    }
+    return deserializeJson(doc, payload);
+  }
 
-    // Get MAC address
-    const auto serial = esp32::esp_serial();
+  auto deserializePayload(JsonDocument &doc, const std::string &payload, const JsonDocument &filter) -> DeserializationError
+  {
+    if (!payload.empty() && payload.front() != '{')
+    {
+      return deserializeMsgPack(doc, payload, DeserializationOption::Filter(filter));
+    }
+    return deserializeJson(doc, payload, DeserializationOption::Filter(filter));
+  }
 
-    ss << "{\"action\":\"alive\","
-       << "\"version\":\"" << FABOMATIC_BUILD << "," << GIT_VERSION << "\","
-       << "\"ip\":\"" << WiFi.localIP().toString() << "\","
-       << "\"serial\":\"" << serial << "\","
-       << "\"heap\":\"" << esp32::getFreeHeap() << "\""
-       << "}";
-    return ss.str();
+  namespace
+  {
+    /// @brief Returns the string value of a JSON member, empty if missing or not a string
+    auto stringOf(const JsonVariantConst &value) -> std::string_view
+    {
+      const auto *str = value.as<const char *>();
+      return str != nullptr ? std::string_view{str} : std::string_view{};
+    }
+
+    /// @brief Adds to a reply filter the members checked on every reply (see FabBackend::checkMachineVersion)
+    auto addCommonFilter(JsonDocument &filter) -> void
+    {
+      filter["request_ok"] = true;
+      filter["machine_version"] = true;
+      filter["machine"] = true;
+      filter["users_version"] = true;
+    }
+  } // namespace
+
+  auto Query::serialize(TxBuffer &out, uint32_t cid, WireFormat format) const -> bool
+  {
+    out.clear(format);
+    out.beginObject();
+    writeFields(out);
+    if (event_time != 0)
+    {
+      out.field("ts", event_time);
+    }
+    if (event_seq != 0)
+    {
+      out.field("seq", event_seq);
+    }
+    if (cid != 0)
+    {
+      out.field("cid", cid);
+    }
+    out.endObject();
+    return out.ok();
   }
 
-  auto StartUseQuery::payload() const -> const std::string
+  auto Query::payload() const -> const std::string
   {
-    std::stringstream ss{};
-    ss << "{\"action\":\"startuse\", "
-       << "\"uid\":\"" << card::uid_str(uid) << "\""
-       << "}";
-    return ss.str();
+    TxBuffer out;
+    if (!serialize(out))
+    {
+      return "";
+    }
+    return std::string{out.view()};
   }
 
-  auto StopUseQuery::payload() const -> const std::string
+  auto UserQuery::writeFields(TxBuffer &out) const -> void
   {
-    std::stringstream ss{};
-    ss << "{\"action\":\"stopuse\", "
-       << "\"uid\":\"" << card::uid_str(uid) << "\","
-       << "\"duration\":" << duration_s.count()
-       << "}";
-    return ss.str();
+    const auto uid_hex = card::uid_chars(uid);
+    out.field("action", "checkuser");
+    out.field("uid", std::string_view{uid_hex.data(), uid_hex.size()});
   }
 
-  auto InUseQuery::payload() const -> const std::string
+  auto MachineQuery::writeFields(TxBuffer &out) const -> void
   {
-    std::stringstream ss{};
-    ss << "{\"action\":\"inuse\", "
-       << "\"uid\":\"" << card::uid_str(uid) << "\","
-       << "\"duration\":" << duration_s.count()
-       << "}";
-    return ss.str();
+    out.field("action", "checkmachine");
   }
 
-  auto RegisterMaintenanceQuery::payload() const -> const std::string
+  auto AliveQuery::writeFields(TxBuffer &out) const -> void
   {
-    std::stringstream ss{};
-    ss << "{\"action\":\"maintenance\", "
-       << "\"uid\":\"" << card::uid_str(uid) << "\""
-       << "}";
-    return ss.str();
+    // Formatted on the stack, IPAddress::toString allocates
+    const auto ip = WiFi.localIP();
+    std::array<char, 16> ip_str{};
+    snprintf(ip_str.data(), ip_str.size(), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+
+    std::array<char, 12> heap_str{};
+    snprintf(heap_str.data(), heap_str.size(), "%lu", static_cast<unsigned long>(esp32::getFreeHeap()));
+
+    out.field("action", "alive");
+    out.field("version", FABOMATIC_BUILD "," GIT_VERSION);
+    out.field("ip", ip_str.data());
+    out.field("serial", esp32::esp_serial());
+    out.field("heap", heap_str.data());
+    if constexpr (conf::mqtt::MSGPACK_PAYLOAD)
+    {
+      out.field("msgpack", true);
+    }
+    out.members(telemetry);
+  }
+
+  auto UserListQuery::writeFields(TxBuffer &out) const -> void
+  {
+    out.field("action", "listusers");
+    out.field("page", page);
+  }
+
+  auto CheckAndStartQuery::writeFields(TxBuffer &out) const -> void
+  {
+    const auto uid_hex = card::uid_chars(uid);
+    out.field("action", "checkandstart");
+    out.field("uid", std::string_view{uid_hex.data(), uid_hex.size()});
+  }
+
+  auto StartUseQuery::writeFields(TxBuffer &out) const -> void
+  {
+    const auto uid_hex = card::uid_chars(uid);
+    out.field("action", "startuse");
+    out.field("uid", std::string_view{uid_hex.data(), uid_hex.size()});
+  }
+
+  auto StopUseQuery::writeFields(TxBuffer &out) const -> void
+  {
+    const auto uid_hex = card::uid_chars(uid);
+    out.field("action", "stopuse");
+    out.field("uid", std::string_view{uid_hex.data(), uid_hex.size()});
+    out.field("duration", duration_s);
+  }
+
+  auto InUseQuery::writeFields(TxBuffer &out) const -> void
+  {
+    const auto uid_hex = card::uid_chars(uid);
+    out.field("action", "inuse");
+    out.field("uid", std::string_view{uid_hex.data(), uid_hex.size()});
+    out.field("duration", duration_s);
+  }
+
+  auto RegisterMaintenanceQuery::writeFields(TxBuffer &out) const -> void
+  {
+    const auto uid_hex = card::uid_chars(uid);
+    out.field("action", "maintenance");
+    out.field("uid", std::string_view{uid_hex.data(), uid_hex.size()});
   }
 
   auto UserResponse::getResult() const -> UserResult
@@ -97,31 +216,66 @@ namespace fabomatic::ServerMQTT
   {
     auto response = std::make_unique<UserResponse>(doc["request_ok"].as<bool>());
     response->result = doc["is_valid"];
-    response->holder_name = doc["name"].as<std::string>();
+    response->holder_name = stringOf(doc["name"]);
     response->user_level = static_cast<FabUser::UserLevel>(doc["level"].as<int>());
 
     return response;
   }
 
+  auto UserResponse::jsonFilter() -> const JsonDocument &
+  {
+    static const auto filter = []()
+    {
+      JsonDocument f;
+      addCommonFilter(f);
+      f["is_valid"] = true;
+      f["name"] = true;
+      f["level"] = true;
+      return f;
+    }();
+    return filter;
+  }
+
   auto UserResponse::toString() const -> const std::string
   {
     std::stringstream ss{};
     ss << "UserResponse: "
        << "request_ok: " << request_ok << ", "
        << "result: " << static_cast<int>(result) << ", "
-       << "holder_name: " << holder_name << ", "
+       << "holder_name: " << holder_name.view() << ", "
        << "user_level: " << static_cast<int>(user_level);
     return ss.str();
   }
 
   auto MachineResponse::fromJson(JsonDocument &doc) -> std::unique_ptr<MachineResponse>
+  {
+    return fromJsonElement(doc.as<JsonVariantConst>());
+  }
+
+  auto MachineResponse::jsonFilter() -> const JsonDocument &
+  {
+    static const auto filter = []()
+    {
+      JsonDocument f;
+      addCommonFilter(f);
+      for (const auto *key : {"is_valid", "maintenance", "allowed", "logoff", "name", "type", "grace",
+                              "description", "users_version", "check_and_start", "msgpack", "summary"})
+      {
+        f[key] = true;
+      }
+      return f;
+    }();
+    return filter;
+  }
+
+  auto MachineResponse::fromJsonElement(const JsonVariantConst &doc) -> std::unique_ptr<MachineResponse>
   {
     auto response = std::make_unique<MachineResponse>(doc["request_ok"].as<bool>());
     response->is_valid = doc["is_valid"];
     response->maintenance = doc["maintenance"];
     response->allowed = doc["allowed"];
     response->logoff = doc["logoff"];
-    response->name = doc["name"].as<std::string>();
+    response->name = stringOf(doc["name"]);
     response->type = doc["type"];
     if (!doc["grace"].isNull())
     {
@@ -131,21 +285,110 @@ namespace fabomatic::ServerMQTT
     {
       response->grace = std::chrono::duration_cast<std::chrono::minutes>(conf::machine::DEFAULT_GRACE_PERIOD).count();
     }
-    if (!doc["description"].isNull())
+    response->description = stringOf(doc["description"]);
+    if (!doc["users_version"].isNull())
     {
-      response->description = doc["description"].as<std::string>();
+      response->users_version = doc["users_version"];
     }
-    else
+    if (!doc["machine_version"].isNull())
+    {
+      response->version = doc["machine_version"];
+    }
+    if (!doc["check_and_start"].isNull())
+    {
+      response->check_and_start = doc["check_and_start"];
+    }
+    if (!doc["msgpack"].isNull())
+    {
+      response->msgpack = doc["msgpack"];
+    }
+    if (!doc["summary"].isNull())
     {
-      response->description = "";
+      response->summary = doc["summary"];
     }
 
     return response;
   }
 
+  auto CheckAndStartResponse::fromJson(JsonDocument &doc) -> std::unique_ptr<CheckAndStartResponse>
+  {
+    auto response = std::make_unique<CheckAndStartResponse>(doc["request_ok"].as<bool>());
+    // Older backends reply without the "started" field
+    response->supported = !doc["started"].isNull();
+    response->started = doc["started"];
+    response->user = UserResponse::fromJson(doc);
+    if (!doc["machine"].isNull())
+    {
+      response->machine = MachineResponse::fromJsonElement(doc["machine"]);
+    }
+
+    return response;
+  }
+
+  auto CheckAndStartResponse::jsonFilter() -> const JsonDocument &
+  {
+    static const auto filter = []()
+    {
+      JsonDocument f{UserResponse::jsonFilter()};
+      f["started"] = true;
+      return f;
+    }();
+    return filter;
+  }
+
+  auto UserListResponse::fromJson(JsonDocument &doc) -> std::unique_ptr<UserListResponse>
+  {
+    auto response = std::make_unique<UserListResponse>(doc["request_ok"].as<bool>());
+    response->page = doc["page"];
+    response->pages = doc["pages"];
+    response->version = doc["version"];
+
+    // Each user is a compact array [uid, level, name], name is optional
+    for (const auto &elem : doc["users"].as<JsonArray>())
+    {
+      const auto uid_str = elem[0].as<std::string>();
+      const auto uid = static_cast<card::uid_t>(std::strtoull(uid_str.c_str(), nullptr, 16));
+      const auto level = static_cast<FabUser::UserLevel>(elem[1].as<int>());
+      if (uid == card::INVALID || level == FabUser::UserLevel::Unknown)
+      {
+        continue;
+      }
+      const auto name = elem[2].isNull() ? uid_str : elem[2].as<std::string>();
+      response->users.emplace_back(uid, name, true, level);
+    }
+
+    return response;
+  }
+
+  auto UserListResponse::jsonFilter() -> const JsonDocument &
+  {
+    static const auto filter = []()
+    {
+      JsonDocument f;
+      addCommonFilter(f);
+      f["page"] = true;
+      f["pages"] = true;
+      f["version"] = true;
+      f["users"] = true;
+      return f;
+    }();
+    return filter;
+  }
+
   auto SimpleResponse::fromJson(JsonDocument &doc) -> std::unique_ptr<SimpleResponse>
   {
     auto response = std::make_unique<SimpleResponse>(doc["request_ok"].as<bool>());
     return response;
   }
+
+  auto SimpleResponse::jsonFilter() -> const JsonDocument &
+  {
+    static const auto filter = []()
+    {
+      JsonDocument f;
+      addCommonFilter(f);
+      return f;
+    }();
+    return filter;
+  }
 } // namespace fabomatic::ServerMQTT
\ No newline at end of file
@@ -175,11 +175,17 @@ namespace fabomatic
     String payload = value ? conf::default_config::mqtt_switch_on_message.data() : conf::default_config::mqtt_switch_on_message.data();
 
     auto retries = 0;
-    while (!mqtt_server.publish(topic, payload, false))
+    while (!mqtt_server.publish(topic, payload))
     {
       ESP_LOGE(TAG, "Error while publishing %s to %s", payload.c_str(), topic.c_str());
 
-      mqtt_server.connect();
+      // Retrying cannot help until reconnected, and would stall the board logic
+      if (!mqtt_server.isOnline())
+      {
+        ESP_LOGW(TAG, "MQTT server offline, switch not set");
+        return;
+      }
+
       Tasks::delay(conf::mqtt::TIMEOUT_REPLY_SERVER);
       retries++;
       if (retries > conf::mqtt::MAX_TRIES)
@@ -44,8 +44,17 @@ namespace fabomatic
   // Starts the WiFi and possibly open the config portal in a blocking manner
   /// @param force_reset if true, the portal will be reset to factory defaults
   /// @param disable_portal if true, the portal will be disabled (useful at boot-time)
+  /// @note At runtime, the MQTT I/O task is stopped while the portal drives the WiFi, and restarted after it unless a reboot is pending.
   void openConfigPortal(bool force_reset, bool disable_portal)
   {
+    auto &server = Board::logic.getServer();
+    const auto restart_io = server.isIoTaskRunning();
+    if (restart_io)
+    {
+      server.stopIoTask();
+      server.disconnect();
+    }
+
     WiFiManager wifiManager;
     auto config = getConfig(force_reset);
 
@@ -127,6 +136,12 @@ namespace fabomatic
       // WiFi settings change may require full reboot
       Board::logic.setRebootRequest(true);
     }
+
+    // The connection state machine reconnects with its own WiFi settings
+    if (restart_io && !Board::logic.getRebootRequest() && !server.startIoTask())
+    {
+      ESP_LOGW(TAG, "MQTT client will run in the main loop");
+    }
   }
 
   void OTAComplete()
@@ -139,7 +154,10 @@ namespace fabomatic
   {
     ArduinoOTA.setHostname(Board::logic.getHostname().c_str());
     ArduinoOTA.onStart([]()
-                       { Board::logic.changeStatus(Status::OTAStarting); });
+                       {
+                         // Pending state is written before the update, the board reboots afterwards
+                         Board::logic.persist();
+                         Board::logic.changeStatus(Status::OTAStarting); });
     ArduinoOTA.onEnd(OTAComplete);
     ArduinoOTA.onError([](ota_error_t error)
                        { Board::logic.changeStatus(Status::OTAError); });
@@ -0,0 +1,313 @@
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#include "PayloadWriter.hpp"
+
+namespace fabomatic
+{
+  namespace detail
+  {
+    template <typename T>
+    struct is_duration : std::false_type
+    {
+    };
+
+    template <typename Rep, typename Period>
+    struct is_duration<std::chrono::duration<Rep, Period>> : std::true_type
+    {
+    };
+  } // namespace detail
+
+  template <size_t N>
+  auto PayloadWriter<N>::append(std::string_view text) -> void
+  {
+    if (failed || length + text.size() > N)
+    {
+      failed = true;
+      return;
+    }
+    text.copy(data.data() + length, text.size());
+    length += text.size();
+    data[length] = '\0';
+  }
+
+  template <size_t N>
+  auto PayloadWriter<N>::append(char c) -> void
+  {
+    append(std::string_view{&c, 1});
+  }
+
+  /// @brief Appends a quoted JSON string, escaping quotes and backslashes
+  template <size_t N>
+  auto PayloadWriter<N>::appendString(std::string_view value) -> void
+  {
+    append('"');
+    while (!value.empty())
+    {
+      const auto pos = value.find_first_of("\"\\");
+      append(value.substr(0, pos));
+      if (pos == std::string_view::npos)
+      {
+        break;
+      }
+      append('\\');
+      append(value[pos]);
+      value.remove_prefix(pos + 1);
+    }
+    append('"');
+  }
+
+  /// @brief Appends a MessagePack type byte followed by the value in big-endian order
+  template <size_t N>
+  auto PayloadWriter<N>::appendPacked(uint8_t type, uint64_t value, size_t bytes) -> void
+  {
+    std::array<char, 9> packed{static_cast<char>(type)};
+    for (size_t i = 0; i < bytes; i++)
+    {
+      packed[1 + i] = static_cast<char>(value >> (8 * (bytes - 1 - i)));
+    }
+    append(std::string_view{packed.data(), bytes + 1});
+  }
+
+  /// @brief Appends a MessagePack string, with the shortest header
+  template <size_t N>
+  auto PayloadWriter<N>::appendPackedString(std::string_view value) -> void
+  {
+    if (value.size() < 32)
+    {
+      append(static_cast<char>(0xa0 | value.size())); // fixstr
+    }
+    else if (value.size() <= UINT8_MAX)
+    {
+      appendPacked(0xd9, value.size(), 1);
+    }
+    else
+    {
+      appendPacked(0xda, value.size(), 2); // Longer than any payload
+    }
+    append(value);
+  }
+
+  /// @brief Appends a MessagePack integer, with the shortest encoding
+  template <size_t N>
+  template <typename T>
+  auto PayloadWriter<N>::appendPackedInteger(T value) -> void
+  {
+    if constexpr (std::is_signed_v<T>)
+    {
+      if (value < 0)
+      {
+        const auto number = static_cast<int64_t>(value);
+        if (number >= -32)
+        {
+          append(static_cast<char>(number)); // negative fixint
+        }
+        else if (number >= std::numeric_limits<int8_t>::min())
+        {
+          appendPacked(0xd0, static_cast<uint64_t>(number), 1);
+        }
+        else if (number >= std::numeric_limits<int16_t>::min())
+        {
+          appendPacked(0xd1, static_cast<uint64_t>(number), 2);
+        }
+        else if (number >= std::numeric_limits<int32_t>::min())
+        {
+          appendPacked(0xd2, static_cast<uint64_t>(number), 4);
+        }
+        else
+        {
+          appendPacked(0xd3, static_cast<uint64_t>(number), 8);
+        }
+        return;
+      }
+    }
+
+    const auto number = static_cast<uint64_t>(value);
+    if (number < 0x80)
+    {
+      append(static_cast<char>(number)); // positive fixint
+    }
+    else if (number <= UINT8_MAX)
+    {
+      appendPacked(0xcc, number, 1);
+    }
+    else if (number <= UINT16_MAX)
+    {
+      appendPacked(0xcd, number, 2);
+    }
+    else if (number <= UINT32_MAX)
+    {
+      appendPacked(0xce, number, 4);
+    }
+    else
+    {
+      appendPacked(0xcf, number, 8);
+    }
+  }
+
+  template <size_t N>
+  auto PayloadWriter<N>::appendKey(std::string_view key) -> void
+  {
+    if (encoding == PayloadFormat::MsgPack)
+    {
+      if (depth == 0)
+      {
+        failed = true; // Members only exist in a map
+        return;
+      }
+      map_sizes[depth - 1]++;
+      appendPackedString(key);
+      return;
+    }
+
+    if (!first_field)
+    {
+      append(',');
+    }
+    first_field = false;
+    appendString(key);
+    append(':');
+  }
+
+  template <size_t N>
+  auto PayloadWriter<N>::clear(PayloadFormat format) -> void
+  {
+    length = 0;
+    failed = false;
+    first_field = true;
+    encoding = format;
+    depth = 0;
+    data[0] = '\0';
+  }
+
+  template <size_t N>
+  auto PayloadWriter<N>::assign(std::string_view content) -> void
+  {
+    clear();
+    append(content);
+  }
+
+  template <size_t N>
+  auto PayloadWriter<N>::beginObject() -> void
+  {
+    if (encoding == PayloadFormat::MsgPack)
+    {
+      if (depth == MAX_DEPTH)
+      {
+        failed = true;
+        return;
+      }
+      // map16 header, the number of members is known at endObject()
+      map_offsets[depth] = length;
+      map_sizes[depth] = 0;
+      depth++;
+      appendPacked(0xde, 0, 2);
+      return;
+    }
+
+    append('{');
+    first_field = true;
+  }
+
+  template <size_t N>
+  auto PayloadWriter<N>::beginObject(std::string_view key) -> void
+  {
+    appendKey(key);
+    beginObject();
+  }
+
+  template <size_t N>
+  auto PayloadWriter<N>::endObject() -> void
+  {
+    if (encoding == PayloadFormat::MsgPack)
+    {
+      if (depth == 0)
+      {
+        failed = true;
+        return;
+      }
+      depth--;
+      if (!failed)
+      {
+        data[map_offsets[depth] + 1] = static_cast<char>(map_sizes[depth] >> 8);
+        data[map_offsets[depth] + 2] = static_cast<char>(map_sizes[depth]);
+      }
+      return;
+    }
+
+    append('}');
+    first_field = false;
+  }
+
+  template <size_t N>
+  template <typename T>
+  auto PayloadWriter<N>::field(std::string_view key, const T &value) -> void
+  {
+    appendKey(key);
+    if (encoding == PayloadFormat::MsgPack)
+    {
+      if constexpr (std::is_same_v<T, bool>)
+      {
+        append(static_cast<char>(value ? 0xc3 : 0xc2));
+      }
+      else if constexpr (detail::is_duration<T>::value)
+      {
+        appendPackedInteger(value.count());
+      }
+      else if constexpr (std::is_integral_v<T>)
+      {
+        appendPackedInteger(value);
+      }
+      else
+      {
+        appendPackedString(std::string_view{value});
+      }
+      return;
+    }
+
+    if constexpr (std::is_same_v<T, bool>)
+    {
+      append(value ? std::string_view{"true"} : std::string_view{"false"});
+    }
+    else if constexpr (std::is_integral_v<T> || detail::is_duration<T>::value)
+    {
+      std::array<char, 24> digits{};
+      const auto number = [&value]()
+      {
+        if constexpr (detail::is_duration<T>::value)
+          return value.count();
+        else
+          return value;
+      }();
+      const auto [end, ec] = std::to_chars(digits.data(), digits.data() + digits.size(), number);
+      append(std::string_view{digits.data(), static_cast<size_t>(end - digits.data())});
+    }
+    else
+    {
+      appendString(std::string_view{value});
+    }
+  }
+
+  template <size_t N>
+  auto PayloadWriter<N>::members(std::string_view json_members) -> void
+  {
+    if (json_members.empty())
+    {
+      return;
+    }
+    if (encoding == PayloadFormat::MsgPack)
+    {
+      failed = true;
+      return;
+    }
+    if (!first_field)
+    {
+      append(',');
+    }
+    first_field = false;
+    append(json_members);
+  }
+} // namespace fabomatic
@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <cstring>
+
+#include "Logging.hpp"
+#include "ReplyArena.hpp"
+
+namespace fabomatic
+{
+  // Each block is preceded by a header holding its size, keeping the payload aligned
+  static constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+  static_assert(HEADER_SIZE >= sizeof(size_t), "Block header too small");
+
+  /**
+   * @brief Gets the size requested for a block.
+   *
+   * @param ptr The block, as returned by allocate.
+   * @return The block size in bytes.
+   */
+  auto ReplyArena::blockSize(const void *ptr) const -> size_t
+  {
+    size_t size;
+    std::memcpy(&size, static_cast<const uint8_t *>(ptr) - HEADER_SIZE, sizeof(size));
+    return size;
+  }
+
+  /**
+   * @brief Checks if a block is the last allocated one, which can be freed or grown in place.
+   */
+  auto ReplyArena::isLast(const void *ptr) const -> bool
+  {
+    return last != NO_BLOCK && ptr == memory.data() + last + HEADER_SIZE;
+  }
+
+  /**
+   * @brief Allocates a block after the previous ones.
+   *
+   * @param size The block size in bytes.
+   * @return The block, nullptr if the arena is exhausted.
+   */
+  auto ReplyArena::allocate(size_t size) -> void *
+  {
+    const auto needed = HEADER_SIZE + aligned(size);
+    if (needed > memory.size() - used)
+    {
+      failures++;
+      ESP_LOGW("ReplyArena", "Reply arena exhausted (%u bytes used, %u requested)", used, size);
+      return nullptr;
+    }
+
+    std::memcpy(memory.data() + used, &size, sizeof(size));
+    last = used;
+    used += needed;
+    peak = std::max(peak, used);
+    return memory.data() + last + HEADER_SIZE;
+  }
+
+  /**
+   * @brief Frees a block. Only the last block gives its memory back, until reset().
+   *
+   * @param ptr The block, as returned by allocate.
+   */
+  auto ReplyArena::deallocate(void *ptr) -> void
+  {
+    if (ptr != nullptr && isLast(ptr))
+    {
+      used = last;
+      last = NO_BLOCK;
+    }
+  }
+
+  /**
+   * @brief Resizes a block, in place if it is the last one or if it shrinks.
+   *
+   * @param ptr The block, as returned by allocate, or nullptr.
+   * @param new_size The new size in bytes.
+   * @return The resized block, nullptr if the arena is exhausted (ptr is then left untouched).
+   */
+  auto ReplyArena::reallocate(void *ptr, size_t new_size) -> void *
+  {
+    if (ptr == nullptr)
+    {
+      return allocate(new_size);
+    }
+
+    const auto old_size = blockSize(ptr);
+    if (isLast(ptr))
+    {
+      const auto needed = HEADER_SIZE + aligned(new_size);
+      if (needed > memory.size() - last)
+      {
+        failures++;
+        return nullptr;
+      }
+      std::memcpy(memory.data() + last, &new_size, sizeof(new_size));
+      used = last + needed;
+      peak = std::max(peak, used);
+      return ptr;
+    }
+
+    if (new_size <= old_size)
+    {
+      return ptr;
+    }
+
+    auto *block = allocate(new_size);
+    if (block != nullptr)
+    {
+      std::memcpy(block, ptr, old_size);
+    }
+    return block;
+  }
+
+  auto ReplyArena::reset() -> void
+  {
+    used = 0;
+    last = NO_BLOCK;
+  }
+} // namespace fabomatic
@@ -0,0 +1,59 @@
+#include "RttEstimator.hpp"
+
+#include <algorithm>
+
+namespace fabomatic
+{
+  auto RttEstimator::clamp(milliseconds timeout) -> milliseconds
+  {
+    return std::clamp<milliseconds>(timeout, conf::mqtt::TIMEOUT_REPLY_MIN, conf::mqtt::TIMEOUT_REPLY_MAX);
+  }
+
+  auto RttEstimator::addSample(milliseconds rtt) -> void
+  {
+    if (samples == 0)
+    {
+      srtt = rtt;
+      rttvar = rtt / 2;
+    }
+    else
+    {
+      // RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, SRTT = 7/8 SRTT + 1/8 R
+      const auto delta = srtt > rtt ? srtt - rtt : rtt - srtt;
+      rttvar = (rttvar * 3 + delta) / 4;
+      srtt = (srtt * 7 + rtt) / 8;
+    }
+    samples++;
+    rto = clamp(srtt + rttvar * 4);
+  }
+
+  auto RttEstimator::backoff() -> void
+  {
+    rto = clamp(rto * 2);
+  }
+
+  auto RttEstimator::getTimeout(uint8_t attempt) const -> milliseconds
+  {
+    auto timeout = rto;
+    for (auto i = 0; i < attempt && timeout < conf::mqtt::TIMEOUT_REPLY_MAX; i++)
+    {
+      timeout *= 2;
+    }
+    return clamp(timeout);
+  }
+
+  auto RttEstimator::getSmoothedRtt() const -> milliseconds
+  {
+    return srtt;
+  }
+
+  auto RttEstimator::getRttVariance() const -> milliseconds
+  {
+    return rttvar;
+  }
+
+  auto RttEstimator::getSamples() const -> uint32_t
+  {
+    return samples;
+  }
+} // namespace fabomatic
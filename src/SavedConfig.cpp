@@ -1,9 +1,13 @@
 #include <optional>
 #include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <mutex>
 
 #include <ArduinoJson.h>
 #include <EEPROM.h>
+#include <Preferences.h>
+#include <esp_rom_crc.h>
 
 #include "Logging.hpp"
 #include "SavedConfig.hpp"
@@ -13,8 +17,45 @@
 namespace fabomatic
 {
   // Define the static variables
-  std::string SavedConfig::json_buffer;
   std::mutex SavedConfig::buffer_mutex;
+  std::optional<SavedConfig> SavedConfig::resident;
+  bool SavedConfig::resident_loaded{false};
+  std::array<SavedConfig::SlotState, static_cast<size_t>(SavedConfig::Section::Count)> SavedConfig::slots;
+  std::optional<SavedConfig> SavedConfig::pending;
+
+  namespace
+  {
+    auto sectionName(SavedConfig::Section section) -> std::string_view
+    {
+      switch (section)
+      {
+      case SavedConfig::Section::Settings:
+        return "settings";
+      case SavedConfig::Section::Counters:
+        return "counters";
+      case SavedConfig::Section::Network:
+        return "network";
+      case SavedConfig::Section::Count:
+        break;
+      }
+      return "";
+    }
+  } // namespace
+
+  constexpr auto SavedConfig::maxSlotSize() -> size_t
+  {
+    size_t size = 0;
+    for (uint8_t section = 0; section < static_cast<uint8_t>(Section::Count); section++)
+    {
+      size = std::max(size, codec::maxBinarySize<SavedConfig>(section));
+    }
+    return sizeof(SlotHeader) + size;
+  }
+
+  auto SavedConfig::slotKey(Section section, uint8_t slot) -> std::string
+  {
+    return std::string{sectionName(section)} + (slot == 0 ? "_a" : "_b");
+  }
 
   auto SavedConfig::setMachineID(MachineID id) -> void
   {
@@ -49,32 +90,129 @@ namespace fabomatic
     return config;
   }
 
-  auto SavedConfig::LoadFromEEPROM() -> std::optional<SavedConfig>
+  auto SavedConfig::readSection(Preferences &prefs, Section section, SavedConfig &config) -> bool
   {
-    std::lock_guard<std::mutex> lock(SavedConfig::buffer_mutex);
-    SavedConfig::json_buffer.resize(JSON_DOC_SIZE);
-    std::fill(SavedConfig::json_buffer.begin(), SavedConfig::json_buffer.begin() + SavedConfig::json_buffer.size(), '\0');
+    auto &state = slots[static_cast<size_t>(section)];
+    std::array<uint8_t, maxSlotSize()> buffer{};
+    std::optional<SavedConfig> newest;
+    SlotState newest_state{};
 
-    if (!EEPROM.begin(JSON_DOC_SIZE))
+    for (uint8_t slot = 0; slot < 2; slot++)
+    {
+      const auto key = slotKey(section, slot);
+      if (!prefs.isKey(key.c_str()))
+        continue;
+
+      SlotHeader header{};
+      const auto len = prefs.getBytes(key.c_str(), buffer.data(), buffer.size());
+      if (len >= sizeof(header))
+      {
+        std::memcpy(&header, buffer.data(), sizeof(header));
+      }
+      const auto expected_crc = header.crc;
+      header.crc = 0;
+      if (len < sizeof(header) || header.length != len - sizeof(header) ||
+          header.version == 0 || header.version > MAGIC_NUMBER ||
+          expected_crc != esp_rom_crc32_le(esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&header), sizeof(header)),
+                                           buffer.data() + sizeof(header), header.length))
+      {
+        ESP_LOGW(TAG, "SavedConfig: ignoring invalid slot %s", key.c_str());
+        continue;
+      }
+      if (newest && header.seq <= newest_state.seq)
+        continue;
+
+      auto candidate = config;
+      codec::ByteReader in{buffer.data() + sizeof(header), header.length};
+      if (!codec::decode(in, candidate, static_cast<uint8_t>(section)))
+      {
+        ESP_LOGW(TAG, "SavedConfig: ignoring undecodable slot %s", key.c_str());
+        continue;
+      }
+      if (section == Section::Settings)
+      {
+        candidate.magic_number = header.version;
+      }
+      newest = std::move(candidate);
+      newest_state = {header.seq, slot};
+    }
+
+    if (!newest)
+    {
+      return false;
+    }
+    config = std::move(newest.value());
+    state = newest_state;
+    return true;
+  }
+
+  auto SavedConfig::readFlash() -> std::optional<SavedConfig>
+  {
+    const auto start = std::chrono::system_clock::now();
+    slots.fill(SlotState{});
+
+    Preferences prefs;
+    // Namespace is created on first write, open read-write to avoid NOT_FOUND errors on a blank NVS
+    if (!prefs.begin(NVS_NAMESPACE, false))
+    {
+      ESP_LOGE(TAG, "SavedConfig::readFlash() : NVS begin failed");
+      return std::nullopt;
+    }
+
+    SavedConfig config;
+    Sections found;
+    for (uint8_t section = 0; section < static_cast<uint8_t>(Section::Count); section++)
+    {
+      found[section] = readSection(prefs, static_cast<Section>(section), config);
+    }
+    prefs.end();
+
+    if (found.none())
+    {
+      // Settings of older firmwares, moved to NVS on the next save
+      return readEEPROM();
+    }
+    if (!found[static_cast<size_t>(Section::Settings)])
+    {
+      ESP_LOGW(TAG, "Failed to load settings from NVS");
+      return std::nullopt;
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - start);
+    ESP_LOGI(TAG, "Loaded settings (version 0x%02x, sections %s) in %lld us", config.magic_number, found.to_string().c_str(), elapsed.count());
+    return config;
+  }
+
+  auto SavedConfig::readEEPROM() -> std::optional<SavedConfig>
+  {
+    const auto start = std::chrono::system_clock::now();
+    if (!EEPROM.begin(EEPROM_SIZE))
     {
       ESP_LOGE(TAG, "SavedConfig::LoadFromEEPROM() : EEPROM.begin failed");
       return std::nullopt;
     }
 
-    for (auto i = 0; i < SavedConfig::json_buffer.size(); i++)
+    // EEPROM.begin reads the whole image in RAM, decode it in place
+    const auto *data = EEPROM.getDataPtr();
+    if (data == nullptr)
     {
-      char c = EEPROM.readChar(i);
-      SavedConfig::json_buffer.at(i) = c;
-      if (c == '\0')
-      {
-        break;
-      }
+      ESP_LOGE(TAG, "SavedConfig::LoadFromEEPROM() : EEPROM not available");
+      return std::nullopt;
     }
 
-    auto reply = fromJsonDocument(SavedConfig::json_buffer);
+    std::optional<SavedConfig> reply;
+    if (data[0] == '{')
+    {
+      const auto *text = reinterpret_cast<const char *>(data);
+      reply = fromJsonDocument(std::string_view{text, strnlen(text, EEPROM_SIZE)});
+    }
+    else
+    {
+      reply = fromBinary(data, EEPROM_SIZE);
+    }
     if (!reply.has_value())
     {
-      ESP_LOGW(TAG, "Failed to load config from EEPROM");
+      ESP_LOGW(TAG, "No settings found in EEPROM");
       return std::nullopt;
     }
     if (reply.value().magic_number > MAGIC_NUMBER)
@@ -82,46 +220,78 @@ namespace fabomatic
       ESP_LOGW(TAG, "Found different more recent settings version in EEPROM (%d vs. %d), ignoring.", reply.value().magic_number, MAGIC_NUMBER);
       return std::nullopt;
     }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - start);
+    ESP_LOGI(TAG, "Loaded settings (version 0x%02x) from EEPROM in %lld us", reply.value().magic_number, elapsed.count());
     return reply.value();
   }
 
-  auto SavedConfig::toJsonDocument() const -> JsonDocument
+  auto SavedConfig::fromBinary(const uint8_t *data, size_t size) -> std::optional<SavedConfig>
   {
-    JsonDocument doc;
-    magic_number = MAGIC_NUMBER;
-    doc["disablePortal"] = disablePortal;
-    doc["bootCount"] = bootCount;
-    doc["ssid"] = ssid;
-    doc["password"] = password;
-    doc["mqtt_server"] = mqtt_server;
-    doc["mqtt_user"] = mqtt_user;
-    doc["mqtt_password"] = mqtt_password;
-    doc["mqtt_switch_topic"] = mqtt_switch_topic;
-    doc["machine_id"] = machine_id;
-    doc["magic_number"] = magic_number;
-    auto json_elem = doc.createNestedArray("cached_cards");
-    for (auto idx = 0; idx < cachedRfid.size(); idx++)
-    {
-      const auto &entry = cachedRfid[idx];
-      if (entry.uid != 0) // Skip empty entries
-      {
-        auto obj = json_elem.createNestedObject();
-        obj["uid"] = entry.uid;
-        obj["level"] = static_cast<uint8_t>(entry.level);
-      }
+    BinaryHeader header{};
+    std::memcpy(&header, data, sizeof(header));
+    if (header.marker != BINARY_MARKER || header.length > size - sizeof(header))
+    {
+      ESP_LOGW(TAG, "fromBinary() : no settings found");
+      return std::nullopt;
     }
 
-    message_buffer.toJson(doc, "message_buffer");
+    SavedConfig config;
+    config.magic_number = header.version;
+    codec::ByteReader in{data + sizeof(header), header.length};
+    if (!codec::decode(in, config))
+    {
+      ESP_LOGE(TAG, "fromBinary() : invalid settings (%u bytes)", header.length);
+      return std::nullopt;
+    }
+    return config;
+  }
 
-    return doc;
+  auto SavedConfig::LoadFromEEPROM() -> std::optional<SavedConfig>
+  {
+    std::lock_guard<std::mutex> lock(SavedConfig::buffer_mutex);
+    if (!resident_loaded)
+    {
+      resident = readFlash();
+      resident_loaded = true;
+    }
+    return pending ? pending : resident;
+  }
+
+  auto SavedConfig::ReloadFromEEPROM() -> std::optional<SavedConfig>
+  {
+    std::lock_guard<std::mutex> lock(SavedConfig::buffer_mutex);
+    resident = readFlash();
+    resident_loaded = true;
+    pending.reset();
+    return resident;
   }
 
-  auto SavedConfig::fromJsonDocument(const std::string &json_text) -> std::optional<SavedConfig>
+  auto SavedConfig::changedSections(const SavedConfig &other) const -> Sections
+  {
+    Sections changed;
+    changed[static_cast<size_t>(Section::Settings)] = magic_number != other.magic_number ||
+                                                      ssid != other.ssid ||
+                                                      password != other.password ||
+                                                      mqtt_server != other.mqtt_server ||
+                                                      mqtt_user != other.mqtt_user ||
+                                                      mqtt_password != other.mqtt_password ||
+                                                      mqtt_switch_topic != other.mqtt_switch_topic ||
+                                                      machine_id != other.machine_id ||
+                                                      disablePortal != other.disablePortal ||
+                                                      legacy_buffer != other.legacy_buffer;
+    changed[static_cast<size_t>(Section::Counters)] = bootCount != other.bootCount;
+    changed[static_cast<size_t>(Section::Network)] = wifi_lease != other.wifi_lease ||
+                                                     broker_address != other.broker_address;
+    return changed;
+  }
+
+  auto SavedConfig::fromJsonDocument(std::string_view json_text) -> std::optional<SavedConfig>
   {
     SavedConfig config;
     JsonDocument doc;
 
-    const auto result = deserializeJson(doc, json_text);
+    const auto result = deserializeJson(doc, json_text.data(), json_text.size());
     if (result != DeserializationError::Ok)
     {
       ESP_LOGE(TAG, "fromJsonDocument() : deserializeJson failed with code %s", result.c_str());
@@ -140,90 +310,189 @@ namespace fabomatic
     config.machine_id = doc["machine_id"].as<std::string>();
     config.magic_number = doc["magic_number"];
 
-    auto idx = 0;
-    for (const auto &elem : doc["cached_cards"].as<JsonArray>())
+    // Buffered messages are now kept in their own log, see FabBackend::loadBuffer
+    if (config.magic_number == 0x51 && doc["message_buffer"]["VERSION"].as<unsigned int>() == 1)
     {
-      const auto level = static_cast<FabUser::UserLevel>(elem["level"].as<uint8_t>());
-      config.cachedRfid.set_at(idx, elem["uid"], level);
-      idx++;
+      for (const auto &elem : doc["message_buffer"]["messages"].as<JsonArrayConst>())
+      {
+        // Only usage events were buffered, on the machine topic
+        if (const auto msg = BufferedMsg::fromPayload(elem["msg"].as<std::string>()); msg)
+        {
+          config.legacy_buffer.push_back(msg.value());
+        }
+      }
     }
 
-    while (idx < conf::rfid_tags::CACHE_LEN)
+    // Optional, a full WiFi scan will be done if missing
+    auto lease = doc["wifi_lease"];
+    config.wifi_lease = WiFiLease::fromJsonElement(lease).value_or(WiFiLease{});
+
+    // Optional, the broker name will be resolved if missing
+    auto address = doc["broker_address"];
+    config.broker_address = BrokerAddress::fromJsonElement(address).value_or(BrokerAddress{});
+
+    ESP_LOGD(TAG, "fromJsonDocument() : data deserialized successfully");
+
+    return config;
+  }
+
+  auto SavedConfig::writeSection(Preferences &prefs, Section section) const -> bool
+  {
+    auto &state = slots[static_cast<size_t>(section)];
+    std::array<uint8_t, maxSlotSize()> buffer{};
+
+    // Encoded in place after the header, without intermediate buffer
+    codec::ByteWriter out{buffer.data() + sizeof(SlotHeader), buffer.size() - sizeof(SlotHeader)};
+    codec::encode(out, *this, static_cast<uint8_t>(section));
+    if (!out.ok())
     {
-      config.cachedRfid.set_at(idx, card::INVALID, FabUser::UserLevel::Unknown);
-      idx++;
+      return false;
     }
 
-    if (config.magic_number >= 0x51)
+    SlotHeader header{state.seq + 1, 0, static_cast<uint16_t>(out.size()), MAGIC_NUMBER, 0};
+    header.crc = esp_rom_crc32_le(esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&header), sizeof(header)),
+                                  buffer.data() + sizeof(header), header.length);
+    std::memcpy(buffer.data(), &header, sizeof(header));
+
+    // The newest slot is kept intact until the other one is fully written
+    const uint8_t slot = state.slot == 0 ? 1 : 0;
+    const auto key = slotKey(section, slot);
+    const auto length = sizeof(header) + header.length;
+    if (prefs.putBytes(key.c_str(), buffer.data(), length) != length)
     {
-      auto mb = doc["message_buffer"];
-      auto loaded = Buffer::fromJsonElement(mb);
-      if (loaded)
-      {
-        config.message_buffer = loaded.value();
-      }
+      ESP_LOGE(TAG, "SavedConfig: failed to write %s", key.c_str());
+      return false;
     }
 
-    ESP_LOGD(TAG, "fromJsonDocument() : data deserialized successfully");
-
-    return config;
+    state = {header.seq, slot};
+    ESP_LOGD(TAG, "SavedConfig: %s written (%u bytes, seq %lu)", key.c_str(), length, header.seq);
+    return true;
   }
 
   auto SavedConfig::SaveToEEPROM() const -> bool
   {
     std::lock_guard<std::mutex> lock(SavedConfig::buffer_mutex);
-    json_buffer.resize(JSON_DOC_SIZE);
-    std::fill(SavedConfig::json_buffer.begin(), SavedConfig::json_buffer.begin() + SavedConfig::json_buffer.size(), '\0');
+    const auto result = commit();
+    if (result)
+    {
+      pending.reset();
+    }
+    return result;
+  }
+
+  auto SavedConfig::Update(const std::function<void(SavedConfig &)> &change) -> void
+  {
+    std::lock_guard<std::mutex> lock(SavedConfig::buffer_mutex);
+    if (!pending)
+    {
+      if (!resident_loaded)
+      {
+        resident = readFlash();
+        resident_loaded = true;
+      }
+      pending = resident.value_or(DefaultConfig());
+    }
+    change(pending.value());
+  }
 
-    if (!EEPROM.begin(JSON_DOC_SIZE))
+  auto SavedConfig::Flush() -> bool
+  {
+    std::lock_guard<std::mutex> lock(SavedConfig::buffer_mutex);
+    if (!pending)
+    {
+      return true;
+    }
+    if (!pending.value().commit())
     {
-      ESP_LOGE(TAG, "SavedConfig::SaveToEEPROM() : EEPROM.begin failed");
       return false;
     }
+    pending.reset();
+    return true;
+  }
+
+  auto SavedConfig::HasPendingChanges() -> bool
+  {
+    std::lock_guard<std::mutex> lock(SavedConfig::buffer_mutex);
+    return pending.has_value();
+  }
+
+  auto SavedConfig::commit() const -> bool
+  {
+    magic_number = MAGIC_NUMBER;
+
+    // The slots in use are known once the flash has been read
+    if (!resident_loaded)
+    {
+      resident = readFlash();
+      resident_loaded = true;
+    }
+
+    // Only the sections which changed, or not yet in NVS, are written
+    auto changed = resident ? changedSections(resident.value()) : Sections{}.set();
+    for (uint8_t section = 0; section < static_cast<uint8_t>(Section::Count); section++)
+    {
+      changed[section] = changed[section] || slots[section].seq == 0;
+    }
+    if (changed.none())
+    {
+      ESP_LOGD(TAG, "Settings unchanged, commit skipped");
+      return true;
+    }
 
-    const auto &doc = toJsonDocument();
-    serializeJson(doc, SavedConfig::json_buffer);
+    static_assert(maxSlotSize() - sizeof(SlotHeader) <= UINT16_MAX, "SavedConfig section length does not fit in the header");
 
-    json_buffer.resize(JSON_DOC_SIZE); // Ensure the buffer is the correct size as serialize may have resized it
+    // Strings longer than their field are rejected before touching the flash
+    codec::ByteWriter measure{nullptr, codec::maxBinarySize<SavedConfig>()};
+    codec::encode(measure, *this);
+    if (!measure.ok())
+    {
+      ESP_LOGE(TAG, "SavedConfig::commit() : a setting is too long, see codec::Fields<SavedConfig>");
+      return false;
+    }
 
-    for (auto i = 0; i < JSON_DOC_SIZE; i++)
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, false))
     {
-      const char c = SavedConfig::json_buffer[i];
-      EEPROM.writeChar(i, c);
-      if (c == '\0')
+      ESP_LOGE(TAG, "SavedConfig::commit() : NVS begin failed");
+      return false;
+    }
+
+    auto result = true;
+    for (uint8_t section = 0; section < static_cast<uint8_t>(Section::Count) && result; section++)
+    {
+      if (changed[section])
       {
-        break;
+        result = writeSection(prefs, static_cast<Section>(section));
       }
     }
-
-    auto result = EEPROM.commit();
+    prefs.end();
 
     if (result)
     {
-      ESP_LOGD(TAG, "EEPROM commit success");
+      ESP_LOGD(TAG, "Settings commit success (sections %s changed)", changed.to_string().c_str());
+      resident = *this;
+      resident_loaded = true;
       return result;
     }
 
-    ESP_LOGE(TAG, "EEPROM commit failure");
+    // The flash contents are unknown, read them again on next load
+    resident.reset();
+    resident_loaded = false;
+
+    ESP_LOGE(TAG, "Settings commit failure");
     return false;
   }
 
   auto SavedConfig::toString() const -> const std::string
   {
-    const auto &doc = toJsonDocument();
-    std::string result;
-    serializeJsonPretty(doc, result);
-    return result;
+    return codec::toJson(*this);
   }
 
   auto SavedConfig::IncrementBootCount() -> size_t
   {
-    auto config = LoadFromEEPROM().value_or(DefaultConfig());
-    config.bootCount++;
-    if (!config.SaveToEEPROM())
-    {
-      ESP_LOGE(TAG, "Failed to save boot count to EEPROM");
-    }
-    return config.bootCount;
+    size_t count = 0;
+    Update([&count](SavedConfig &config)
+           { count = ++config.bootCount; });
+    return count;
   }
 } // namespace fabomatic
@@ -0,0 +1,86 @@
+#include "SpscQueue.hpp"
+
+namespace fabomatic
+{
+  template <typename T, size_t N>
+  auto SpscQueue<T, N>::push(T &&item) -> bool
+  {
+    const auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N)
+    {
+      return false;
+    }
+
+    slots[t & (N - 1)] = std::move(item);
+    tail.store(t + 1, std::memory_order_release); // Publishes the slot content to the consumer
+    return true;
+  }
+
+  template <typename T, size_t N>
+  auto SpscQueue<T, N>::pop() -> std::optional<T>
+  {
+    const auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+    {
+      return std::nullopt;
+    }
+
+    std::optional<T> item{std::move(slots[h & (N - 1)])};
+    head.store(h + 1, std::memory_order_release); // Gives the slot back to the producer
+    return item;
+  }
+
+  template <typename T, size_t N>
+  auto SpscQueue<T, N>::acquire() -> T *
+  {
+    const auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N)
+    {
+      return nullptr;
+    }
+    return &slots[t & (N - 1)];
+  }
+
+  template <typename T, size_t N>
+  auto SpscQueue<T, N>::commit() -> void
+  {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  template <typename T, size_t N>
+  auto SpscQueue<T, N>::front() -> T *
+  {
+    const auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+    {
+      return nullptr;
+    }
+    return &slots[h & (N - 1)];
+  }
+
+  template <typename T, size_t N>
+  auto SpscQueue<T, N>::release() -> void
+  {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  template <typename T, size_t N>
+  auto SpscQueue<T, N>::empty() const -> bool
+  {
+    return size() == 0;
+  }
+
+  template <typename T, size_t N>
+  auto SpscQueue<T, N>::size() const -> size_t
+  {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+  }
+
+  template <typename T, size_t N>
+  auto SpscQueue<T, N>::clear() -> void
+  {
+    while (pop().has_value())
+    {
+    }
+  }
+} // namespace fabomatic
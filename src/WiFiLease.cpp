@@ -0,0 +1,60 @@
+#include "WiFiLease.hpp"
+
+#include <cstdio>
+#include <string>
+
+#include "Logging.hpp"
+
+namespace fabomatic
+{
+  namespace
+  {
+    auto ipFromString(const std::string &text) -> std::optional<uint32_t>
+    {
+      unsigned a, b, c, d;
+      if (sscanf(text.c_str(), "%u.%u.%u.%u", &a, &b, &c, &d) != 4 || a > 255 || b > 255 || c > 255 || d > 255)
+      {
+        return std::nullopt;
+      }
+      return a | (b << 8) | (c << 16) | (d << 24);
+    }
+  } // namespace
+
+  auto WiFiLease::fromJsonElement(const JsonObject &json_obj) -> std::optional<WiFiLease>
+  {
+    if (json_obj.isNull())
+    {
+      return std::nullopt;
+    }
+
+    WiFiLease lease;
+    unsigned b[6];
+    const auto bssid_str = json_obj["bssid"].as<std::string>();
+    if (sscanf(bssid_str.c_str(), "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+    {
+      ESP_LOGW(TAG, "Invalid BSSID in saved WiFi lease: %s", bssid_str.c_str());
+      return std::nullopt;
+    }
+    for (auto i = 0U; i < lease.bssid.size(); i++)
+    {
+      lease.bssid[i] = static_cast<uint8_t>(b[i]);
+    }
+
+    lease.channel = json_obj["channel"];
+    const auto ip = ipFromString(json_obj["ip"].as<std::string>());
+    const auto gateway = ipFromString(json_obj["gateway"].as<std::string>());
+    const auto subnet = ipFromString(json_obj["subnet"].as<std::string>());
+    const auto dns = ipFromString(json_obj["dns"].as<std::string>());
+    if (!ip || !gateway || !subnet || !dns)
+    {
+      ESP_LOGW(TAG, "Invalid address in saved WiFi lease");
+      return std::nullopt;
+    }
+    lease.ip = ip.value();
+    lease.gateway = gateway.value();
+    lease.subnet = subnet.value();
+    lease.dns = dns.value();
+
+    return lease.isValid() ? std::optional{lease} : std::nullopt;
+  }
+} // namespace fabomatic
@@ -38,28 +38,11 @@ namespace fabomatic
     extern BoardLogic logic;
   } // namespace Board
 
-  /// @brief Opens WiFi and server connection and updates board state accordingly
+  /// @brief Refreshes the machine state from the server and reports the ongoing usage, if online
   void taskConnect()
   {
     auto &server = Board::logic.getServer();
 
-    if (!server.isOnline())
-    {
-      // connection to wifi
-      Board::logic.changeStatus(Status::Connecting);
-
-      // Try to connect
-      server.connect();
-      // Refresh after connection
-      Board::logic.changeStatus(server.isOnline() ? Status::Connected : Status::Offline);
-
-      if (server.isOnline())
-      {
-        // Briefly show to the user
-        Tasks::delay(conf::lcd::SHORT_MESSAGE_DELAY);
-      }
-    }
-
     if (server.isOnline())
     {
       ESP_LOGI(TAG, "taskConnect - online, calling refreshFromServer");
@@ -67,13 +50,16 @@ namespace fabomatic
       Board::logic.refreshFromServer();
       if (auto &machine = Board::logic.getMachine(); !machine.isFree())
       {
-        const auto response = Board::logic.getServer().inUse(
+        Board::logic.getServer().inUseAsync(
             machine.getActiveUser().card_uid,
-            machine.getUsageDuration());
-        if (!response)
-        {
-          ESP_LOGE(TAG, "taskConnect - inUse failed");
-        }
+            machine.getUsageDuration(),
+            [](std::unique_ptr<ServerMQTT::SimpleResponse> response)
+            {
+              if (!response->request_ok)
+              {
+                ESP_LOGE(TAG, "taskConnect - inUse failed");
+              }
+            });
       }
     }
   }
@@ -112,6 +98,7 @@ namespace fabomatic
       if (Board::logic.getMachine().getPowerState() == Machine::PowerState::PoweredOff)
       {
         ESP_LOGI(TAG, "Rebooting as per request");
+        Board::logic.persist();
         esp32::restart();
       }
     }
@@ -171,13 +158,21 @@ namespace fabomatic
     }
   }
 
-  /// @brief sends the MQTT alive message
+  /// @brief Processes the messages received by the MQTT I/O task and the reply timeouts
   void taskMQTTClientLoop()
   {
     auto &server = Board::logic.getServer();
-    if (server.isOnline())
+    const auto was_online = server.isOnline();
+
+    if (server.loop())
     {
-      server.loop();
+      // Apply machine configuration pushed by the backend without waiting for taskConnect
+      Board::logic.processMachineUpdate();
+    }
+
+    if (server.isOnline() != was_online)
+    {
+      Board::logic.changeStatus(server.isOnline() ? Status::Connected : Status::Offline);
     }
   }
 
@@ -194,14 +189,10 @@ namespace fabomatic
       }
     }
 
-    if (!Board::logic.saveRfidCache())
+    // State changed since the last period is written to flash in one pass
+    if (!Board::logic.persist())
     {
-      ESP_LOGE(TAG, "taskIsAlive - saveRfidCache failed");
-    }
-
-    if (!server.saveBuffer())
-    {
-      ESP_LOGE(TAG, "Failure to save buffered MQTT messages");
+      ESP_LOGE(TAG, "taskIsAlive - persist failed");
     }
 
     if constexpr (conf::debug::ENABLE_LOGS)
@@ -309,7 +300,7 @@ namespace fabomatic
   Task t_wdg("Watchdog", conf::tasks::WATCHDOG_PERIOD, &taskEspWatchdog, Board::scheduler, false);
   const Task t_test("Selftest", conf::tasks::RFID_SELFTEST_PERIOD, &taskRfidWatchdog, Board::scheduler, true);
   const Task t_warn("PoweroffWarning", conf::machine::DELAY_BETWEEN_BEEPS, &taskPoweroffWarning, Board::scheduler, true);
-  const Task t_mqtt("MQTT client loop", 1s, &taskMQTTClientLoop, Board::scheduler, true);
+  const Task t_mqtt("MQTT client loop", conf::tasks::MQTT_EVENTS_PERIOD, &taskMQTTClientLoop, Board::scheduler, true);
   const Task t_led("LED", 1s, &taskBlink, Board::scheduler, true);
   const Task t_rst("FactoryReset", 500ms, &taskFactoryReset, Board::scheduler, pins.buttons.factory_defaults_pin != NO_PIN);
   const Task t_alive("IsAlive", conf::tasks::MQTT_ALIVE_PERIOD, &taskIsAlive, Board::scheduler, true, conf::tasks::MQTT_ALIVE_PERIOD);
@@ -368,17 +359,42 @@ namespace fabomatic
     std::cout << "\tRFID_CHECK_PERIOD: " << std::chrono::milliseconds(tasks::RFID_CHECK_PERIOD).count() << "ms" << '\n';
     std::cout << "\tRFID_SELFTEST_PERIOD: " << std::chrono::seconds(tasks::RFID_SELFTEST_PERIOD).count() << "s" << '\n';
     std::cout << "\tMQTT_REFRESH_PERIOD: " << std::chrono::seconds(tasks::MQTT_REFRESH_PERIOD).count() << "s" << '\n';
+    std::cout << "\tMACHINE_POLL_PERIOD: " << std::chrono::seconds(tasks::MACHINE_POLL_PERIOD).count() << "s" << '\n';
     std::cout << "\tWATCHDOG_TIMEOUT: " << std::chrono::seconds(tasks::WATCHDOG_TIMEOUT).count() << "s" << '\n';
     std::cout << "\tWATCHDOG_PERIOD: " << std::chrono::seconds(tasks::WATCHDOG_PERIOD).count() << "s" << '\n';
     std::cout << "\tPORTAL_CONFIG_TIMEOUT: " << std::chrono::seconds(tasks::PORTAL_CONFIG_TIMEOUT).count() << "s" << '\n';
     std::cout << "\tMQTT_ALIVE_PERIOD: " << std::chrono::seconds(tasks::MQTT_ALIVE_PERIOD).count() << "s" << '\n';
+    std::cout << "\tMQTT_IO_PERIOD: " << std::chrono::milliseconds(tasks::MQTT_IO_PERIOD).count() << "ms" << '\n';
+    std::cout << "\tMQTT_EVENTS_PERIOD: " << std::chrono::milliseconds(tasks::MQTT_EVENTS_PERIOD).count() << "ms" << '\n';
     // namespace conf::mqtt
     std::cout << "MQTT settings:" << '\n';
     std::cout << "\ttopic: " << mqtt::topic << '\n';
     std::cout << "\tresponse_topic: " << mqtt::response_topic << '\n';
+    std::cout << "\tconfig_topic: " << mqtt::config_topic << '\n';
+    std::cout << "\tmsgpack_topic: " << mqtt::msgpack_topic << '\n';
+    std::cout << "\tMSGPACK_PAYLOAD: " << mqtt::MSGPACK_PAYLOAD << '\n';
+    std::cout << "\tMAX_MSG_SIZE: " << mqtt::MAX_MSG_SIZE << '\n';
+    std::cout << "\tREPLY_ARENA_SIZE: " << mqtt::REPLY_ARENA_SIZE << '\n';
     std::cout << "\tMAX_TRIES: " << mqtt::MAX_TRIES << '\n';
     std::cout << "\tTIMEOUT_REPLY_SERVER: " << std::chrono::milliseconds(mqtt::TIMEOUT_REPLY_SERVER).count() << "ms" << '\n';
+    std::cout << "\tTIMEOUT_REPLY_MIN: " << std::chrono::milliseconds(mqtt::TIMEOUT_REPLY_MIN).count() << "ms" << '\n';
+    std::cout << "\tTIMEOUT_REPLY_MAX: " << std::chrono::milliseconds(mqtt::TIMEOUT_REPLY_MAX).count() << "ms" << '\n';
+    std::cout << "\tWIFI_CONNECT_TIMEOUT: " << std::chrono::milliseconds(mqtt::WIFI_CONNECT_TIMEOUT).count() << "ms" << '\n';
+    std::cout << "\tWIFI_FAST_CONNECT_TIMEOUT: " << std::chrono::milliseconds(mqtt::WIFI_FAST_CONNECT_TIMEOUT).count() << "ms" << '\n';
+    std::cout << "\tBROKER_ADDRESS_TTL: " << std::chrono::seconds(mqtt::BROKER_ADDRESS_TTL).count() << "s" << '\n';
+    std::cout << "\tPERSISTENT_SESSION: " << mqtt::PERSISTENT_SESSION << '\n';
+    std::cout << "\tQOS_BACKEND: " << mqtt::QOS_BACKEND << '\n';
+    std::cout << "\tBREAKER_FAILURE_THRESHOLD: " << mqtt::BREAKER_FAILURE_THRESHOLD << '\n';
+    std::cout << "\tBREAKER_OPEN_PERIOD: " << std::chrono::seconds(mqtt::BREAKER_OPEN_PERIOD).count() << "s" << '\n';
     std::cout << "\tPORT_NUMBER: " << mqtt::PORT_NUMBER << '\n';
+    // namespace conf::buffer
+    std::cout << "Buffer settings:" << '\n';
+    std::cout << "\tPARTITION_LABEL: " << buffer::PARTITION_LABEL << '\n';
+    std::cout << "\tRAM_LOG_SIZE: " << buffer::RAM_LOG_SIZE << '\n';
+    std::cout << "\tREPLAY_WINDOW: " << buffer::REPLAY_WINDOW << '\n';
+    std::cout << "NTP settings:" << '\n';
+    std::cout << "\tSERVER: " << ntp::SERVER << '\n';
+    std::cout << "\tSYNC_PERIOD: " << std::chrono::minutes(ntp::SYNC_PERIOD).count() << "min" << '\n';
     // Now dump all pins.hpp settings
     std::cout << "Hardware settings:" << '\n';
     std::cout << "\tLED:" << '\n';
@@ -488,8 +504,19 @@ void setup()
   // Since the WiFiManager may have taken minutes, recompute the tasks schedule
   scheduler.updateSchedules();
 
-  // Try to connect immediately
+  // Try to connect immediately, then the connection is maintained by the MQTT I/O task
+  logic.changeStatus(fabomatic::BoardLogic::Status::Connecting);
+  logic.getServer().connect();
+  logic.changeStatus(logic.getServer().isOnline() ? fabomatic::BoardLogic::Status::Connected : fabomatic::BoardLogic::Status::Offline);
   fabomatic::taskConnect();
+
+  // Boot count, migrated settings and the network state of the first connection are written together
+  logic.persist();
+
+  if (!logic.getServer().startIoTask())
+  {
+    ESP_LOGW(TAG, "MQTT client will run in the main loop");
+  }
 }
 
 void loop()
@@ -1,5 +1,6 @@
 #include "mock/MockMQTTBroker.hpp"
 #include "Logging.hpp"
+#include "MQTTtypes.hpp"
 #include "conf.hpp"
 #include "secrets.hpp"
 
@@ -8,6 +9,12 @@
 // TAG for logging purposes
 static const char *const TAG2 = "MockMQTTBroker";
 
+// Machine state, shared by checkmachine and checkandstart replies
+static constexpr const char *MACHINE_REPLY = "{\"request_ok\":true,\"is_valid\":true,\"allowed\":true,\"maintenance\":false,\"logoff\":30,\"name\":\"ENDER_1\",\"type\":1,\"description\":\"\",\"users_version\":1,\"check_and_start\":true,\"msgpack\":true,\"machine_version\":1}";
+
+// Reply to queries without specific data, machine state version is piggybacked
+static constexpr const char *SIMPLE_REPLY = "{\"request_ok\":true,\"machine_version\":1}";
+
 namespace fabomatic
 {
   /**
@@ -62,8 +69,21 @@ namespace fabomatic
       topic = e->Topic();
       payload = e->Payload();
 
+      // MessagePack queries are handed over as JSON to the reply callback, and answered in MessagePack
+      const auto msgpack = topic.size() > conf::mqtt::msgpack_topic.size() &&
+                           topic.compare(topic.size() - conf::mqtt::msgpack_topic.size(), std::string::npos, conf::mqtt::msgpack_topic) == 0;
+      if (msgpack)
+      {
+        JsonDocument doc;
+        payload.clear();
+        if (ServerMQTT::deserializePayload(doc, e->Payload()) == DeserializationError::Ok)
+        {
+          serializeJson(doc, payload);
+        }
+      }
+
       ESP_LOGI(TAG2, "MQTT BROKER: Received  %s -> %s", topic.c_str(), payload.c_str());
-      queries.push({topic, payload, topic + "/reply"});
+      queries.push({topic, payload, topic + "/reply", msgpack});
     }
     break;
     case RemoveClient_sMQTTEventType:
@@ -111,6 +131,37 @@ namespace fabomatic
     return is_running;
   }
 
+  /**
+   * @brief Builds the user fields of the checkuser reply.
+   *
+   * @param uid_str The card UID as sent by FabBackend.
+   * @return The JSON fields is_valid, level and name, without braces.
+   */
+  auto MockMQTTBroker::userFields(const std::string &uid_str) const -> const std::string
+  {
+    // Check if the uid is present in the secrets::cards::whitelist
+    const auto elem = std::find_if(secrets::cards::whitelist.begin(), secrets::cards::whitelist.end(),
+                                   [&uid_str](const auto &elem)
+                                   {
+                                     const auto &[id, level, name] = elem;
+                                     return card::uid_str(id) == uid_str;
+                                   });
+    std::stringstream ss;
+    if (elem != secrets::cards::whitelist.end())
+    {
+      const auto &[id, level, name] = *elem;
+      ss << "\"is_valid\":" << (level != FabUser::UserLevel::Unknown ? "true" : "false")
+         << ",\"level\":" << +static_cast<uint8_t>(level)
+         << ",\"name\":\"" << name << "\"";
+      return ss.str();
+    }
+
+    // Still return a valid user
+    ss << "\"is_valid\":true,\"level\":" << +2
+       << ",\"name\":\"User" << uid_str << "\"";
+    return ss.str();
+  }
+
   /**
    * @brief Provides fake server replies for testing purposes.
    *
@@ -121,56 +172,77 @@ namespace fabomatic
   {
     if (query.find("checkmachine") != std::string::npos)
     {
-      return "{\"request_ok\":true,\"is_valid\":true,\"allowed\":true,\"maintenance\":false,\"logoff\":30,\"name\":\"ENDER_1\",\"type\":1,\"description\":\"\"}";
+      return MACHINE_REPLY;
+    }
+
+    if (query.find("listusers") != std::string::npos)
+    {
+      // Pages of 4 users, to exercise the paging logic
+      constexpr auto PAGE_SIZE = 4U;
+      constexpr auto NB_PAGES = (secrets::cards::whitelist.size() + PAGE_SIZE - 1) / PAGE_SIZE;
+      JsonDocument doc;
+      if (deserializeJson(doc, query) != DeserializationError::Ok)
+      {
+        return "{\"request_ok\":false}";
+      }
+      const auto page = doc["page"].as<size_t>();
+      std::stringstream ss;
+      ss << "{\"request_ok\":true,\"version\":1,\"page\":" << page << ",\"pages\":" << NB_PAGES << ",\"users\":[";
+      for (auto idx = page * PAGE_SIZE; idx < std::min((page + 1) * PAGE_SIZE, secrets::cards::whitelist.size()); idx++)
+      {
+        const auto &[id, level, name] = secrets::cards::whitelist[idx];
+        ss << (idx == page * PAGE_SIZE ? "" : ",")
+           << "[\"" << card::uid_str(id) << "\"," << +static_cast<uint8_t>(level) << ",\"" << name << "\"]";
+      }
+      ss << "]}";
+      return ss.str();
     }
 
     if (query.find("maintenance") != std::string::npos)
     {
-      return "{\"request_ok\":true}";
+      return SIMPLE_REPLY;
     }
 
     if (query.find("startuse") != std::string::npos)
     {
-      return "{\"request_ok\":true}";
+      return SIMPLE_REPLY;
     }
 
     if (query.find("inuse") != std::string::npos)
     {
-      return "{\"request_ok\":true}";
+      return SIMPLE_REPLY;
     }
 
     if (query.find("stopuse") != std::string::npos)
     {
-      return "{\"request_ok\":true}";
+      return SIMPLE_REPLY;
     }
 
-    if (query.find("checkuser") != std::string::npos)
+    if (query.find("checkandstart") != std::string::npos)
     {
       JsonDocument doc;
       if (deserializeJson(doc, query) == DeserializationError::Ok && doc.containsKey("uid"))
       {
-        const auto uid_str = doc["uid"].as<std::string>();
-        // Check if the uid is present in the secrets::cards::whitelist
-        const auto elem = std::find_if(secrets::cards::whitelist.begin(), secrets::cards::whitelist.end(),
-                                       [&uid_str](const auto &elem)
-                                       {
-                                         const auto &[id, level, name] = elem;
-                                         return card::uid_str(id) == uid_str;
-                                       });
-        if (elem != secrets::cards::whitelist.end())
-        {
-          std::stringstream ss;
-          const auto &[id, level, name] = *elem;
-          ss << "{\"request_ok\":true,\"is_valid\":" << (level != FabUser::UserLevel::Unknown ? "true" : "false")
-             << ",\"level\":" << +static_cast<uint8_t>(level)
-             << ",\"name\":\"" << name << "\"}";
-          return ss.str();
-        }
+        const auto user = userFields(doc["uid"].as<std::string>());
+        std::stringstream ss;
+        // Machine is always allowed and without maintenance, so usage starts for valid users
+        ss << "{\"request_ok\":true," << user
+           << ",\"started\":" << (user.find("\"is_valid\":true") != std::string::npos ? "true" : "false")
+           << ",\"machine\":" << MACHINE_REPLY << "}";
+        return ss.str();
+      }
+
+      ESP_LOGE(TAG2, "Failed to parse checkandstart query");
+      return "{\"request_ok\":false}";
+    }
 
-        // Still return a valid user
+    if (query.find("checkuser") != std::string::npos)
+    {
+      JsonDocument doc;
+      if (deserializeJson(doc, query) == DeserializationError::Ok && doc.containsKey("uid"))
+      {
         std::stringstream ss;
-        ss << "{\"request_ok\":true,\"is_valid\":true,\"level\":" << +2
-           << ",\"name\":\"User" << uid_str << "\"}";
+        ss << "{\"request_ok\":true,\"machine_version\":1," << userFields(doc["uid"].as<std::string>()) << "}";
         return ss.str();
       }
 
@@ -188,7 +260,7 @@ namespace fabomatic
       return "";
     }
 
-    return std::string{"{\"request_ok\":true}"};
+    return std::string{SIMPLE_REPLY};
   }
 
   /**
@@ -202,6 +274,18 @@ namespace fabomatic
     this->callback = callback;
   }
 
+  /**
+   * @brief Queues a retained message, published by the broker thread in processQueries.
+   *
+   * @param topic The topic to publish to.
+   * @param payload The message content.
+   */
+  auto MockMQTTBroker::pushRetained(const std::string &topic, const std::string &payload) -> void
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    retained.push({topic, payload});
+  }
+
   /**
    * @brief Processes pending MQTT queries.
    *
@@ -214,17 +298,37 @@ namespace fabomatic
   {
     std::lock_guard<std::mutex> lock(mutex);
 
+    while (!retained.empty())
+    {
+      const auto [retained_topic, retained_payload] = retained.front();
+      retained.pop();
+      ESP_LOGI(TAG2, "MQTT BROKER: Retaining %s -> %s", retained_topic.c_str(), retained_payload.c_str());
+      publish(retained_topic, retained_payload, 0, true);
+    }
+
     if (!queries.empty())
     {
       std::string response{""};
-      const auto [topic, query, reply_topic] = queries.front();
+      const auto [topic, query, reply_topic, msgpack] = queries.front();
       queries.pop();
       response = callback(topic, query);
 
+      // Echo the correlation id like the backend does
+      JsonDocument filter;
+      filter["cid"] = true;
+      JsonDocument cid_doc;
+      if (const auto pos = response.rfind('}');
+          pos != std::string::npos &&
+          !deserializeJson(cid_doc, query, DeserializationOption::Filter(filter)) &&
+          !cid_doc["cid"].isNull())
+      {
+        response.insert(pos, ",\"cid\":" + std::to_string(cid_doc["cid"].as<uint32_t>()));
+      }
+
       if (!response.empty())
       {
         ESP_LOGI(TAG2, "MQTT BROKER: Sending %s -> %s", reply_topic.c_str(), response.c_str());
-        publish(reply_topic, response);
+        publish(reply_topic, msgpack ? ServerMQTT::toMsgPack(response) : response);
       }
     }
     return queries.size();
@@ -1,15 +1,18 @@
 #include <atomic>
 #include <chrono>
 #include <functional>
+#include <memory>
 #include <pthread.h>
 #include <string>
 #include <vector>
 
 #include "BoardLogic.hpp"
+#include "CardCacheStore.hpp"
 #include "Espressif.hpp"
 #include "FabBackend.hpp"
 #include "LCDWrapper.hpp"
 #include "RFIDWrapper.hpp"
+#include "RttEstimator.hpp"
 #include "SavedConfig.hpp"
 #include "Tasks.hpp"
 #include "conf.hpp"
@@ -70,7 +73,7 @@ namespace fabomatic::tests
       result = server.registerMaintenance(uid);
       TEST_ASSERT_FALSE_MESSAGE(result->request_ok, "(6) Request should have failed");
     }
-    // Should have generated 5 * 10 = 50 messages, truncated to 40.
+    // Should have generated 5 * 10 = 50 messages.
 
     TEST_ASSERT_TRUE_MESSAGE(server.hasBufferedMsg(), "There are pending messages");
     TEST_ASSERT_TRUE_MESSAGE(server.saveBuffer(), "Saving pending messages works");
@@ -88,7 +91,8 @@ namespace fabomatic::tests
 
     TEST_ASSERT_TRUE_MESSAGE(server.alive(), "Alive request works");
 
-    // Since old messages must be sent first, the buffer shall be empty now
+    // The backlog is replayed in the background, live queries do not wait for it
+    TEST_ASSERT_TRUE_MESSAGE(server.transmitBuffer(), "Buffered messages replayed");
     TEST_ASSERT_FALSE_MESSAGE(server.hasBufferedMsg(), "There are no more pending messages");
 
     TEST_ASSERT_TRUE_MESSAGE(server.saveBuffer(), "Saving pending messages works");
@@ -209,7 +213,7 @@ namespace fabomatic::tests
     TEST_ASSERT_TRUE_MESSAGE(auth.saveCache(), "AuthProvider saveCache failed");
 
     // Test that the cache contains all the valid whitelist entries
-    auto cached_entries = SavedConfig::LoadFromEEPROM().value().cachedRfid;
+    auto cached_entries = CardCacheStore().load();
     for (const auto &[uid, level, name] : secrets::cards::whitelist)
     {
       const auto &cached_card = cached_entries.find_uid(uid);
@@ -218,6 +222,640 @@ namespace fabomatic::tests
     }
   }
 
+  void test_prefetch_users()
+  {
+    auto &server = logic.getServer();
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+
+    const auto machine_resp = server.checkMachine();
+    TEST_ASSERT_TRUE_MESSAGE(machine_resp->request_ok, "Server checkMachine request failed");
+    TEST_ASSERT_NOT_EQUAL_MESSAGE(0, machine_resp->users_version, "Backend does not announce users list version");
+
+    AuthProvider auth(secrets::cards::whitelist);
+    TEST_ASSERT_TRUE_MESSAGE(auth.prefetchUsers(server, machine_resp->users_version), "Prefetch of users failed");
+    TEST_ASSERT_EQUAL_MESSAGE(machine_resp->users_version, auth.getPrefetchVersion(), "Prefetch version mismatch");
+
+    const auto nb_valid = std::count_if(secrets::cards::whitelist.cbegin(), secrets::cards::whitelist.cend(),
+                                        [](const auto &elem)
+                                        { return std::get<1>(elem) != FabUser::UserLevel::Unknown; });
+    TEST_ASSERT_EQUAL_MESSAGE(nb_valid, auth.getPrefetchCount(), "Not all pages have been prefetched");
+
+    // Background prefetch, driven by the reply callbacks in loop()
+    AuthProvider async_auth(secrets::cards::whitelist);
+    TEST_ASSERT_TRUE_MESSAGE(async_auth.startPrefetch(server, machine_resp->users_version), "Background prefetch not started");
+    const auto start = std::chrono::system_clock::now();
+    while (async_auth.isPrefetching() && std::chrono::system_clock::now() - start < 10s)
+    {
+      server.loop();
+      delay(25);
+    }
+    TEST_ASSERT_FALSE_MESSAGE(async_auth.isPrefetching(), "Background prefetch not completed");
+    TEST_ASSERT_EQUAL_MESSAGE(machine_resp->users_version, async_auth.getPrefetchVersion(), "Background prefetch version mismatch");
+    TEST_ASSERT_EQUAL_MESSAGE(nb_valid, async_auth.getPrefetchCount(), "Not all pages have been prefetched in background");
+
+    // A users-only change is announced with any reply, the machine state being unchanged
+    const auto new_version = machine_resp->users_version + 1;
+    broker.configureReplies([new_version](const std::string &topic, const std::string &query)
+                            {
+                              auto reply = broker.defaultReplies(query);
+                              if (query.find("checkuser") != std::string::npos)
+                                reply.insert(reply.rfind('}'), ",\"users_version\":" + std::to_string(new_version));
+                              return reply; });
+    const auto &[first_uid, first_level, first_name] = secrets::cards::whitelist[0];
+    TEST_ASSERT_TRUE_MESSAGE(server.checkCard(first_uid)->request_ok, "Server checkCard request failed");
+    TEST_ASSERT_EQUAL_MESSAGE(new_version, server.getUsersVersion(), "Users version not taken from checkuser reply");
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            { return broker.defaultReplies(query); });
+
+    // Prefetched users are authorized without the backend
+    server.disconnect();
+    for (const auto &[uid, level, name] : secrets::cards::whitelist)
+    {
+      if (level == FabUser::UserLevel::Unknown)
+        continue;
+      const auto response = auth.tryLogin(uid, server);
+      TEST_ASSERT_TRUE_MESSAGE(response.has_value() && response.value().authenticated, "Prefetched user not authorized");
+      TEST_ASSERT_TRUE_MESSAGE(response.value().user_level == level, "Prefetched user has wrong level");
+      TEST_ASSERT_EQUAL_STRING_MESSAGE(name.data(), response.value().holder_name.c_str(), "Prefetched user has wrong name");
+    }
+  }
+
+  void test_check_and_start()
+  {
+    auto &server = logic.getServer();
+    auto saved_config = SavedConfig::DefaultConfig();
+    saved_config.mqtt_server.assign("127.0.0.1");
+    server.configure(saved_config);
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+    TEST_ASSERT_FALSE_MESSAGE(server.isCheckAndStartSupported(), "Combined query used before backend announcement");
+
+    TEST_ASSERT_TRUE_MESSAGE(server.checkMachine()->request_ok, "Server checkMachine request failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.isCheckAndStartSupported(), "Backend announcement not detected");
+
+    const auto &[uid, level, name] = secrets::cards::whitelist[0];
+    auto response = server.checkCardAndStartUse(uid);
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok && response->supported, "Server checkCardAndStartUse failed");
+    TEST_ASSERT_TRUE_MESSAGE(response->started, "Usage not started by the backend");
+    TEST_ASSERT_TRUE_MESSAGE(response->user->getResult() == ServerMQTT::UserResult::Authorized, "User not authorized");
+    TEST_ASSERT_TRUE_MESSAGE(response->user->user_level == level, "Server returned wrong user level");
+    TEST_ASSERT_TRUE_MESSAGE(response->machine->request_ok && response->machine->is_valid, "Machine state missing from reply");
+    TEST_ASSERT_TRUE_MESSAGE(server.finishUse(uid, 1s)->request_ok, "Server finishUse failed");
+
+    // Older backends reply without the started field
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            { return query.find("checkandstart") != std::string::npos ? std::string{"{\"request_ok\":true}"} : broker.defaultReplies(query); });
+    response = server.checkCardAndStartUse(uid);
+    TEST_ASSERT_FALSE_MESSAGE(response->supported, "Old backend reply shall not be supported");
+    TEST_ASSERT_FALSE_MESSAGE(server.isCheckAndStartSupported(), "Combined query not disabled after old backend reply");
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            { return broker.defaultReplies(query); });
+  }
+
+  /// @brief Compares the size, encoding and decoding time of each query type, JSON vs MessagePack
+  void test_wire_format()
+  {
+    constexpr auto NB_ITERATIONS = 100;
+    const auto uid = std::get<0>(secrets::cards::whitelist[0]);
+
+    // Average time of NB_ITERATIONS calls, in us
+    const auto measure = [](const auto &action)
+    {
+      const auto start = micros();
+      for (auto i = 0; i < NB_ITERATIONS; i++)
+      {
+        action();
+      }
+      return (micros() - start) / NB_ITERATIONS;
+    };
+
+    const auto compare = [&measure](std::string_view name, const std::string &json, const std::string &packed,
+                                    unsigned long json_encode_us, unsigned long packed_encode_us)
+    {
+      TEST_ASSERT_FALSE_MESSAGE(packed.empty(), "MessagePack encoding failed");
+      TEST_ASSERT_LESS_THAN_MESSAGE(json.size(), packed.size(), "MessagePack shall be smaller than JSON");
+
+      // Both encodings shall give the same document
+      JsonDocument from_json, from_packed;
+      TEST_ASSERT_TRUE_MESSAGE(ServerMQTT::deserializePayload(from_json, json) == DeserializationError::Ok, "JSON decoding failed");
+      TEST_ASSERT_TRUE_MESSAGE(ServerMQTT::deserializePayload(from_packed, packed) == DeserializationError::Ok, "MessagePack decoding failed");
+      TEST_ASSERT_TRUE_MESSAGE(from_json.as<JsonVariantConst>() == from_packed.as<JsonVariantConst>(), "MessagePack round-trip mismatch");
+
+      const auto json_us = measure([&json]()
+                                   { JsonDocument doc; (void)deserializeJson(doc, json); });
+      const auto packed_us = measure([&packed]()
+                                     { JsonDocument doc; (void)deserializeMsgPack(doc, packed); });
+
+      ESP_LOGI(TAG3, "%-14s JSON %3u bytes %4lu/%4lu us, MessagePack %3u bytes %4lu/%4lu us (encode/decode)", name.data(),
+               json.size(), json_encode_us, json_us, packed.size(), packed_encode_us, packed_us);
+    };
+
+    std::vector<std::pair<std::string_view, std::unique_ptr<ServerMQTT::Query>>> queries;
+    queries.emplace_back("checkuser", std::make_unique<ServerMQTT::UserQuery>(uid));
+    queries.emplace_back("checkmachine", std::make_unique<ServerMQTT::MachineQuery>());
+    queries.emplace_back("listusers", std::make_unique<ServerMQTT::UserListQuery>(2));
+    queries.emplace_back("checkandstart", std::make_unique<ServerMQTT::CheckAndStartQuery>(uid));
+    queries.emplace_back("startuse", std::make_unique<ServerMQTT::StartUseQuery>(uid));
+    queries.emplace_back("stopuse", std::make_unique<ServerMQTT::StopUseQuery>(uid, 3600s));
+    queries.emplace_back("inuse", std::make_unique<ServerMQTT::InUseQuery>(uid, 60s));
+    queries.emplace_back("maintenance", std::make_unique<ServerMQTT::RegisterMaintenanceQuery>(uid));
+    queries.emplace_back("replay", std::make_unique<BufferedQuery>(BufferedMsg{BufferedAction::StopUse, uid, 3600s, 1720000000, 1234}));
+
+    // Queries are written directly in either format, as in FabBackend::publish
+    ServerMQTT::TxBuffer out;
+    for (const auto &[name, query] : queries)
+    {
+      query->setEvent(1234, 1720000000);
+      TEST_ASSERT_TRUE_MESSAGE(query->serialize(out, 12345, ServerMQTT::WireFormat::Json), "JSON encoding failed");
+      const std::string json{out.view()};
+      TEST_ASSERT_TRUE_MESSAGE(query->serialize(out, 12345, ServerMQTT::WireFormat::MsgPack), "MessagePack encoding failed");
+      const std::string packed{out.view()};
+
+      const auto json_encode_us = measure([&]()
+                                          { (void)query->serialize(out, 12345, ServerMQTT::WireFormat::Json); });
+      const auto packed_encode_us = measure([&]()
+                                            { (void)query->serialize(out, 12345, ServerMQTT::WireFormat::MsgPack); });
+      compare(name, json, packed, json_encode_us, packed_encode_us);
+    }
+
+    // Telemetry members are preformatted JSON: the alive message cannot be packed and is sent as JSON
+    const ServerMQTT::AliveQuery alive{logic.getServer().getTelemetry()};
+    TEST_ASSERT_FALSE_MESSAGE(alive.serialize(out, 0, ServerMQTT::WireFormat::MsgPack), "Alive message shall not be packed with its telemetry");
+    TEST_ASSERT_TRUE_MESSAGE(ServerMQTT::AliveQuery{}.serialize(out, 0, ServerMQTT::WireFormat::MsgPack), "Alive message without telemetry not packed");
+
+    // Replies are packed by the backend
+    const std::string reply{R"({"request_ok":true,"is_valid":true,"allowed":true,"maintenance":false,"logoff":30,"name":"ENDER_1","type":1,"description":"","users_version":1,"machine_version":1,"cid":12345})"};
+    compare("reply", reply, ServerMQTT::toMsgPack(reply), 0, 0);
+  }
+
+  void test_msgpack_queries()
+  {
+    auto &server = logic.getServer();
+    auto saved_config = SavedConfig::DefaultConfig();
+    saved_config.mqtt_server.assign("127.0.0.1");
+    server.configure(saved_config);
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.getWireFormat() == ServerMQTT::WireFormat::Json, "MessagePack used before backend acknowledgement");
+
+    TEST_ASSERT_TRUE_MESSAGE(server.checkMachine()->request_ok, "Server checkMachine request failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.getWireFormat() == ServerMQTT::WireFormat::MsgPack, "Backend acknowledgement not detected");
+
+    static std::atomic<bool> packed{false};
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            {
+                              packed = topic.find(conf::mqtt::msgpack_topic) != std::string::npos;
+                              return broker.defaultReplies(query); });
+
+    const auto &[uid, level, name] = secrets::cards::whitelist[0];
+    auto response = server.checkCard(uid);
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok, "Server checkCard failed with MessagePack");
+    TEST_ASSERT_TRUE_MESSAGE(packed, "Query not sent on the msgpack topic");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(name.data(), response->holder_name.c_str(), "Wrong user name in MessagePack reply");
+    TEST_ASSERT_TRUE_MESSAGE(server.finishUse(uid, 1s)->request_ok, "Server finishUse failed with MessagePack");
+
+    // Backend without MessagePack support
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            {
+                              packed = topic.find(conf::mqtt::msgpack_topic) != std::string::npos;
+                              if (query.find("checkmachine") != std::string::npos)
+                                return std::string{"{\"request_ok\":true,\"is_valid\":true,\"allowed\":true,\"maintenance\":false,\"logoff\":30,\"name\":\"ENDER_1\",\"type\":1}"};
+                              return broker.defaultReplies(query); });
+    TEST_ASSERT_TRUE_MESSAGE(server.checkMachine()->request_ok, "Server checkMachine request failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.getWireFormat() == ServerMQTT::WireFormat::Json, "JSON not restored");
+    TEST_ASSERT_TRUE_MESSAGE(server.checkCard(uid)->request_ok, "Server checkCard failed with JSON");
+    TEST_ASSERT_FALSE_MESSAGE(packed, "Query sent on the msgpack topic");
+
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            { return broker.defaultReplies(query); });
+  }
+
+  void test_machine_version()
+  {
+    auto &server = logic.getServer();
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.checkMachine()->request_ok, "Server checkMachine request failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.isMachineStateCurrent(), "Machine state not current after checkMachine");
+    TEST_ASSERT_NULL_MESSAGE(server.takeMachineUpdate().get(), "No machine update expected");
+
+    const auto &[uid, level, name] = secrets::cards::whitelist[0];
+
+    // Backend piggybacks a new machine state
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            {
+                              if (query.find("inuse") != std::string::npos)
+                                return std::string{"{\"request_ok\":true,\"machine_version\":2,\"machine\":{\"request_ok\":true,\"is_valid\":true,\"allowed\":false,\"maintenance\":false,\"logoff\":30,\"name\":\"ENDER_2\",\"type\":1}}"};
+                              return broker.defaultReplies(query); });
+    TEST_ASSERT_TRUE_MESSAGE(server.inUse(uid, 1s)->request_ok, "Server inUse failed");
+    const auto update = server.takeMachineUpdate();
+    TEST_ASSERT_NOT_NULL_MESSAGE(update.get(), "Piggybacked machine state not received");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("ENDER_2", update->name.c_str(), "Piggybacked machine name mismatch");
+    TEST_ASSERT_FALSE_MESSAGE(update->allowed, "Piggybacked allowed flag mismatch");
+    TEST_ASSERT_TRUE_MESSAGE(server.isMachineStateCurrent(), "Machine state not current after piggyback");
+
+    // Backend announces a new version without the state
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            {
+                              if (query.find("inuse") != std::string::npos)
+                                return std::string{"{\"request_ok\":true,\"machine_version\":3}"};
+                              return broker.defaultReplies(query); });
+    TEST_ASSERT_TRUE_MESSAGE(server.inUse(uid, 2s)->request_ok, "Server inUse failed");
+    TEST_ASSERT_NULL_MESSAGE(server.takeMachineUpdate().get(), "No machine state in reply");
+    TEST_ASSERT_FALSE_MESSAGE(server.isMachineStateCurrent(), "Machine state shall be stale");
+
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            { return broker.defaultReplies(query); });
+    TEST_ASSERT_TRUE_MESSAGE(server.checkMachine()->request_ok, "Server checkMachine request failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.isMachineStateCurrent(), "Machine state not current after checkMachine");
+  }
+
+  /// @brief Runs the MQTT client until a machine update is received or timeout
+  auto waitMachineUpdate(FabBackend &server) -> std::unique_ptr<ServerMQTT::MachineResponse>
+  {
+    for (auto i = 0; i < 30; i++)
+    {
+      server.loop();
+      if (auto update = server.takeMachineUpdate(); update)
+      {
+        return update;
+      }
+      delay(100);
+    }
+    return nullptr;
+  }
+
+  void test_pushed_config()
+  {
+    auto &server = logic.getServer();
+    auto saved_config = SavedConfig::DefaultConfig();
+    saved_config.mqtt_server.assign("127.0.0.1");
+    server.configure(saved_config);
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+
+    std::stringstream config_topic;
+    config_topic << conf::mqtt::topic << "/" << saved_config.machine_id << conf::mqtt::config_topic;
+    const std::string config{"{\"request_ok\":true,\"is_valid\":true,\"allowed\":false,\"maintenance\":true,\"logoff\":30,\"name\":\"PUSHED\",\"type\":1,\"machine_version\":5}"};
+
+    broker.pushRetained(config_topic.str(), config);
+    auto update = waitMachineUpdate(server);
+    TEST_ASSERT_NOT_NULL_MESSAGE(update.get(), "Pushed config not received");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("PUSHED", update->name.c_str(), "Pushed machine name mismatch");
+    TEST_ASSERT_TRUE_MESSAGE(update->maintenance, "Pushed maintenance flag mismatch");
+    TEST_ASSERT_TRUE_MESSAGE(server.isMachineStateCurrent(), "Machine state not current after push");
+
+    // Same version again (e.g. retained message after reconnection) is ignored
+    broker.pushRetained(config_topic.str(), config);
+    TEST_ASSERT_NULL_MESSAGE(waitMachineUpdate(server).get(), "Duplicate pushed config not ignored");
+
+    // Clear the retained message for next tests
+    broker.pushRetained(config_topic.str(), "");
+    TEST_ASSERT_NULL_MESSAGE(waitMachineUpdate(server).get(), "Empty pushed config not ignored");
+  }
+
+  /// @brief Runs the MQTT client until all pending queries completed or timeout
+  auto waitPendingQueries(FabBackend &server, std::chrono::milliseconds timeout) -> bool
+  {
+    const auto start = std::chrono::system_clock::now();
+    while (server.pendingQueries() > 0 && std::chrono::system_clock::now() - start < timeout)
+    {
+      server.loop();
+      delay(25);
+    }
+    return server.pendingQueries() == 0;
+  }
+
+  void test_async_queries()
+  {
+    auto &server = logic.getServer();
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+    const auto &[uid, level, name] = secrets::cards::whitelist[0];
+
+    // Several outstanding queries, completed through the callbacks
+    std::vector<bool> results;
+    const auto record = [&results](std::unique_ptr<ServerMQTT::SimpleResponse> response)
+    { results.push_back(response->request_ok); };
+
+    TEST_ASSERT_TRUE_MESSAGE(server.startUseAsync(uid, record), "startUseAsync not published");
+    TEST_ASSERT_TRUE_MESSAGE(server.inUseAsync(uid, 1s, record), "inUseAsync not published");
+    TEST_ASSERT_TRUE_MESSAGE(server.finishUseAsync(uid, 2s, record), "finishUseAsync not published");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(3, server.pendingQueries(), "Queries shall be pending");
+    TEST_ASSERT_TRUE_MESSAGE(results.empty(), "Callbacks called before replies");
+
+    TEST_ASSERT_TRUE_MESSAGE(waitPendingQueries(server, 5s), "Async queries not completed");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(3, results.size(), "Callbacks not called");
+    for (const auto ok : results)
+    {
+      TEST_ASSERT_TRUE_MESSAGE(ok, "Async query failed");
+    }
+
+    // Reply arriving after the timeout shall not be taken for the reply of the next query
+    // The reply comes while the next query is waiting
+    const auto &estimator = server.getRttEstimator(ServerMQTT::QueryType::InUse);
+    const auto timeout = estimator.getTimeout(0) + estimator.getTimeout(1);
+    broker.configureReplies([timeout](const std::string &topic, const std::string &query)
+                            {
+                              if (query.find("inuse") != std::string::npos)
+                                Tasks::delay(timeout + 200ms);
+                              return broker.defaultReplies(query); });
+    results.clear();
+    TEST_ASSERT_TRUE_MESSAGE(server.inUseAsync(uid, 3s, record), "inUseAsync not published");
+    TEST_ASSERT_TRUE_MESSAGE(waitPendingQueries(server, timeout + 500ms), "Async query did not time out");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, results.size(), "Timeout callback not called");
+    TEST_ASSERT_FALSE_MESSAGE(results[0], "Timed out query shall fail");
+
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            { return broker.defaultReplies(query); });
+    const auto response = server.checkMachine();
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok, "Server checkMachine request failed");
+    TEST_ASSERT_TRUE_MESSAGE(response->is_valid, "Late inuse reply taken as checkMachine reply");
+  }
+
+  /// @brief Pending query surviving a disconnection, completed by the reply delivered after reconnection.
+  /// The mock broker has no session: the queued QoS 1 reply is emulated with a retained message.
+  void test_reply_after_reconnection()
+  {
+    auto &server = logic.getServer();
+    auto config = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(config.has_value(), "Config load failed");
+
+    // The broker finds the session by the client id
+    server.configure(config.value());
+    const auto client_id = server.getClientId();
+    server.configure(config.value());
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(client_id.c_str(), server.getClientId().c_str(), "Client id shall be stable");
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+
+    // The inuse reply is not sent while connected
+    std::atomic<uint32_t> cid{0};
+    broker.configureReplies([&cid](const std::string &topic, const std::string &query) -> const std::string
+                            {
+                              if (query.find("inuse") != std::string::npos)
+                              {
+                                JsonDocument query_doc;
+                                if (!deserializeJson(query_doc, query))
+                                  cid = query_doc["cid"].as<uint32_t>();
+                                return "";
+                              }
+                              return broker.defaultReplies(query); });
+
+    const auto &[uid, level, name] = secrets::cards::whitelist[0];
+    std::vector<bool> results;
+    const auto record = [&results](std::unique_ptr<ServerMQTT::SimpleResponse> response)
+    { results.push_back(response->request_ok); };
+    TEST_ASSERT_TRUE_MESSAGE(server.inUseAsync(uid, 1s, record), "inUseAsync not published");
+
+    const auto start = std::chrono::system_clock::now();
+    while (cid == 0 && std::chrono::system_clock::now() - start < 2s)
+    {
+      server.loop();
+      delay(25);
+    }
+    TEST_ASSERT_NOT_EQUAL_MESSAGE(0, cid.load(), "Query not received by the broker");
+
+    // Short disconnection, longer than the reply timeout
+    server.disconnect();
+    const auto &estimator = server.getRttEstimator(ServerMQTT::QueryType::InUse);
+    Tasks::delay(estimator.getTimeout(0) + estimator.getTimeout(1) + 200ms);
+
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server reconnect failed");
+
+    // Replies to queries of a previous session, or without correlation id, shall be ignored
+    std::stringstream reply_topic;
+    reply_topic << conf::mqtt::topic << "/" << config.value().machine_id << conf::mqtt::response_topic;
+    broker.pushRetained(reply_topic.str(), "{\"request_ok\":false,\"cid\":" + std::to_string(cid.load() + 1000) + "}");
+    broker.pushRetained(reply_topic.str(), "{\"request_ok\":false}");
+
+    // Reply held by the broker, delivered after the stale ones
+    broker.pushRetained(reply_topic.str(), "{\"request_ok\":true,\"cid\":" + std::to_string(cid.load()) + "}");
+
+    TEST_ASSERT_TRUE_MESSAGE(waitPendingQueries(server, 10s), "Held reply not received after reconnection");
+    TEST_ASSERT_TRUE_MESSAGE(server.isOnline(), "Server shall be reconnected");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, results.size(), "Callback not called");
+    TEST_ASSERT_TRUE_MESSAGE(results[0], "Query shall complete with the held reply");
+
+    // Clear the retained message for next tests
+    broker.pushRetained(reply_topic.str(), "");
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            { return broker.defaultReplies(query); });
+    const auto response = server.checkMachine();
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok, "Server checkMachine request failed");
+  }
+
+  /// @brief A usage event sent live reaches the broker once, it is not replayed from the log as well
+  void test_live_event_sent_once()
+  {
+    auto &server = logic.getServer();
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.transmitBuffer(), "Buffered messages not replayed");
+
+    std::atomic<uint32_t> published{0};
+    broker.configureReplies([&published](const std::string &topic, const std::string &query)
+                            {
+                              if (query.find("startuse") != std::string::npos)
+                                published++;
+                              return broker.defaultReplies(query); });
+
+    const auto &[uid, level, name] = secrets::cards::whitelist[0];
+    const auto response = server.startUse(uid);
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok, "startUse failed");
+
+    // Leave time for a replay to reach the broker
+    const auto start = std::chrono::system_clock::now();
+    while (std::chrono::system_clock::now() - start < 1s)
+    {
+      server.loop();
+      delay(25);
+    }
+    TEST_ASSERT_FALSE_MESSAGE(server.hasBufferedMsg(), "Live event shall be acknowledged");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(1, published.load(), "Live event shall be published once");
+
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            { return broker.defaultReplies(query); });
+  }
+
+  /// @brief A usage event rejected by the backend stays in the log, live or replayed
+  void test_rejected_event_kept()
+  {
+    auto &server = logic.getServer();
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.transmitBuffer(), "Buffered messages not replayed");
+
+    std::atomic<uint32_t> rejected{0};
+    broker.configureReplies([&rejected](const std::string &topic, const std::string &query) -> const std::string
+                            {
+                              if (query.find("\"action\":\"maintenance\"") != std::string::npos)
+                              {
+                                rejected++;
+                                return "{\"request_ok\":false}";
+                              }
+                              return broker.defaultReplies(query); });
+
+    const auto &[uid, level, name] = secrets::cards::whitelist[0];
+    TEST_ASSERT_FALSE_MESSAGE(server.registerMaintenance(uid)->request_ok, "Maintenance shall be rejected");
+    TEST_ASSERT_TRUE_MESSAGE(server.hasBufferedMsg(), "Rejected event shall stay in the log");
+
+    // Replayed and rejected again, then the replay pauses
+    const auto start = std::chrono::system_clock::now();
+    while (std::chrono::system_clock::now() - start < 1s)
+    {
+      server.loop();
+      delay(25);
+    }
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, rejected.load(), "Rejected event shall be replayed once before the pause");
+    TEST_ASSERT_TRUE_MESSAGE(server.hasBufferedMsg(), "Rejected replay shall stay in the log");
+
+    // A new configuration resumes the replay
+    broker.configureReplies([](const std::string &topic, const std::string &query)
+                            { return broker.defaultReplies(query); });
+    auto config = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(config.has_value(), "Config load failed");
+    server.configure(config.value());
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server reconnect failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.transmitBuffer(), "Buffered messages not replayed");
+    TEST_ASSERT_FALSE_MESSAGE(server.hasBufferedMsg(), "Accepted replay shall leave the log");
+  }
+
+  void test_io_task()
+  {
+    auto &server = logic.getServer();
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.startIoTask(), "I/O task start failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.isIoTaskRunning(), "I/O task shall be running");
+
+    // Synchronous query, the reply being received by the I/O task
+    auto response = server.checkMachine();
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok, "checkMachine through I/O task failed");
+    TEST_ASSERT_TRUE_MESSAGE(response->is_valid, "checkMachine reply mismatch");
+
+    // Asynchronous queries, completed by loop()
+    const auto &[uid, level, name] = secrets::cards::whitelist[0];
+    std::vector<bool> results;
+    const auto record = [&results](std::unique_ptr<ServerMQTT::SimpleResponse> response)
+    { results.push_back(response->request_ok); };
+    TEST_ASSERT_TRUE_MESSAGE(server.startUseAsync(uid, record), "startUseAsync not published");
+    TEST_ASSERT_TRUE_MESSAGE(server.finishUseAsync(uid, 1s, record), "finishUseAsync not published");
+    TEST_ASSERT_TRUE_MESSAGE(waitPendingQueries(server, 5s), "Async queries not completed");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, results.size(), "Callbacks not called");
+    TEST_ASSERT_TRUE_MESSAGE(results[0] && results[1], "Async query failed");
+
+    // Reconnection by the I/O task
+    server.disconnect();
+    const auto start = std::chrono::system_clock::now();
+    while (!server.loop() && std::chrono::system_clock::now() - start < 10s)
+    {
+      delay(25);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(server.isOnline(), "I/O task did not reconnect");
+    response = server.checkMachine();
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok, "checkMachine after reconnection failed");
+
+    // Back to the client run by loop()
+    server.stopIoTask();
+    TEST_ASSERT_FALSE_MESSAGE(server.isIoTaskRunning(), "I/O task shall be stopped");
+    response = server.checkMachine();
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok, "checkMachine without I/O task failed");
+  }
+
+  void test_circuit_breaker()
+  {
+    auto &server = logic.getServer();
+    auto config = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(config.has_value(), "Config load failed");
+
+    // Unreachable backend
+    auto unreachable = config.value();
+    unreachable.mqtt_server.assign("invalid.invalid");
+    server.configure(unreachable);
+    TEST_ASSERT_TRUE_MESSAGE(server.isBreakerClosed(), "Breaker shall be closed after configure");
+
+    for (auto i = 0U; i < conf::mqtt::BREAKER_FAILURE_THRESHOLD; i++)
+    {
+      TEST_ASSERT_FALSE_MESSAGE(server.connect(), "Connection shall fail");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(server.getBreakerState() == FabBackend::BreakerState::Open, "Breaker shall be open");
+    TEST_ASSERT_FALSE_MESSAGE(server.isReconnectDue(), "Reconnection shall wait BREAKER_OPEN_PERIOD");
+
+    // No more connection attempts while open
+    const auto start = std::chrono::system_clock::now();
+    TEST_ASSERT_FALSE_MESSAGE(server.connect(), "Connection shall be skipped");
+    TEST_ASSERT_TRUE_MESSAGE(std::chrono::system_clock::now() - start < 50ms, "Connect shall return immediately while open");
+
+    // Taps are authorized locally
+    const auto &[uid, level, name] = secrets::cards::whitelist[0];
+    const auto user = AuthProvider(secrets::cards::whitelist).tryLogin(uid, server);
+    TEST_ASSERT_TRUE_MESSAGE(user.has_value() && user->authenticated, "Whitelisted user shall be authorized locally");
+
+    // Restore working backend
+    server.configure(config.value());
+    TEST_ASSERT_TRUE_MESSAGE(server.connect(), "Server connect failed");
+    const auto response = server.checkMachine();
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok, "checkMachine failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.isBreakerClosed(), "Breaker shall be closed after a reply");
+  }
+
+  void test_reconnect_state_machine()
+  {
+    auto &server = logic.getServer();
+    auto config = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(config.has_value(), "Config load failed");
+
+    auto unreachable = config.value();
+    unreachable.mqtt_server.assign("invalid.invalid");
+    server.configure(unreachable);
+    TEST_ASSERT_TRUE_MESSAGE(server.getLinkState() == FabBackend::LinkState::Disconnected, "Shall be disconnected after configure");
+
+    // One step per call until the attempt fails
+    auto steps = 0;
+    while (server.connectStep() != FabBackend::LinkState::Disconnected && steps < 100)
+    {
+      steps++;
+      delay(100);
+    }
+    TEST_ASSERT_GREATER_THAN_MESSAGE(0, steps, "Connection shall take several steps");
+    TEST_ASSERT_FALSE_MESSAGE(server.isOnline(), "Connection shall fail");
+
+    // Backoff before the next attempt
+    TEST_ASSERT_TRUE_MESSAGE(server.connectStep() == FabBackend::LinkState::Disconnected, "Next attempt shall wait for backoff");
+
+    // Background reconnection through loop()
+    server.configure(config.value());
+    const auto start = std::chrono::system_clock::now();
+    while (!server.loop() && std::chrono::system_clock::now() - start < 10s)
+    {
+      delay(100);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(server.isOnline(), "Reconnection through loop() failed");
+    TEST_ASSERT_TRUE_MESSAGE(server.getLinkState() == FabBackend::LinkState::Connected, "Link shall be connected");
+  }
+
+  void test_rtt_estimator()
+  {
+    RttEstimator estimator;
+    TEST_ASSERT_EQUAL_MESSAGE(std::chrono::milliseconds(conf::mqtt::TIMEOUT_REPLY_SERVER).count(), estimator.getTimeout().count(), "Initial timeout shall be TIMEOUT_REPLY_SERVER");
+
+    // Stable fast link: timeout decreases down to the lower bound
+    for (auto i = 0; i < 20; i++)
+    {
+      estimator.addSample(20ms);
+    }
+    TEST_ASSERT_EQUAL_MESSAGE(20, estimator.getSmoothedRtt().count(), "Smoothed RTT mismatch");
+    TEST_ASSERT_EQUAL_MESSAGE(std::chrono::milliseconds(conf::mqtt::TIMEOUT_REPLY_MIN).count(), estimator.getTimeout().count(), "Timeout shall be clamped to TIMEOUT_REPLY_MIN");
+
+    // Exponential backoff on successive waits, bounded
+    TEST_ASSERT_EQUAL_MESSAGE(estimator.getTimeout().count() * 2, estimator.getTimeout(1).count(), "Timeout shall double");
+    TEST_ASSERT_EQUAL_MESSAGE(std::chrono::milliseconds(conf::mqtt::TIMEOUT_REPLY_MAX).count(), estimator.getTimeout(20).count(), "Timeout shall be clamped to TIMEOUT_REPLY_MAX");
+
+    // Slow link: timeout follows the RTT and its variance
+    for (auto i = 0; i < 20; i++)
+    {
+      estimator.addSample(i % 2 == 0 ? 800ms : 1200ms);
+    }
+    TEST_ASSERT_GREATER_THAN_MESSAGE(1000, estimator.getTimeout().count(), "Timeout shall exceed the RTT on slow link");
+    TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(std::chrono::milliseconds(conf::mqtt::TIMEOUT_REPLY_MAX).count(), estimator.getTimeout().count(), "Timeout shall not exceed TIMEOUT_REPLY_MAX");
+
+    const auto before = estimator.getTimeout();
+    estimator.backoff();
+    TEST_ASSERT_GREATER_THAN_MESSAGE(before.count(), estimator.getTimeout().count(), "Backoff shall increase the timeout");
+  }
+
   /// @brief Opens WiFi and server connection and updates board state accordingly
   void test_taskConnect()
   {
@@ -346,7 +984,10 @@ namespace fabomatic::tests
   }
 } // namespace fabomatic::Tests
 
-void tearDown(void) {};
+void tearDown(void)
+{
+  fabomatic::tests::logic.getServer().stopIoTask();
+};
 
 void setUp(void)
 {
@@ -361,10 +1002,24 @@ void setup()
   auto original = fabomatic::SavedConfig::LoadFromEEPROM();
 
   UNITY_BEGIN();
+  RUN_TEST(fabomatic::tests::test_rtt_estimator);
   RUN_TEST(fabomatic::tests::test_create_buffered_messages);
   RUN_TEST(fabomatic::tests::test_start_broker);
   RUN_TEST(fabomatic::tests::test_check_transmission);
   RUN_TEST(fabomatic::tests::test_fabserver_calls);
+  RUN_TEST(fabomatic::tests::test_prefetch_users);
+  RUN_TEST(fabomatic::tests::test_check_and_start);
+  RUN_TEST(fabomatic::tests::test_wire_format);
+  RUN_TEST(fabomatic::tests::test_msgpack_queries);
+  RUN_TEST(fabomatic::tests::test_machine_version);
+  RUN_TEST(fabomatic::tests::test_pushed_config);
+  RUN_TEST(fabomatic::tests::test_async_queries);
+  RUN_TEST(fabomatic::tests::test_reply_after_reconnection);
+  RUN_TEST(fabomatic::tests::test_live_event_sent_once);
+  RUN_TEST(fabomatic::tests::test_rejected_event_kept);
+  RUN_TEST(fabomatic::tests::test_io_task);
+  RUN_TEST(fabomatic::tests::test_circuit_breaker);
+  RUN_TEST(fabomatic::tests::test_reconnect_state_machine);
   RUN_TEST(fabomatic::tests::test_normal_use);
   RUN_TEST(fabomatic::tests::test_stop_broker);
 
@@ -9,7 +9,9 @@
 #include <AuthProvider.hpp>
 #include <FabBackend.hpp>
 #include "BoardLogic.hpp"
+#include "BufferLog.hpp"
 #include "BufferedMsg.hpp"
+#include "CardCacheStore.hpp"
 
 using namespace std::chrono_literals;
 
@@ -91,32 +93,231 @@ namespace fabomatic::tests
     TEST_ASSERT_TRUE_MESSAGE(original.SaveToEEPROM(), "Loaded config save failed");
   }
 
+  void test_wifi_lease()
+  {
+    auto result = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(result.has_value(), "Loaded config is empty");
+    auto config = result.value();
+
+    WiFiLease lease;
+    TEST_ASSERT_FALSE_MESSAGE(lease.isValid(), "Default lease shall be invalid");
+    lease.bssid = {0x42, 0x13, 0x37, 0x55, 0xaa, 0x01};
+    lease.channel = 11;
+    lease.ip = IPAddress(192, 168, 1, 42);
+    lease.gateway = IPAddress(192, 168, 1, 1);
+    lease.subnet = IPAddress(255, 255, 255, 0);
+    lease.dns = IPAddress(8, 8, 8, 8);
+    TEST_ASSERT_TRUE_MESSAGE(lease.isValid(), "Lease shall be valid");
+
+    config.wifi_lease = lease;
+    TEST_ASSERT_TRUE_MESSAGE(config.SaveToEEPROM(), "Config save failed");
+    result = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(result.has_value(), "Loaded config is empty");
+    TEST_ASSERT_TRUE_MESSAGE(result.value().wifi_lease == lease, "Loaded WiFi lease mismatch");
+
+    // Missing lease loads as invalid
+    config.wifi_lease = WiFiLease{};
+    TEST_ASSERT_TRUE_MESSAGE(config.SaveToEEPROM(), "Config save failed");
+    result = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(result.has_value(), "Loaded config is empty");
+    TEST_ASSERT_FALSE_MESSAGE(result.value().wifi_lease.isValid(), "Loaded WiFi lease shall be invalid");
+  }
+
+  void test_broker_address()
+  {
+    auto result = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(result.has_value(), "Loaded config is empty");
+    auto config = result.value();
+
+    BrokerAddress address{"fabpi2.local", "10.10.0.10"};
+    TEST_ASSERT_TRUE_MESSAGE(address.isValidFor("fabpi2.local"), "Address shall be valid for its host");
+    TEST_ASSERT_FALSE_MESSAGE(address.isValidFor("fabpi3.local"), "Address shall be invalid for another host");
+    TEST_ASSERT_FALSE_MESSAGE(BrokerAddress{}.isValidFor(""), "Default address shall be invalid");
+
+    config.broker_address = address;
+    TEST_ASSERT_TRUE_MESSAGE(config.SaveToEEPROM(), "Config save failed");
+    result = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(result.has_value(), "Loaded config is empty");
+    TEST_ASSERT_TRUE_MESSAGE(result.value().broker_address == address, "Loaded broker address mismatch");
+
+    // Missing address loads as empty
+    config.broker_address = BrokerAddress{};
+    TEST_ASSERT_TRUE_MESSAGE(config.SaveToEEPROM(), "Config save failed");
+    result = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(result.has_value(), "Loaded config is empty");
+    TEST_ASSERT_TRUE_MESSAGE(result.value().broker_address.ip.empty(), "Loaded broker address shall be empty");
+  }
+
+  void test_resident_config()
+  {
+    auto result = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(result.has_value(), "Loaded config is empty");
+    auto config = result.value();
+    TEST_ASSERT_TRUE_MESSAGE(config.changedSections(SavedConfig::LoadFromEEPROM().value()).none(), "Resident copy shall not change between loads");
+
+    using Section = SavedConfig::Section;
+    auto changed = config;
+    changed.bootCount++;
+    auto sections = changed.changedSections(config);
+    TEST_ASSERT_TRUE_MESSAGE(sections.test(static_cast<size_t>(Section::Counters)), "Boot count is a counter");
+    TEST_ASSERT_EQUAL_MESSAGE(1, sections.count(), "Only the counters changed");
+
+    changed.wifi_lease.channel = 6;
+    changed.mqtt_server = "changed.local";
+    sections = changed.changedSections(config);
+    TEST_ASSERT_TRUE_MESSAGE(sections.test(static_cast<size_t>(Section::Network)), "WiFi lease is a network setting");
+    TEST_ASSERT_TRUE_MESSAGE(sections.test(static_cast<size_t>(Section::Settings)), "MQTT server is a setting");
+
+    // Saving updates the resident copy, and the flash holds the same settings
+    TEST_ASSERT_TRUE_MESSAGE(changed.SaveToEEPROM(), "Config save failed");
+    TEST_ASSERT_TRUE_MESSAGE(changed.changedSections(SavedConfig::LoadFromEEPROM().value()).none(), "Resident copy not updated");
+    TEST_ASSERT_TRUE_MESSAGE(changed.SaveToEEPROM(), "Unchanged config save failed");
+    const auto reloaded = SavedConfig::ReloadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(reloaded.has_value(), "Reloaded config is empty");
+    TEST_ASSERT_TRUE_MESSAGE(changed.changedSections(reloaded.value()).none(), "Flash contents differ from the resident copy");
+
+    TEST_ASSERT_TRUE_MESSAGE(config.SaveToEEPROM(), "Config restore failed");
+  }
+
+  void test_torn_slot()
+  {
+    using Section = SavedConfig::Section;
+    auto config = SavedConfig::LoadFromEEPROM().value_or(SavedConfig::DefaultConfig());
+    const auto original = config;
+
+    config.ssid = "one";
+    TEST_ASSERT_TRUE_MESSAGE(config.SaveToEEPROM(), "Config save failed");
+    config.ssid = "two";
+    TEST_ASSERT_TRUE_MESSAGE(config.SaveToEEPROM(), "Config save failed");
+
+    // Both slots hold the settings, writing one does not touch the other sections
+    Preferences prefs;
+    TEST_ASSERT_TRUE(prefs.begin(SavedConfig::NVS_NAMESPACE, false));
+    TEST_ASSERT_TRUE_MESSAGE(prefs.isKey(SavedConfig::slotKey(Section::Settings, 0).c_str()), "Settings slot A missing");
+    TEST_ASSERT_TRUE_MESSAGE(prefs.isKey(SavedConfig::slotKey(Section::Settings, 1).c_str()), "Settings slot B missing");
+
+    // Simulate a torn write of one slot, the other one is loaded
+    const auto key = SavedConfig::slotKey(Section::Settings, 0);
+    std::array<uint8_t, 16> garbage{};
+    garbage.fill(0x5A);
+    TEST_ASSERT_EQUAL(garbage.size(), prefs.putBytes(key.c_str(), garbage.data(), garbage.size()));
+    prefs.end();
+
+    const auto reloaded = SavedConfig::ReloadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(reloaded.has_value(), "Torn slot shall fall back to the other slot");
+    TEST_ASSERT_TRUE_MESSAGE(reloaded.value().ssid == "one" || reloaded.value().ssid == "two", "Settings lost with a torn slot");
+    TEST_ASSERT_EQUAL_MESSAGE(config.bootCount, reloaded.value().bootCount, "Counters shall not depend on the settings slots");
+
+    TEST_ASSERT_TRUE_MESSAGE(original.SaveToEEPROM(), "Config restore failed");
+    const auto restored = SavedConfig::ReloadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(restored.has_value() && restored.value().ssid == original.ssid, "Config restore mismatch");
+  }
+
+  void test_pending_config()
+  {
+    const auto original = SavedConfig::LoadFromEEPROM().value_or(SavedConfig::DefaultConfig());
+    TEST_ASSERT_TRUE_MESSAGE(original.SaveToEEPROM(), "Config save failed");
+    TEST_ASSERT_FALSE_MESSAGE(SavedConfig::HasPendingChanges(), "No change shall be pending after a save");
+
+    // Changes are visible at once, and written together
+    const auto count = SavedConfig::IncrementBootCount();
+    TEST_ASSERT_EQUAL_MESSAGE(original.bootCount + 1, count, "Boot count not incremented");
+    SavedConfig::Update([](SavedConfig &config)
+                        { config.broker_address = BrokerAddress{"pending.local", "10.0.0.42"}; });
+    TEST_ASSERT_TRUE_MESSAGE(SavedConfig::HasPendingChanges(), "Changes shall be pending");
+    const auto loaded = SavedConfig::LoadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(loaded.has_value(), "Loaded config is empty");
+    TEST_ASSERT_EQUAL_MESSAGE(count, loaded.value().bootCount, "Pending boot count not loaded");
+    TEST_ASSERT_TRUE_MESSAGE(loaded.value().broker_address.ip == "10.0.0.42", "Pending broker address not loaded");
+
+    TEST_ASSERT_TRUE_MESSAGE(SavedConfig::Flush(), "Flush failed");
+    TEST_ASSERT_FALSE_MESSAGE(SavedConfig::HasPendingChanges(), "No change shall be pending after a flush");
+    TEST_ASSERT_TRUE_MESSAGE(SavedConfig::Flush(), "Flush without changes shall succeed");
+    const auto reloaded = SavedConfig::ReloadFromEEPROM();
+    TEST_ASSERT_TRUE_MESSAGE(reloaded.has_value(), "Reloaded config is empty");
+    TEST_ASSERT_EQUAL_MESSAGE(count, reloaded.value().bootCount, "Boot count not flushed");
+    TEST_ASSERT_TRUE_MESSAGE(reloaded.value().broker_address.ip == "10.0.0.42", "Broker address not flushed");
+
+    TEST_ASSERT_TRUE_MESSAGE(original.SaveToEEPROM(), "Config restore failed");
+  }
+
+  void test_config_codec()
+  {
+    auto config = SavedConfig::DefaultConfig();
+    config.bootCount = 42;
+    config.wifi_lease.bssid = {0x42, 0x13, 0x37, 0x55, 0xaa, 0x01};
+    config.wifi_lease.channel = 6;
+    config.wifi_lease.ip = IPAddress(10, 0, 0, 2);
+    config.broker_address = BrokerAddress{"fabpi2.local", "10.10.0.10"};
+
+    std::array<uint8_t, codec::maxBinarySize<SavedConfig>()> buffer{};
+    codec::ByteWriter out{buffer.data(), buffer.size()};
+    codec::encode(out, config);
+    TEST_ASSERT_TRUE_MESSAGE(out.ok(), "Encoding failed");
+
+    SavedConfig decoded;
+    codec::ByteReader in{buffer.data(), out.size()};
+    TEST_ASSERT_TRUE_MESSAGE(codec::decode(in, decoded), "Decoding failed");
+    decoded.magic_number = config.magic_number;
+    TEST_ASSERT_TRUE_MESSAGE(decoded.changedSections(config).none(), "Decoded config mismatch");
+
+    // Records written before fields were appended decode with the defaults
+    const auto trailing = codec::maxBinarySize<WiFiLease>() + 1 + config.broker_address.hostname.size() + 1 + config.broker_address.ip.size();
+    SavedConfig older;
+    codec::ByteReader older_in{buffer.data(), out.size() - trailing};
+    TEST_ASSERT_TRUE_MESSAGE(codec::decode(older_in, older), "Decoding older record failed");
+    TEST_ASSERT_TRUE_MESSAGE(older.ssid == config.ssid, "Older record ssid mismatch");
+    TEST_ASSERT_FALSE_MESSAGE(older.wifi_lease.isValid(), "Missing lease shall be invalid");
+
+    // Truncated in the middle of a field
+    codec::ByteReader truncated{buffer.data(), out.size() - trailing + 3};
+    TEST_ASSERT_FALSE_MESSAGE(codec::decode(truncated, older), "Truncated record shall be rejected");
+
+    // Too long strings are not saved
+    auto too_long = config;
+    too_long.ssid.assign(conf::common::STR_MAX_LENGTH + 1, 'x');
+    codec::ByteWriter measure{nullptr, buffer.size()};
+    codec::encode(measure, too_long);
+    TEST_ASSERT_FALSE_MESSAGE(measure.ok(), "Too long string shall not be encoded");
+    TEST_ASSERT_FALSE_MESSAGE(too_long.SaveToEEPROM(), "Too long string shall not be saved");
+
+    const auto json = config.toString();
+    TEST_ASSERT_TRUE_MESSAGE(json.size() <= codec::maxJsonSize<SavedConfig>(), "JSON larger than its bound");
+    TEST_ASSERT_TRUE_MESSAGE(json.find(R"("bssid":"42:13:37:55:aa:01")") != std::string::npos, "BSSID rendering mismatch");
+    TEST_ASSERT_TRUE_MESSAGE(json.find(R"("ip":"10.0.0.2")") != std::string::npos, "IP rendering mismatch");
+    TEST_ASSERT_EQUAL_MESSAGE('}', json.back(), "JSON not complete");
+  }
+
   void test_rfid_cache()
   {
     auto defaults = SavedConfig::DefaultConfig();
     defaults.SaveToEEPROM();
 
-    TEST_ASSERT_TRUE_MESSAGE(defaults.cachedRfid.size() == conf::rfid_tags::CACHE_LEN, "Default config cachedRfid size mismatch");
+    CardCacheStore store;
+    TEST_ASSERT_TRUE_MESSAGE(store.clear(), "CardCacheStore clear failed");
 
-    // Test that default config has empty cache
-    for (auto i = 0; i < defaults.cachedRfid.size(); i++)
+    auto cached = store.load();
+    TEST_ASSERT_TRUE_MESSAGE(cached.size() == conf::rfid_tags::CACHE_LEN, "Cached cards size mismatch");
+
+    // Test that cleared store has empty cache
+    for (auto i = 0; i < cached.size(); i++)
     {
-      const auto &tag = defaults.cachedRfid[i];
-      TEST_ASSERT_TRUE_MESSAGE(tag.uid == 0, "Default config cachedRfid not empty");
-      TEST_ASSERT_TRUE_MESSAGE(tag.level == FabUser::UserLevel::Unknown, "Default config cachedRfid not empty");
+      const auto &tag = cached[i];
+      TEST_ASSERT_TRUE_MESSAGE(tag.uid == 0, "Cleared cache not empty");
+      TEST_ASSERT_TRUE_MESSAGE(tag.level == FabUser::UserLevel::Unknown, "Cleared cache not empty");
     }
 
     AuthProvider authProvider(secrets::cards::whitelist);
     TEST_ASSERT_TRUE_MESSAGE(authProvider.saveCache(), "AuthProvider saveCache failed");
 
-    defaults = SavedConfig::LoadFromEEPROM().value_or(SavedConfig::DefaultConfig());
+    cached = store.load();
 
-    // Test that default config is still empty
-    for (auto i = 0; i < defaults.cachedRfid.size(); i++)
+    // Test that cache is still empty
+    for (auto i = 0; i < cached.size(); i++)
     {
-      const auto &tag = defaults.cachedRfid[i];
-      TEST_ASSERT_TRUE_MESSAGE(tag.uid == 0, "Default config cachedRfid not empty after AuthProvider saveCache");
-      TEST_ASSERT_TRUE_MESSAGE(tag.level == FabUser::UserLevel::Unknown, "Default config cachedRfid not empty after AuthProvider saveCache");
+      const auto &tag = cached[i];
+      TEST_ASSERT_TRUE_MESSAGE(tag.uid == 0, "Cache not empty after AuthProvider saveCache");
+      TEST_ASSERT_TRUE_MESSAGE(tag.level == FabUser::UserLevel::Unknown, "Cache not empty after AuthProvider saveCache");
     }
 
     FabBackend server;
@@ -131,24 +332,62 @@ namespace fabomatic::tests
     // Now save the positive result (should not be do anything, because offline)
     TEST_ASSERT_TRUE_MESSAGE(authProvider.saveCache(), "AuthProvider saveCache 2 failed");
     // Reload the cache
-    defaults = SavedConfig::LoadFromEEPROM().value_or(SavedConfig::DefaultConfig());
+    cached = store.load();
 
-    TEST_ASSERT_TRUE_MESSAGE(0 == defaults.cachedRfid[0].uid, "AuthProvider tryLogin card_uid mismatch");
-    TEST_ASSERT_TRUE_MESSAGE(FabUser::UserLevel::Unknown == defaults.cachedRfid[0].level, "AuthProvider tryLogin user_level mismatch");
+    TEST_ASSERT_TRUE_MESSAGE(0 == cached[0].uid, "AuthProvider tryLogin card_uid mismatch");
+    TEST_ASSERT_TRUE_MESSAGE(FabUser::UserLevel::Unknown == cached[0].level, "AuthProvider tryLogin user_level mismatch");
 
     // Generate many events
     for (auto i = 0; i < 50; i++)
     {
       auto rnd = random(0, conf::rfid_tags::CACHE_LEN);
-      auto result = authProvider.tryLogin(defaults.cachedRfid[rnd].uid, server);
+      auto result = authProvider.tryLogin(cached[rnd].uid, server);
     }
 
     TEST_ASSERT_TRUE_MESSAGE(authProvider.saveCache(), "AuthProvider saveCache 2 failed");
-    defaults = SavedConfig::LoadFromEEPROM().value_or(SavedConfig::DefaultConfig());
 
     // Online scenario with cache is testing in MQTT testcase with the broker.
   }
 
+  void test_card_cache_store()
+  {
+    CardCacheStore store;
+    TEST_ASSERT_TRUE_MESSAGE(store.clear(), "CardCacheStore clear failed");
+
+    CachedCards cards;
+    for (auto i = 0; i < cards.size(); i++)
+    {
+      cards.set_at(i, 0x11223344 + i, FabUser::UserLevel::NormalUser, i + 1);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(store.save(cards), "CardCacheStore save failed");
+
+    // A different store instance must read back the same records
+    CardCacheStore other;
+    auto loaded = other.load();
+    for (auto i = 0; i < cards.size(); i++)
+    {
+      TEST_ASSERT_TRUE_MESSAGE(cards[i] == loaded[i], "CardCacheStore record mismatch after reload");
+    }
+
+    // Least recently seen card is evicted first
+    TEST_ASSERT_EQUAL_MESSAGE(0, loaded.eviction_idx(), "Eviction index shall point to the oldest card");
+    loaded.set_at(loaded.eviction_idx(), 0xAABBCCDD, FabUser::UserLevel::FabAdmin, loaded.next_stamp());
+    TEST_ASSERT_EQUAL_MESSAGE(1, loaded.eviction_idx(), "Eviction index shall point to the oldest card");
+
+    // Single slot update, and slot removal
+    loaded.set_at(3, card::INVALID, FabUser::UserLevel::Unknown);
+    TEST_ASSERT_TRUE_MESSAGE(other.save(loaded), "CardCacheStore partial save failed");
+    auto reloaded = store.load();
+    for (auto i = 0; i < loaded.size(); i++)
+    {
+      TEST_ASSERT_TRUE_MESSAGE(loaded[i] == reloaded[i], "CardCacheStore record mismatch after partial save");
+    }
+    TEST_ASSERT_EQUAL_MESSAGE(3, reloaded.eviction_idx(), "Empty slot shall be reused first");
+
+    TEST_ASSERT_TRUE_MESSAGE(store.clear(), "CardCacheStore clear failed");
+    TEST_ASSERT_FALSE_MESSAGE(store.load().find_uid(0xAABBCCDD).has_value(), "CardCacheStore not empty after clear");
+  }
+
   void test_magic_number()
   {
     auto result1 = SavedConfig::LoadFromEEPROM();
@@ -159,149 +398,216 @@ namespace fabomatic::tests
     TEST_ASSERT_TRUE_MESSAGE(loaded.SaveToEEPROM(), "Loaded config save failed");
     TEST_ASSERT_EQUAL_MESSAGE(original_magic, loaded.magic_number, "Magic number overwritten by application");
 
-    // Force abnormal case after FW update
+    // Force abnormal case after FW update, without settings in NVS the EEPROM of older firmwares is read
+    Preferences prefs;
+    TEST_ASSERT_TRUE(prefs.begin(SavedConfig::NVS_NAMESPACE, false));
+    TEST_ASSERT_TRUE(prefs.clear());
+    prefs.end();
     TEST_ASSERT_TRUE(EEPROM.begin(sizeof(SavedConfig)));
     loaded.magic_number = SavedConfig::MAGIC_NUMBER - 1;
     EEPROM.put(0, &loaded);
     TEST_ASSERT_TRUE(EEPROM.commit());
 
-    // Now check the loaded version is null due to version mismatch
-    auto result2 = SavedConfig::LoadFromEEPROM();
+    // Now check the loaded version is null due to version mismatch, the EEPROM has been written directly
+    auto result2 = SavedConfig::ReloadFromEEPROM();
     TEST_ASSERT_FALSE_MESSAGE(result2.has_value(), "Loaded config is not empty");
   }
 
-  bool test_deserialization(Buffer &buff)
-  {
-    JsonDocument json_doc;
-    buff.toJson(json_doc, "message_buffer");
-    std::string json_text;
-    auto chars = serializeJson(json_doc, json_text);
-    TEST_ASSERT_GREATER_THAN_MESSAGE(0, chars, "Non empty JSON text");
-
-    ESP_LOGD(TAG, "test_deserialization: json_text:%s", json_text.c_str());
-
-    auto result = Buffer::fromJsonElement(json_doc["message_buffer"]);
-    TEST_ASSERT_TRUE_MESSAGE(result.has_value(), "Deserialization succeeds");
-
-    auto &new_buff = result.value();
-
-    TEST_ASSERT_EQUAL_MESSAGE(buff.count(), new_buff.count(), "Messages are lost in json");
-
-    while (new_buff.count() > 0)
-    {
-      const auto &msg_new = new_buff.getMessage();
-      const auto &msg_old = buff.getMessage();
-      TEST_ASSERT_EQUAL_STRING_MESSAGE(msg_new.mqtt_message.c_str(), msg_old.mqtt_message.c_str(), "Messages are in different order or damaged");
-      TEST_ASSERT_EQUAL_STRING_MESSAGE(msg_new.mqtt_topic.c_str(), msg_old.mqtt_topic.c_str(), "Topics are in different order or damaged");
-      TEST_ASSERT_EQUAL_MESSAGE(msg_new.wait_for_answer, msg_old.wait_for_answer, "Wait flags are in different order or damaged");
-    }
-    return true;
-  }
-
   void test_buffered_msg()
   {
-    constexpr auto NUM_MESSAGES = std::min(30, Buffer::MAX_MESSAGES - 3);
+    constexpr auto NUM_MESSAGES = 30;
 
+    // No such partition, the log is kept in RAM
     Buffer buff;
-    BufferedMsg msg1{"msg1", "topic1", false};
-    BufferedMsg msg2{"msg2", "topic1", false};
-    BufferedMsg msg3{"msg3", "topic2", false};
-    std::vector messages{msg3, msg2, msg1};
-
-    TEST_ASSERT_TRUE(msg1.mqtt_message == "msg1");
-    TEST_ASSERT_TRUE(msg1.mqtt_topic == "topic1");
-    TEST_ASSERT_TRUE(msg2.mqtt_message == "msg2");
-    TEST_ASSERT_TRUE(msg2.mqtt_topic == "topic1");
-    TEST_ASSERT_TRUE(msg3.mqtt_message == "msg3");
-    TEST_ASSERT_TRUE(msg3.mqtt_topic == "topic2");
+    buff.begin("");
+    TEST_ASSERT_FALSE_MESSAGE(buff.isPersistent(), "Buffer shall be in RAM");
+
+    BufferedMsg msg1{BufferedAction::StartUse, 0x11223344};
+    BufferedMsg msg2{BufferedAction::StopUse, 0x55667788, 3600s};
+    BufferedMsg msg3{BufferedAction::Maintenance, 0xAABBCCDDEEFF0011, 0s, 1718000000};
+    std::vector messages{msg1, msg2, msg3};
 
     // Create some more messages
     for (auto msg_num = 0; msg_num < NUM_MESSAGES; msg_num++)
     {
-      std::string message{"{action=\"test\", value=\""};
-      message.append(std::to_string(msg_num));
-      message.append("\", test: true}");
-      std::string topic{"machine/TESTTOPIC/"};
-
-      topic.append(std::to_string(msg_num));
-      messages.push_back({message, topic, true});
+      messages.push_back({BufferedAction::StopUse, static_cast<card::uid_t>(msg_num), std::chrono::seconds{msg_num * 60}, static_cast<uint32_t>(msg_num)});
     }
 
-    TEST_ASSERT_TRUE_MESSAGE(buff.hasChanged(), "Buffer has pending changes");
+    // Legacy JSON payloads are converted to records
+    const auto legacy = BufferedMsg::fromPayload(R"({"action":"stopuse","uid":"55667788","duration":3600})");
+    TEST_ASSERT_TRUE_MESSAGE(legacy.has_value(), "Legacy stopuse payload is converted");
+    TEST_ASSERT_TRUE_MESSAGE(legacy.value() == msg2, "Legacy payload conversion is correct");
+    TEST_ASSERT_FALSE_MESSAGE(BufferedMsg::fromPayload(R"({"action":"checkuser","uid":"11223344"})").has_value(),
+                              "Only usage events are buffered");
 
     // Nothing to test
     if constexpr (!conf::debug::ENABLE_BUFFERING)
       return;
 
-    // Test insertion, messages must be queued newest first (msg3-msg2-msg1)
     auto msg_count = 0;
     for (const auto &msg : messages)
     {
       TEST_ASSERT_EQUAL_MESSAGE(msg_count, buff.count(), "Push_back: Buffer count is correct");
-      const auto &bmsg = BufferedMsg{msg.mqtt_message, msg.mqtt_topic, msg.wait_for_answer};
-      buff.push_front(bmsg);
+      buff.push_back(msg);
       msg_count++;
     }
-
     TEST_ASSERT_EQUAL_MESSAGE(messages.size(), buff.count(), "Buffer contains all expected messages");
 
-    TEST_ASSERT_TRUE_MESSAGE(buff.hasChanged(), "Buffer has pending changes");
-    buff.setChanged(false);
+    // Messages stay buffered until acknowledged
+    const auto first = buff.front();
+    TEST_ASSERT_TRUE_MESSAGE(first.has_value(), "Front message is available");
+    TEST_ASSERT_TRUE_MESSAGE(first->action == msg1.action && first->uid == msg1.uid, "Front message is the oldest");
+    TEST_ASSERT_EQUAL_MESSAGE(messages.size(), buff.count(), "Front does not remove the message");
+
+    // Replay window
+    const auto window = buff.peek(4);
+    TEST_ASSERT_EQUAL_MESSAGE(4, window.size(), "Peek returns the requested number of messages");
+    TEST_ASSERT_EQUAL_MESSAGE(first->seq, window.front().seq, "Peek starts with the oldest message");
+    for (size_t i = 1; i < window.size(); i++)
+    {
+      TEST_ASSERT_TRUE_MESSAGE(window[i].uid == messages[i].uid && window[i].seq > window[i - 1].seq, "Peek returns the messages in order");
+    }
+    TEST_ASSERT_EQUAL_MESSAGE(messages.size(), buff.count(), "Peek does not remove the messages");
 
-    // Test retrieval oldest first (msg1-msg2-msg3-...)
-    for (auto elem = messages.rbegin(); elem != messages.rend(); ++elem)
+    // Retrieval oldest first, with increasing sequence numbers
+    uint32_t last_seq = 0;
+    for (const auto &elem : messages)
     {
-      auto &msg = buff.getMessage();
-      TEST_ASSERT_EQUAL_STRING_MESSAGE(elem->mqtt_message.c_str(), msg.mqtt_message.c_str(), "(1) Retrieval oldest first message is correct");
-      TEST_ASSERT_EQUAL_STRING_MESSAGE(elem->mqtt_topic.c_str(), msg.mqtt_topic.c_str(), "(1) Retrieval oldest first topic is correct");
-      TEST_ASSERT_EQUAL_MESSAGE(elem->wait_for_answer, msg.wait_for_answer, "(1) Retrieval oldest first wait_for_answer is correct");
+      const auto &msg = buff.getMessage();
+      TEST_ASSERT_TRUE_MESSAGE(msg.action == elem.action, "Retrieval oldest first action is correct");
+      TEST_ASSERT_TRUE_MESSAGE(msg.uid == elem.uid, "Retrieval oldest first uid is correct");
+      TEST_ASSERT_TRUE_MESSAGE(msg.duration == elem.duration, "Retrieval oldest first duration is correct");
+      TEST_ASSERT_EQUAL_MESSAGE(elem.timestamp, msg.timestamp, "Retrieval oldest first timestamp is correct");
+      TEST_ASSERT_GREATER_THAN_MESSAGE(last_seq, msg.seq, "Sequence numbers are increasing");
+      last_seq = msg.seq;
     }
 
     TEST_ASSERT_EQUAL_MESSAGE(0, buff.count(), "Buffer is now empty");
-    TEST_ASSERT_TRUE_MESSAGE(buff.hasChanged(), "Buffer has pending changes");
-    buff.setChanged(false);
+    TEST_ASSERT_FALSE_MESSAGE(buff.front().has_value(), "No front message in empty buffer");
+  }
 
-    // Test insertion in reverse order
-    msg_count = 0;
-    for (const auto &msg : messages)
+  void test_buffer_compaction()
+  {
+    if constexpr (!conf::debug::ENABLE_BUFFERING)
+      return;
+
+    Buffer buff;
+    buff.begin("");
+
+    // Start and stop of the same card are merged
+    buff.push_back({BufferedAction::StartUse, 0x1234, 0s, 1718000000});
+    buff.push_back({BufferedAction::StopUse, 0x1234, 60s, 1718000060});
+    TEST_ASSERT_EQUAL_MESSAGE(1, buff.count(), "StartUse and StopUse merged");
+    const auto session = buff.front();
+    TEST_ASSERT_TRUE_MESSAGE(session.has_value() && session->action == BufferedAction::Session, "Session buffered");
+    TEST_ASSERT_TRUE_MESSAGE(session->duration == 60s, "Session duration is the StopUse one");
+    TEST_ASSERT_EQUAL_MESSAGE(1718000000, session->timestamp, "Session starts with the StartUse");
+    TEST_ASSERT_EQUAL_MESSAGE(1, buff.getCompactionStats().sessions, "Session counted");
+
+    // Not merged once the StartUse has been published
+    const auto start = buff.push_back({BufferedAction::StartUse, 0x5678});
+    TEST_ASSERT_TRUE_MESSAGE(start.has_value() && start->seq > session->seq, "Logged message returned with its sequence number");
+    buff.markPublished(start->seq);
+    const auto stop = buff.push_back({BufferedAction::StopUse, 0x5678, 10s});
+    TEST_ASSERT_EQUAL_MESSAGE(3, buff.count(), "Published StartUse not merged");
+
+    // Not merged when the StopUse is published live either
+    buff.push_back({BufferedAction::StartUse, 0x9ABC});
+    buff.push_back({BufferedAction::StopUse, 0x9ABC, 10s}, false);
+    TEST_ASSERT_EQUAL_MESSAGE(5, buff.count(), "StopUse not merged on request");
+
+    // Answered live messages leave the log wherever they are
+    buff.acknowledge(stop->seq);
+    TEST_ASSERT_EQUAL_MESSAGE(4, buff.count(), "Acknowledged message removed");
+    TEST_ASSERT_EQUAL_MESSAGE(session->seq, buff.front()->seq, "Older messages kept");
+
+    // Overflow the RAM log, maintenance events are never summarized
+    constexpr auto NUM_EVENTS = 2000;
+    auto maintenance = 0;
+    for (auto i = 0; i < NUM_EVENTS; i++)
     {
-      TEST_ASSERT_EQUAL_MESSAGE(msg_count, buff.count(), "(1) Push_front: Buffer count is correct");
-      const auto &bmsg = BufferedMsg{msg.mqtt_message, msg.mqtt_topic, msg.wait_for_answer};
-      buff.push_back(bmsg);
-      msg_count++;
+      if (i % 50 == 0)
+      {
+        buff.push_back({BufferedAction::Maintenance, static_cast<card::uid_t>(i)});
+        maintenance++;
+      }
+      else
+      {
+        buff.push_back({BufferedAction::StartUse, static_cast<card::uid_t>(i)});
+      }
     }
 
-    TEST_ASSERT_TRUE_MESSAGE(buff.hasChanged(), "Buffer has pending changes");
-    buff.setChanged(false);
-
-    for (auto elem = messages.begin(); elem != messages.end(); ++elem)
+    auto kept_maintenance = 0;
+    uint32_t summarized_events = 0;
+    auto records = 0;
+    for (const auto &msg : buff.peek(buff.count()))
     {
-      auto &msg = buff.getMessage();
-      TEST_ASSERT_EQUAL_STRING_MESSAGE(elem->mqtt_message.c_str(), msg.mqtt_message.c_str(), "(2) Retrieval oldest first message is correct");
-      TEST_ASSERT_EQUAL_STRING_MESSAGE(elem->mqtt_topic.c_str(), msg.mqtt_topic.c_str(), "(2) Retrieval oldest first topic is correct");
-      TEST_ASSERT_EQUAL_MESSAGE(elem->wait_for_answer, msg.wait_for_answer, "(2) Retrieval oldest first wait_for_answer is correct");
+      records++;
+      if (msg.action == BufferedAction::Maintenance)
+        kept_maintenance++;
+      if (msg.action == BufferedAction::Summary)
+        summarized_events += msg.events;
+      else
+        summarized_events++;
     }
+    TEST_ASSERT_EQUAL_MESSAGE(buff.count(), records, "All records readable");
+    TEST_ASSERT_EQUAL_MESSAGE(maintenance, kept_maintenance, "Maintenance events kept");
+    TEST_ASSERT_EQUAL_MESSAGE(NUM_EVENTS + 4, summarized_events, "Every event is kept or summarized");
+    TEST_ASSERT_GREATER_THAN_MESSAGE(0, buff.getCompactionStats().summarized, "Summaries counted");
+    TEST_ASSERT_EQUAL_MESSAGE(0, buff.getStats().dropped, "No event dropped");
+  }
 
-    TEST_ASSERT_EQUAL_MESSAGE(0, buff.count(), "(2) Buffer is now empty");
-    TEST_ASSERT_TRUE_MESSAGE(buff.hasChanged(), "Buffer has pending changes");
-    buff.setChanged(false);
-
-    // Test empty buffer
-    TEST_ASSERT_TRUE_MESSAGE(test_deserialization(buff), "JSON works for empty buffer");
-    TEST_ASSERT_FALSE_MESSAGE(buff.hasChanged(), "Buffer has no pending changes");
+  void test_buffer_log()
+  {
+    BufferLog log;
+    if (!log.open(conf::buffer::PARTITION_LABEL, conf::buffer::RAM_LOG_SIZE))
+    {
+      TEST_IGNORE_MESSAGE("No log partition in the partition table");
+    }
+    log.clear();
+    TEST_ASSERT_EQUAL_MESSAGE(0, log.count(), "Log is empty after clear");
 
-    // Insert more messages
-    msg_count = 0;
-    for (const auto &msg : messages)
+    constexpr auto NUM_RECORDS = 50;
+    std::optional<uint32_t> first_seq;
+    for (auto i = 0; i < NUM_RECORDS; i++)
     {
-      TEST_ASSERT_EQUAL_MESSAGE(msg_count, buff.count(), "(2) Push_front: Buffer count is correct");
-      const auto &bmsg = BufferedMsg{msg.mqtt_message, msg.mqtt_topic, msg.wait_for_answer};
-      buff.push_back(bmsg);
-      msg_count++;
+      const auto seq = log.append("record " + std::to_string(i));
+      TEST_ASSERT_TRUE_MESSAGE(seq.has_value(), "Append works");
+      if (!first_seq)
+      {
+        first_seq = seq;
+      }
+    }
+    for (auto i = 0; i < 10; i++)
+    {
+      log.pop_front();
     }
 
-    TEST_ASSERT_TRUE_MESSAGE(test_deserialization(buff), "JSON works for full buffer");
-    TEST_ASSERT_TRUE_MESSAGE(buff.hasChanged(), "Buffer has pending changes");
+    // Acknowledgements and records survive a reload
+    {
+      BufferLog reloaded;
+      TEST_ASSERT_TRUE_MESSAGE(reloaded.open(conf::buffer::PARTITION_LABEL, conf::buffer::RAM_LOG_SIZE), "Reload works");
+      TEST_ASSERT_EQUAL_MESSAGE(NUM_RECORDS - 10, reloaded.count(), "Pending records reloaded");
+      const auto entry = reloaded.front();
+      TEST_ASSERT_TRUE_MESSAGE(entry.has_value(), "Oldest record available");
+      TEST_ASSERT_EQUAL_STRING_MESSAGE("record 10", entry->data.c_str(), "Oldest pending record is correct");
+      TEST_ASSERT_EQUAL_MESSAGE(first_seq.value() + 10, entry->seq, "Sequence numbers are kept");
+
+      // When full, the oldest records are dropped and the count stays bounded
+      const std::string filler(200, 'x');
+      const auto stats = reloaded.getStats();
+      const auto max_records = stats.capacity / filler.size();
+      for (size_t i = 0; i < max_records + 20; i++)
+      {
+        TEST_ASSERT_TRUE_MESSAGE(reloaded.append(filler).has_value(), "Append works when full");
+      }
+      TEST_ASSERT_GREATER_THAN_MESSAGE(stats.dropped, reloaded.getStats().dropped, "Oldest records dropped");
+      TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(max_records, reloaded.count(), "Count bounded by capacity");
+      TEST_ASSERT_LESS_OR_EQUAL_MESSAGE(stats.capacity, reloaded.getStats().used, "Usage bounded by capacity");
+
+      reloaded.clear();
+      TEST_ASSERT_EQUAL_MESSAGE(0, reloaded.count(), "Log is empty after clear");
+    }
   }
 } // namespace fabomatic::tests
 
@@ -324,8 +630,17 @@ void setup()
   RUN_TEST(fabomatic::tests::test_defaults);
   RUN_TEST(fabomatic::tests::test_changes);
   RUN_TEST(fabomatic::tests::test_magic_number);
+  RUN_TEST(fabomatic::tests::test_wifi_lease);
+  RUN_TEST(fabomatic::tests::test_broker_address);
+  RUN_TEST(fabomatic::tests::test_resident_config);
+  RUN_TEST(fabomatic::tests::test_torn_slot);
+  RUN_TEST(fabomatic::tests::test_pending_config);
+  RUN_TEST(fabomatic::tests::test_config_codec);
   RUN_TEST(fabomatic::tests::test_rfid_cache);
+  RUN_TEST(fabomatic::tests::test_card_cache_store);
   RUN_TEST(fabomatic::tests::test_buffered_msg);
+  RUN_TEST(fabomatic::tests::test_buffer_compaction);
+  RUN_TEST(fabomatic::tests::test_buffer_log);
 
   if (original.has_value())
   {
@@ -1,6 +1,10 @@
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <new>
 #include <string>
 #include <functional>
+#include <vector>
 
 #include <Arduino.h>
 #define UNITY_INCLUDE_PRINT_FORMATTED
@@ -8,9 +12,56 @@
 #include "Tasks.hpp"
 #include "Logging.hpp"
 #include "Espressif.hpp"
+#include "SpscQueue.hpp"
+#include "BufferedMsg.hpp"
+#include "MQTTtypes.hpp"
+#include "ReplyArena.hpp"
+#include "pthread.h"
 
 using namespace std::chrono_literals;
 
+// Counts the heap allocations made through operator new while enabled
+static std::atomic<bool> count_allocations{false};
+static std::atomic<size_t> heap_allocations{0};
+
+void *operator new(size_t size)
+{
+  if (count_allocations)
+  {
+    heap_allocations++;
+  }
+  if (auto *ptr = std::malloc(size == 0 ? 1 : size); ptr != nullptr)
+  {
+    return ptr;
+  }
+  std::abort();
+}
+
+void *operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+  std::free(ptr);
+}
+
 namespace fabomatic::tests
 {
   using Task = fabomatic::Tasks::Task;
@@ -139,6 +190,165 @@ namespace fabomatic::tests
     TEST_ASSERT_TRUE_MESSAGE(fabomatic::esp32::setupWatchdog(30s), "Watchdog setup");
     fabomatic::esp32::removeWatchdog();
   }
+
+  constexpr auto NB_ITEMS = 2000;
+  SpscQueue<std::string, 8> queue;
+
+  void *producer(void *arg)
+  {
+    for (auto i = 0; i < NB_ITEMS;)
+    {
+      if (queue.push(std::to_string(i)))
+      {
+        i++;
+      }
+      else
+      {
+        delay(1);
+      }
+    }
+    return arg;
+  }
+
+  void test_spsc_queue()
+  {
+    TEST_ASSERT_TRUE_MESSAGE(queue.empty(), "Queue shall be empty");
+    TEST_ASSERT_FALSE_MESSAGE(queue.pop().has_value(), "Empty queue shall not pop");
+
+    for (auto i = 0U; i < queue.capacity(); i++)
+    {
+      TEST_ASSERT_TRUE_MESSAGE(queue.push(std::to_string(i)), "Push shall succeed until capacity");
+    }
+    TEST_ASSERT_FALSE_MESSAGE(queue.push("full"), "Push shall fail when full");
+    TEST_ASSERT_EQUAL_MESSAGE(queue.capacity(), queue.size(), "Queue shall be full");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("0", queue.pop().value().c_str(), "Items shall be popped in order");
+    queue.clear();
+    TEST_ASSERT_TRUE_MESSAGE(queue.empty(), "Queue shall be empty after clear");
+
+    // Producer and consumer in different threads
+    pthread_t thread;
+    TEST_ASSERT_EQUAL_MESSAGE(0, pthread_create(&thread, nullptr, producer, nullptr), "Producer thread creation failed");
+    const auto start = std::chrono::system_clock::now();
+    auto expected = 0;
+    while (expected < NB_ITEMS && std::chrono::system_clock::now() - start < 10s)
+    {
+      if (auto item = queue.pop(); item.has_value())
+      {
+        TEST_ASSERT_EQUAL_STRING_MESSAGE(std::to_string(expected).c_str(), item.value().c_str(), "Items lost or reordered");
+        expected++;
+      }
+      else
+      {
+        delay(1);
+      }
+    }
+    pthread_join(thread, nullptr);
+    TEST_ASSERT_EQUAL_MESSAGE(NB_ITEMS, expected, "Not all items received");
+    TEST_ASSERT_TRUE_MESSAGE(queue.empty(), "Queue shall be empty");
+  }
+
+  void test_query_allocations()
+  {
+    using namespace ServerMQTT;
+    constexpr card::uid_t uid{0xAABBCCD1};
+    const UserQuery user{uid};
+    const MachineQuery machine{};
+    const AliveQuery alive{R"("stats":{"rssi":-60})"};
+    const UserListQuery list{1};
+    const CheckAndStartQuery check_and_start{uid};
+    const StartUseQuery start{uid};
+    const StopUseQuery stop{uid, 3600s};
+    const InUseQuery in_use{uid, 60s};
+    const RegisterMaintenanceQuery maintenance{uid};
+    const BufferedQuery replay{BufferedMsg{BufferedAction::StopUse, uid, 10s, 0, 42}};
+    const std::vector<const Query *> queries{&user, &machine, &alive, &list, &check_and_start, &start, &stop, &in_use, &maintenance, &replay};
+
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(R"({"action":"stopuse","uid":"aabbccd1","duration":10,"replay":true,"seq":42})",
+                                     replay.payload().c_str(), "Buffered record rendered as the original query");
+
+    // Transmit buffers preallocated in the slots, as in the FabBackend I/O queue
+    static SpscQueue<TxBuffer, 4> tx_queue;
+
+    for (const auto *query : queries)
+    {
+      const auto expected = query->payload(); // Also initializes lazy statics such as the serial number
+      TEST_ASSERT_EQUAL_MESSAGE('}', expected.back(), "Payload shall be a complete JSON object");
+
+      heap_allocations = 0;
+      count_allocations = true;
+      auto *slot = tx_queue.acquire();
+      const auto serialized = slot != nullptr && query->serialize(*slot, 1234);
+      if (serialized)
+      {
+        tx_queue.commit();
+      }
+      count_allocations = false;
+
+      TEST_ASSERT_TRUE_MESSAGE(serialized, "Query serialization failed");
+      TEST_ASSERT_EQUAL_MESSAGE(0, heap_allocations.load(), "Query serialization shall not allocate");
+
+      auto *sent = tx_queue.front();
+      TEST_ASSERT_NOT_NULL_MESSAGE(sent, "Serialized query not queued");
+      const auto payload = std::string{sent->view()};
+      TEST_ASSERT_TRUE_MESSAGE(payload.rfind(",\"cid\":1234}") != std::string::npos, "Correlation id shall be the last member");
+      TEST_ASSERT_EQUAL_STRING_MESSAGE(expected.substr(0, expected.size() - 1).c_str(),
+                                       payload.substr(0, expected.size() - 1).c_str(), "Serialized payload mismatch");
+      tx_queue.release();
+    }
+
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(R"({"action":"stopuse","uid":"aabbccd1","duration":3600})", stop.payload().c_str(), "Stop use payload mismatch");
+
+    // Usage events logged before publication carry their event time and sequence number
+    StopUseQuery logged_stop{uid, 3600s};
+    logged_stop.setEvent(7, 1718000000);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(R"({"action":"stopuse","uid":"aabbccd1","duration":3600,"ts":1718000000,"seq":7})",
+                                     logged_stop.payload().c_str(), "Event time and sequence number mismatch");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(R"({"action":"stopuse","uid":"aabbccd1","duration":10,"replay":true,"seq":42})", replay.payload().c_str(), "Replay payload mismatch");
+  }
+
+  void test_reply_parsing()
+  {
+    using namespace ServerMQTT;
+    static ReplyArena arena;
+    const std::string long_name(2 * conf::mqtt::NAME_MAX_LENGTH, 'X');
+    const std::string reply{R"({"request_ok":true,"is_valid":1,"name":")" + long_name +
+                            R"(","level":2,"unused":{"nested":[1,2,3,"skipped by the filter"]},"cid":7})"};
+    (void)UserResponse::jsonFilter(); // Built once, on first use
+
+    heap_allocations = 0;
+    count_allocations = true;
+    std::unique_ptr<UserResponse> response;
+    {
+      arena.reset();
+      JsonDocument doc{&arena};
+      if (!deserializePayload(doc, reply, UserResponse::jsonFilter()))
+      {
+        response = UserResponse::fromJson(doc);
+      }
+    }
+    count_allocations = false;
+
+    TEST_ASSERT_NOT_NULL_MESSAGE(response, "Reply shall be parsed within the arena");
+    TEST_ASSERT_EQUAL_MESSAGE(1, heap_allocations.load(), "Only the response object shall be allocated");
+    TEST_ASSERT_TRUE_MESSAGE(response->request_ok, "request_ok mismatch");
+    TEST_ASSERT_TRUE_MESSAGE(response->getResult() == UserResult::Authorized, "Result mismatch");
+    TEST_ASSERT_EQUAL_MESSAGE(conf::mqtt::NAME_MAX_LENGTH, response->holder_name.size(), "Name shall be truncated");
+    TEST_ASSERT_TRUE_MESSAGE(arena.getPeak() < conf::mqtt::REPLY_ARENA_SIZE, "Arena peak out of bounds");
+
+    // Replies larger than the arena are rejected, not allocated on the heap
+    std::string huge{R"({"request_ok":true,"users":[)"};
+    for (auto i = 0; i < 400; i++)
+    {
+      huge += R"(["aabbccdd",2,"name"],)";
+    }
+    huge.back() = ']';
+    huge += '}';
+    arena.reset();
+    JsonDocument doc{&arena};
+    const auto error = deserializePayload(doc, huge, UserListResponse::jsonFilter());
+    TEST_ASSERT_TRUE_MESSAGE(error == DeserializationError::NoMemory, "Oversized reply shall fail with NoMemory");
+    TEST_ASSERT_GREATER_THAN_MESSAGE(0, arena.getFailures(), "Arena failure not counted");
+  }
 } // namespace fabomatic::tests
 
 void setup()
@@ -148,6 +358,9 @@ void setup()
   RUN_TEST(fabomatic::tests::test_execute_runs_all_tasks);
   RUN_TEST(fabomatic::tests::test_stop_start_tasks);
   RUN_TEST(fabomatic::tests::test_esp32);
+  RUN_TEST(fabomatic::tests::test_spsc_queue);
+  RUN_TEST(fabomatic::tests::test_query_allocations);
+  RUN_TEST(fabomatic::tests::test_reply_parsing);
   UNITY_END(); // stop unit testing
 }
 